@@ -0,0 +1,277 @@
+/*
+ * schedtrace2json — convert a mios scheduler trace to Chrome / Perfetto
+ * JSON (load it in ui.perfetto.dev or chrome://tracing).
+ *
+ *   schedtrace2json [FILE]
+ *       Read binary trace from FILE (or stdin) and write JSON to stdout.
+ *
+ * The binary trace is what the "schedtrace" service on the device
+ * emits when connected to (see include/mios/sched_trace.h), eg:
+ *
+ *   nc <device> 7011 > trace.bin
+ *
+ * Each CPU becomes a process with a single track on which the running
+ * thread is drawn as a slice (idle is left blank). Wakeups are drawn as
+ * flow arrows from the waker to where the woken thread starts to run,
+ * and IRQs and softirqs as instant events.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+
+#define SCHED_TRACE_MAGIC   0x43525453
+#define SCHED_TRACE_VERSION 1
+
+#define SCHED_TRACE_SWITCH  1
+#define SCHED_TRACE_WAKEUP  2
+#define SCHED_TRACE_SOFTIRQ 3
+#define SCHED_TRACE_IRQ     4
+
+#define SCHED_TRACE_NO_THREAD 0xffff
+
+#define HEADER_SIZE 32
+#define THREAD_SIZE 16
+
+#define MAX_CPUS 64
+
+typedef struct {
+  uint32_t cycles;
+  uint8_t type;
+  uint8_t cpu;
+  uint16_t thread;
+  uint32_t arg;
+} record_t;
+
+static char thread_names[65536][15];
+
+typedef struct {
+  int running;      // Thread id, -1 if unknown / idle
+  double start;
+} cpu_state_t;
+
+static cpu_state_t cpus[MAX_CPUS];
+
+// Pending flow (wakeup) id per thread, 0 if none
+static uint32_t pending_flow[65536];
+
+
+static uint16_t
+rd16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+rd32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+rd64(const uint8_t *p)
+{
+  return rd32(p) | ((uint64_t)rd32(p + 4) << 32);
+}
+
+
+static const char *
+thread_name(int id)
+{
+  static char buf[24];
+  if(id == SCHED_TRACE_NO_THREAD)
+    return "task";
+  if(id == 0)
+    return "idle";
+  if(thread_names[id][0])
+    return thread_names[id];
+  snprintf(buf, sizeof(buf), "thread-%d", id);
+  return buf;
+}
+
+
+static int first_event = 1;
+
+static void
+emit(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void
+emit(const char *fmt, ...)
+{
+  va_list ap;
+  printf("%s\n  ", first_event ? "" : ",");
+  first_event = 0;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+}
+
+
+static void
+slice_end(int cpu, double ts)
+{
+  cpu_state_t *cs = &cpus[cpu];
+  if(cs->running <= 0)
+    return;
+  emit("{\"name\":\"%s\",\"cat\":\"sched\",\"ph\":\"X\",\"pid\":%d,"
+       "\"tid\":0,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"thread\":%d}}",
+       thread_name(cs->running), cpu, cs->start, ts - cs->start,
+       cs->running);
+}
+
+
+int
+main(int argc, char **argv)
+{
+  FILE *fp = stdin;
+  if(argc > 1) {
+    fp = fopen(argv[1], "rb");
+    if(fp == NULL) {
+      fprintf(stderr, "Unable to open %s -- %s\n", argv[1], strerror(errno));
+      exit(1);
+    }
+  }
+
+  uint8_t hdr[HEADER_SIZE];
+  if(fread(hdr, sizeof(hdr), 1, fp) != 1) {
+    fprintf(stderr, "Short read of header\n");
+    exit(1);
+  }
+
+  if(rd32(hdr) != SCHED_TRACE_MAGIC) {
+    fprintf(stderr, "Not a scheduler trace\n");
+    exit(1);
+  }
+  if(rd16(hdr + 4) != SCHED_TRACE_VERSION) {
+    fprintf(stderr, "Unsupported version %d\n", rd16(hdr + 4));
+    exit(1);
+  }
+
+  const size_t record_size = rd16(hdr + 6);
+  const uint32_t num_threads = rd32(hdr + 8);
+  const uint32_t num_records = rd32(hdr + 12);
+  const uint32_t cycles_per_ms = rd32(hdr + 16);
+  const uint32_t cycles_freeze = rd32(hdr + 20);
+  const uint64_t clock_freeze = rd64(hdr + 24);
+
+  if(record_size < 12 || cycles_per_ms == 0) {
+    fprintf(stderr, "Invalid header\n");
+    exit(1);
+  }
+
+  for(uint32_t i = 0; i < num_threads; i++) {
+    uint8_t t[THREAD_SIZE];
+    if(fread(t, sizeof(t), 1, fp) != 1) {
+      fprintf(stderr, "Short read of thread table\n");
+      exit(1);
+    }
+    memcpy(thread_names[rd16(t)], t + 2, 14);
+  }
+
+  record_t *records = calloc(num_records, sizeof(record_t));
+  uint64_t *cycles = calloc(num_records + 1, sizeof(uint64_t));
+  uint8_t *buf = malloc(record_size);
+  uint32_t n = 0;
+
+  for(; n < num_records; n++) {
+    if(fread(buf, record_size, 1, fp) != 1)
+      break;
+    records[n].cycles = rd32(buf);
+    records[n].type = buf[4];
+    records[n].cpu = buf[5] % MAX_CPUS;
+    records[n].thread = rd16(buf + 6);
+    records[n].arg = rd32(buf + 8);
+  }
+  if(n != num_records)
+    fprintf(stderr, "Warning: Only got %u of %u records\n", n, num_records);
+
+  // Unwrap the 32 bit cycle counter, assuming no two consecutive
+  // events are further apart than a full wrap
+  for(uint32_t i = 1; i < n; i++)
+    cycles[i] = cycles[i - 1] + (uint32_t)(records[i].cycles -
+                                           records[i - 1].cycles);
+  // Anchor everything to the (absolute) clock at freeze
+  const uint64_t end = n ?
+    cycles[n - 1] + (uint32_t)(cycles_freeze - records[n - 1].cycles) : 0;
+
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+  int max_cpu = 0;
+  for(uint32_t i = 0; i < n; i++) {
+    if(records[i].cpu > max_cpu)
+      max_cpu = records[i].cpu;
+  }
+
+  for(int i = 0; i < MAX_CPUS; i++)
+    cpus[i].running = -1;
+
+  for(int i = 0; i <= max_cpu; i++) {
+    emit("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+         "\"args\":{\"name\":\"CPU %d\"}}", i, i);
+  }
+
+  uint32_t flow_id = 0;
+  double ts = 0;
+
+  for(uint32_t i = 0; i < n; i++) {
+    const record_t *r = &records[i];
+    ts = (double)clock_freeze -
+      (double)(end - cycles[i]) * 1000.0 / cycles_per_ms;
+    cpu_state_t *cs = &cpus[r->cpu];
+
+    switch(r->type) {
+    case SCHED_TRACE_SWITCH:
+      if(cs->running == -1)
+        cs->running = r->arg;
+      slice_end(r->cpu, ts);
+      cs->running = r->thread;
+      cs->start = ts;
+      if(pending_flow[r->thread]) {
+        emit("{\"name\":\"wakeup\",\"cat\":\"sched\",\"ph\":\"f\","
+             "\"bp\":\"e\",\"id\":%u,\"pid\":%d,\"tid\":0,\"ts\":%.3f}",
+             pending_flow[r->thread], r->cpu, ts);
+        pending_flow[r->thread] = 0;
+      }
+      break;
+
+    case SCHED_TRACE_WAKEUP:
+      emit("{\"name\":\"wakeup %s\",\"cat\":\"sched\",\"ph\":\"i\","
+           "\"s\":\"t\",\"pid\":%d,\"tid\":0,\"ts\":%.3f,"
+           "\"args\":{\"waker\":\"%s\"}}",
+           thread_name(r->thread), r->cpu, ts, thread_name(r->arg));
+      if(r->thread != SCHED_TRACE_NO_THREAD && r->arg != 0) {
+        flow_id++;
+        emit("{\"name\":\"wakeup\",\"cat\":\"sched\",\"ph\":\"s\","
+             "\"id\":%u,\"pid\":%d,\"tid\":0,\"ts\":%.3f}",
+             flow_id, r->cpu, ts);
+        pending_flow[r->thread] = flow_id;
+      }
+      break;
+
+    case SCHED_TRACE_SOFTIRQ:
+      emit("{\"name\":\"softirq %u\",\"cat\":\"softirq\",\"ph\":\"i\","
+           "\"s\":\"t\",\"pid\":%d,\"tid\":0,\"ts\":%.3f}",
+           r->arg, r->cpu, ts);
+      break;
+
+    case SCHED_TRACE_IRQ:
+      emit("{\"name\":\"irq %d\",\"cat\":\"irq\",\"ph\":\"i\","
+           "\"s\":\"t\",\"pid\":%d,\"tid\":0,\"ts\":%.3f}",
+           (int32_t)r->arg, r->cpu, ts);
+      break;
+    }
+  }
+
+  for(int i = 0; i <= max_cpu; i++)
+    slice_end(i, ts);
+
+  printf("\n]}\n");
+
+  free(buf);
+  free(cycles);
+  free(records);
+  return 0;
+}
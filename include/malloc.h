@@ -6,6 +6,19 @@
 void *xalloc(size_t size, size_t alignment, unsigned int type_flags)
   __attribute__((malloc,warn_unused_result));
 
+// xalloc() on behalf of 'caller'. Allocators layered on top of the heap
+// pass MALLOC_CALLER from their own entry point so ENABLE_MALLOC_PROFILE
+// attributes the block to their caller instead of to the allocator
+void *xalloc_caller(size_t size, size_t alignment, unsigned int type_flags,
+                    void *caller)
+  __attribute__((malloc,warn_unused_result));
+
+#ifdef ENABLE_MALLOC_PROFILE
+#define MALLOC_CALLER __builtin_return_address(0)
+#else
+#define MALLOC_CALLER NULL
+#endif
+
 // Return 1 if failed to free memory (locked and will not block)
 int free_try(void *ptr);
 
@@ -24,3 +37,11 @@ int free_try(void *ptr);
 // Lower numerical prio means it be tried earlier if no specific
 // memory type is requested when allocating
 void heap_add_mem(long start, long end, uint8_t type, uint8_t prio);
+
+// Invoke 'cb' for every allocated block with the return address of the
+// allocating call and the requested size. Only available with
+// ENABLE_MALLOC_PROFILE. The heap is locked during the walk so 'cb'
+// must not allocate or free memory
+void heap_foreach_allocation(void (*cb)(void *opaque, void *caller,
+                                        size_t size),
+                             void *opaque);
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Scoped arena allocator
+ *
+ * For allocations that share a lifetime (a request, a command, a
+ * decode pass). Memory is handed out from chunks by bumping a pointer
+ * and everything is released in one go with arena_release() or back to
+ * an earlier point with arena_rewind(). There is no per-allocation free.
+ *
+ * The first chunk can be supplied by the caller (on the stack or inline
+ * in some other allocation). Further chunks are allocated from the heap
+ * as needed, up to an optional limit:
+ *
+ *   uint8_t buf[256];
+ *   arena_t a;
+ *   arena_init(&a, buf, sizeof(buf), 512, 4096);
+ *   ...
+ *   arena_release(&a);
+ *
+ * An arena is not thread safe.
+ */
+
+typedef struct arena_chunk {
+  struct arena_chunk *ac_prev;
+  uint32_t ac_size;      // Usable bytes in ac_data
+  uint32_t ac_used;
+  uint8_t ac_data[] __attribute__((aligned(8)));
+} arena_chunk_t;
+
+typedef struct arena {
+  arena_chunk_t *a_chunk;   // Current chunk, others linked via ac_prev
+  arena_chunk_t *a_first;   // Caller supplied chunk (not freed) or NULL
+  void *a_last;             // Most recent allocation, can grow in place
+  uint32_t a_chunk_size;    // Default size of heap chunks
+  uint32_t a_limit;         // Max heap bytes, 0 = No limit
+  uint32_t a_heap;          // Heap bytes currently held
+} arena_t;
+
+typedef struct arena_mark {
+  arena_chunk_t *am_chunk;
+  uint32_t am_used;
+} arena_mark_t;
+
+/**
+ * Initialize an arena
+ *
+ * @param buf         Memory for the first chunk or NULL. Part of it is
+ *                    used for a chunk header
+ * @param bufsize     Size of buf
+ * @param chunk_size  Size of heap chunks. Larger allocations get a
+ *                    chunk of their own
+ * @param limit       Max number of heap bytes, 0 for no limit
+ */
+void arena_init(arena_t *a, void *buf, size_t bufsize,
+                size_t chunk_size, size_t limit);
+
+/**
+ * Allocate 'size' bytes, 8 byte aligned
+ *
+ * @return Memory or NULL if the heap limit is reached or out of memory
+ */
+void *arena_alloc(arena_t *a, size_t size)
+  __attribute__((malloc, warn_unused_result));
+
+/**
+ * Grow an allocation. Done in place if 'ptr' is the most recent
+ * allocation and there is room, otherwise the data is copied. A NULL
+ * 'ptr' is the same as arena_alloc()
+ *
+ * @return The (possibly moved) allocation or NULL on failure, in which
+ *         case 'ptr' is still valid
+ */
+void *arena_realloc(arena_t *a, void *ptr, size_t oldsize, size_t newsize)
+  __attribute__((warn_unused_result));
+
+/**
+ * Append 'len' bytes to the NUL terminated string in '*strp', or start
+ * a new string if '*strp' is NULL
+ *
+ * @return The new string (also stored in '*strp') or NULL on failure
+ */
+char *arena_strappend(arena_t *a, char **strp, const char *src, size_t len);
+
+/**
+ * Current position, for arena_rewind(). Allocations made before the
+ * mark are no longer grown in place by arena_realloc()
+ */
+arena_mark_t arena_mark(arena_t *a);
+
+/**
+ * Release everything allocated after 'm' was taken
+ */
+void arena_rewind(arena_t *a, arena_mark_t m);
+
+/**
+ * Release everything. The arena can be used again afterwards
+ */
+void arena_release(arena_t *a);
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "task.h"
+#include "timer.h"
+
+/*
+ * Stackless coroutines
+ *
+ * A coroutine is a plain task_t (run to completion from the scheduler,
+ * no stack of its own) that can suspend itself and later continue
+ * where it left off. All state that must survive a suspension has to
+ * be kept in a caller-provided struct (typically one that embeds the
+ * coro_t), local variables are lost.
+ *
+ *   typedef struct {
+ *     coro_t co;
+ *     int retries;
+ *   } my_state_t;
+ *
+ *   static void
+ *   my_coro(coro_t *co)
+ *   {
+ *     my_state_t *s = (my_state_t *)co;
+ *     CORO_BEGIN(co);
+ *     for(s->retries = 0; s->retries < 3; s->retries++) {
+ *       send_request();
+ *       CORO_WAIT_DEADLINE(co, &reply_cond, clock_get() + 100000);
+ *       if(!coro_timedout(co))
+ *         break;
+ *     }
+ *     CORO_END(co);
+ *   }
+ *
+ * The CORO_ macros record the resume point using __LINE__, so at most
+ * one may be used per source line, and they can not be used from
+ * within a nested switch statement.
+ *
+ * Coroutines execute in the same context as other tasks: They must
+ * never block (no mutex_lock(), no sleeping) and are not preemptible
+ * by threads on the same CPU.
+ */
+
+#define CORO_LINE_DONE 0xffff
+
+typedef struct coro {
+  task_t co_task;           // Scheduled to run co_fn, must be first
+  task_t co_wait;           // Enlisted on the waitable while waiting
+  timer_t co_timer;
+  void (*co_fn)(struct coro *co);
+  task_waitable_t *co_waitable;
+  uint16_t co_line;         // Resume point, 0 = start
+  uint8_t co_waiting;
+  uint8_t co_timedout;
+} coro_t;
+
+
+/**
+ * Initialize a coroutine. It does not start running until coro_start()
+ *
+ * @param co    Coroutine state
+ * @param fn    Coroutine body, must start with CORO_BEGIN()
+ * @param prio  Scheduling priority (1-31), also decides the wakeup order
+ *              among tasks waiting on the same waitable
+ * @param name  Name, used for the timer
+ */
+void coro_init(coro_t *co, void (*fn)(coro_t *co), unsigned int prio,
+               const char *name);
+
+/**
+ * (Re)start a coroutine from the beginning. It must not be waiting
+ */
+void coro_start(coro_t *co);
+
+/**
+ * Stop a coroutine. It will not run again until restarted with
+ * coro_start(). Must be called from the CPU / context that runs it
+ */
+void coro_stop(coro_t *co);
+
+/**
+ * Non-zero if the last CORO_WAIT_DEADLINE() or CORO_WAIT_UNTIL_DEADLINE()
+ * returned due to the deadline passing
+ */
+static inline int
+coro_timedout(const coro_t *co)
+{
+  return co->co_timedout;
+}
+
+/**
+ * Non-zero if the coroutine has run to CORO_END()
+ */
+static inline int
+coro_done(const coro_t *co)
+{
+  return co->co_line == CORO_LINE_DONE;
+}
+
+// Helpers for the macros below, not to be called directly
+
+void coro_prepare_wait(coro_t *co, task_waitable_t *waitable,
+                       int64_t deadline);
+
+void coro_cancel_wait(coro_t *co);
+
+void coro_wakeup_sched_locked(task_t *t);
+
+
+#define CORO_BEGIN(co) switch((co)->co_line) { case 0:
+
+#define CORO_END(co) } (co)->co_line = CORO_LINE_DONE
+
+/**
+ * Let other tasks of the same (or higher) priority run, then continue
+ */
+#define CORO_YIELD(co)                                  \
+  do {                                                  \
+    (co)->co_line = __LINE__;                           \
+    task_run(&(co)->co_task);                           \
+    return;                                             \
+  case __LINE__:;                                       \
+  } while(0)
+
+/**
+ * Wait for the waitable to be signalled (by task_wakeup(),
+ * cond_signal() etc) or for the deadline to pass (0 = no deadline)
+ */
+#define CORO_WAIT_DEADLINE(co, waitable, deadline)      \
+  do {                                                  \
+    (co)->co_line = __LINE__;                           \
+    coro_prepare_wait(co, waitable, deadline);          \
+    return;                                             \
+  case __LINE__:;                                       \
+  } while(0)
+
+#define CORO_WAIT(co, waitable) CORO_WAIT_DEADLINE(co, waitable, 0)
+
+/**
+ * Wait until 'cond' is true. The coroutine is enlisted on the waitable
+ * before 'cond' is evaluated so a wakeup can not be lost in between.
+ * 'cond' is reevaluated each time the waitable is signalled
+ */
+#define CORO_WAIT_UNTIL_DEADLINE(co, waitable, cond, deadline)  \
+  do {                                                  \
+    (co)->co_line = __LINE__;                           \
+    (co)->co_timedout = 0;                              \
+  case __LINE__:                                        \
+    if(!coro_timedout(co)) {                            \
+      coro_prepare_wait(co, waitable, deadline);        \
+      if(!(cond))                                       \
+        return;                                         \
+      coro_cancel_wait(co);                             \
+    } else if(cond) {                                   \
+      (co)->co_timedout = 0;                            \
+    }                                                   \
+  } while(0)
+
+#define CORO_WAIT_UNTIL(co, waitable, cond)             \
+  CORO_WAIT_UNTIL_DEADLINE(co, waitable, cond, 0)
+
+/**
+ * Sleep until the given clock_get() time
+ */
+#define CORO_SLEEP_UNTIL(co, deadline)                  \
+  CORO_WAIT_DEADLINE(co, NULL, deadline)
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include "task.h"
+
+/*
+ * Slab caches for fixed size objects
+ *
+ * Objects are carved out of slabs, each being a single heap allocation
+ * holding a number of objects. Freed objects go back on their slab's
+ * free list and are handed out again without involving the heap. A
+ * slab is returned to the heap once all its objects are free, except
+ * for one empty slab per cache which is kept around to avoid thrashing.
+ * Caches with just one object per slab (large objects) keep no empty
+ * slab.
+ *
+ * Caches are usually defined statically:
+ *
+ *   kmem_cache_t foo_cache = KMEM_CACHE_INITIALIZER("foo", sizeof(foo_t), 0);
+ *
+ * They are set up and registered (for 'slabinfo') on first allocation.
+ */
+
+#ifndef KMEM_SLAB_SIZE
+#define KMEM_SLAB_SIZE 512  // Target size of a slab
+#endif
+
+LIST_HEAD(kmem_slab_list, kmem_slab);
+
+typedef struct kmem_cache {
+  mutex_t kc_mutex;
+  struct kmem_slab_list kc_partial;  // Slabs with free objects
+  SLIST_ENTRY(kmem_cache) kc_link;
+  const char *kc_name;
+  uint32_t kc_objsize;
+  uint32_t kc_memtype;               // MEM_TYPE_* for the slabs
+  uint32_t kc_stride;                // Object spacing, 0 until set up
+  uint16_t kc_per_slab;
+  uint16_t kc_empty;                 // Number of empty slabs kept
+
+  // Statistics
+  uint32_t kc_slabs;
+  uint32_t kc_inuse;
+  uint32_t kc_inuse_max;
+  uint32_t kc_allocs;
+  uint32_t kc_failed;
+} kmem_cache_t;
+
+#define KMEM_CACHE_INITIALIZER(name, size, memtype) {   \
+    .kc_mutex = MUTEX_INITIALIZER(name),                \
+    .kc_name = (name),                                  \
+    .kc_objsize = (size),                               \
+    .kc_memtype = (memtype),                            \
+  }
+
+/**
+ * Find a cache with the given name and object size, or create one if
+ * no such cache exists. Useful for objects whose size is only known at
+ * runtime but rarely varies
+ *
+ * @param name     Name of the cache (compared by pointer)
+ * @param size     Object size
+ * @param memtype  MEM_TYPE_* for the slabs
+ * @return The cache or NULL if out of memory
+ */
+kmem_cache_t *kmem_cache_get(const char *name, size_t size,
+                             unsigned int memtype);
+
+/**
+ * Allocate an object
+ *
+ * @param kc     The cache
+ * @param flags  MEM_MAY_FAIL and/or MEM_CLEAR
+ * @return The object, NULL if out of memory and MEM_MAY_FAIL is set
+ */
+void *kmem_cache_alloc(kmem_cache_t *kc, unsigned int flags)
+  __attribute__((malloc,warn_unused_result));
+
+/**
+ * Return an object to the cache it was allocated from. NULL is ignored
+ */
+void kmem_cache_free(kmem_cache_t *kc, void *obj);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "atomic.h"
+#include "error.h"
+
+/*
+ * IRQ-safe pool of fixed size objects
+ *
+ * Free objects are kept on a lock-free stack (linked through their
+ * first word) so objpool_get() and objpool_put() can be called from
+ * any context, including interrupt handlers at any priority, without
+ * masking interrupts.
+ *
+ * On ARMv7/ARMv8 the pop is a single LDREX/STREX (LDAXR/STXR on
+ * AArch64) sequence which cannot suffer from ABA as any intervening
+ * write to the head clears the exclusive monitor. CPUs without
+ * exclusive access instructions (ARMv6-M, RISC-V) briefly disable
+ * interrupts instead.
+ *
+ * Objects must be at least pointer sized and pointer aligned.
+ */
+
+typedef struct objpool {
+  void *op_head;
+  atomic_t op_avail;   // Approximate while objects are in flight
+  atomic_t op_fails;   // objpool_get() on an empty pool
+} objpool_t;
+
+
+void *objpool_get(objpool_t *op)
+  __attribute__((malloc, warn_unused_result));
+
+void objpool_put(objpool_t *op, void *item);
+
+/**
+ * Add objects carved from [start, end) with the given stride
+ *
+ * @return Number of objects added
+ */
+size_t objpool_add(objpool_t *op, void *start, void *end, size_t item_size);
+
+/**
+ * Allocate 'count' objects of 'item_size' from the heap and add them
+ */
+error_t objpool_alloc(objpool_t *op, size_t item_size, size_t count);
+
+static inline int
+objpool_avail(const objpool_t *op)
+{
+  return atomic_get(&op->op_avail);
+}
@@ -15,6 +15,8 @@
 #define RPC_TYPE_CONST_STRING 'S'
 #define RPC_TYPE_CONST_BINARY 'B'
 
+struct arena;
+
 typedef struct rpc_result {
   union {
     struct {
@@ -25,6 +27,11 @@ typedef struct rpc_result {
     float flt;
   };
   char type;
+
+  // Scratch memory released once the reply has been sent, or NULL.
+  // Results allocated from here should use the CONST types as they
+  // must not be free()d
+  struct arena *arena;
 } rpc_result_t;
 
 typedef struct rpc_method {
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Scheduler event trace
+ *
+ * When built with ENABLE_SCHED_TRACE the scheduler records context
+ * switches, wakeups, softirqs and interrupts into a ring buffer. The
+ * ring is frozen and dumped with the 'schedtrace' CLI command, or
+ * streamed in binary form by the "schedtrace" service (see
+ * host/schedtrace for a converter to Chrome / Perfetto JSON).
+ *
+ * The binary stream consists of a sched_trace_header_t, followed by
+ * num_threads sched_trace_thread_t and then num_records
+ * sched_trace_record_t in chronological order. All fields are little
+ * endian.
+ */
+
+#define SCHED_TRACE_MAGIC   0x43525453 // 'STRC'
+#define SCHED_TRACE_VERSION 1
+
+#define SCHED_TRACE_SWITCH  1 // thread: Switched to, arg: Switched from
+#define SCHED_TRACE_WAKEUP  2 // thread: Woken up, arg: Waker
+#define SCHED_TRACE_SOFTIRQ 3 // thread: Current, arg: Softirq id
+#define SCHED_TRACE_IRQ     4 // thread: Interrupted, arg: IRQ number
+
+// Thread id used for tasks that are not threads
+#define SCHED_TRACE_NO_THREAD 0xffff
+
+typedef struct sched_trace_record {
+  uint32_t cycles;  // cpu_cycle_counter()
+  uint8_t type;
+  uint8_t cpu;
+  uint16_t thread;  // thread_t.t_trace_id, idle threads are 0
+  uint32_t arg;
+} sched_trace_record_t;
+
+typedef struct sched_trace_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+  uint32_t num_threads;
+  uint32_t num_records;
+  uint32_t cycles_per_ms;  // Measured when frozen
+  uint32_t cycles_freeze;  // cpu_cycle_counter() when frozen
+  uint64_t clock_freeze;   // clock_get() when frozen
+} sched_trace_header_t;
+
+typedef struct sched_trace_thread {
+  uint16_t id;
+  char name[14];
+} sched_trace_thread_t;
+
+
+void sched_trace_add(uint8_t type, uint16_t thread, uint32_t arg);
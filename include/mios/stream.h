@@ -7,6 +7,7 @@
 
 struct stream;
 struct task_waitable;
+struct pbuf;
 
 #define STREAM_WRITE_NO_WAIT  0x1  /* Write as much as possible, but don't
                                     * wait. Returns number of bytes written
@@ -40,6 +41,11 @@ typedef struct stream_vtable {
 
   ssize_t (*drop)(struct stream *s, size_t bytes);
 
+  // Optional. Write the payload of a pbuf chain without copying it.
+  // The stream takes ownership of 'pb' whatever the outcome. Use
+  // stream_write_pbuf() which falls back to write() if not implemented
+  ssize_t (*write_pbuf)(struct stream *s, struct pbuf *pb);
+
 } stream_vtable_t;
 
 
@@ -90,6 +96,9 @@ stream_drop(struct stream *s, size_t bytes)
   return s->vtable->drop(s, bytes);
 }
 
+// Implemented in net/pbuf.c
+ssize_t stream_write_pbuf(struct stream *s, struct pbuf *pb);
+
 __attribute__((always_inline))
 static inline ssize_t
 stream_flush(struct stream *s)
@@ -48,6 +48,7 @@ LIST_HEAD(task_list, task);
 #define TASK_STATE_SLEEPING 3  /**< Sleeping on a waitable */
 #define TASK_STATE_ZOMBIE   4  /**< Terminated, waiting to be joined */
 #define TASK_STATE_MUXED_SLEEP 5  /**< Sleeping in a multiplexed wait */
+#define TASK_STATE_CORO_SLEEP 6   /**< Coroutine waiting (see coro.h) */
 
 /**
  * Base task structure
@@ -95,6 +96,12 @@ void task_run(task_t *t);
  *
  */
 
+/**
+ * Number of log2 buckets in the per-thread wakeup-to-run latency
+ * histogram. Bucket N counts latencies of [2^N, 2^(N+1)) CPU cycles,
+ * the last bucket is open ended
+ */
+#define TASK_LATENCY_BUCKETS 24
 
 /**
  * Full thread structure with stack and execution context
@@ -115,11 +122,28 @@ typedef struct thread {
   const char *t_wchan;  /**< Wait channel name (valid when SLEEPING) */
 #endif
 
+  struct mutex *t_blocked_on; /**< Mutex this thread is waiting for */
+
+#ifdef ENABLE_SMP
+  struct cpu *t_cpu;    /**< CPU this thread is scheduled on */
+#endif
+
   SLIST_ENTRY(thread) t_global_link;  /**< Link in global thread list */
   struct stream *t_stream;            /**< Associated I/O stream */
 
   char t_name[11];      /**< Thread name (max 10 chars + null) */
   uint8_t t_refcount;   /**< Reference count for thread lifecycle */
+  uint8_t t_base_prio;  /**< Priority without inheritance from waiters */
+
+#ifdef ENABLE_SCHED_TRACE
+  uint16_t t_trace_id;  /**< Thread id in scheduler trace, 0 for idle */
+#endif
+
+#ifdef ENABLE_TASK_LATENCY
+  uint32_t t_ready_cycle;       /**< CPU cycle count when made ready */
+  uint32_t t_latency_max;       /**< Worst wakeup-to-run latency (cycles) */
+  uint32_t t_latency[TASK_LATENCY_BUCKETS]; /**< log2(cycles) histogram */
+#endif
 
 #ifdef ENABLE_TASK_ACCOUNTING
   uint32_t t_cycle_enter;       /**< CPU cycle count at context switch in */
@@ -127,11 +151,32 @@ typedef struct thread {
   uint32_t t_ctx_switches_acc;  /**< Accumulated context switches */
   uint32_t t_ctx_switches;      /**< Current context switch count */
   uint16_t t_load;              /**< CPU load percentage (0-10000 = 0-100%) */
-  uint16_t t_stacksize;         /**< Stack size in bytes */
 #endif
+  uint16_t t_stacksize;         /**< Stack size in bytes */
 
 } thread_t;
 
+#define IDLE_RESIDENCY_BUCKETS 24  /**< log2(µs) buckets, last is open ended */
+#define IDLE_WAKEUP_SOURCES    8   /**< Distinct wakeup sources tracked */
+
+#define IDLE_WAKEUP_UNKNOWN    INT16_MIN
+
+/**
+ * Per-CPU idle statistics
+ *
+ * Updated by the idle loop each time the CPU returns from a low power
+ * wait. Wakeup sources are interrupt numbers as seen by the interrupt
+ * controller (on Cortex-M, core exceptions are negative, SysTick is -1)
+ */
+typedef struct idle_stats {
+  uint64_t is_total;      /**< Total time spent waiting (µs) */
+  uint32_t is_entries;    /**< Number of waits */
+  uint32_t is_residency[IDLE_RESIDENCY_BUCKETS]; /**< Waits by duration */
+  int16_t is_wakeup_irq[IDLE_WAKEUP_SOURCES];    /**< Wakeup source */
+  uint32_t is_wakeup_count[IDLE_WAKEUP_SOURCES]; /**< Wakeups per source */
+  uint32_t is_wakeup_other; /**< Wakeups not fitting in table above */
+} idle_stats_t;
+
 /**
  * Per-CPU scheduler structure
  *
@@ -148,9 +193,24 @@ typedef struct sched_cpu {
   thread_t *current_fpu;  /**< Thread currently owning FPU context */
 #endif
 
+  idle_stats_t idle_stats; /**< Idle residency and wakeup sources */
+
 } sched_cpu_t;
 
 
+/**
+ * Return the currently executing thread of this CPU as stored in
+ * mutex_t.lock by the owner
+ *
+ * @note cpu_t must start with its sched_cpu_t
+ */
+static inline intptr_t __attribute__((always_inline))
+mutex_self(void)
+{
+  return (intptr_t)((sched_cpu_t *)curcpu())->current;
+}
+
+
 /**
  * Initialize a CPU scheduler structure
  *
@@ -159,6 +219,17 @@ typedef struct sched_cpu {
  */
 void sched_cpu_init(sched_cpu_t *sc, thread_t *idle);
 
+/**
+ * Record a completed idle wait on the current CPU
+ *
+ * Called by the CPU's idle loop with interrupts masked, after waking
+ * up but before the wakeup interrupt is serviced.
+ *
+ * @param enter   Value of clock_get_irq_blocked() when the wait started
+ * @param source  Interrupt that caused the wakeup, or IDLE_WAKEUP_UNKNOWN
+ */
+void idle_account(uint64_t enter, int source);
+
 /**
  * Waitable object for task synchronization
  *
@@ -187,17 +258,30 @@ typedef struct task_waitable {
 /**
  * Mutex for mutual exclusion
  *
- * Provides exclusive access to shared resources. The union allows for
- * fast atomic operations when uncontended, falling back to a waiter
- * list when threads need to block.
+ * Provides exclusive access to shared resources. The lock word holds
+ * the owning thread which allows for fast atomic operations when
+ * uncontended. Once threads need to block, MUTEX_CONTENDED is set and
+ * the owner inherits the priority of the highest waiter until the
+ * mutex is released.
  */
 typedef struct mutex {
-  union {
-    task_waitable_t waiters;  /**< List of waiting threads */
-    intptr_t lock;            /**< Lock value (0=unlocked, 1=locked) */
-  };
+  intptr_t lock;              /**< Owning thread (0=unlocked) | MUTEX_CONTENDED */
+  task_waitable_t waiters;    /**< List of waiting threads */
+#ifdef ENABLE_LOCKSTAT
+  struct lockstat *stat;      /**< Statistics entry, resolved on first lock */
+  uint32_t hold_start;        /**< cpu_cycle_counter() when acquired */
+#endif
 } mutex_t;
 
+#define MUTEX_CONTENDED 0x1
+
+#ifdef ENABLE_LOCKSTAT
+// All operations must go via the slow paths to be accounted
+#define MUTEX_FAST_PATH 0
+#else
+#define MUTEX_FAST_PATH __atomic_always_lock_free(sizeof(intptr_t), 0)
+#endif
+
 /**
  * Condition variable for thread synchronization
  *
@@ -223,6 +307,9 @@ void thread_init_cpu(sched_cpu_t *sc, const char *cpu_name, void *sp_bottom);
 // Remaining flags are only used during thread_create
 #define TASK_NO_FPU            0x100
 #define TASK_NO_DMA_STACK      0x200
+#define TASK_CPU_SHIFT         10
+#define TASK_CPU_MASK          (0x3f << TASK_CPU_SHIFT)
+#define TASK_CPU(x)            (((x) + 1) << TASK_CPU_SHIFT) // Run on CPU x
 #define TASK_MEMTYPE_SHIFT     16
 
 /**
@@ -237,6 +324,10 @@ void thread_init_cpu(sched_cpu_t *sc, const char *cpu_name, void *sp_bottom);
  *                    - TASK_NO_FPU: Thread is not allowed to use FPU
  *                    - TASK_NO_DMA_STACK: Don't use DMA-capable memory
  *                                         for stack
+ *                    - TASK_CPU(x): Run thread on CPU x (ENABLE_SMP only).
+ *                                   Falls back to CPU 0 if CPU x is
+ *                                   not online. Without it threads
+ *                                   are distributed over all CPUs
  *
  *                    - Memory type can be specified in bits 16+
  * @param prio        Thread priority (1-31, where 31 is highest;
@@ -314,6 +405,15 @@ void task_wakeup(task_waitable_t *waitable, int all);
  */
 void task_wakeup_sched_locked(task_waitable_t *waitable, int all);
 
+/**
+ * Enlist a task on a waitable object, ordered by priority (highest
+ * first, FIFO among equal priorities) which is the order in which
+ * task_wakeup() wakes them
+ *
+ * @note Must be called with IRQ_LEVEL_SCHED forbidden
+ */
+void task_insert_wait_list(task_waitable_t *waitable, task_t *t);
+
 /**
  * Put the current task to sleep on a waitable object
  *
@@ -369,6 +469,17 @@ int task_sleep_delta(task_waitable_t *waitable, int useconds)
  */
 thread_t *thread_current(void);
 
+/**
+ * Iterate over all threads
+ *
+ * The returned thread is retained until passed back in the next call,
+ * so the iteration must run to completion (until NULL is returned)
+ *
+ * @param cur  Previous thread or NULL to start from the beginning
+ * @return Next thread or NULL when done
+ */
+thread_t *thread_get_next(thread_t *cur);
+
 #ifdef ENABLE_TASK_WCHAN
 #define MUTEX_INITIALIZER(n) { .waiters = {.name = (n)}}
 #else
@@ -385,10 +496,14 @@ thread_t *thread_current(void);
 inline void  __attribute__((always_inline))
 mutex_init(mutex_t *m, const char *name)
 {
+  m->lock = 0;
   LIST_INIT(&m->waiters.list);
 #ifdef ENABLE_TASK_WCHAN
   m->waiters.name = name;
 #endif
+#ifdef ENABLE_LOCKSTAT
+  m->stat = NULL;
+#endif
 }
 
 /**
@@ -409,12 +524,13 @@ void mutex_lock_slow(mutex_t *m);
  * @note This function blocks until the mutex is acquired. It first attempts
  *       a fast atomic compare-exchange, falling back to mutex_lock_slow() if needed.
  */
-inline void  __attribute__((always_inline))
+static inline void  __attribute__((always_inline))
 mutex_lock(mutex_t *m)
 {
-  if(__atomic_always_lock_free(sizeof(intptr_t), 0)) {
+  if(MUTEX_FAST_PATH) {
     intptr_t expected = 0;
-    if(__builtin_expect(__atomic_compare_exchange_n(&m->lock, &expected, 1, 1,
+    if(__builtin_expect(__atomic_compare_exchange_n(&m->lock, &expected,
+                                                    mutex_self(), 1,
                                                     __ATOMIC_SEQ_CST,
                                                     __ATOMIC_RELAXED), 1))
       return;
@@ -444,12 +560,13 @@ int mutex_trylock_slow(mutex_t *m);
  * @note This function does not block. It returns immediately whether or not
  *       the lock was acquired.
  */
-inline int  __attribute__((always_inline))
+static inline int  __attribute__((always_inline))
 mutex_trylock(mutex_t *m)
 {
-  if(__atomic_always_lock_free(sizeof(intptr_t), 0)) {
+  if(MUTEX_FAST_PATH) {
     intptr_t expected = 0;
-    if(__builtin_expect(__atomic_compare_exchange_n(&m->lock, &expected, 1, 1,
+    if(__builtin_expect(__atomic_compare_exchange_n(&m->lock, &expected,
+                                                    mutex_self(), 1,
                                                     __ATOMIC_SEQ_CST,
                                                     __ATOMIC_RELAXED), 1))
       return 0;
@@ -474,13 +591,14 @@ void mutex_unlock_slow(mutex_t *m);
  * @param m  Pointer to the mutex to unlock
  *
  * @note The mutex must be currently held by the calling thread. If there are
- *       threads waiting on the mutex, one will be woken up.
+ *       threads waiting on the mutex, ownership is handed over to the
+ *       one with highest priority.
  */
-inline void  __attribute__((always_inline))
+static inline void  __attribute__((always_inline))
 mutex_unlock(mutex_t *m)
 {
-  if(__atomic_always_lock_free(sizeof(intptr_t), 0)) {
-    intptr_t expected = 1;
+  if(MUTEX_FAST_PATH) {
+    intptr_t expected = mutex_self();
     if(__builtin_expect(__atomic_compare_exchange_n(&m->lock, &expected, 0, 1,
                                                     __ATOMIC_SEQ_CST,
                                                     __ATOMIC_RELAXED), 1))
@@ -489,6 +607,22 @@ mutex_unlock(mutex_t *m)
   mutex_unlock_slow(m);
 }
 
+#ifdef ENABLE_LOCKSTAT
+/**
+ * Account a mutex acquisition (called with IRQ_LEVEL_SCHED forbidden)
+ *
+ * @param m          The mutex, now owned by the current thread
+ * @param contended  Non-zero if the caller had to block
+ * @param wait       Cycles spent blocked
+ */
+void lockstat_acquired(mutex_t *m, int contended, uint32_t wait);
+
+/**
+ * Account a mutex release (called with IRQ_LEVEL_SCHED forbidden)
+ */
+void lockstat_released(mutex_t *m);
+#endif
+
 
 #ifdef ENABLE_TASK_WCHAN
 #define COND_INITIALIZER(n) {.name = (n)}
@@ -3,7 +3,39 @@
 #include <stdint.h>
 #include <sys/queue.h>
 
-LIST_HEAD(timer_list, timer);
+LIST_HEAD(timer_slot, timer);
+
+/*
+ * Timers are kept in a hierarchical timing wheel. Level 0 has
+ * TIMER_WHEEL_SLOTS slots each spanning 2^TIMER_WHEEL_SHIFT µs, and
+ * every level above spans TIMER_WHEEL_SLOTS times more. Arm and disarm
+ * are O(1). Timers are cascaded into lower levels as time approaches
+ * their deadline, and the expiry itself is always compared against the
+ * exact t_expire, so the wheel granularity does not affect precision.
+ *
+ * With the defaults the wheel covers ~268s. Timers further out than
+ * that are kept on an overflow list until they come within reach.
+ *
+ * The geometry changes the layout of struct timer_list, so it must be
+ * the same in every translation unit. It is set from the Makefile
+ * (TIMER_WHEEL_BITS, TIMER_WHEEL_LEVELS, TIMER_WHEEL_SHIFT) and ends up
+ * in config.h. Platforms short on RAM can shrink the wheel from their
+ * .mk file.
+ */
+#if !defined(TIMER_WHEEL_BITS) || !defined(TIMER_WHEEL_LEVELS) || \
+  !defined(TIMER_WHEEL_SHIFT)
+#error Timer wheel geometry is not configured, config.h missing?
+#endif
+
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+struct timer_list {
+  uint64_t tl_tick;   // Current position of the wheel, in level 0 slots
+  uint64_t tl_next;   // Lower bound of earliest deadline, 0 if empty
+  uint32_t tl_pending[TIMER_WHEEL_LEVELS]; // Bitmask of non-empty slots
+  struct timer_slot tl_slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  struct timer_slot tl_overflow;
+};
 
 typedef struct timer {
   LIST_ENTRY(timer) t_link;
@@ -20,9 +52,27 @@ void timer_arm_abs(timer_t *t, uint64_t deadline);
 // IRQ_LEVEL_CLOCK must be blocked
 int timer_disarm(timer_t *t);
 
-void timer_arm_on_queue(timer_t *t, uint64_t deadline, struct timer_list *tl);
+// Return 1 if the timer is now the earliest on the queue, in which
+// case whoever waits for the queue's deadline needs to reprogram
+int timer_arm_on_queue(timer_t *t, uint64_t deadline, struct timer_list *tl);
+
+// Fire all timers that have expired at 'now'. Returns when
+// timer_dispatch() needs to be called again (see timer_list_next())
+uint64_t timer_dispatch(struct timer_list *tl, uint64_t now);
+
+// Deadline at which timer_dispatch() needs to be called next, 0 if
+// nothing is armed. It may be earlier than the actual first deadline
+// (if that timer has been disarmed) but never later
+static inline uint64_t
+timer_list_next(const struct timer_list *tl)
+{
+  return tl->tl_next;
+}
 
-void timer_dispatch(struct timer_list *tl, uint64_t now);
+// Invoke cb for each timer armed on the queue (in no particular order)
+void timer_list_walk(const struct timer_list *tl,
+                     void (*cb)(const timer_t *t, void *opaque),
+                     void *opaque);
 
 void timer_init(timer_t *t, void (*cb)(void *opaque, uint64_t expire),
                 void *opaque, const char *name, uint64_t deadline);
@@ -1,3 +1,9 @@
 #pragma once
 
 #define CACHE_LINE_SIZE 32
+
+#if !defined(ASM)
+struct cpu;
+extern struct cpu cpu0;
+static inline struct cpu *curcpu(void) { return &cpu0; }
+#endif
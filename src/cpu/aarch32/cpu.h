@@ -11,10 +11,6 @@ typedef struct cpu {
   sched_cpu_t sched;
 } cpu_t;
 
-extern struct cpu cpu0;
-
-static inline struct cpu *curcpu(void) { return &cpu0; }
-
 static inline void
 cpu_stack_redzone(thread_t *t)
 {
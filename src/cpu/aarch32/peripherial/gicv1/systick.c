@@ -71,24 +71,12 @@ clock_get(void)
 }
 
 
-static int
-timer_cmp(const timer_t *a, const timer_t *b)
-{
-  return a->t_expire > b->t_expire;
-}
-
-
 // IRQ_LEVEL_CLOCK must be blocked
 __attribute__((weak))
 void
 timer_arm_abs(timer_t *t, uint64_t expire)
 {
-  if(t->t_expire)
-    LIST_REMOVE(t, t_link);
-
-  t->t_expire = expire;
-
-  LIST_INSERT_SORTED(&timers, t, t_link, timer_cmp);
+  timer_arm_on_queue(t, expire, &timers);
 }
 
 
@@ -3,5 +3,16 @@
 #if !defined(ASM)
 struct cpu;
 extern struct cpu cpu0;
+#ifdef ENABLE_SMP
+// TPIDR_EL1 points to the cpu_t of the executing core. Threads never
+// migrate between cores so the value is stable within a thread
+static inline struct cpu *curcpu(void)
+{
+  struct cpu *c;
+  asm("mrs %0, tpidr_el1" : "=r"(c));
+  return c;
+}
+#else
 static inline struct cpu *curcpu(void) { return &cpu0; }
 #endif
+#endif
@@ -4,6 +4,7 @@ TOOLCHAIN ?= ${TOOLCHAIN_AARCH64}
 
 ENABLE_MATH ?= no
 ENABLE_TASK_ACCOUNTING ?= no
+ENABLE_SMP ?= no
 
 GLOBALDEPS += ${C}/aarch64.mk ${C}/aarch64.ld
 
@@ -26,6 +27,8 @@ SRCS += \
 	${C}/exc.c \
 	${C}/rnd.c \
 
+SRCS-${ENABLE_SMP} += ${C}/smp.c
+
 
 ENTRYPOINT ?= start
 LDFLAGS += -e ${ENTRYPOINT}
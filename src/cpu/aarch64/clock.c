@@ -6,8 +6,11 @@
 
 #include "irq.h"
 
-static uint64_t nxt_timer;
-static uint64_t hz;
+#ifdef ENABLE_SMP
+#include "cpu.h"
+
+#define SGI_CLOCK_REPROGRAM 1
+#endif
 
 static struct timer_list timers;
 
@@ -29,30 +32,60 @@ uint64_t clock_get(void)
   return clock_get_irq_blocked();
 }
 
-static int
-timer_cmp(const timer_t *a, const timer_t *b)
+
+/**
+ * The virtual timer is run in one-shot mode, always programmed for the
+ * earliest deadline on the timer queue (or not at all if the queue is
+ * empty), so an idle CPU is not woken up by a periodic tick
+ */
+static void
+clock_program(uint64_t deadline)
 {
-  return a->t_expire > b->t_expire;
+  uint64_t cval = UINT64_MAX;
+  if(deadline) {
+    uint32_t freq;
+    asm volatile ("mrs %0, cntfrq_el0\n\r" : "=r"(freq));
+    // Round up so we never fire before the deadline
+    cval = deadline / 1000000 * freq +
+      ((deadline % 1000000) * freq + 999999) / 1000000;
+  }
+  asm volatile ("msr cntv_cval_el0, %0\n\t" : : "r"(cval));
+  asm volatile ("isb");
 }
 
-void
-timer_arm_abs(timer_t *t, uint64_t expire)
+
+#ifdef ENABLE_SMP
+
+static void
+clock_reprogram(void *arg)
 {
-  if(t->t_expire)
-    LIST_REMOVE(t, t_link);
+  clock_program(timer_list_next(&timers));
+}
+
+#endif
 
-  t->t_expire = expire;
 
-  LIST_INSERT_SORTED(&timers, t, t_link, timer_cmp);
+void
+timer_arm_abs(timer_t *t, uint64_t expire)
+{
+  if(!timer_arm_on_queue(t, expire, &timers))
+    return;
+
+#ifdef ENABLE_SMP
+  // The virtual timer interrupt is only routed to the boot CPU
+  if(curcpu() != &cpu0) {
+    sgi_send(cpu0.mpidr, SGI_CLOCK_REPROGRAM);
+    return;
+  }
+#endif
+  clock_program(expire);
 }
 
 static void
 timer_virt(void *arg)
 {
-  nxt_timer += hz;
-  asm volatile ("msr cntv_cval_el0, %0\n\t" : : "r"(nxt_timer));
-  uint64_t now = clock_get_irq_blocked();
-  timer_dispatch(&timers, now);
+  const uint64_t now = clock_get_irq_blocked();
+  clock_program(timer_dispatch(&timers, now));
 }
 
 
@@ -62,16 +95,15 @@ clock_init(void)
   uint32_t freq;
   asm volatile ("mrs %0, cntfrq_el0\n\r" : "=r"(freq));
   printf("Timer frequency: %d\n", freq);
-  nxt_timer = clock_get_irq_blocked();
-  printf("System clock is %ld\n", nxt_timer);
-  hz = freq / 1000;
+  printf("System clock is %ld\n", clock_get_irq_blocked());
 
   irq_enable_fn_arg(27, IRQ_LEVEL_CLOCK, timer_virt, NULL);
+#ifdef ENABLE_SMP
+  irq_enable_fn_arg(SGI_CLOCK_REPROGRAM, IRQ_LEVEL_CLOCK,
+                    clock_reprogram, NULL);
+#endif
 
-  uint64_t cntr;
-  asm volatile ("mrs %0, cntvct_el0\n\r" : "=r"(cntr));
-  cntr += hz;
-  asm volatile ("msr cntv_cval_el0, %0\n\t" : : "r"(nxt_timer));
+  clock_program(timer_list_next(&timers));
 
   // Enable timer
   asm volatile("msr cntv_ctl_el0, %0\n\t" : : "r" (1));
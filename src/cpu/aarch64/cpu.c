@@ -44,24 +44,35 @@ cpu_stack_init(uint64_t *stack, void *entry,
 }
 
 
-static void __attribute__((constructor(150)))
-cpu_init(void)
+thread_t *
+cpu_idle_thread_create(cpu_t *cpu)
 {
   const size_t stack_size = 1024;
 
-  // Create idle task
   void *sp_bottom = xalloc(stack_size + sizeof(thread_t),
                            CPU_STACK_ALIGNMENT, 0);
   memset(sp_bottom, 0x55, stack_size + sizeof(thread_t));
   void *sp = sp_bottom + stack_size;
-  asm volatile ("msr sp_el0, %0\n\t" : : "r" (sp));
   thread_t *t = sp;
   strlcpy(t->t_name, "idle", sizeof(t->t_name));
   t->t_sp_bottom = sp_bottom;
   t->t_stream = NULL;
   t->t_task.t_state = TASK_STATE_ZOMBIE;
   t->t_task.t_prio = 0;
-  sched_cpu_init(&curcpu()->sched, t);
+#ifdef ENABLE_SMP
+  t->t_cpu = cpu;
+#endif
+  sched_cpu_init(&cpu->sched, t);
+  return t;
+}
+
+
+static void __attribute__((constructor(150)))
+cpu_init(void)
+{
+  // Idle thread's stack starts right below its thread_t
+  thread_t *t = cpu_idle_thread_create(curcpu());
+  asm volatile ("msr sp_el0, %0\n\t" : : "r" (t));
 }
 
 
@@ -70,6 +81,6 @@ void
 cpu_idle(void)
 {
   while(1) {
-    asm volatile("wfi");
+    cpu_idle_wait();
   }
 }
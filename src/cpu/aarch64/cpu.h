@@ -1,16 +1,28 @@
 #pragma once
 
 #include <stdarg.h>
+#include <unistd.h>
+
+#include <mios/task.h>
 
 #define CPU_STACK_ALIGNMENT 16
 
 #define MIN_STACK_SIZE 1024
 
+#ifndef CPU_MAX
+#define CPU_MAX 1
+#endif
+
 void *cpu_stack_init(uint64_t *stack, void *entry,
                      void (*thread_exit)(void *), int nargs, va_list ap);
 
 typedef struct cpu {
   sched_cpu_t sched;
+#ifdef ENABLE_SMP
+  uint64_t mpidr;
+  unsigned int index;
+  int online;
+#endif
 } cpu_t;
 
 static inline void
@@ -24,3 +36,71 @@ cpu_stack_redzone(thread_t *t)
 }
 
 void cpu_fpu_ctx_init(int *ctx);
+
+#define HAVE_CYCLE_COUNTER
+
+// Not cycles as such, but the (fixed frequency) generic timer
+static inline uint32_t
+cpu_cycle_counter(void)
+{
+  uint64_t cntr;
+  asm volatile ("mrs %0, cntvct_el0" : "=r"(cntr));
+  return cntr;
+}
+
+// Rate of cpu_cycle_counter() in cycles per µs as a fixed point
+// number with CPU_CYCLES_PER_US_SHIFT fractional bits. Measured once
+// (see timer.c)
+#define CPU_CYCLES_PER_US_SHIFT 16
+uint32_t cpu_cycles_per_us(void);
+
+// Convert a cpu_cycle_counter() delta to µs
+uint32_t cpu_cycles_to_us(uint64_t cycles);
+
+thread_t *cpu_idle_thread_create(cpu_t *cpu);
+
+/**
+ * Idle loop helpers. cpu_idle_enter() must be called with IRQs masked
+ * in DAIF and the returned timestamp passed to cpu_idle_leave() after
+ * WFI returns, but before IRQs are unmasked, so the pending interrupt
+ * that ended the wait can be recorded
+ */
+static inline uint64_t
+cpu_idle_enter(void)
+{
+  return clock_get_irq_blocked();
+}
+
+static inline void
+cpu_idle_leave(uint64_t enter)
+{
+  uint64_t intid;
+  asm volatile ("mrs %0, icc_hppir1_el1" : "=r"(intid));
+  intid &= 0xffffff;
+  idle_account(enter, intid < 1020 ? (int)intid : IDLE_WAKEUP_UNKNOWN);
+}
+
+static inline void
+cpu_idle_wait(void)
+{
+  asm volatile ("msr daifset, #2");
+  const uint64_t enter = cpu_idle_enter();
+  asm volatile ("wfi");
+  cpu_idle_leave(enter);
+  asm volatile ("msr daifclr, #2");
+}
+
+#ifdef ENABLE_SMP
+
+// Online CPUs, indexed by cpu_t.index. Indices of cores that did not
+// come online in time are NULL
+extern cpu_t *cpu_array[CPU_MAX];
+extern unsigned int cpu_online;
+
+// Make a (remote) CPU reevaluate its readyqueues
+void cpu_kick(cpu_t *cpu);
+
+// Provided by platform: MPIDR of the index'th CPU
+uint64_t cpu_mpidr(unsigned int index);
+
+#endif
@@ -7,6 +7,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <mios/mios.h>
+#include <mios/sched_trace.h>
+#include <mios/task.h>
 
 #define GICD_CTLR          (0x000)
 #define GICD_TYPER         (0x004)
@@ -90,7 +92,16 @@ trap_irq(uint32_t irq)
 
   if(irqs[irq].fn == NULL)
     panic("Spurious IRQ %d", irq);
+#ifdef ENABLE_SMP
+  smp_giant_enter();
+#endif
+#ifdef ENABLE_SCHED_TRACE
+  sched_trace_add(SCHED_TRACE_IRQ, thread_current()->t_trace_id, irq);
+#endif
   irqs[irq].fn(irqs[irq].arg);
+#ifdef ENABLE_SMP
+  smp_giant_leave();
+#endif
 }
 
 
@@ -139,19 +150,27 @@ irq_disable(int irq)
 
 
 
-static void  __attribute__((constructor(105)))
-irq_init(void)
+void
+gic_cpu_init(void)
 {
-  reg_wr(GIC_GICD_BASE + GICD_CTLR, 7);
-
   long base = gicr_base();
-  printf("GICv3: GICR @ 0x%lx\n", base);
 
   reg_wr(base + GICR_WAKER, 0);
 
   asm volatile ("msr icc_sre_el1, %0\n\t" : : "r" (1));
-  asm volatile ("msr icc_pmr_el1, %0\n\t" : : "r" (0xff));
+  asm volatile ("msr icc_pmr_el1, %0\n\t" : : "r" (IRQ_PMR_OPEN));
   asm volatile ("msr icc_igrpen1_el1, %0\n\t" : : "r" (1));
 
   sgi_enable(0, IRQ_LEVEL_SWITCH);
 }
+
+
+static void  __attribute__((constructor(105)))
+irq_init(void)
+{
+  reg_wr(GIC_GICD_BASE + GICD_CTLR, 7);
+
+  printf("GICv3: GICR @ 0x%lx\n", gicr_base());
+
+  gic_cpu_init();
+}
@@ -1,3 +1,6 @@
 #pragma once
 
 long gicr_base(void);
+
+// Bring up the redistributor and CPU interface of the calling core
+void gic_cpu_init(void);
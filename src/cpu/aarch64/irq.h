@@ -14,6 +14,21 @@
 
 #define IRQ_LEVEL_TO_PRI(x) ((x) << IRQ_PRI_LEVEL_SHIFT)
 
+#define IRQ_PMR_OPEN 0xff
+
+#ifdef ENABLE_SMP
+/*
+ * All code that runs with interrupts (partially) masked or from an
+ * interrupt handler assumes it has exclusive access to whatever the
+ * masked levels protect. On SMP this is upheld by a recursive lock
+ * that is held by a core whenever its priority mask is not fully
+ * open. Threads running with all interrupts enabled execute in
+ * parallel.
+ */
+void smp_giant_enter(void);
+void smp_giant_leave(void);
+#endif
+
 static inline unsigned int
 irq_forbid(unsigned int level)
 {
@@ -28,6 +43,10 @@ irq_forbid(unsigned int level)
   asm volatile ("mrs %0, icc_pmr_el1\n\r" : "=r"(current));
   if(pmr < current) {
     asm volatile ("msr icc_pmr_el1, %0\n\t" : : "r" (pmr));
+#ifdef ENABLE_SMP
+    if(current == IRQ_PMR_OPEN)
+      smp_giant_enter();
+#endif
   }
   asm volatile ("msr daif, %0\n\t" : : "r" (daif));
   return current;
@@ -36,7 +55,17 @@ irq_forbid(unsigned int level)
 static inline void
 irq_permit(unsigned int old)
 {
+#ifdef ENABLE_SMP
+  unsigned int current;
+  asm volatile ("mrs %0, icc_pmr_el1\n\r" : "=r"(current));
+  if(old == IRQ_PMR_OPEN && current != IRQ_PMR_OPEN)
+    smp_giant_leave();
+#endif
   asm volatile ("msr icc_pmr_el1, %0\n\t" : : "r" (old));
+#ifdef ENABLE_SMP
+  if(old != IRQ_PMR_OPEN && current == IRQ_PMR_OPEN)
+    smp_giant_enter();
+#endif
 }
 
 static inline unsigned int
@@ -44,7 +73,11 @@ irq_lower(void)
 {
   unsigned int current;
   asm volatile ("mrs %0, icc_pmr_el1\n\r" : "=r"(current));
-  asm volatile ("msr icc_pmr_el1, %0\n\t" : : "r" (0xff));
+#ifdef ENABLE_SMP
+  if(current != IRQ_PMR_OPEN)
+    smp_giant_leave();
+#endif
+  asm volatile ("msr icc_pmr_el1, %0\n\t" : : "r" (IRQ_PMR_OPEN));
   return current;
 }
 
@@ -55,19 +88,27 @@ irq_off(void)
 }
 
 static inline void  __attribute__((always_inline))
-schedule(void)
+sgi_send(long mpidr, int sgi)
 {
-  long id;
-  __asm__ volatile ("mrs %0, mpidr_el1" : "=r"(id));
+  const long aff0 = mpidr & 0xf;
+  const long aff1 = (mpidr >> 8) & 0xff;
+  const long aff2 = (mpidr >> 16) & 0xff;
 
-  const long aff1 = (id >> 8) & 0xff;
-  const long aff2 = (id >> 16) & 0xff;
-
-  long x = 1;
+  long x = 1 << aff0;
+  x |= ((long)sgi << 24);
   x |= (aff1 << 16);
   x |= (aff2 << 32);
 
   asm volatile ("msr icc_sgi1r_el1, %0\n\t" : : "r"(x));
+}
+
+static inline void  __attribute__((always_inline))
+schedule(void)
+{
+  long id;
+  __asm__ volatile ("mrs %0, mpidr_el1" : "=r"(id));
+
+  sgi_send(id, 0);
 
   asm volatile("" ::: "memory");
 }
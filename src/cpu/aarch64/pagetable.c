@@ -71,7 +71,7 @@ static int       gb_to_l2[512];           // GB → table_pool index (or -1)
 static int       initialized;
 
 
-static uint64_t
+uint64_t
 va_to_pa(const void *va)
 {
   uint64_t par;
@@ -368,5 +368,5 @@ pt_apply(void)
     cache_op(table_pool[i], sizeof(table_pool[i]), DCACHE_CLEAN_INV);
   cache_op(ttbr0, 512 * sizeof(uint64_t), DCACHE_CLEAN_INV);
   __asm__ volatile("dsb sy; isb");
-  __asm__ volatile("tlbi vmalle1; dsb ish; isb" ::: "memory");
+  __asm__ volatile("tlbi vmalle1is; dsb ish; isb" ::: "memory");
 }
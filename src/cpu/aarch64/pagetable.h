@@ -33,6 +33,11 @@ void pt_set_gb(int gb, pt_mem_type_t type);
 void pt_unmap_gb(int gb);
 
 
+// Translate a VA using the current EL1 stage-1 mapping. Returns ~0
+// if the address is not mapped
+uint64_t va_to_pa(const void *va);
+
+
 // Make all pending changes visible: install promoted L2 tables, clean
 // the descriptor caches, invalidate TLBs. Call once after a batch of
 // pt_set / pt_unmap / pt_set_gb / pt_unmap_gb calls.
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include <mios/mios.h>
+#include <mios/task.h>
+#include <mios/cli.h>
+
+#include "cpu.h"
+#include "irq.h"
+#include "gicv3.h"
+#include "cache.h"
+#include "pagetable.h"
+
+#define PSCI_CPU_ON_64          0xc4000003
+
+#define PSCI_SUCCESS            0
+
+#define CURRENTEL_EL2           (2 << 2)
+
+#define SMP_EXC_STACK_SIZE      8192
+
+// Layout is known by secondary_start in entry.S
+typedef struct cpu_boot {
+  uint64_t ttbr0;
+  uint64_t ttbr1;
+  uint64_t tcr;
+  uint64_t mair;
+  uint64_t sctlr;
+  uint64_t vbar;
+  uint64_t sp;
+  cpu_t *cpu;
+  void *entry;
+} cpu_boot_t;
+
+_Static_assert(offsetof(cpu_boot_t, sp) == 48, "entry.S");
+_Static_assert(offsetof(cpu_boot_t, entry) == 64, "entry.S");
+
+cpu_t *cpu_array[CPU_MAX] = { &cpu0 };
+unsigned int cpu_online = 1;
+
+static cpu_boot_t cpu_boot __attribute__((aligned(64)));
+
+static struct {
+  int owner; // cpu index + 1, 0 if free
+  int depth;
+} giant;
+
+
+void
+smp_giant_enter(void)
+{
+  const int self = curcpu()->index + 1;
+
+  if(__atomic_load_n(&giant.owner, __ATOMIC_RELAXED) == self) {
+    giant.depth++;
+    return;
+  }
+
+  while(1) {
+    int expected = 0;
+    if(__atomic_compare_exchange_n(&giant.owner, &expected, self, 1,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+    while(__atomic_load_n(&giant.owner, __ATOMIC_RELAXED))
+      asm volatile("wfe");
+  }
+  giant.depth = 1;
+}
+
+
+void
+smp_giant_leave(void)
+{
+  if(--giant.depth)
+    return;
+  __atomic_store_n(&giant.owner, 0, __ATOMIC_RELEASE);
+  asm volatile("dsb ish; sev");
+}
+
+
+void
+cpu_kick(cpu_t *cpu)
+{
+  // Make sure readyqueue updates are visible before the SGI arrives
+  asm volatile("dsb ish" ::: "memory");
+  sgi_send(cpu->mpidr, 0);
+}
+
+
+static long
+psci_call(uint64_t fn, uint64_t arg0, uint64_t arg1, uint64_t arg2)
+{
+  extern uint64_t boot_el;
+
+  register uint64_t x0 asm("x0") = fn;
+  register uint64_t x1 asm("x1") = arg0;
+  register uint64_t x2 asm("x2") = arg1;
+  register uint64_t x3 asm("x3") = arg2;
+
+  // If we were started in EL2, HVC traps to our own EL2 vectors,
+  // so firmware must be reached via SMC
+  if(boot_el == CURRENTEL_EL2) {
+    asm volatile("smc #0"
+                 : "+r"(x0) : "r"(x1), "r"(x2), "r"(x3)
+                 : "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11",
+                   "x12", "x13", "x14", "x15", "x16", "x17", "memory");
+  } else {
+    asm volatile("hvc #0"
+                 : "+r"(x0) : "r"(x1), "r"(x2), "r"(x3)
+                 : "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11",
+                   "x12", "x13", "x14", "x15", "x16", "x17", "memory");
+  }
+  return x0;
+}
+
+
+void
+cpu_secondary_init(cpu_t *cpu)
+{
+  asm volatile("msr tpidr_el1, %0" : : "r"(cpu));
+
+  gic_cpu_init();
+
+  // Idle thread's stack starts right below its thread_t
+  asm volatile("msr sp_el0, %0" : : "r"(cpu->sched.idle));
+
+  __atomic_store_n(&cpu->online, 1, __ATOMIC_RELEASE);
+}
+
+
+static int
+cpu_start(cpu_t *cpu)
+{
+  extern void *load_addr;
+  extern const uint64_t secondary_start_offset;
+  extern void secondary_vstart(void);
+
+  void *sp = xalloc(SMP_EXC_STACK_SIZE, 16, MEM_MAY_FAIL);
+  if(sp == NULL)
+    return -1;
+
+  cpu_boot_t *cb = &cpu_boot;
+  asm volatile("mrs %0, ttbr0_el1" : "=r"(cb->ttbr0));
+  asm volatile("mrs %0, ttbr1_el1" : "=r"(cb->ttbr1));
+  asm volatile("mrs %0, tcr_el1"   : "=r"(cb->tcr));
+  asm volatile("mrs %0, mair_el1"  : "=r"(cb->mair));
+  asm volatile("mrs %0, sctlr_el1" : "=r"(cb->sctlr));
+  asm volatile("mrs %0, vbar_el1"  : "=r"(cb->vbar));
+  cb->sp = (uint64_t)sp + SMP_EXC_STACK_SIZE;
+  cb->cpu = cpu;
+  cb->entry = secondary_vstart;
+
+  // Secondary reads the block with MMU (and thus caches) off
+  cache_op(cb, sizeof(cpu_boot_t), DCACHE_CLEAN);
+
+  const uint64_t entry = (uint64_t)load_addr + secondary_start_offset;
+  long r = psci_call(PSCI_CPU_ON_64, cpu->mpidr, entry, va_to_pa(cb));
+  if(r != PSCI_SUCCESS) {
+    free(sp);
+    return r;
+  }
+
+  for(int i = 0; i < 1000; i++) {
+    if(__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE))
+      return 0;
+    udelay(100);
+  }
+  printf("SMP: CPU 0x%lx did not come online\n", cpu->mpidr);
+  return 1;
+}
+
+
+static void __attribute__((constructor(160)))
+smp_init(void)
+{
+  uint64_t mpidr;
+  asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+  cpu0.mpidr = mpidr & 0xffffff;
+  cpu0.online = 1;
+
+  // cpu->index must be unique among all cores that may run, which
+  // includes cores that timed out (they might still come online)
+  unsigned int next_index = 1;
+
+  for(unsigned int i = 0; i < CPU_MAX; i++) {
+    const uint64_t id = cpu_mpidr(i);
+    if(id == cpu0.mpidr)
+      continue;
+
+    cpu_t *cpu = xalloc(sizeof(cpu_t), CACHE_LINE_SIZE, MEM_MAY_FAIL);
+    if(cpu == NULL)
+      break;
+    memset(cpu, 0, sizeof(cpu_t));
+    cpu->mpidr = id;
+    cpu->index = next_index;
+    thread_t *idle = cpu_idle_thread_create(cpu);
+
+    int r = cpu_start(cpu);
+    if(r == 0) {
+      next_index++;
+      cpu_array[cpu->index] = cpu;
+      __atomic_store_n(&cpu_online, cpu_online + 1, __ATOMIC_RELEASE);
+    } else if(r < 0) {
+      // Core not present (or refused by firmware), its index is reused
+      free(idle->t_sp_bottom);
+      free(cpu);
+    } else {
+      // The core might still show up later and use its stacks and
+      // index, so they are deliberately leaked
+      next_index++;
+    }
+  }
+  printf("SMP: %d CPU%s online\n", cpu_online, cpu_online == 1 ? "" : "s");
+}
+
+
+static error_t
+cmd_cpus(cli_t *cli, int argc, char **argv)
+{
+  cli_printf(cli, " CPU MPIDR    Running        ReadyQueues\n");
+  for(unsigned int i = 0; i < CPU_MAX; i++) {
+    const cpu_t *cpu = cpu_array[i];
+    if(cpu == NULL)
+      continue;
+    cli_printf(cli, " %-3d %08lx %-14s %08x\n",
+               cpu->index, cpu->mpidr, cpu->sched.current->t_name,
+               cpu->sched.active_queues);
+  }
+  return 0;
+}
+
+CLI_CMD_DEF("cpus", cmd_cpus);
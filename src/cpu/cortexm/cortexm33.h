@@ -5,3 +5,5 @@
 #define HAVE_BASEPRI
 
 #define HAVE_PSPLIM
+
+#define HAVE_CYCLE_COUNTER
@@ -5,6 +5,7 @@ CFLAGS += -mcpu=cortex-m4 -mthumb -mfpu=fpv4-sp-d16 -mfloat-abi=hard
 CPPFLAGS += -include ${SRC}/cpu/cortexm/cortexm4f.h
 
 SRCS += ${C}/cortexm4f.c \
+	${C}/memcpy.s \
 	${C}/mpu.c \
 
 include ${SRC}/cpu/cortexm/cortexm.mk
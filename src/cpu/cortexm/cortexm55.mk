@@ -5,6 +5,7 @@ CFLAGS += -mcpu=cortex-m7 -mthumb -mfloat-abi=hard -mfpu=fpv5-d16 -mfp16-format=
 CPPFLAGS += -include ${SRC}/cpu/cortexm/cortexm55.h
 
 SRCS += ${C}/cortexm55.c \
+	${C}/memcpy.s \
 	${C}/cache.c \
 	${C}/mpu_v8.c \
 
@@ -5,3 +5,5 @@
 #define CACHE_LINE_SIZE 32
 
 #define HAVE_BASEPRI
+
+#define HAVE_CYCLE_COUNTER
@@ -98,7 +98,7 @@ void   __attribute__((weak, noreturn))
 cpu_idle(void)
 {
   while(1) {
-    asm volatile ("wfi");
+    cpu_idle_wait();
   }
 }
 
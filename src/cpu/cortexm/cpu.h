@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <unistd.h>
 
 #include <mios/task.h>
 
@@ -44,9 +45,54 @@ void cpu_fpu_ctx_init(int *ctx);
 
 
 
+// HAVE_CYCLE_COUNTER is defined by the CPU headers that have DWT CYCCNT
+// (not ARMv6-M), platforms start the counter
+
 static inline uint32_t
 cpu_cycle_counter(void)
 {
   volatile unsigned int *DWT_CYCCNT   = (volatile unsigned int *)0xE0001004;
   return *DWT_CYCCNT;
 }
+
+#ifdef HAVE_CYCLE_COUNTER
+// Rate of cpu_cycle_counter() in cycles per µs as a fixed point
+// number with CPU_CYCLES_PER_US_SHIFT fractional bits. Measured once
+// (see timer.c)
+#define CPU_CYCLES_PER_US_SHIFT 16
+uint32_t cpu_cycles_per_us(void);
+
+// Convert a cpu_cycle_counter() delta to µs
+uint32_t cpu_cycles_to_us(uint64_t cycles);
+#endif
+
+
+/**
+ * Idle loop helpers. cpu_idle_enter() must be called with interrupts
+ * disabled (cpsid i) and the returned timestamp passed to
+ * cpu_idle_leave() after WFI returns, but before interrupts are enabled
+ * again, so the pending interrupt that ended the wait can be recorded
+ */
+static inline uint64_t
+cpu_idle_enter(void)
+{
+  return clock_get_irq_blocked();
+}
+
+static inline void
+cpu_idle_leave(uint64_t enter)
+{
+  static volatile unsigned int * const ICSR = (unsigned int *)0xe000ed04;
+  const int vectpending = (*ICSR >> 12) & 0x1ff;
+  idle_account(enter, vectpending ? vectpending - 16 : IDLE_WAKEUP_UNKNOWN);
+}
+
+static inline void
+cpu_idle_wait(void)
+{
+  asm volatile ("cpsid i");
+  const uint64_t enter = cpu_idle_enter();
+  asm volatile ("wfi;isb");
+  cpu_idle_leave(enter);
+  asm volatile ("cpsie i");
+}
@@ -4,6 +4,8 @@
 #include <malloc.h>
 #include <string.h>
 #include <mios/mios.h>
+#include <mios/sched_trace.h>
+#include <mios/task.h>
 
 #include "irq.h"
 #include "mpu.h"
@@ -47,6 +49,25 @@ irq_disable(int irq)
   NVIC_ICER[(irq >> 5) & 0xf] |= 1 << (irq & 0x1f);
 }
 
+#ifdef ENABLE_SCHED_TRACE
+
+/*
+ * Handlers installed at runtime are routed via irq_trace_entry() so
+ * the IRQ can be recorded. Handlers linked straight into the vector
+ * table (irq_NN) are not traced
+ */
+static void (*irq_trace_vector[CORTEXM_IRQ_COUNT])(void);
+
+static void
+irq_trace_entry(void)
+{
+  const int irq = (*ICSR & 0x1ff) - 16;
+  sched_trace_add(SCHED_TRACE_IRQ, thread_current()->t_trace_id, irq);
+  irq_trace_vector[irq]();
+}
+
+#endif
+
 #define VECTOR_COUNT (16 + CORTEXM_IRQ_COUNT)
 // VTOR requires the table aligned to a power of two >= its byte size.
 #define VECTOR_ALIGN (VECTOR_COUNT > 256 ? 0x800 : VECTOR_COUNT >= 128 ? 0x400 : 0x200)
@@ -70,6 +91,10 @@ irq_enable_fn(int irq, int level, void (*fn)(void))
   }
 
   uint32_t *vtable = (uint32_t *)*VTOR;
+#ifdef ENABLE_SCHED_TRACE
+  irq_trace_vector[irq] = fn;
+  fn = irq_trace_entry;
+#endif
   vtable[irq + 16] = (uint32_t)fn;
 #ifdef HAVE_BASEPRI
   NVIC_IPR[irq] = IRQ_LEVEL_TO_PRI(level);
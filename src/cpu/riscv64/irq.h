@@ -1,5 +1,6 @@
 #pragma once
 
+#define IRQ_LEVEL_ALL      1
 #define IRQ_LEVEL_SCHED    2
 
 #define IRQ_LEVEL_CONSOLE  3
@@ -279,7 +279,8 @@ lan743x_eth_output(struct ether_netif *eni, pbuf_t *pkt,
     int bufidx = wrptr & TX_RING_MASK;
     desc_t *tx = l->tx_ring + bufidx;
 
-    cache_op(pb->pb_data, pb->pb_buflen, DCACHE_CLEAN | DCACHE_INVALIDATE);
+    cache_op(pb->pb_data + pb->pb_offset, pb->pb_buflen,
+             DCACHE_CLEAN | DCACHE_INVALIDATE);
 
     l->tx_pbuf_data[bufidx] = pb->pb_data;
     l->tx_size[bufidx] = pb->pb_buflen;
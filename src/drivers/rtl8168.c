@@ -133,7 +133,8 @@ rtl8168_eth_output(struct ether_netif *eni, pbuf_t *pkt,
 
     desc_t *tx = r->tx_ring + bufidx;
 
-    cache_op(pb->pb_data, pb->pb_buflen, DCACHE_CLEAN | DCACHE_INVALIDATE);
+    cache_op(pb->pb_data + pb->pb_offset, pb->pb_buflen,
+             DCACHE_CLEAN | DCACHE_INVALIDATE);
 
     r->tx_pbuf_data[bufidx] = pb->pb_data;
     r->tx_size[bufidx] = pb->pb_buflen;
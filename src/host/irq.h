@@ -0,0 +1,22 @@
+#pragma once
+
+// IRQ level stand-ins for code built into host side tests. There is
+// nothing to mask as the tests are single threaded
+
+#define IRQ_LEVEL_ALL      1
+#define IRQ_LEVEL_SCHED    2
+#define IRQ_LEVEL_NET      4
+#define IRQ_LEVEL_CLOCK    6
+
+static inline int
+irq_forbid(int level)
+{
+  (void)level;
+  return 0;
+}
+
+static inline void
+irq_permit(int q)
+{
+  (void)q;
+}
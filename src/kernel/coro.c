@@ -0,0 +1,130 @@
+#include <mios/coro.h>
+
+#include <stddef.h>
+#include <string.h>
+
+#include "irq.h"
+
+/*
+ * A coroutine uses two task_t's. co_task is what gets scheduled,
+ * co_wait is what is put on the waitable's list. They can't be one and
+ * the same as t_run shares storage with t_wait_link.
+ *
+ * Wakeups may race with the coroutine cancelling its wait and moving
+ * on (see CORO_WAIT_UNTIL()), in which case co_task can end up queued
+ * without anything to resume. Such runs are dropped by coro_run()
+ */
+
+static void
+coro_run(task_t *t)
+{
+  coro_t *co = (coro_t *)t;
+
+  if(co->co_waiting || co->co_line == CORO_LINE_DONE)
+    return;
+  co->co_fn(co);
+}
+
+
+static void
+coro_unwait_sched_locked(coro_t *co)
+{
+  if(co->co_wait.t_state == TASK_STATE_CORO_SLEEP)
+    LIST_REMOVE(&co->co_wait, t_wait_link);
+  co->co_wait.t_state = TASK_STATE_NONE;
+  co->co_waitable = NULL;
+  co->co_waiting = 0;
+  timer_disarm(&co->co_timer);
+}
+
+
+static void
+coro_timeout(void *opaque, uint64_t expire)
+{
+  coro_t *co = opaque;
+  const int q = irq_forbid(IRQ_LEVEL_SCHED);
+  if(co->co_waiting) {
+    coro_unwait_sched_locked(co);
+    co->co_timedout = 1;
+    task_run(&co->co_task);
+  }
+  irq_permit(q);
+}
+
+
+void
+coro_init(coro_t *co, void (*fn)(coro_t *co), unsigned int prio,
+          const char *name)
+{
+  memset(co, 0, sizeof(coro_t));
+  prio &= TASK_PRIO_MASK;
+  if(prio == 0)
+    prio = 1;
+  co->co_task.t_run = coro_run;
+  co->co_task.t_prio = prio;
+  co->co_wait.t_prio = prio;
+  co->co_fn = fn;
+  co->co_line = CORO_LINE_DONE;
+  co->co_timer.t_cb = coro_timeout;
+  co->co_timer.t_opaque = co;
+  co->co_timer.t_name = name;
+}
+
+
+void
+coro_start(coro_t *co)
+{
+  const int q = irq_forbid(IRQ_LEVEL_SCHED);
+  coro_unwait_sched_locked(co);
+  co->co_line = 0;
+  co->co_timedout = 0;
+  task_run(&co->co_task);
+  irq_permit(q);
+}
+
+
+void
+coro_stop(coro_t *co)
+{
+  const int q = irq_forbid(IRQ_LEVEL_SCHED);
+  coro_unwait_sched_locked(co);
+  co->co_line = CORO_LINE_DONE;
+  irq_permit(q);
+}
+
+
+void
+coro_prepare_wait(coro_t *co, task_waitable_t *waitable, int64_t deadline)
+{
+  const int q = irq_forbid(IRQ_LEVEL_SCHED);
+  co->co_timedout = 0;
+  co->co_waiting = 1;
+  co->co_waitable = waitable;
+  if(waitable != NULL) {
+    co->co_wait.t_state = TASK_STATE_CORO_SLEEP;
+    task_insert_wait_list(waitable, &co->co_wait);
+  }
+  if(deadline)
+    timer_arm_abs(&co->co_timer, deadline);
+  irq_permit(q);
+}
+
+
+void
+coro_cancel_wait(coro_t *co)
+{
+  const int q = irq_forbid(IRQ_LEVEL_SCHED);
+  coro_unwait_sched_locked(co);
+  irq_permit(q);
+}
+
+
+void
+coro_wakeup_sched_locked(task_t *t)
+{
+  // Already removed from the waitable's list
+  coro_t *co = (void *)t - offsetof(coro_t, co_wait);
+  t->t_state = TASK_STATE_NONE;
+  coro_unwait_sched_locked(co);
+  task_run(&co->co_task);
+}
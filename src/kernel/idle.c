@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <unistd.h>
+
+#include <mios/task.h>
+#include <mios/cli.h>
+
+#include "irq.h"
+#include "cpu.h"
+
+void
+idle_account(uint64_t enter, int source)
+{
+  idle_stats_t *is = &curcpu()->sched.idle_stats;
+  const uint64_t delta = clock_get_irq_blocked() - enter;
+
+  is->is_total += delta;
+  is->is_entries++;
+
+  int bucket = delta ? 63 - __builtin_clzll(delta) : 0;
+  if(bucket >= IDLE_RESIDENCY_BUCKETS)
+    bucket = IDLE_RESIDENCY_BUCKETS - 1;
+  is->is_residency[bucket]++;
+
+  for(int i = 0; i < IDLE_WAKEUP_SOURCES; i++) {
+    if(is->is_wakeup_count[i] == 0) {
+      is->is_wakeup_irq[i] = source;
+      is->is_wakeup_count[i] = 1;
+      return;
+    }
+    if(is->is_wakeup_irq[i] == source) {
+      is->is_wakeup_count[i]++;
+      return;
+    }
+  }
+  is->is_wakeup_other++;
+}
+
+
+static void
+idle_stats_print(cli_t *cli, const idle_stats_t *is, uint64_t now)
+{
+  cli_printf(cli, "  Idle: %u waits, %u.%03us (%d%%)\n",
+             is->is_entries,
+             (unsigned int)(is->is_total / 1000000),
+             (unsigned int)(is->is_total / 1000 % 1000),
+             now ? (int)(is->is_total * 100 / now) : 0);
+
+  cli_printf(cli, "  Residency (µs)          Count\n");
+  for(int i = 0; i < IDLE_RESIDENCY_BUCKETS; i++) {
+    if(!is->is_residency[i])
+      continue;
+    const unsigned int lo = i ? 1 << i : 0;
+    if(i == IDLE_RESIDENCY_BUCKETS - 1) {
+      cli_printf(cli, "  %8u -           %10u\n", lo, is->is_residency[i]);
+    } else {
+      cli_printf(cli, "  %8u - %8u  %10u\n",
+                 lo, (2 << i) - 1, is->is_residency[i]);
+    }
+  }
+
+  cli_printf(cli, "  Wakeup source           Count\n");
+  for(int i = 0; i < IDLE_WAKEUP_SOURCES; i++) {
+    if(!is->is_wakeup_count[i])
+      break;
+    if(is->is_wakeup_irq[i] == IDLE_WAKEUP_UNKNOWN) {
+      cli_printf(cli, "  Unknown              %10u\n",
+                 is->is_wakeup_count[i]);
+    } else {
+      cli_printf(cli, "  IRQ %-4d             %10u\n",
+                 is->is_wakeup_irq[i], is->is_wakeup_count[i]);
+    }
+  }
+  if(is->is_wakeup_other)
+    cli_printf(cli, "  Other                %10u\n", is->is_wakeup_other);
+}
+
+
+static error_t
+cmd_idle(cli_t *cli, int argc, char **argv)
+{
+  const uint64_t now = clock_get();
+#ifdef ENABLE_SMP
+  for(unsigned int i = 0; i < CPU_MAX; i++) {
+    if(cpu_array[i] == NULL)
+      continue;
+    cli_printf(cli, "CPU %d\n", i);
+    idle_stats_print(cli, &cpu_array[i]->sched.idle_stats, now);
+  }
+#else
+  idle_stats_print(cli, &curcpu()->sched.idle_stats, now);
+#endif
+  return 0;
+}
+
+CLI_CMD_DEF_EXT("idle", cmd_idle, NULL, "Show idle residency and wakeups");
@@ -6,10 +6,15 @@ SRCS += ${SRC}/kernel/mios.c \
 	${SRC}/kernel/device.c \
 	${SRC}/kernel/driver.c \
 	${SRC}/kernel/timer.c \
+	${SRC}/kernel/idle.c \
+	${SRC}/kernel/coro.c \
+	${SRC}/kernel/kmem.c \
 	${SRC}/kernel/eventlog.c \
 	${SRC}/kernel/panic.c \
 
 SRCS-${ENABLE_PROFILE} += ${SRC}/kernel/profile.c
+SRCS-${ENABLE_SCHED_TRACE} += ${SRC}/kernel/sched_trace.c
+SRCS-${ENABLE_LOCKSTAT} += ${SRC}/kernel/lockstat.c
 
 # When profiling, bump function alignment to the bucket size so each
 # bucket holds at most one function's prologue — keeps addr2line honest
@@ -0,0 +1,215 @@
+#include <mios/kmem.h>
+#include <mios/mios.h>
+#include <mios/cli.h>
+
+#include <assert.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Each object is preceded by a pointer to its slab so it can be freed
+ * without searching. Objects (and slabs) are aligned like the heap
+ */
+
+#define KMEM_ALIGN (2 * sizeof(void *))
+
+#define ALIGN(a, b) (((a) + (b) - 1) & ~((b) - 1))
+
+#define KMEM_MAX_PER_SLAB 64
+
+typedef struct kmem_slab {
+  LIST_ENTRY(kmem_slab) ks_link;   // On kc_partial if ks_free != NULL
+  kmem_cache_t *ks_cache;
+  void *ks_free;
+  uint16_t ks_inuse;
+} kmem_slab_t;
+
+#define KMEM_FIRST_OBJ ALIGN(sizeof(kmem_slab_t) + sizeof(void *), KMEM_ALIGN)
+
+static SLIST_HEAD(, kmem_cache) kmem_caches;
+
+static mutex_t kmem_caches_mutex = MUTEX_INITIALIZER("kmem");
+
+
+// Must be called with kmem_caches_mutex held
+static void
+kmem_cache_setup_locked(kmem_cache_t *kc)
+{
+  kc->kc_stride = ALIGN(sizeof(void *) + kc->kc_objsize, KMEM_ALIGN);
+  const size_t n = (KMEM_SLAB_SIZE - KMEM_FIRST_OBJ) / kc->kc_stride;
+  kc->kc_per_slab = n < 1 ? 1 : n > KMEM_MAX_PER_SLAB ? KMEM_MAX_PER_SLAB : n;
+
+  SLIST_INSERT_HEAD(&kmem_caches, kc, kc_link);
+}
+
+
+static void
+kmem_cache_setup(kmem_cache_t *kc)
+{
+  mutex_lock(&kmem_caches_mutex);
+  kmem_cache_setup_locked(kc);
+  mutex_unlock(&kmem_caches_mutex);
+}
+
+
+kmem_cache_t *
+kmem_cache_get(const char *name, size_t size, unsigned int memtype)
+{
+  kmem_cache_t *kc;
+
+  // Lookup and creation under the same lock so two callers can't
+  // register duplicate caches
+  mutex_lock(&kmem_caches_mutex);
+  SLIST_FOREACH(kc, &kmem_caches, kc_link) {
+    if(kc->kc_name == name && kc->kc_objsize == size &&
+       kc->kc_memtype == memtype)
+      break;
+  }
+
+  if(kc == NULL) {
+    kc = xalloc_caller(sizeof(kmem_cache_t), 0, MEM_MAY_FAIL | MEM_CLEAR,
+                       MALLOC_CALLER);
+    if(kc != NULL) {
+      mutex_init(&kc->kc_mutex, name);
+      kc->kc_name = name;
+      kc->kc_objsize = size;
+      kc->kc_memtype = memtype;
+      kmem_cache_setup_locked(kc);
+    }
+  }
+  mutex_unlock(&kmem_caches_mutex);
+  return kc;
+}
+
+
+static kmem_slab_t *
+kmem_slab_create(kmem_cache_t *kc, void *caller)
+{
+  kmem_slab_t *ks =
+    xalloc_caller(KMEM_FIRST_OBJ + kc->kc_per_slab * kc->kc_stride,
+                  KMEM_ALIGN, kc->kc_memtype | MEM_MAY_FAIL, caller);
+  if(ks == NULL)
+    return NULL;
+
+  ks->ks_cache = kc;
+  ks->ks_inuse = 0;
+  ks->ks_free = NULL;
+
+  // Build free list backwards so objects are handed out in order
+  void *obj = (void *)ks + KMEM_FIRST_OBJ + kc->kc_per_slab * kc->kc_stride;
+  for(int i = 0; i < kc->kc_per_slab; i++) {
+    obj -= kc->kc_stride;
+    ((kmem_slab_t **)obj)[-1] = ks;
+    *(void **)obj = ks->ks_free;
+    ks->ks_free = obj;
+  }
+
+  LIST_INSERT_HEAD(&kc->kc_partial, ks, ks_link);
+  kc->kc_slabs++;
+  kc->kc_empty++;
+  return ks;
+}
+
+
+void *
+kmem_cache_alloc(kmem_cache_t *kc, unsigned int flags)
+{
+  if(kc->kc_stride == 0) {
+    // Static caches are set up on first use
+    mutex_lock(&kc->kc_mutex);
+    if(kc->kc_stride == 0)
+      kmem_cache_setup(kc);
+    mutex_unlock(&kc->kc_mutex);
+  }
+
+  mutex_lock(&kc->kc_mutex);
+
+  kmem_slab_t *ks = LIST_FIRST(&kc->kc_partial);
+  if(ks == NULL) {
+    ks = kmem_slab_create(kc, MALLOC_CALLER);
+    if(ks == NULL) {
+      kc->kc_failed++;
+      mutex_unlock(&kc->kc_mutex);
+      if(!(flags & MEM_MAY_FAIL))
+        panic("kmem: Out of memory for %s", kc->kc_name);
+      return NULL;
+    }
+  }
+
+  void *obj = ks->ks_free;
+  ks->ks_free = *(void **)obj;
+  if(ks->ks_free == NULL)
+    LIST_REMOVE(ks, ks_link);
+  if(ks->ks_inuse++ == 0)
+    kc->kc_empty--;
+
+  kc->kc_allocs++;
+  if(++kc->kc_inuse > kc->kc_inuse_max)
+    kc->kc_inuse_max = kc->kc_inuse;
+
+  mutex_unlock(&kc->kc_mutex);
+
+  if(flags & MEM_CLEAR)
+    memset(obj, 0, kc->kc_objsize);
+  return obj;
+}
+
+
+void
+kmem_cache_free(kmem_cache_t *kc, void *obj)
+{
+  if(obj == NULL)
+    return;
+
+  kmem_slab_t *ks = ((kmem_slab_t **)obj)[-1];
+  assert(ks->ks_cache == kc);
+
+  mutex_lock(&kc->kc_mutex);
+
+  if(ks->ks_free == NULL)
+    LIST_INSERT_HEAD(&kc->kc_partial, ks, ks_link);
+  *(void **)obj = ks->ks_free;
+  ks->ks_free = obj;
+  kc->kc_inuse--;
+
+  if(--ks->ks_inuse == 0) {
+    // Keep one empty slab around, unless it only holds a single object
+    // in which case it's likely big and there is nothing to gain
+    if(kc->kc_empty || kc->kc_per_slab == 1) {
+      LIST_REMOVE(ks, ks_link);
+      kc->kc_slabs--;
+    } else {
+      kc->kc_empty++;
+      ks = NULL;
+    }
+  } else {
+    ks = NULL;
+  }
+  mutex_unlock(&kc->kc_mutex);
+  free(ks);
+}
+
+
+static error_t
+cmd_slabinfo(cli_t *cli, int argc, char **argv)
+{
+  cli_printf(cli, " Name         Size  Per  Slabs  InUse    Max     Allocs "
+             "Failed     Bytes\n");
+
+  mutex_lock(&kmem_caches_mutex);
+  const kmem_cache_t *kc;
+  SLIST_FOREACH(kc, &kmem_caches, kc_link) {
+    cli_printf(cli, " %-12s %4u %4u %6u %6u %6u %10u %6u %9u\n",
+               kc->kc_name, kc->kc_objsize, kc->kc_per_slab,
+               kc->kc_slabs, kc->kc_inuse, kc->kc_inuse_max,
+               kc->kc_allocs, kc->kc_failed,
+               (unsigned int)(kc->kc_slabs *
+                              (KMEM_FIRST_OBJ +
+                               kc->kc_per_slab * kc->kc_stride)));
+  }
+  mutex_unlock(&kmem_caches_mutex);
+  return 0;
+}
+
+CLI_CMD_DEF_EXT("slabinfo", cmd_slabinfo, NULL, "Show slab caches");
@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mios/task.h>
+#include <mios/cli.h>
+
+#include "irq.h"
+#include "cpu.h"
+
+/*
+ * Mutex contention statistics
+ *
+ * Mutexes are aggregated by name (task_waitable_t.name), so all
+ * instances of eg. per-socket mutexes end up in the same entry. All
+ * updates are done with IRQ_LEVEL_SCHED forbidden. Times are kept in
+ * cpu_cycle_counter() cycles and converted when displayed.
+ */
+
+#ifndef ENABLE_TASK_WCHAN
+#error ENABLE_LOCKSTAT requires ENABLE_TASK_WCHAN
+#endif
+
+#ifndef HAVE_CYCLE_COUNTER
+#error ENABLE_LOCKSTAT requires a CPU with a cycle counter
+#endif
+
+#ifndef LOCKSTAT_ENTRIES
+#define LOCKSTAT_ENTRIES 48
+#endif
+
+typedef struct lockstat {
+  const char *ls_name;
+  uint32_t ls_acquisitions;
+  uint32_t ls_contended;
+  uint64_t ls_wait_total;
+  uint32_t ls_wait_max;
+  uint32_t ls_hold_max;
+} lockstat_t;
+
+// Last entry catches everything that does not fit
+static lockstat_t lockstats[LOCKSTAT_ENTRIES];
+
+
+static lockstat_t *
+lockstat_resolve(const char *name)
+{
+  if(name == NULL)
+    name = "<unnamed>";
+
+  for(int i = 0; i < LOCKSTAT_ENTRIES - 1; i++) {
+    lockstat_t *ls = &lockstats[i];
+    if(ls->ls_name == NULL) {
+      ls->ls_name = name;
+      return ls;
+    }
+    if(ls->ls_name == name || !strcmp(ls->ls_name, name))
+      return ls;
+  }
+  lockstats[LOCKSTAT_ENTRIES - 1].ls_name = "<other>";
+  return &lockstats[LOCKSTAT_ENTRIES - 1];
+}
+
+
+void
+lockstat_acquired(mutex_t *m, int contended, uint32_t wait)
+{
+  lockstat_t *ls = m->stat;
+  if(ls == NULL)
+    ls = m->stat = lockstat_resolve(m->waiters.name);
+
+  ls->ls_acquisitions++;
+  if(contended) {
+    ls->ls_contended++;
+    ls->ls_wait_total += wait;
+    if(wait > ls->ls_wait_max)
+      ls->ls_wait_max = wait;
+  }
+  m->hold_start = cpu_cycle_counter();
+}
+
+
+void
+lockstat_released(mutex_t *m)
+{
+  lockstat_t *ls = m->stat;
+  if(ls == NULL)
+    return;
+
+  const uint32_t hold = cpu_cycle_counter() - m->hold_start;
+  if(hold > ls->ls_hold_max)
+    ls->ls_hold_max = hold;
+}
+
+
+static error_t
+cmd_lockstat(cli_t *cli, int argc, char **argv)
+{
+  if(argc > 1 && !strcmp(argv[1], "-r")) {
+    // Keep the names as mutexes have their entries cached
+    int q = irq_forbid(IRQ_LEVEL_SCHED);
+    for(int i = 0; i < LOCKSTAT_ENTRIES; i++) {
+      lockstat_t *ls = &lockstats[i];
+      memset((void *)ls + offsetof(lockstat_t, ls_acquisitions), 0,
+             sizeof(lockstat_t) - offsetof(lockstat_t, ls_acquisitions));
+    }
+    irq_permit(q);
+    return 0;
+  }
+
+  // Show entries in order of total wait time, highest first
+  uint8_t order[LOCKSTAT_ENTRIES];
+  int n = 0;
+  for(int i = 0; i < LOCKSTAT_ENTRIES; i++) {
+    if(lockstats[i].ls_name == NULL)
+      continue;
+    int j = n++;
+    for(; j > 0; j--) {
+      if(lockstats[order[j - 1]].ls_wait_total >= lockstats[i].ls_wait_total)
+        break;
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+  }
+
+  cli_printf(cli, " Name             Acquired  Contended  "
+             "Wait(µs)  MaxWait(µs) MaxHold(µs)\n");
+  for(int i = 0; i < n; i++) {
+    const lockstat_t *ls = &lockstats[order[i]];
+    cli_printf(cli, " %-16s %8u  %9u  %8u  %11u %11u\n",
+               ls->ls_name, ls->ls_acquisitions, ls->ls_contended,
+               cpu_cycles_to_us(ls->ls_wait_total),
+               cpu_cycles_to_us(ls->ls_wait_max),
+               cpu_cycles_to_us(ls->ls_hold_max));
+  }
+  return 0;
+}
+
+CLI_CMD_DEF_EXT("lockstat", cmd_lockstat, "[-r]",
+                "Show (or reset) mutex contention statistics");
@@ -0,0 +1,280 @@
+#include <mios/sched_trace.h>
+#include <mios/task.h>
+#include <mios/cli.h>
+#include <mios/service.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include "net/pbuf.h"
+
+#include "irq.h"
+#include "cpu.h"
+
+#ifndef HAVE_CYCLE_COUNTER
+#error ENABLE_SCHED_TRACE requires a CPU with a cycle counter
+#endif
+
+#ifndef SCHED_TRACE_RECORDS
+#define SCHED_TRACE_RECORDS 512
+#endif
+
+#define SCHED_TRACE_MASK (SCHED_TRACE_RECORDS - 1)
+
+_Static_assert((SCHED_TRACE_RECORDS & SCHED_TRACE_MASK) == 0,
+               "SCHED_TRACE_RECORDS must be a power of 2");
+
+_Static_assert(sizeof(sched_trace_record_t) == 12, "Binary format");
+_Static_assert(sizeof(sched_trace_header_t) == 32, "Binary format");
+_Static_assert(sizeof(sched_trace_thread_t) == 16, "Binary format");
+
+static sched_trace_record_t st_ring[SCHED_TRACE_RECORDS];
+static uint32_t st_head;
+static uint8_t st_frozen;
+
+
+void
+sched_trace_add(uint8_t type, uint16_t thread, uint32_t arg)
+{
+  int q = irq_forbid(IRQ_LEVEL_ALL);
+  if(!st_frozen) {
+    sched_trace_record_t *r = &st_ring[st_head++ & SCHED_TRACE_MASK];
+    r->cycles = cpu_cycle_counter();
+    r->type = type;
+#ifdef ENABLE_SMP
+    r->cpu = curcpu()->index;
+#else
+    r->cpu = 0;
+#endif
+    r->thread = thread;
+    r->arg = arg;
+  }
+  irq_permit(q);
+}
+
+
+/**
+ * Stop recording and return how many records are valid. The oldest
+ * one is at st_head - count. Returns 0 if someone else already has the
+ * ring frozen
+ */
+static uint32_t
+sched_trace_freeze(sched_trace_header_t *sth)
+{
+  int q = irq_forbid(IRQ_LEVEL_ALL);
+  if(st_frozen) {
+    irq_permit(q);
+    return 0;
+  }
+  st_frozen = 1;
+  sth->cycles_freeze = cpu_cycle_counter();
+  sth->clock_freeze = clock_get_irq_blocked();
+  irq_permit(q);
+
+  sth->cycles_per_ms =
+    ((uint64_t)cpu_cycles_per_us() * 1000) >> CPU_CYCLES_PER_US_SHIFT;
+
+  sth->magic = SCHED_TRACE_MAGIC;
+  sth->version = SCHED_TRACE_VERSION;
+  sth->record_size = sizeof(sched_trace_record_t);
+  sth->num_threads = 0;
+  sth->num_records =
+    st_head < SCHED_TRACE_RECORDS ? st_head : SCHED_TRACE_RECORDS;
+  return sth->num_records;
+}
+
+
+static void
+sched_trace_resume(void)
+{
+  int q = irq_forbid(IRQ_LEVEL_ALL);
+  st_head = 0;
+  st_frozen = 0;
+  irq_permit(q);
+}
+
+
+static const sched_trace_record_t *
+sched_trace_record(const sched_trace_header_t *sth, uint32_t i)
+{
+  return &st_ring[(st_head - sth->num_records + i) & SCHED_TRACE_MASK];
+}
+
+
+static const char *sched_trace_type_str[] = {
+  [SCHED_TRACE_SWITCH]  = "switch",
+  [SCHED_TRACE_WAKEUP]  = "wakeup",
+  [SCHED_TRACE_SOFTIRQ] = "softirq",
+  [SCHED_TRACE_IRQ]     = "irq",
+};
+
+
+static error_t
+cmd_schedtrace(cli_t *cli, int argc, char **argv)
+{
+  sched_trace_header_t sth;
+  if(!sched_trace_freeze(&sth))
+    return ERR_NOT_READY;
+
+  cli_printf(cli, "# %u records, %u cycles/ms\n",
+             sth.num_records, sth.cycles_per_ms);
+
+  thread_t *t = NULL;
+  while((t = thread_get_next(t)) != NULL) {
+    cli_printf(cli, "# thread %5u %s\n", t->t_trace_id, t->t_name);
+  }
+
+  cli_printf(cli, "#     Cycles CPU Type    Thread Arg\n");
+  for(uint32_t i = 0; i < sth.num_records; i++) {
+    const sched_trace_record_t *r = sched_trace_record(&sth, i);
+    cli_printf(cli, "  %10u %-3d %-7s %5u  %u\n",
+               r->cycles, r->cpu, sched_trace_type_str[r->type],
+               r->thread, r->arg);
+  }
+
+  sched_trace_resume();
+  return 0;
+}
+
+CLI_CMD_DEF_EXT("schedtrace", cmd_schedtrace, NULL,
+                "Freeze and dump scheduler trace");
+
+
+/*
+ * The service freezes the ring when a client connects, streams it and
+ * then closes the connection, after which recording resumes
+ */
+
+#define SCHED_TRACE_CHUNK 256
+
+typedef struct sched_trace_svc {
+  pushpull_t *sts_pp;
+  uint8_t *sts_preamble;   // Header and thread table
+  size_t sts_preamble_len;
+  size_t sts_offset;       // Bytes sent so far
+  size_t sts_total;
+} sched_trace_svc_t;
+
+
+static pbuf_t *
+sched_trace_svc_pull(void *opaque)
+{
+  sched_trace_svc_t *sts = opaque;
+  pushpull_t *pp = sts->sts_pp;
+
+  if(sts->sts_offset == sts->sts_total) {
+    pp->net->event(pp->net_opaque, PUSHPULL_EVENT_CLOSE);
+    return NULL;
+  }
+
+  pbuf_t *pb = pbuf_make(pp->preferred_offset, 0);
+  if(pb == NULL)
+    return NULL;
+
+  const sched_trace_header_t *sth = (const void *)sts->sts_preamble;
+  size_t len = 0;
+
+  while(len < SCHED_TRACE_CHUNK && sts->sts_offset < sts->sts_total) {
+    const size_t o = sts->sts_offset;
+    const void *src;
+    size_t n;
+    if(o < sts->sts_preamble_len) {
+      src = sts->sts_preamble + o;
+      n = sts->sts_preamble_len - o;
+    } else {
+      // Records are sent one by one as the ring may wrap
+      const size_t ro = o - sts->sts_preamble_len;
+      const size_t rec = ro / sizeof(sched_trace_record_t);
+      const size_t skip = ro % sizeof(sched_trace_record_t);
+      src = (const void *)sched_trace_record(sth, rec) + skip;
+      n = sizeof(sched_trace_record_t) - skip;
+    }
+    if(n > SCHED_TRACE_CHUNK - len)
+      n = SCHED_TRACE_CHUNK - len;
+
+    pb = pbuf_write(pb, src, n, pp, 0);
+    if(pb == NULL)
+      return NULL;
+    len += n;
+    sts->sts_offset += n;
+  }
+  return pb;
+}
+
+
+static void
+sched_trace_svc_close(void *opaque, const char *reason)
+{
+  sched_trace_svc_t *sts = opaque;
+  if(sts->sts_offset != sts->sts_total) {
+    // Closed by peer before we were done
+    pushpull_t *pp = sts->sts_pp;
+    pp->net->event(pp->net_opaque, PUSHPULL_EVENT_CLOSE);
+  }
+  sched_trace_resume();
+  free(sts->sts_preamble);
+  free(sts);
+}
+
+
+static const pushpull_app_fn_t sched_trace_svc_fn = {
+  .pull = sched_trace_svc_pull,
+  .close = sched_trace_svc_close
+};
+
+
+static error_t
+sched_trace_svc_open(pushpull_t *pp)
+{
+  sched_trace_svc_t *sts = xalloc(sizeof(sched_trace_svc_t), 0,
+                                  MEM_MAY_FAIL);
+  if(sts == NULL)
+    return ERR_NO_MEMORY;
+
+  sched_trace_header_t sth;
+  if(!sched_trace_freeze(&sth)) {
+    free(sts);
+    return ERR_NOT_READY;
+  }
+
+  thread_t *t = NULL;
+  while((t = thread_get_next(t)) != NULL)
+    sth.num_threads++;
+
+  // Threads created after counting are not included, ones exiting
+  // leave a zeroed entry
+  sts->sts_preamble_len = sizeof(sched_trace_header_t) +
+    sth.num_threads * sizeof(sched_trace_thread_t);
+  sts->sts_preamble = xalloc(sts->sts_preamble_len, 0, MEM_MAY_FAIL);
+  if(sts->sts_preamble == NULL) {
+    sched_trace_resume();
+    free(sts);
+    return ERR_NO_MEMORY;
+  }
+  memset(sts->sts_preamble, 0, sts->sts_preamble_len);
+
+  sched_trace_thread_t *stt =
+    (void *)sts->sts_preamble + sizeof(sched_trace_header_t);
+  uint32_t i = 0;
+  while((t = thread_get_next(t)) != NULL) {
+    if(i == sth.num_threads)
+      continue;
+    stt[i].id = t->t_trace_id;
+    strlcpy(stt[i].name, t->t_name, sizeof(stt[i].name));
+    i++;
+  }
+  memcpy(sts->sts_preamble, &sth, sizeof(sth));
+
+  sts->sts_pp = pp;
+  sts->sts_offset = 0;
+  sts->sts_total = sts->sts_preamble_len +
+    sth.num_records * sizeof(sched_trace_record_t);
+
+  pp->app = &sched_trace_svc_fn;
+  pp->app_opaque = sts;
+  return 0;
+}
+
+SERVICE_DEF_PUSHPULL("schedtrace", 7011, 0, sched_trace_svc_open);
@@ -17,10 +17,18 @@
 #include <mios/timer.h>
 #include <mios/poll.h>
 #include <mios/unwind.h>
+#include <mios/sched_trace.h>
+#include <mios/coro.h>
 
 #include "irq.h"
 #include "cpu.h"
 
+_Static_assert(offsetof(cpu_t, sched) == 0, "mutex_self() needs sched first");
+
+#if defined(ENABLE_TASK_LATENCY) && !defined(HAVE_CYCLE_COUNTER)
+#error ENABLE_TASK_LATENCY requires a CPU with a cycle counter
+#endif
+
 SLIST_HEAD(thread_slist, thread);
 
 static struct thread_slist allthreads;
@@ -57,6 +65,9 @@ void
 softirq_raise(uint32_t id)
 {
   __atomic_or_fetch(&softirq_pending, (1 << id), __ATOMIC_SEQ_CST);
+#ifdef ENABLE_SCHED_TRACE
+  sched_trace_add(SCHED_TRACE_SOFTIRQ, thread_current()->t_trace_id, id);
+#endif
   schedule();
 }
 
@@ -132,6 +143,62 @@ readyqueue_insert(cpu_t *cpu, task_t *t, const char *whom)
   STAILQ_INSERT_TAIL(&cpu->sched.readyqueue[t->t_prio], t, t_ready_link);
   cpu->sched.active_queues |= 1 << t->t_prio;
   t->t_state = TASK_STATE_READY;
+#ifdef ENABLE_TASK_LATENCY
+  if(t->t_flags & TASK_THREAD)
+    ((thread_t *)t)->t_ready_cycle = cpu_cycle_counter();
+#endif
+}
+
+
+/**
+ * CPU a task is scheduled on. Threads stay on the CPU they were
+ * created on, plain tasks run on whatever CPU queues them
+ */
+static inline cpu_t *
+task_cpu(task_t *t)
+{
+#ifdef ENABLE_SMP
+  if(t->t_flags & TASK_THREAD)
+    return ((thread_t *)t)->t_cpu;
+#endif
+  return curcpu();
+}
+
+
+/**
+ * Make a task that has been sleeping runnable again. It might not yet
+ * have switched away after going to sleep, in which case it just
+ * continues to run. Returns non-zero if this CPU needs to reschedule
+ */
+static int
+task_resume(task_t *t, const char *whom)
+{
+  cpu_t *const cpu = task_cpu(t);
+  const task_t *cur = &cpu->sched.current->t_task;
+
+#ifdef ENABLE_SCHED_TRACE
+  // Covers wakeups from waitables as well as timeouts and mutex handoff
+  sched_trace_add(SCHED_TRACE_WAKEUP,
+                  t->t_flags & TASK_THREAD ?
+                  ((thread_t *)t)->t_trace_id : SCHED_TRACE_NO_THREAD,
+                  thread_current()->t_trace_id);
+#endif
+
+  if(t == cur) {
+    t->t_state = TASK_STATE_RUNNING;
+    return cpu == curcpu();
+  }
+
+  readyqueue_insert(cpu, t, whom);
+  if(t->t_prio < cur->t_prio)
+    return 0;
+#ifdef ENABLE_SMP
+  if(cpu != curcpu()) {
+    cpu_kick(cpu);
+    return 0;
+  }
+#endif
+  return 1;
 }
 
 
@@ -146,6 +213,12 @@ task_switch(void *cur_sp)
   curthread->t_cycle_acc += cpu_cycle_counter() - curthread->t_cycle_enter;
 #endif
 
+#ifdef ENABLE_SMP
+  // Softirqs and tasks run with interrupts open but expect the same
+  // exclusion as interrupt handlers, so hold the giant lock while
+  // dispatching them
+  smp_giant_enter();
+#endif
 
 #if NUM_SOFTIRQ > 0
 
@@ -203,9 +276,29 @@ task_switch(void *cur_sp)
     q = irq_forbid(IRQ_LEVEL_SCHED);
   }
 
+#ifdef ENABLE_TASK_LATENCY
+  if(t != curthread && &t->t_task != cpu->sched.idle) {
+    const uint32_t lat = cpu_cycle_counter() - t->t_ready_cycle;
+    int bucket = lat ? 31 - __builtin_clz(lat) : 0;
+    if(bucket >= TASK_LATENCY_BUCKETS)
+      bucket = TASK_LATENCY_BUCKETS - 1;
+    t->t_latency[bucket]++;
+    if(lat > t->t_latency_max)
+      t->t_latency_max = lat;
+  }
+#endif
+
+#ifdef ENABLE_SCHED_TRACE
+  if(t != curthread)
+    sched_trace_add(SCHED_TRACE_SWITCH, t->t_trace_id, curthread->t_trace_id);
+#endif
+
   t->t_task.t_state = TASK_STATE_RUNNING;
   cpu->sched.current = t;
   irq_permit(q);
+#ifdef ENABLE_SMP
+  smp_giant_leave();
+#endif
 
 #ifdef ENABLE_TASK_ACCOUNTING
   t->t_cycle_enter = cpu_cycle_counter();
@@ -261,12 +354,18 @@ thread_release(thread_t *t)
   if(t->t_refcount)
     return;
 
-  cpu_t *cpu = curcpu();
+  // Reap on the thread's own CPU, as it might still be executing
+  // on its stack until it has switched away
+  cpu_t *cpu = task_cpu(&t->t_task);
   t->t_task.t_flags &= ~TASK_THREAD;
   t->t_task.t_run = thread_exit2;
   t->t_task.t_prio = 1;
   int q = irq_forbid(IRQ_LEVEL_SCHED);
   readyqueue_insert(cpu, &t->t_task, "zombie");
+#ifdef ENABLE_SMP
+  if(cpu != curcpu())
+    cpu_kick(cpu);
+#endif
   irq_permit(q);
 }
 
@@ -317,6 +416,32 @@ thread_join(thread_t *t)
 }
 
 
+#define STACK_PAINT 0xbb
+
+#ifdef CPU_STACK_REDZONE_SIZE
+// Guarded by the MPU, never used and not readable
+#define STACK_SCAN_START CPU_STACK_REDZONE_SIZE
+#else
+#define STACK_SCAN_START 0
+#endif
+
+/**
+ * Return the deepest stack use (in bytes) seen so far by scanning
+ * for the first overwritten word of paint from the bottom up
+ */
+static size_t
+thread_stack_peak(const thread_t *t)
+{
+  const uint32_t *p = t->t_sp_bottom + STACK_SCAN_START;
+  const uint32_t *top = t->t_sp_bottom + t->t_stacksize;
+  const uint32_t paint = STACK_PAINT * 0x01010101u;
+
+  while(p < top && *p == paint)
+    p++;
+  return (void *)top - (void *)p;
+}
+
+
 static size_t
 get_default_stacksize(int flags)
 {
@@ -339,6 +464,26 @@ get_default_stacksize(int flags)
 
 }
 
+#ifdef ENABLE_SMP
+static cpu_t *
+thread_select_cpu(int flags)
+{
+  static unsigned int next_cpu;
+  const unsigned int pin = (flags & TASK_CPU_MASK) >> TASK_CPU_SHIFT;
+
+  if(pin)
+    return pin <= CPU_MAX && cpu_array[pin - 1] ? cpu_array[pin - 1] :
+      cpu_array[0];
+
+  while(1) {
+    cpu_t *cpu = cpu_array[next_cpu++ % CPU_MAX];
+    if(cpu != NULL)
+      return cpu;
+  }
+}
+#endif
+
+
 thread_t *
 thread_create_va(void *entry, size_t stack_size,
                  const char *name, int flags, unsigned int prio,
@@ -372,7 +517,8 @@ thread_create_va(void *entry, size_t stack_size,
   if(sp_bottom == NULL)
     return NULL;
 
-  memset(sp_bottom, 0xbb, stack_size + fpu_ctx_size + sizeof(thread_t));
+  // Paint the stack so thread_stack_peak() can find the high-water mark
+  memset(sp_bottom, STACK_PAINT, stack_size + fpu_ctx_size + sizeof(thread_t));
   void *sp = sp_bottom + stack_size;
   thread_t *t = sp + fpu_ctx_size;
 
@@ -389,7 +535,12 @@ thread_create_va(void *entry, size_t stack_size,
   t->t_load = 0;
   t->t_ctx_switches = 0;
   t->t_ctx_switches_acc = 0;
+#endif
   t->t_stacksize = stack_size;
+
+#ifdef ENABLE_TASK_LATENCY
+  t->t_latency_max = 0;
+  memset(t->t_latency, 0, sizeof(t->t_latency));
 #endif
 
 #ifdef HAVE_FPU
@@ -404,6 +555,8 @@ thread_create_va(void *entry, size_t stack_size,
   t->t_sp = cpu_stack_init(sp, entry, thread_exit, nargs, ap);
   t->t_sp_bottom = sp_bottom;
   t->t_stream = NULL;
+  t->t_blocked_on = NULL;
+  t->t_base_prio = prio;
 
   task_t *task = &t->t_task;
   task->t_state = TASK_STATE_READY;
@@ -412,9 +565,26 @@ thread_create_va(void *entry, size_t stack_size,
   task->t_run = NULL;
 
   int s = irq_forbid(IRQ_LEVEL_SCHED);
+#ifdef ENABLE_SCHED_TRACE
+  static uint16_t trace_id;
+  if(++trace_id == SCHED_TRACE_NO_THREAD)
+    trace_id = 1;
+  t->t_trace_id = trace_id;
+#endif
+#ifdef ENABLE_SMP
+  cpu = thread_select_cpu(flags);
+  t->t_cpu = cpu;
+#endif
   STAILQ_INSERT_TAIL(&cpu->sched.readyqueue[task->t_prio], task, t_ready_link);
   cpu->sched.active_queues |= 1 << task->t_prio;
+#ifdef ENABLE_TASK_LATENCY
+  t->t_ready_cycle = cpu_cycle_counter();
+#endif
   SLIST_INSERT_HEAD(&allthreads, t, t_global_link);
+#ifdef ENABLE_SMP
+  if(cpu != curcpu())
+    cpu_kick(cpu);
+#endif
   irq_permit(s);
 
   schedule();
@@ -466,19 +636,17 @@ task_wakeup_sched_locked(task_waitable_t *waitable, int all)
       continue;
     }
 
+    if(t->t_state == TASK_STATE_CORO_SLEEP) {
+      LIST_REMOVE(t, t_wait_link);
+      coro_wakeup_sched_locked(t);
+      if(!all)
+        break;
+      continue;
+    }
+
     assert(t->t_state == TASK_STATE_SLEEPING);
     LIST_REMOVE(t, t_wait_link);
-    cpu_t *cpu = curcpu();
-
-    if(t != &cpu->sched.current->t_task) {
-      if(t->t_prio >= cpu->sched.current->t_task.t_prio) {
-        do_sched = 1;
-      }
-      readyqueue_insert(cpu, t, "wakeup");
-    } else {
-      do_sched = 1;
-      t->t_state = TASK_STATE_RUNNING;
-    }
+    do_sched |= task_resume(t, "wakeup");
     if(!all)
       break;
   }
@@ -505,7 +673,7 @@ task_prio_cmp(const task_t *a, const task_t *b)
 
 
 
-static void __attribute__((noinline))
+void __attribute__((noinline))
 task_insert_wait_list(task_waitable_t *waitable, task_t *t)
 {
   LIST_INSERT_SORTED(&waitable->list, t, t_wait_link, task_prio_cmp);
@@ -529,13 +697,7 @@ task_sleep_abs_sched_locked_timeout(void *opaque, uint64_t expire)
   if(t->t_state == TASK_STATE_SLEEPING) {
 
     LIST_REMOVE(t, t_wait_link);
-
-    cpu_t *cpu = curcpu();
-    if(t != &cpu->sched.current->t_task) {
-      readyqueue_insert(cpu, t, "sleep-timo");
-    } else {
-      t->t_state = TASK_STATE_RUNNING;
-    }
+    task_resume(t, "sleep-timo");
     schedule();
   }
   irq_permit(s);
@@ -649,12 +811,7 @@ task_sleep_until_timeout(void *opaque, uint64_t expire)
   const int s = irq_forbid(IRQ_LEVEL_SCHED);
 
   assert(t->t_state == TASK_STATE_SLEEPING);
-  cpu_t *cpu = curcpu();
-  if(t != &cpu->sched.current->t_task) {
-    readyqueue_insert(cpu, t, "sleep-timo2");
-  } else {
-    t->t_state = TASK_STATE_RUNNING;
-  }
+  task_resume(t, "sleep-timo2");
   schedule();
   irq_permit(s);
 }
@@ -711,53 +868,154 @@ sleep(unsigned int sec)
 
 
 static void
-mutex_lock_sched_locked(mutex_t *m, task_t *curtask)
+readyqueue_remove(cpu_t *cpu, task_t *t)
 {
-  while(m->lock & 1) {
+  struct task_queue *q = &cpu->sched.readyqueue[t->t_prio];
+  STAILQ_REMOVE(q, t, task, t_ready_link);
+  if(STAILQ_FIRST(q) == NULL)
+    cpu->sched.active_queues &= ~(1 << t->t_prio);
+}
 
-#ifdef ENABLE_TASK_DEBUG
-    if(task_is_on_readyqueue(curcpu(), curtask)) {
-      panic("%s: Task %p is on readyqueue",
-            __FUNCTION__, curtask);
+
+/**
+ * Raise the owner of 'm' to (at least) 'prio'. If the owner itself is
+ * blocked on a mutex, continue with that mutex's owner and so on
+ */
+static void
+mutex_pi_boost(mutex_t *m, unsigned int prio)
+{
+  while(m != NULL) {
+    thread_t *owner = (thread_t *)(m->lock & ~MUTEX_CONTENDED);
+    if(owner == NULL || owner->t_task.t_prio >= prio)
+      return;
+
+    task_t *t = &owner->t_task;
+    cpu_t *cpu;
+
+    switch(t->t_state) {
+    case TASK_STATE_READY:
+      cpu = task_cpu(t);
+      readyqueue_remove(cpu, t);
+      t->t_prio = prio;
+      t->t_state = TASK_STATE_NONE;
+      readyqueue_insert(cpu, t, "mutex_pi_boost");
+#ifdef ENABLE_SMP
+      if(cpu != curcpu())
+        cpu_kick(cpu);
+#endif
+      break;
+    case TASK_STATE_SLEEPING:
+      if(owner->t_blocked_on != NULL) {
+        // Keep the wait list of the next mutex in the chain sorted
+        LIST_REMOVE(t, t_wait_link);
+        t->t_prio = prio;
+        task_insert_wait_list(&owner->t_blocked_on->waiters, t);
+        break;
+      }
+      // FALLTHRU
+    default:
+      t->t_prio = prio;
+      break;
     }
+    m = owner->t_blocked_on;
+  }
+}
+
+
+/**
+ * Recompute the priority of 'cur' once it has released a mutex. It
+ * needs to stay boosted for any waiters on other mutexes it still holds
+ */
+static void
+mutex_pi_restore(thread_t *cur)
+{
+  unsigned int prio = cur->t_base_prio;
+  const intptr_t self = (intptr_t)cur;
+  thread_t *t;
+
+  SLIST_FOREACH(t, &allthreads, t_global_link) {
+    const mutex_t *m = t->t_blocked_on;
+    if(m != NULL && (m->lock & ~MUTEX_CONTENDED) == self &&
+       t->t_task.t_prio > prio)
+      prio = t->t_task.t_prio;
+  }
+  cur->t_task.t_prio = prio;
+}
+
+
+static void
+mutex_lock_sched_locked(mutex_t *m, thread_t *cur)
+{
+  const intptr_t self = (intptr_t)cur;
+
+#ifdef ENABLE_SMP
+  // Until MUTEX_CONTENDED is set, fast paths on other CPUs may race
+  // with us
+  intptr_t v = __atomic_load_n(&m->lock, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&m->lock, &v,
+                                     v ? v | MUTEX_CONTENDED : self, 1,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+  }
+  if(v == 0) {
+#ifdef ENABLE_LOCKSTAT
+    lockstat_acquired(m, 0, 0);
+#endif
+    return;
+  }
+#else
+  if(m->lock == 0) {
+    m->lock = self;
+#ifdef ENABLE_LOCKSTAT
+    lockstat_acquired(m, 0, 0);
+#endif
+    return;
+  }
+  m->lock |= MUTEX_CONTENDED;
 #endif
 
+#ifdef ENABLE_LOCKSTAT
+  const uint32_t wait_start = cpu_cycle_counter();
+#endif
+
+  assert((m->lock & ~MUTEX_CONTENDED) != self);
+  assert(cur->t_task.t_state == TASK_STATE_RUNNING);
+
 #ifdef ENABLE_TASK_DEBUG
-    m->lock &= ~1;
-    if(task_is_on_list(curtask, &m->waiters.list)) {
-      panic("%s: Task %p is already on wait queue",
-            __FUNCTION__, curtask);
-    }
-    m->lock |= 1;
+  if(task_is_on_readyqueue(curcpu(), &cur->t_task)) {
+    panic("%s: Task %p is on readyqueue",
+          __FUNCTION__, cur);
+  }
+  if(task_is_on_list(&cur->t_task, &m->waiters.list)) {
+    panic("%s: Task %p is already on wait queue",
+          __FUNCTION__, cur);
+  }
 #endif
 
-    if(curtask->t_state != TASK_STATE_SLEEPING) {
-      curtask->t_state = TASK_STATE_SLEEPING;
+  cur->t_task.t_state = TASK_STATE_SLEEPING;
 #ifdef ENABLE_TASK_WCHAN
-      thread_t *curthread = (thread_t *)curtask;
-      curthread->t_wchan = m->waiters.name ?: __FUNCTION__;
-#endif
-      // We need to clear the lockbit or list manipulation will fail
-      // as they share the same memory address
-      m->lock &= ~1;
-      task_insert_wait_list(&m->waiters, curtask);
-      m->lock |= 1;
-    }
+  cur->t_wchan = m->waiters.name ?: __FUNCTION__;
+#endif
+  cur->t_blocked_on = m;
+  task_insert_wait_list(&m->waiters, &cur->t_task);
+  mutex_pi_boost(m, cur->t_task.t_prio);
 
+  // mutex_unlock_sched_locked() hands the mutex over to us directly
+  while(cur->t_task.t_state == TASK_STATE_SLEEPING) {
     schedule();
     irq_permit(irq_lower());
   }
-  m->lock |= 1;
+  assert((m->lock & ~MUTEX_CONTENDED) == self);
+#ifdef ENABLE_LOCKSTAT
+  lockstat_acquired(m, 1, cpu_cycle_counter() - wait_start);
+#endif
 }
 
 
 void
 mutex_lock_slow(mutex_t *m)
 {
-  task_t *const curtask = task_current();
-
   const int s = irq_forbid(IRQ_LEVEL_SCHED);
-  mutex_lock_sched_locked(m, curtask);
+  mutex_lock_sched_locked(m, thread_current());
   irq_permit(s);
 }
 
@@ -766,10 +1024,21 @@ int
 mutex_trylock_slow(mutex_t *m)
 {
   const int s = irq_forbid(IRQ_LEVEL_SCHED);
-  int r = m->lock & 1;
+#ifdef ENABLE_SMP
+  intptr_t expected = 0;
+  int r = !__atomic_compare_exchange_n(&m->lock, &expected,
+                                       (intptr_t)thread_current(), 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+#else
+  int r = m->lock != 0;
   if(!r) {
-    m->lock |= 1;
+    m->lock = (intptr_t)thread_current();
   }
+#endif
+#ifdef ENABLE_LOCKSTAT
+  if(!r)
+    lockstat_acquired(m, 0, 0);
+#endif
   irq_permit(s);
   return r;
 }
@@ -779,20 +1048,35 @@ mutex_trylock_slow(mutex_t *m)
 static void
 mutex_unlock_sched_locked(mutex_t *m)
 {
-  assert(m->lock != 0);
+  cpu_t *const cpu = curcpu();
+  thread_t *const cur = cpu->sched.current;
 
-  m->lock &= ~1;
+  assert((m->lock & ~MUTEX_CONTENDED) == (intptr_t)cur);
 
-  task_t *t = LIST_FIRST(&m->waiters.list);
-  if(t != NULL) {
-    cpu_t *const cpu = curcpu();
-    task_t *const cur = &cpu->sched.current->t_task;
+#ifdef ENABLE_LOCKSTAT
+  lockstat_released(m);
+#endif
 
+  // Fast paths never modify a locked mutex, only ordering matters here
+  task_t *t = LIST_FIRST(&m->waiters.list);
+  if(t == NULL) {
+    __atomic_store_n(&m->lock, 0, __ATOMIC_RELEASE);
+  } else {
+    // Hand over to the highest priority waiter, it inherits from
+    // whoever remains on the list
     LIST_REMOVE(t, t_wait_link);
-    readyqueue_insert(cpu, t, "mutex_unlock");
-    if(t->t_prio >= cur->t_prio)
-      schedule();
+    thread_t *next = (thread_t *)t;
+    next->t_blocked_on = NULL;
+    __atomic_store_n(&m->lock, (intptr_t)next |
+                     (LIST_FIRST(&m->waiters.list) ? MUTEX_CONTENDED : 0),
+                     __ATOMIC_RELEASE);
   }
+
+  if(cur->t_task.t_prio != cur->t_base_prio)
+    mutex_pi_restore(cur);
+
+  if(t != NULL && task_resume(t, "mutex_unlock"))
+    schedule();
 }
 
 
@@ -825,7 +1109,7 @@ cond_wait(cond_t *c, mutex_t *m)
   const int s = irq_forbid(IRQ_LEVEL_SCHED);
   mutex_unlock_sched_locked(m);
   task_sleep_sched_locked(c);
-  mutex_lock_sched_locked(m, task_current());
+  mutex_lock_sched_locked(m, thread_current());
   irq_permit(s);
 }
 
@@ -836,7 +1120,7 @@ cond_wait_timeout(cond_t *c, mutex_t *m, uint64_t deadline)
   const int s = irq_forbid(IRQ_LEVEL_SCHED);
   mutex_unlock_sched_locked(m);
   int r = task_sleep_abs_sched_locked(c, deadline);
-  mutex_lock_sched_locked(m, task_current());
+  mutex_lock_sched_locked(m, thread_current());
   irq_permit(s);
   return r;
 }
@@ -846,12 +1130,18 @@ void
 sched_cpu_init(sched_cpu_t *sc, thread_t *idle)
 {
   idle->t_task.t_flags = TASK_THREAD;
+  idle->t_base_prio = idle->t_task.t_prio;
+  idle->t_blocked_on = NULL;
+#ifdef ENABLE_SCHED_TRACE
+  idle->t_trace_id = 0;
+#endif
   sc->idle = &idle->t_task;
   sc->current = idle;
 #ifdef HAVE_FPU
   sc->current_fpu = NULL;
 #endif
   sc->active_queues = 0;
+  memset(&sc->idle_stats, 0, sizeof(sc->idle_stats));
 
   for(int i = 0; i < TASK_PRIOS; i++)
     STAILQ_INIT(&sc->readyqueue[i]);
@@ -939,9 +1229,55 @@ task_init_accounting(void)
 #endif
 
 
+#ifdef ENABLE_TASK_LATENCY
+
+static void
+ps_latency(cli_t *cli)
+{
+  const uint64_t cycles_per_us = cpu_cycles_per_us();
+
+  cli_printf(cli, " Name           Max(µs)  Latency histogram (<µs:count)\n");
+
+  thread_t *t = NULL;
+  while((t = thread_get_next(t)) != NULL) {
+    cli_printf(cli, " %-14s %-8u", t->t_name,
+               (unsigned int)cpu_cycles_to_us(t->t_latency_max));
+    // Buckets below 1µs resolution are merged
+    uint32_t acc = 0;
+    unsigned int prev = 0;
+    for(int i = 0; i < TASK_LATENCY_BUCKETS - 1; i++) {
+      const unsigned int us =
+        (((2ull << i) << CPU_CYCLES_PER_US_SHIFT) + cycles_per_us - 1) /
+        cycles_per_us;
+      if(us != prev && acc) {
+        cli_printf(cli, " %u:%u", prev, acc);
+        acc = 0;
+      }
+      acc += t->t_latency[i];
+      prev = us;
+    }
+    if(acc)
+      cli_printf(cli, " %u:%u", prev, acc);
+    if(t->t_latency[TASK_LATENCY_BUCKETS - 1])
+      cli_printf(cli, " >%u:%u", prev,
+                 t->t_latency[TASK_LATENCY_BUCKETS - 1]);
+    cli_printf(cli, "\n");
+  }
+}
+
+#endif
+
+
 static error_t
 cmd_ps(cli_t *cli, int argc, char **argv)
 {
+#ifdef ENABLE_TASK_LATENCY
+  if(argc > 1 && (!strcmp(argv[1], "l") || !strcmp(argv[1], "-l"))) {
+    ps_latency(cli);
+    return 0;
+  }
+#endif
+
   if(argc > 1 && !strcmp(argv[1], "x")) {
 
     thread_t *t = NULL;
@@ -949,6 +1285,16 @@ cmd_ps(cli_t *cli, int argc, char **argv)
       cli_printf(cli, "Name:\t\t\t%s\n", t->t_name);
       cli_printf(cli, "Thread:\t\t\t%p\n", t);
       cli_printf(cli, "Stack pointer:\t\t%p (Bottom:%p)\n", t->t_sp, t->t_sp_bottom);
+      cli_printf(cli, "Stack usage:\t\t%u of %u bytes\n",
+                 (unsigned int)thread_stack_peak(t), t->t_stacksize);
+      cli_printf(cli, "Priority:\t\t%d (Base:%d)\n",
+                 t->t_task.t_prio, t->t_base_prio);
+#ifdef ENABLE_SMP
+      cli_printf(cli, "CPU:\t\t\t%d\n", t->t_cpu->index);
+#endif
+      if(t->t_blocked_on != NULL)
+        cli_printf(cli, "Blocked on:\t\t%p (Owner:%p)\n", t->t_blocked_on,
+                   (void *)(t->t_blocked_on->lock & ~MUTEX_CONTENDED));
 #ifdef ENABLE_TASK_WCHAN
       cli_printf(cli, "WaitOn:\t\t\t%s\n", t->t_wchan);
 #endif
@@ -967,7 +1313,7 @@ cmd_ps(cli_t *cli, int argc, char **argv)
     return 0;
   }
 
-  cli_printf(cli, " Name           Pri Sta "
+  cli_printf(cli, " Name           Pri Sta  Stack/Size "
 #ifdef ENABLE_TASK_ACCOUNTING
              "CtxSwch  Load"
 #endif
@@ -978,7 +1324,7 @@ cmd_ps(cli_t *cli, int argc, char **argv)
 
   thread_t *t = NULL;
   while((t = thread_get_next(t)) != NULL) {
-    cli_printf(cli, " %-14s %-3d %c%c%c "
+    cli_printf(cli, " %-14s %-2d%c %c%c%c %5u/%-5u "
 #ifdef ENABLE_TASK_ACCOUNTING
                "%-7d %3d.%1d "
 #endif
@@ -987,13 +1333,15 @@ cmd_ps(cli_t *cli, int argc, char **argv)
 #endif
                "\n",
                t->t_name, t->t_task.t_prio,
+               t->t_task.t_prio != t->t_base_prio ? '+' : ' ',
                "_RrSZ"[t->t_task.t_state],
 #ifdef HAVE_FPU
                t->t_fpuctx ? 'F' : ' ',
 #else
                ' ',
 #endif
-               (t->t_task.t_flags & TASK_DETACHED) ? 'd' : ' '
+               (t->t_task.t_flags & TASK_DETACHED) ? 'd' : ' ',
+               (unsigned int)thread_stack_peak(t), t->t_stacksize
 #ifdef ENABLE_TASK_ACCOUNTING
                ,t->t_ctx_switches,
                t->t_load / 10,
@@ -1007,7 +1355,47 @@ cmd_ps(cli_t *cli, int argc, char **argv)
   return 0;
 }
 
-CLI_CMD_DEF_EXT("ps", cmd_ps, "<x>", "Show process status");
+CLI_CMD_DEF_EXT("ps", cmd_ps, "<x|l>", "Show process status");
+
+
+/**
+ * Suggest a stack size for each thread based on its high-water mark.
+ * Only as good as the code paths exercised so far, so run this after
+ * the system has been put through its paces
+ */
+static error_t
+cmd_stacks(cli_t *cli, int argc, char **argv)
+{
+  size_t total = 0;
+  size_t suggested_total = 0;
+
+  cli_printf(cli, " Name            Size  Peak  Suggested\n");
+
+  thread_t *t = NULL;
+  while((t = thread_get_next(t)) != NULL) {
+    const size_t peak = thread_stack_peak(t);
+    // 25% margin plus room for an exception frame, rounded up
+    size_t suggested = (peak + peak / 4 + 64 + 63) & ~63;
+    if(suggested < MIN_STACK_SIZE)
+      suggested = MIN_STACK_SIZE;
+    if(suggested > t->t_stacksize)
+      suggested = t->t_stacksize;
+
+    cli_printf(cli, " %-14s %5u %5u  %5u%s\n",
+               t->t_name, t->t_stacksize, (unsigned int)peak,
+               (unsigned int)suggested,
+               peak + STACK_SCAN_START >= t->t_stacksize ? " (overflow?)" : "");
+    total += t->t_stacksize;
+    suggested_total += suggested;
+  }
+  cli_printf(cli, " Total          %5u        %5u  (%u bytes reclaimable)\n",
+             (unsigned int)total, (unsigned int)suggested_total,
+             (unsigned int)(total - suggested_total));
+  return 0;
+}
+
+CLI_CMD_DEF_EXT("stacks", cmd_stacks, NULL,
+                "Show stack high-water marks and suggested sizes");
 
 
 error_t
@@ -1,20 +1,257 @@
 #include <mios/timer.h>
 
-static int
-timer_cmp(const timer_t *a, const timer_t *b)
+#include <unistd.h>
+
+#include "irq.h"
+#include "cpu.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Number of level 0 ticks covered by the entire wheel
+#define TIMER_WHEEL_SPAN (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+_Static_assert(TIMER_WHEEL_SLOTS <= 32, "tl_pending is a 32 bit mask");
+
+
+static void
+timer_wheel_insert(struct timer_list *tl, timer_t *t)
 {
-  return a->t_expire > b->t_expire;
+  const uint64_t tick = t->t_expire >> TIMER_WHEEL_SHIFT;
+  uint64_t slot = tl->tl_tick;
+  int level = 0;
+
+  if(tick > tl->tl_tick) {
+    for(; ; level++) {
+      if(level == TIMER_WHEEL_LEVELS) {
+        // Beyond reach of the wheel
+        LIST_INSERT_HEAD(&tl->tl_overflow, t, t_link);
+        return;
+      }
+      const int s = level * TIMER_WHEEL_BITS;
+      const uint64_t pos = tl->tl_tick >> s;
+      slot = tick >> s;
+      if(slot - pos < TIMER_WHEEL_SLOTS)
+        break;
+    }
+  }
+  // else: Already due, goes into the current slot
+
+  slot &= TIMER_WHEEL_MASK;
+  LIST_INSERT_HEAD(&tl->tl_slots[level][slot], t, t_link);
+  tl->tl_pending[level] |= 1u << slot;
 }
 
 
-void
+static void
+timer_wheel_reinsert(struct timer_list *tl, struct timer_slot *ts)
+{
+  struct timer_slot pending;
+  timer_t *t;
+
+  LIST_INIT(&pending);
+  LIST_SWAP(&pending, ts, timer, t_link);
+
+  while((t = LIST_FIRST(&pending)) != NULL) {
+    LIST_REMOVE(t, t_link);
+    timer_wheel_insert(tl, t);
+  }
+}
+
+
+static void
+timer_wheel_cascade(struct timer_list *tl)
+{
+  const int top = (TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_BITS;
+  if(!(tl->tl_tick & ((1ull << top) - 1))) {
+    // Top level advanced, timers on the overflow list might be
+    // within reach now
+    timer_wheel_reinsert(tl, &tl->tl_overflow);
+  }
+
+  for(int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+    const int s = level * TIMER_WHEEL_BITS;
+    if(tl->tl_tick & ((1ull << s) - 1))
+      continue;
+    const unsigned int slot = (tl->tl_tick >> s) & TIMER_WHEEL_MASK;
+    if(!(tl->tl_pending[level] & (1u << slot)))
+      continue;
+    tl->tl_pending[level] &= ~(1u << slot);
+    timer_wheel_reinsert(tl, &tl->tl_slots[level][slot]);
+  }
+}
+
+
+/**
+ * Rotate the pending mask for a level so that bit 0 corresponds to
+ * slot 'idx'
+ */
+static inline uint32_t
+timer_wheel_rotate(uint32_t pending, unsigned int idx)
+{
+  const uint64_t p = pending;
+  return ((p >> idx) | (p << (TIMER_WHEEL_SLOTS - idx))) &
+    ((1ull << TIMER_WHEEL_SLOTS) - 1);
+}
+
+
+/**
+ * Find the next tick (up to and including 'limit') at which something
+ * needs to be done: Either a level 0 slot to expire, a slot in an
+ * upper level to be cascaded, or the overflow list to be revisited
+ */
+static uint64_t
+timer_wheel_next_tick(const struct timer_list *tl, uint64_t limit)
+{
+  uint64_t next = limit;
+
+  if(!LIST_EMPTY(&tl->tl_overflow)) {
+    const int s = (TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_BITS;
+    next = ((tl->tl_tick >> s) + 1) << s;
+    if(next > limit)
+      next = limit;
+  }
+
+  for(int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    const uint32_t pending = tl->tl_pending[level];
+    if(!pending)
+      continue;
+    const int s = level * TIMER_WHEEL_BITS;
+    const uint64_t pos = tl->tl_tick >> s;
+    // The current slot never needs a visit in the future
+    const uint32_t r = timer_wheel_rotate(pending, pos & TIMER_WHEEL_MASK) & ~1;
+    if(!r)
+      continue;
+    const uint64_t tick = (pos + __builtin_ctz(r)) << s;
+    if(tick < next)
+      next = tick;
+  }
+  return next;
+}
+
+
+static void
+timer_wheel_expire(struct timer_list *tl, uint64_t now)
+{
+  const unsigned int slot = tl->tl_tick & TIMER_WHEEL_MASK;
+  struct timer_slot *ts = &tl->tl_slots[0][slot];
+  struct timer_slot pending;
+  timer_t *t;
+  int fired;
+
+  if(!(tl->tl_pending[0] & (1u << slot)))
+    return;
+
+  LIST_INIT(&pending);
+
+  // Callbacks may arm timers that are already due, those end up in
+  // this slot again so keep going until nothing more fires
+  do {
+    fired = 0;
+    LIST_SWAP(&pending, ts, timer, t_link);
+
+    while((t = LIST_FIRST(&pending)) != NULL) {
+      LIST_REMOVE(t, t_link);
+      if(t->t_expire > now) {
+        LIST_INSERT_HEAD(ts, t, t_link);
+        continue;
+      }
+      const uint64_t expire = t->t_expire;
+      t->t_expire = 0;
+      t->t_cb(t->t_opaque, expire);
+      fired = 1;
+    }
+  } while(fired && !LIST_EMPTY(ts));
+
+  if(LIST_EMPTY(ts))
+    tl->tl_pending[0] &= ~(1u << slot);
+}
+
+
+static void
+timer_wheel_rebase(struct timer_list *tl, uint64_t tick)
+{
+  struct timer_slot all;
+  LIST_INIT(&all);
+
+  LIST_SWAP(&all, &tl->tl_overflow, timer, t_link);
+
+  for(int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for(int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      struct timer_slot *ts = &tl->tl_slots[level][slot];
+      timer_t *t;
+      while((t = LIST_FIRST(ts)) != NULL) {
+        LIST_REMOVE(t, t_link);
+        LIST_INSERT_HEAD(&all, t, t_link);
+      }
+    }
+    tl->tl_pending[level] = 0;
+  }
+
+  tl->tl_tick = tick;
+  timer_wheel_reinsert(tl, &all);
+}
+
+
+/**
+ * Compute earliest deadline on the wheel. For each level, the first
+ * non-empty slot (in wheel order) holds that level's earliest timer.
+ * Timers on the overflow list are later than anything on the wheel
+ */
+static uint64_t
+timer_wheel_earliest(struct timer_list *tl)
+{
+  uint64_t best = 0;
+
+  for(int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    const int s = level * TIMER_WHEEL_BITS;
+    const unsigned int idx = (tl->tl_tick >> s) & TIMER_WHEEL_MASK;
+
+    while(tl->tl_pending[level]) {
+      const uint32_t r = timer_wheel_rotate(tl->tl_pending[level], idx);
+      const unsigned int slot = (idx + __builtin_ctz(r)) & TIMER_WHEEL_MASK;
+      const struct timer_slot *ts = &tl->tl_slots[level][slot];
+
+      if(LIST_EMPTY(ts)) {
+        // All timers in this slot has been disarmed
+        tl->tl_pending[level] &= ~(1u << slot);
+        continue;
+      }
+
+      const timer_t *t;
+      LIST_FOREACH(t, ts, t_link) {
+        if(!best || t->t_expire < best)
+          best = t->t_expire;
+      }
+      break;
+    }
+  }
+
+  if(!best) {
+    const timer_t *t;
+    LIST_FOREACH(t, &tl->tl_overflow, t_link) {
+      if(!best || t->t_expire < best)
+        best = t->t_expire;
+    }
+  }
+
+  tl->tl_next = best;
+  return best;
+}
+
+
+int
 timer_arm_on_queue(timer_t *t, uint64_t expire, struct timer_list *tl)
 {
   if(t->t_expire)
     LIST_REMOVE(t, t_link);
 
   t->t_expire = expire;
-  LIST_INSERT_SORTED(tl, t, t_link, timer_cmp);
+  timer_wheel_insert(tl, t);
+
+  if(tl->tl_next && tl->tl_next <= expire)
+    return 0;
+  tl->tl_next = expire;
+  return 1;
 }
 
 
@@ -23,25 +260,57 @@ timer_disarm(timer_t *t)
 {
   if(!t->t_expire)
     return 1;
+  // The slot's pending bit and the queue's tl_next are left as is and
+  // will be lazily corrected
   LIST_REMOVE(t, t_link);
   t->t_expire = 0;
   return 0;
 }
 
 
-void
+uint64_t
 timer_dispatch(struct timer_list *tl, uint64_t now)
 {
+  if(tl->tl_next == 0 || tl->tl_next > now)
+    return tl->tl_next;
+
+  const uint64_t nowtick = now >> TIMER_WHEEL_SHIFT;
+
+  if(nowtick > tl->tl_tick + TIMER_WHEEL_SPAN) {
+    // We've fallen so far behind that every timer needs to be placed
+    // from scratch anyway
+    timer_wheel_rebase(tl, nowtick);
+  }
+
   while(1) {
-    timer_t *t = LIST_FIRST(tl);
-    if(t == NULL)
-      break;
-    uint64_t expire = t->t_expire;
-    if(expire > now)
+    timer_wheel_expire(tl, now);
+    if(tl->tl_tick >= nowtick)
       break;
-    LIST_REMOVE(t, t_link);
-    t->t_expire = 0;
-    t->t_cb(t->t_opaque, expire);
+    tl->tl_tick = timer_wheel_next_tick(tl, nowtick);
+    timer_wheel_cascade(tl);
+  }
+  return timer_wheel_earliest(tl);
+}
+
+
+void
+timer_list_walk(const struct timer_list *tl,
+                void (*cb)(const timer_t *t, void *opaque), void *opaque)
+{
+  const timer_t *t;
+
+  for(int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    if(!tl->tl_pending[level])
+      continue;
+    for(int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      LIST_FOREACH(t, &tl->tl_slots[level][slot], t_link) {
+        cb(t, opaque);
+      }
+    }
+  }
+
+  LIST_FOREACH(t, &tl->tl_overflow, t_link) {
+    cb(t, opaque);
   }
 }
 
@@ -55,3 +324,48 @@ timer_init(timer_t *t, void (*cb)(void *opaque, uint64_t expire),
   t->t_name = name;
   timer_arm_abs(t, deadline);
 }
+
+
+#ifdef HAVE_CYCLE_COUNTER
+/*
+ * Calibrate the cycle counter against the clock. Both are sampled
+ * together so being preempted during the wait doesn't skew the result
+ * and nothing needs to be held for the full millisecond
+ */
+uint32_t
+cpu_cycles_per_us(void)
+{
+  static uint32_t cycles_per_us;
+  if(cycles_per_us)
+    return cycles_per_us;
+
+  int q = irq_forbid(IRQ_LEVEL_ALL);
+  const uint32_t c0 = cpu_cycle_counter();
+  const uint64_t t0 = clock_get_irq_blocked();
+  irq_permit(q);
+
+  udelay(1000);
+
+  q = irq_forbid(IRQ_LEVEL_ALL);
+  const uint32_t cycles = cpu_cycle_counter() - c0;
+  const uint32_t us = clock_get_irq_blocked() - t0;
+  irq_permit(q);
+
+  const uint32_t r =
+    (((uint64_t)cycles << CPU_CYCLES_PER_US_SHIFT) + us / 2) / us;
+  cycles_per_us = r ? r : 1;
+  return cycles_per_us;
+}
+
+
+uint32_t
+cpu_cycles_to_us(uint64_t cycles)
+{
+  // Split so the shift can't overflow for large totals
+  const uint32_t rate = cpu_cycles_per_us();
+  const uint64_t q = cycles / rate;
+  const uint64_t r = cycles % rate;
+  return (q << CPU_CYCLES_PER_US_SHIFT) +
+    ((r << CPU_CYCLES_PER_US_SHIFT) / rate);
+}
+#endif
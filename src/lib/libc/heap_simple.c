@@ -28,6 +28,10 @@ typedef struct heap_block {
   unsigned long prev : 63;
   unsigned long free : 1;
 #endif
+#ifdef ENABLE_MALLOC_PROFILE
+  void *caller;  // Return address of the allocating call
+  size_t size;   // Requested size
+#endif
 } heap_block_t;
 
 
@@ -194,6 +198,24 @@ cmd_show_malloc(cli_t *cli, int argc, char **argv)
 CLI_CMD_DEF_EXT("show_malloc", cmd_show_malloc, NULL, "Memory allocator info");
 
 
+#ifdef ENABLE_MALLOC_PROFILE
+void
+heap_foreach_allocation(void (*cb)(void *opaque, void *caller, size_t size),
+                        void *opaque)
+{
+  mutex_lock(&heap_mutex);
+  heap_header_t *hh;
+  LIST_FOREACH(hh, &heaps, link) {
+    for(heap_block_t *hb = hh->blocks; hb->next; hb = hb->next) {
+      if(!hb->free)
+        cb(opaque, hb->caller, hb->size);
+    }
+  }
+  mutex_unlock(&heap_mutex);
+}
+#endif
+
+
 
 static void *
 heap_alloc(heap_block_t *hb, size_t size, size_t align)
@@ -289,7 +311,7 @@ heap_free(void *ptr)
 
 
 static void *
-malloc0(size_t size, size_t align, int type)
+malloc0(size_t size, size_t align, int type, void *caller)
 {
   mutex_lock(&heap_mutex);
 
@@ -307,6 +329,11 @@ malloc0(size_t size, size_t align, int type)
 
     void *x = heap_alloc(hb, size, align);
     if(x) {
+#ifdef ENABLE_MALLOC_PROFILE
+      hb = (heap_block_t *)x - 1;
+      hb->caller = caller;
+      hb->size = size;
+#endif
       mutex_unlock(&heap_mutex);
       if(type & MEM_CLEAR)
         memset(x, 0, size);
@@ -326,14 +353,14 @@ malloc0(size_t size, size_t align, int type)
 void *
 malloc(size_t size)
 {
-  return malloc0(size, 0, 0);
+  return malloc0(size, 0, 0, MALLOC_CALLER);
 }
 
 void *
 calloc(size_t nmemb, size_t size)
 {
   size *= nmemb;
-  return malloc0(size, 0, MEM_CLEAR);
+  return malloc0(size, 0, MEM_CLEAR, MALLOC_CALLER);
 }
 
 void
@@ -359,13 +386,19 @@ free_try(void *ptr)
 void *
 memalign(size_t size, size_t alignment)
 {
-  return malloc0(size, alignment, 0);
+  return malloc0(size, alignment, 0, MALLOC_CALLER);
 }
 
 void *
 xalloc(size_t size, size_t alignment, unsigned int type)
 {
-  return malloc0(size, alignment, type);
+  return malloc0(size, alignment, type, MALLOC_CALLER);
+}
+
+void *
+xalloc_caller(size_t size, size_t alignment, unsigned int type, void *caller)
+{
+  return malloc0(size, alignment, type, caller);
 }
 
 
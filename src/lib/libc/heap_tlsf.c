@@ -0,0 +1,489 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sys/queue.h>
+#include <stddef.h>
+#include <string.h>
+#include <malloc.h>
+
+#include <mios/mios.h>
+#include <mios/cli.h>
+#include <mios/task.h>
+
+/*
+ * Two-level segregated fit allocator (TLSF)
+ *
+ * Free blocks are kept on segregated lists indexed by a first level
+ * (power of two) and a second level (TLSF_SL_COUNT linear steps within
+ * that power of two). Two bitmaps track which lists are non-empty so
+ * both malloc and free are O(1) regardless of fragmentation.
+ *
+ * Every heap added with heap_add_mem() has its own set of lists. The
+ * block header is the same size as in heap_simple.c.
+ */
+
+#define ALIGN(a, b) (((a) + (b) - 1) & ~((b) - 1))
+
+extern unsigned long _ebss;
+static const unsigned long ebss_start = (long)&_ebss;
+
+static mutex_t heap_mutex = MUTEX_INITIALIZER("heap");
+
+typedef struct heap_block {
+  struct heap_block *prev_phys;  // Physically previous block
+  size_t size;                   // Including this header | HB_FREE
+#ifdef ENABLE_MALLOC_PROFILE
+  void *caller;                  // Return address of the allocating call
+  size_t req_size;               // Requested size
+#endif
+  // Only valid when the block is free
+  struct heap_block *next_free;
+  struct heap_block *prev_free;
+} heap_block_t;
+
+#define HB_FREE 0x1
+
+#define HB_HDR     offsetof(heap_block_t, next_free)
+#define HB_MIN     sizeof(heap_block_t)
+
+#define TLSF_ALIGN (2 * sizeof(void *))
+
+#if __LONG_WIDTH__ == 64
+#define TLSF_ALIGN_LOG2 4
+#else
+#define TLSF_ALIGN_LOG2 3
+#endif
+
+_Static_assert(TLSF_ALIGN == 1 << TLSF_ALIGN_LOG2, "TLSF_ALIGN_LOG2");
+_Static_assert(HB_HDR % TLSF_ALIGN == 0, "HB_HDR not aligned");
+
+#ifndef TLSF_SL_LOG2
+#define TLSF_SL_LOG2 3
+#endif
+
+// log2 of the largest block, larger regions are split into multiple heaps
+#ifndef TLSF_FL_MAX
+#if __LONG_WIDTH__ == 64
+#define TLSF_FL_MAX 32
+#else
+#define TLSF_FL_MAX 24
+#endif
+#endif
+
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + TLSF_ALIGN_LOG2)
+#define TLSF_SMALL    (1 << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_FL_SHIFT + 2)
+#define TLSF_MAX_BLOCK (((size_t)2 << TLSF_FL_MAX) - TLSF_ALIGN)
+
+_Static_assert(TLSF_FL_COUNT <= 32, "fl_bitmap too small");
+_Static_assert(TLSF_SL_COUNT <= 8, "sl_bitmap too small");
+
+LIST_HEAD(heap_header_list, heap_header);
+
+static struct heap_header_list heaps;
+
+typedef struct heap_header {
+  LIST_ENTRY(heap_header) link;
+  heap_block_t *blocks;
+  heap_block_t *sentinel;
+  uint16_t type;
+  uint16_t prio;
+  uint32_t fl_bitmap;
+  uint8_t sl_bitmap[TLSF_FL_COUNT];
+  heap_block_t *free_list[TLSF_FL_COUNT][TLSF_SL_COUNT];
+} heap_header_t;
+
+
+static inline size_t
+hb_size(const heap_block_t *hb)
+{
+  return hb->size & ~(size_t)HB_FREE;
+}
+
+
+static inline heap_block_t *
+hb_next(const heap_block_t *hb)
+{
+  return (void *)hb + hb_size(hb);
+}
+
+
+static inline int
+fls_size(size_t size)
+{
+  return __LONG_WIDTH__ - 1 - __builtin_clzl(size);
+}
+
+
+static void
+tlsf_mapping(size_t size, int *fl, int *sl)
+{
+  if(size < TLSF_SMALL) {
+    *fl = 0;
+    *sl = size >> TLSF_ALIGN_LOG2;
+  } else {
+    const int f = fls_size(size);
+    *sl = (size >> (f - TLSF_SL_LOG2)) - TLSF_SL_COUNT;
+    *fl = f - TLSF_FL_SHIFT + 1;
+  }
+}
+
+
+static void
+tlsf_insert(heap_header_t *hh, heap_block_t *hb)
+{
+  int fl, sl;
+  tlsf_mapping(hb_size(hb), &fl, &sl);
+
+  heap_block_t *head = hh->free_list[fl][sl];
+  hb->next_free = head;
+  hb->prev_free = NULL;
+  if(head != NULL)
+    head->prev_free = hb;
+  hh->free_list[fl][sl] = hb;
+  hh->fl_bitmap |= 1 << fl;
+  hh->sl_bitmap[fl] |= 1 << sl;
+  hb->size |= HB_FREE;
+}
+
+
+static void
+tlsf_remove(heap_header_t *hh, heap_block_t *hb)
+{
+  int fl, sl;
+  tlsf_mapping(hb_size(hb), &fl, &sl);
+
+  if(hb->next_free != NULL)
+    hb->next_free->prev_free = hb->prev_free;
+  if(hb->prev_free != NULL) {
+    hb->prev_free->next_free = hb->next_free;
+  } else {
+    hh->free_list[fl][sl] = hb->next_free;
+    if(hb->next_free == NULL) {
+      hh->sl_bitmap[fl] &= ~(1 << sl);
+      if(!hh->sl_bitmap[fl])
+        hh->fl_bitmap &= ~(1 << fl);
+    }
+  }
+  hb->size &= ~(size_t)HB_FREE;
+}
+
+
+/**
+ * Find a free block of at least 'size' bytes, or NULL
+ */
+static heap_block_t *
+tlsf_find(heap_header_t *hh, size_t size)
+{
+  // Round up to the next list so any block found is large enough
+  if(size >= TLSF_SMALL)
+    size += ((size_t)1 << (fls_size(size) - TLSF_SL_LOG2)) - 1;
+
+  int fl, sl;
+  tlsf_mapping(size, &fl, &sl);
+  if(fl >= TLSF_FL_COUNT)
+    return NULL;
+
+  uint32_t sl_map = hh->sl_bitmap[fl] & (~0u << sl);
+  if(!sl_map) {
+    const uint32_t fl_map = hh->fl_bitmap & (~0u << fl << 1);
+    if(!fl_map)
+      return NULL;
+    fl = __builtin_ctz(fl_map);
+    sl_map = hh->sl_bitmap[fl];
+  }
+  sl = __builtin_ctz(sl_map);
+  return hh->free_list[fl][sl];
+}
+
+
+/**
+ * Split the tail off a used block and put it on the free lists
+ */
+static void
+heap_trim(heap_header_t *hh, heap_block_t *hb, size_t size)
+{
+  const size_t avail = hb_size(hb);
+  if(avail - size < HB_MIN)
+    return;
+
+  heap_block_t *next = hb_next(hb);
+  heap_block_t *split = (void *)hb + size;
+  split->prev_phys = hb;
+  split->size = avail - size;
+  next->prev_phys = split;
+  hb->size = size;
+  // The block was free so its physical neighbours are in use
+  tlsf_insert(hh, split);
+}
+
+
+static long
+heap_cmp(const heap_header_t *a, const heap_header_t *b)
+{
+  return a->prio > b->prio;
+}
+
+
+void
+heap_add_mem(long start, long end, uint8_t type, uint8_t prio)
+{
+  if(start == HEAP_START_EBSS) {
+    start = ebss_start;
+  }
+
+  heap_header_t *hh = (void *)start;
+  memset(hh, 0, sizeof(heap_header_t));
+
+  heap_block_t *hb = (void *)ALIGN((intptr_t)(hh + 1), TLSF_ALIGN);
+
+  heap_block_t *sentinel = (void *)((end - HB_HDR) & ~(TLSF_ALIGN - 1));
+
+  if((void *)sentinel - (void *)hb > TLSF_MAX_BLOCK) {
+    // Too large to be represented, add the rest as a separate heap
+    sentinel = (void *)hb + TLSF_MAX_BLOCK;
+    heap_add_mem((long)sentinel + HB_HDR, end, type, prio);
+  }
+
+  if((void *)sentinel - (void *)hb < HB_MIN)
+    return;
+
+  hb->prev_phys = NULL;
+  hb->size = (void *)sentinel - (void *)hb;
+
+  sentinel->prev_phys = hb;
+  sentinel->size = 0;  // Never free
+
+  hh->blocks = hb;
+  hh->sentinel = sentinel;
+  hh->type = type;
+  hh->prio = prio;
+  tlsf_insert(hh, hb);
+  mutex_lock(&heap_mutex);
+  LIST_INSERT_SORTED(&heaps, hh, link, heap_cmp);
+  mutex_unlock(&heap_mutex);
+}
+
+
+const char *memtypeflags =
+  "LOCAL\0"
+  "DMA\0"
+  "NO-CACHE\0"
+  "VECTORS\0"
+  "CHAINLOADER\0"
+  "CODE\0\0";
+
+static error_t
+cmd_show_malloc(cli_t *cli, int argc, char **argv)
+{
+  mutex_lock(&heap_mutex);
+
+  heap_header_t *hh;
+  LIST_FOREACH(hh, &heaps, link) {
+    cli_printf(cli, "Heap at %p  [", hh);
+    stprintflags(cli->cl_stream, memtypeflags, hh->type, ", ");
+    cli_printf(cli, "]\n");
+
+    heap_block_t *hb = hh->blocks;
+    size_t use = 0;
+    size_t avail = 0;
+    for(; hb_size(hb); hb = hb_next(hb)) {
+      const int is_free = hb->size & HB_FREE;
+      cli_printf(cli, "\t%s @ %p size:0x%08zx %zd\n",
+                 is_free ? "free" : "used",
+                 hb, hb_size(hb), hb_size(hb));
+      if(is_free)
+        avail += hb_size(hb);
+      else
+        use += hb_size(hb);
+    }
+    cli_printf(cli, "\t%zd bytes used, %zd bytes free\n\n",
+               use, avail);
+  }
+  mutex_unlock(&heap_mutex);
+  return 0;
+}
+
+CLI_CMD_DEF_EXT("show_malloc", cmd_show_malloc, NULL, "Memory allocator info");
+
+
+#ifdef ENABLE_MALLOC_PROFILE
+void
+heap_foreach_allocation(void (*cb)(void *opaque, void *caller, size_t size),
+                        void *opaque)
+{
+  mutex_lock(&heap_mutex);
+  heap_header_t *hh;
+  LIST_FOREACH(hh, &heaps, link) {
+    for(heap_block_t *hb = hh->blocks; hb_size(hb); hb = hb_next(hb)) {
+      if(!(hb->size & HB_FREE))
+        cb(opaque, hb->caller, hb->req_size);
+    }
+  }
+  mutex_unlock(&heap_mutex);
+}
+#endif
+
+
+static void *
+heap_alloc(heap_header_t *hh, size_t size, size_t align)
+{
+  if(align < TLSF_ALIGN)
+    align = TLSF_ALIGN;
+
+  if(size > TLSF_MAX_BLOCK)
+    return NULL;
+
+  size = ALIGN(size, TLSF_ALIGN) + HB_HDR;
+  if(size < HB_MIN)
+    size = HB_MIN;
+
+  // Leave room for padding in front that is large enough to be a
+  // block of its own
+  const size_t search = align > TLSF_ALIGN ? size + align + HB_MIN : size;
+
+  heap_block_t *hb = tlsf_find(hh, search);
+  if(hb == NULL)
+    return NULL;
+  tlsf_remove(hh, hb);
+
+  const uintptr_t addr = (uintptr_t)hb + HB_HDR;
+  uintptr_t aligned_addr = ALIGN(addr, align);
+  if(aligned_addr != addr) {
+    if(aligned_addr - addr < HB_MIN)
+      aligned_addr = ALIGN(addr + HB_MIN, align);
+
+    heap_block_t *n = hb_next(hb);
+    heap_block_t *lead = hb;
+    hb = (void *)(aligned_addr - HB_HDR);
+    hb->prev_phys = lead;
+    hb->size = (void *)n - (void *)hb;
+    n->prev_phys = hb;
+    lead->size = (void *)hb - (void *)lead;
+    tlsf_insert(hh, lead);
+  }
+
+  heap_trim(hh, hb, size);
+  return (void *)aligned_addr;
+}
+
+
+static void
+heap_free(void *ptr)
+{
+  if(ptr == NULL)
+    return;
+
+  heap_header_t *hh = NULL;
+  heap_block_t *hb = ptr - HB_HDR;
+  assert(!(hb->size & HB_FREE));
+
+  // Find which heap the block belongs to, there are only a few
+  LIST_FOREACH(hh, &heaps, link) {
+    if(hb >= hh->blocks && hb < hh->sentinel)
+      break;
+  }
+  assert(hh != NULL);
+
+  heap_block_t *next = hb_next(hb);
+  if(next->size & HB_FREE) {
+    tlsf_remove(hh, next);
+    hb->size += hb_size(next);
+  }
+
+  heap_block_t *prev = hb->prev_phys;
+  if(prev != NULL && prev->size & HB_FREE) {
+    tlsf_remove(hh, prev);
+    prev->size += hb_size(hb);
+    hb = prev;
+  }
+  hb_next(hb)->prev_phys = hb;
+  tlsf_insert(hh, hb);
+}
+
+
+static void *
+malloc0(size_t size, size_t align, int type, void *caller)
+{
+  mutex_lock(&heap_mutex);
+
+  int heap_type = type & 0xffff;
+
+  heap_header_t *hh;
+
+  LIST_FOREACH(hh, &heaps, link) {
+    if(heap_type && ((type & hh->type) != heap_type))
+      continue;
+
+    void *x = heap_alloc(hh, size, align);
+    if(x) {
+#ifdef ENABLE_MALLOC_PROFILE
+      heap_block_t *hb = x - HB_HDR;
+      hb->caller = caller;
+      hb->req_size = size;
+#endif
+      mutex_unlock(&heap_mutex);
+      if(type & MEM_CLEAR)
+        memset(x, 0, size);
+      return x;
+    }
+  }
+
+  mutex_unlock(&heap_mutex);
+  if(!(type & MEM_MAY_FAIL))
+    panic("Out of memory (s=%zd a=%zd t=%d)", size, align, type & 0xf);
+  return NULL;
+}
+
+
+void *
+malloc(size_t size)
+{
+  return malloc0(size, 0, 0, MALLOC_CALLER);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  size *= nmemb;
+  return malloc0(size, 0, MEM_CLEAR, MALLOC_CALLER);
+}
+
+void
+free(void *ptr)
+{
+  mutex_lock(&heap_mutex);
+  heap_free(ptr);
+  mutex_unlock(&heap_mutex);
+}
+
+
+int
+free_try(void *ptr)
+{
+  if(mutex_trylock(&heap_mutex))
+    return 1;
+  heap_free(ptr);
+  mutex_unlock(&heap_mutex);
+  return 0;
+}
+
+
+void *
+memalign(size_t size, size_t alignment)
+{
+  return malloc0(size, alignment, 0, MALLOC_CALLER);
+}
+
+void *
+xalloc(size_t size, size_t alignment, unsigned int type)
+{
+  return malloc0(size, alignment, type, MALLOC_CALLER);
+}
+
+void *
+xalloc_caller(size_t size, size_t alignment, unsigned int type, void *caller)
+{
+  return malloc0(size, alignment, type, caller);
+}
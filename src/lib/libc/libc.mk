@@ -4,8 +4,16 @@ SRCS +=	\
 	${SRC}/lib/libc/string.c \
 	${SRC}/lib/libc/libc.c \
 	${SRC}/lib/libc/stdio.c \
-	${SRC}/lib/libc/heap_simple.c \
+
+ifeq (${ENABLE_HEAP_TLSF},yes)
+SRCS += ${SRC}/lib/libc/heap_tlsf.c
+else
+SRCS += ${SRC}/lib/libc/heap_simple.c
+endif
+
+SRCS-${ENABLE_MALLOC_PROFILE} += ${SRC}/lib/libc/malloc_profile.c
 
 ${MOS}/lib/libc/%.o : CFLAGS += ${NOFPU}
 
-${MOS}/lib/libc/string.o : CFLAGS += ${NOFPU} -ffreestanding -fno-builtin -fno-lto
+${MOS}/lib/libc/string.o : CFLAGS += ${NOFPU} -ffreestanding -fno-builtin -fno-lto \
+	-fno-tree-loop-distribute-patterns
@@ -0,0 +1,119 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <stdlib.h>
+
+#include <mios/cli.h>
+#include <mios/version.h>
+
+/*
+ * Heap profile by allocation site
+ *
+ * With ENABLE_MALLOC_PROFILE each block header records the return
+ * address of the malloc()/xalloc() call and the requested size.
+ * Allocators built on top of the heap (kmem, pbuf, strdup) forward
+ * their own caller through xalloc_caller() so their blocks are charged
+ * to the code using them. The 'malloc profile' command (registered as
+ * malloc_profile, the shell matches '_' against a space as with
+ * 'show malloc') aggregates all live blocks per call site.
+ *
+ * Addresses are printed raw together with the build-id so they can be
+ * resolved on the host against the matching ELF:
+ *
+ *   support/malloc_profile.sh build.<platform>/mios.full.elf < capture.txt
+ */
+
+#ifndef MALLOC_PROFILE_SITES
+#define MALLOC_PROFILE_SITES 64
+#endif
+
+typedef struct malloc_site {
+  void *caller;
+  uint32_t blocks;
+  size_t bytes;
+} malloc_site_t;
+
+typedef struct malloc_profile {
+  malloc_site_t *sites;
+  size_t num_sites;
+  size_t total_blocks;
+  size_t total_bytes;
+  size_t other_blocks;   // Blocks from sites that did not fit in the table
+  size_t other_bytes;
+} malloc_profile_t;
+
+
+static void
+malloc_profile_add(void *opaque, void *caller, size_t size)
+{
+  malloc_profile_t *mp = opaque;
+
+  mp->total_blocks++;
+  mp->total_bytes += size;
+
+  for(size_t i = 0; i < mp->num_sites; i++) {
+    malloc_site_t *ms = &mp->sites[i];
+    if(ms->caller == caller) {
+      ms->blocks++;
+      ms->bytes += size;
+      return;
+    }
+  }
+
+  if(mp->num_sites == MALLOC_PROFILE_SITES) {
+    mp->other_blocks++;
+    mp->other_bytes += size;
+    return;
+  }
+  malloc_site_t *ms = &mp->sites[mp->num_sites++];
+  ms->caller = caller;
+  ms->blocks = 1;
+  ms->bytes = size;
+}
+
+
+static error_t
+cmd_malloc_profile(cli_t *cli, int argc, char **argv)
+{
+  malloc_profile_t mp = {};
+
+  // The table itself shows up in the profile as a single block
+  mp.sites = xalloc(MALLOC_PROFILE_SITES * sizeof(malloc_site_t), 0,
+                    MEM_MAY_FAIL);
+  if(mp.sites == NULL)
+    return ERR_NO_MEMORY;
+
+  heap_foreach_allocation(malloc_profile_add, &mp);
+
+  cli_printf(cli, "# build-id ");
+  sthexstr(cli->cl_stream, mios_build_id(), 20);
+  cli_printf(cli, "\n# %zd bytes in %zd blocks from %zd sites\n",
+             mp.total_bytes, mp.total_blocks, mp.num_sites);
+  cli_printf(cli, "# %6s %10s  caller\n", "blocks", "bytes");
+
+  // Selection sort, largest number of live bytes first
+  for(size_t i = 0; i < mp.num_sites; i++) {
+    size_t best = i;
+    for(size_t j = i + 1; j < mp.num_sites; j++)
+      if(mp.sites[j].bytes > mp.sites[best].bytes)
+        best = j;
+    if(best != i) {
+      malloc_site_t tmp = mp.sites[i];
+      mp.sites[i] = mp.sites[best];
+      mp.sites[best] = tmp;
+    }
+    const malloc_site_t *ms = &mp.sites[i];
+    cli_printf(cli, "  %6u %10zd  %p\n", ms->blocks, ms->bytes, ms->caller);
+  }
+
+  if(mp.other_blocks)
+    cli_printf(cli, "# %zd bytes in %zd blocks from other sites\n",
+               mp.other_bytes, mp.other_blocks);
+
+  free(mp.sites);
+  return 0;
+}
+
+CLI_CMD_DEF_EXT("malloc_profile", cmd_malloc_profile, NULL,
+                "Show live heap usage by allocation site");
@@ -2,29 +2,106 @@
 #include <inttypes.h>
 #include <malloc.h>
 
+/*
+ * Word-at-a-time memory functions
+ *
+ * These are the generic versions. CPUs with something better provide
+ * strong memcpy/memset in assembly (see src/cpu/.../memcpy.S).
+ *
+ * This file is built with -fno-tree-loop-distribute-patterns (and
+ * -fno-builtin) so GCC does not turn the copy loops back into calls to
+ * memcpy()/memset(), ie, ourselves.
+ */
+
+typedef size_t __attribute__((may_alias)) word_t;
+
+#define WSIZE sizeof(word_t)
+#define WMASK (WSIZE - 1)
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define WSHIFT_FWD(lo, hi, s) (((lo) >> (s)) | ((hi) << (8 * WSIZE - (s))))
+#else
+#define WSHIFT_FWD(lo, hi, s) (((lo) << (s)) | ((hi) >> (8 * WSIZE - (s))))
+#endif
+
+/*
+ * Copy in ascending address order. Safe for overlapping buffers as long
+ * as dst is below src
+ */
 static void
-bcopy(const void *src, void *dest, size_t len)
+copy_fwd(uint8_t *d, const uint8_t *s, size_t n)
 {
-  if(len == 0)
-    return;
-  if(dest < src) {
-    const char *s = src;
-    const char *e = src + len;
-    char *d = dest;
-
-    while(s != e) {
+  if(n >= 2 * WSIZE) {
+    while((uintptr_t)d & WMASK) {
       *d++ = *s++;
+      n--;
     }
 
-  } else {
+    word_t *dw = (word_t *)d;
+    const size_t misalign = (uintptr_t)s & WMASK;
+
+    if(misalign == 0) {
+      const word_t *sw = (const word_t *)s;
+      for(; n >= 4 * WSIZE; n -= 4 * WSIZE) {
+        const word_t a = sw[0];
+        const word_t b = sw[1];
+        const word_t c = sw[2];
+        const word_t e = sw[3];
+        dw[0] = a;
+        dw[1] = b;
+        dw[2] = c;
+        dw[3] = e;
+        dw += 4;
+        sw += 4;
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *dw++ = *sw++;
+      s = (const uint8_t *)sw;
+    } else {
+      // Only aligned loads, each source word holds at least one byte
+      // we are copying so this never reads outside of the buffer's words
+      const unsigned int shift = misalign * 8;
+      const word_t *sw = (const word_t *)(s - misalign);
+      word_t lo = *sw++;
+      for(; n >= WSIZE; n -= WSIZE) {
+        const word_t hi = *sw++;
+        *dw++ = WSHIFT_FWD(lo, hi, shift);
+        lo = hi;
+      }
+      s = (const uint8_t *)sw - WSIZE + misalign;
+    }
+    d = (uint8_t *)dw;
+  }
+
+  while(n--)
+    *d++ = *s++;
+}
 
-    const char *s = src + len;
-    const char *b = src;
-    char *d = dest + len;
-    do {
+
+/*
+ * Copy in descending address order, for dst above src
+ */
+static void
+copy_bwd(uint8_t *d, const uint8_t *s, size_t n)
+{
+  d += n;
+  s += n;
+
+  if(n >= 2 * WSIZE && (((uintptr_t)d ^ (uintptr_t)s) & WMASK) == 0) {
+    while((uintptr_t)d & WMASK) {
       *--d = *--s;
-    } while(b != s);
+      n--;
+    }
+    word_t *dw = (word_t *)d;
+    const word_t *sw = (const word_t *)s;
+    for(; n >= WSIZE; n -= WSIZE)
+      *--dw = *--sw;
+    d = (uint8_t *)dw;
+    s = (const uint8_t *)sw;
   }
+
+  while(n--)
+    *--d = *--s;
 }
 
 
@@ -34,6 +111,23 @@ memcmp(const void *str1, const void *str2, size_t count)
   const unsigned char *s1 = (const unsigned char *)str1;
   const unsigned char *s2 = (const unsigned char *)str2;
 
+  if(count >= 2 * WSIZE && (((uintptr_t)s1 ^ (uintptr_t)s2) & WMASK) == 0) {
+    while((uintptr_t)s1 & WMASK) {
+      if(*s1 != *s2)
+        return *s1 < *s2 ? -1 : 1;
+      s1++;
+      s2++;
+      count--;
+    }
+    // Skip over equal words, the differing one is compared bytewise below
+    while(count >= WSIZE &&
+          *(const word_t *)s1 == *(const word_t *)s2) {
+      s1 += WSIZE;
+      s2 += WSIZE;
+      count -= WSIZE;
+    }
+  }
+
   while(count-- > 0) {
     if(*s1++ != *s2++) {
       return s1[-1] < s2[-1] ? -1 : 1;
@@ -42,61 +136,158 @@ memcmp(const void *str1, const void *str2, size_t count)
   return 0;
 }
 
-// TODO: temporary slow byte-copy. Replace with a non-recursive fast path
-// (the previous __builtin_memcpy version recursed into itself on aarch64).
-__attribute__((weak, optimize("no-tree-loop-distribute-patterns",
-                              "no-tree-loop-distribution")))
+
+__attribute__((weak))
 void *
 memcpy(void *dest, const void *src, size_t n)
 {
-  char *d = dest;
-  const char *s = src;
-  while(n--)
-    *d++ = *s++;
+  copy_fwd(dest, src, n);
   return dest;
 }
 
+
 void *
 memmove(void *dest, const void *src, size_t n)
 {
-  bcopy(src, dest, n);
+  if(dest + n <= src || src + n <= dest) {
+    // No overlap, memcpy() might be faster
+    return memcpy(dest, src, n);
+  }
+
+  if(dest < src) {
+    copy_fwd(dest, src, n);
+  } else if(dest > src) {
+    copy_bwd(dest, src, n);
+  }
   return dest;
 }
 
 
+__attribute__((weak))
 void *
 memset(void *dest, int val, size_t len)
 {
   unsigned char *ptr = (unsigned char *)dest;
+
+  if(len >= 2 * WSIZE) {
+    while((uintptr_t)ptr & WMASK) {
+      *ptr++ = val;
+      len--;
+    }
+
+    const word_t w = (word_t)0x0101010101010101ull * (unsigned char)val;
+
+    word_t *pw = (word_t *)ptr;
+    for(; len >= 4 * WSIZE; len -= 4 * WSIZE) {
+      pw[0] = w;
+      pw[1] = w;
+      pw[2] = w;
+      pw[3] = w;
+      pw += 4;
+    }
+    for(; len >= WSIZE; len -= WSIZE)
+      *pw++ = w;
+    ptr = (unsigned char *)pw;
+  }
+
   while(len-- > 0)
     *ptr++ = val;
   return dest;
 }
 
 
+/*
+ * The string functions below look for the terminating NUL a word at a
+ * time (once the pointers are word aligned). They may read up to the
+ * end of the aligned word holding the NUL but never beyond it, so they
+ * can not fault even if the string ends right before unmapped memory.
+ *
+ * Comparisons only take the word path if both strings have the same
+ * alignment. See string_test.c for the host side fuzzer
+ */
+
+#define WONES  ((word_t)0x0101010101010101ull)
+#define WHIGHS (WONES * 0x80)
+
+// Nonzero if any byte in 'v' is zero
+#define WHASZERO(v) (((v) - WONES) & ~(v) & WHIGHS)
+
+#define SAME_ALIGNMENT(a, b) ((((uintptr_t)(a) ^ (uintptr_t)(b)) & WMASK) == 0)
+
+
 size_t
 strlen(const char *s)
 {
-  size_t r = 0;
-  while(*s++) {
-    r++;
+  const char *p = s;
+
+  while((uintptr_t)p & WMASK) {
+    if(*p == 0)
+      return p - s;
+    p++;
   }
-  return r;
+
+  const word_t *w = (const word_t *)p;
+  while(!WHASZERO(*w))
+    w++;
+
+  p = (const char *)w;
+  while(*p)
+    p++;
+  return p - s;
 }
 
 int
 strcmp(const char *s1, const char *s2)
 {
+  if(SAME_ALIGNMENT(s1, s2)) {
+    while((uintptr_t)s1 & WMASK) {
+      if(*s1 == 0 || *s1 != *s2)
+        goto done;
+      s1++;
+      s2++;
+    }
+
+    const word_t *w1 = (const word_t *)s1;
+    const word_t *w2 = (const word_t *)s2;
+    while(*w1 == *w2 && !WHASZERO(*w1)) {
+      w1++;
+      w2++;
+    }
+    s1 = (const char *)w1;
+    s2 = (const char *)w2;
+  }
+
   while(*s1 && (*s1 == *s2)) {
     s1++;
     s2++;
   }
+ done:
   return *(const unsigned char *)s1 - *(const unsigned char *)s2;
 }
 
 int
 strncmp(const char *s1, const char *s2, size_t n)
 {
+  if(SAME_ALIGNMENT(s1, s2)) {
+    while(n && (uintptr_t)s1 & WMASK) {
+      if(*s1 == 0 || *s1 != *s2)
+        goto done;
+      s1++;
+      s2++;
+      n--;
+    }
+
+    const word_t *w1 = (const word_t *)s1;
+    const word_t *w2 = (const word_t *)s2;
+    while(n >= WSIZE && *w1 == *w2 && !WHASZERO(*w1)) {
+      w1++;
+      w2++;
+      n -= WSIZE;
+    }
+    s1 = (const char *)w1;
+    s2 = (const char *)w2;
+  }
+
   while(n && *s1 && (*s1 == *s2)) {
     s1++;
     s2++;
@@ -104,6 +295,7 @@ strncmp(const char *s1, const char *s2, size_t n)
   }
   if(n == 0)
     return 0;
+ done:
   return *(const unsigned char *)s1 - *(const unsigned char *)s2;
 }
 
@@ -117,11 +309,45 @@ tolower(int c)
 int
 strcasecmp(const char *s1, const char *s2)
 {
-  while(*s1 && (tolower(*s1) == tolower(*s2))) {
-    s1++;
-    s2++;
+  const unsigned char *u1 = (const unsigned char *)s1;
+  const unsigned char *u2 = (const unsigned char *)s2;
+  int d;
+
+  if(SAME_ALIGNMENT(u1, u2)) {
+    while((uintptr_t)u1 & WMASK) {
+      d = tolower(*u1) - tolower(*u2);
+      if(d || *u1 == 0)
+        return d;
+      u1++;
+      u2++;
+    }
+
+    while(1) {
+      // Skip identical words, then compare the next one bytewise
+      const word_t *w1 = (const word_t *)u1;
+      const word_t *w2 = (const word_t *)u2;
+      while(*w1 == *w2 && !WHASZERO(*w1)) {
+        w1++;
+        w2++;
+      }
+      u1 = (const unsigned char *)w1;
+      u2 = (const unsigned char *)w2;
+
+      for(size_t i = 0; i < WSIZE; i++) {
+        d = tolower(u1[i]) - tolower(u2[i]);
+        if(d || u1[i] == 0)
+          return d;
+      }
+      u1 += WSIZE;
+      u2 += WSIZE;
+    }
   }
-  return tolower(*(const unsigned char *)s1) - tolower(*(const unsigned char *)s2);
+
+  while(*u1 && (tolower(*u1) == tolower(*u2))) {
+    u1++;
+    u2++;
+  }
+  return tolower(*u1) - tolower(*u2);
 }
 
 size_t
@@ -178,6 +404,20 @@ strcpy(char *dst, const char *src)
 char *
 strchr(const char *s, int c)
 {
+  while((uintptr_t)s & WMASK) {
+    if(*s == 0)
+      return NULL;
+    if((char)c == *s)
+      return (char *)s;
+    s++;
+  }
+
+  const word_t cc = WONES * (unsigned char)c;
+  const word_t *w = (const word_t *)s;
+  while(!WHASZERO(*w) && !WHASZERO(*w ^ cc))
+    w++;
+  s = (const char *)w;
+
   while(*s) {
     if((char)c == *s)
       return (char *)s;
@@ -216,7 +456,7 @@ char *
 strdup(const char *line)
 {
   size_t len = strlen(line);
-  char *new = xalloc(len + 1, 1, MEM_MAY_FAIL);
+  char *new = xalloc_caller(len + 1, 1, MEM_MAY_FAIL, MALLOC_CALLER);
   if (new == NULL)
     return NULL;
   strlcpy(new, line, len + 1);
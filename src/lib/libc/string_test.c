@@ -0,0 +1,268 @@
+// ====================================================================
+// Host side fuzzer for string.c
+//
+// Run tests:    make string_test
+//
+// Compares the word-at-a-time mem/str functions against trivial byte
+// loop references with random lengths, alignments and contents.
+// Strings are also placed right before an inaccessible page to catch
+// reads beyond the word holding the terminating NUL.
+// ====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define memcmp     mios_memcmp
+#define memcpy     mios_memcpy
+#define memmove    mios_memmove
+#define memset     mios_memset
+#define strlen     mios_strlen
+#define strcmp     mios_strcmp
+#define strncmp    mios_strncmp
+#define strcasecmp mios_strcasecmp
+#define strlcpy    mios_strlcpy
+#define strtbl     mios_strtbl
+#define strcpy     mios_strcpy
+#define strchr     mios_strchr
+#define strspn     mios_strspn
+#define strcspn    mios_strcspn
+#define strdup     mios_strdup
+#define glob       mios_glob
+
+#define MEM_MAY_FAIL 0
+#define xalloc(size, align, flags) malloc(size)
+#define xalloc_caller(size, align, flags, caller) malloc(size)
+#define MALLOC_CALLER NULL
+
+#include "string.c"
+
+
+static int
+sign(int x)
+{
+  return x < 0 ? -1 : x > 0;
+}
+
+static size_t
+ref_strlen(const char *s)
+{
+  size_t r = 0;
+  while(s[r])
+    r++;
+  return r;
+}
+
+static int
+ref_strncmp(const char *a, const char *b, size_t n)
+{
+  for(; n; n--, a++, b++) {
+    if(*a != *b || *a == 0)
+      return *(const unsigned char *)a - *(const unsigned char *)b;
+  }
+  return 0;
+}
+
+static int
+ref_strcasecmp(const char *a, const char *b)
+{
+  for(;; a++, b++) {
+    int d = tolower(*(const unsigned char *)a) -
+      tolower(*(const unsigned char *)b);
+    if(d || *a == 0)
+      return d;
+  }
+}
+
+static const char *
+ref_strchr(const char *s, int c)
+{
+  for(; *s; s++)
+    if(*s == (char)c)
+      return s;
+  return NULL;
+}
+
+static void
+ref_memmove(uint8_t *d, const uint8_t *s, size_t n)
+{
+  uint8_t tmp[n ?: 1];
+  for(size_t i = 0; i < n; i++)
+    tmp[i] = s[i];
+  for(size_t i = 0; i < n; i++)
+    d[i] = tmp[i];
+}
+
+
+static int failures;
+
+#define CHECK(cond, ...) do {                           \
+    if(!(cond)) {                                       \
+      printf("  FAIL %s:%d: ", __FUNCTION__, __LINE__); \
+      printf(__VA_ARGS__);                              \
+      printf("\n");                                     \
+      if(++failures > 10)                               \
+        exit(1);                                        \
+    }                                                   \
+  } while(0)
+
+
+// Random string of 'len' characters from a small alphabet (so compares
+// often run long) with the occasional high bit character
+static void
+fill_string(char *s, size_t len)
+{
+  static const char alphabet[] = "aAbB\x80\xff";
+  for(size_t i = 0; i < len; i++)
+    s[i] = alphabet[rand() % (rand() & 7 ? 2 : sizeof(alphabet) - 1)];
+  s[len] = 0;
+}
+
+
+static void
+test_strings(int rounds)
+{
+  char a[160], b[160];
+
+  for(int r = 0; r < rounds; r++) {
+    const size_t oa = rand() % 16;
+    const size_t ob = rand() & 1 ? oa : (size_t)rand() % 16;
+    const size_t la = rand() % 128;
+    char *sa = a + oa;
+    char *sb = b + ob;
+
+    fill_string(sa, la);
+    size_t lb = la;
+    for(size_t i = 0; i <= la; i++)
+      sb[i] = sa[i];
+    switch(rand() % 4) {
+    case 0:  // Equal
+      break;
+    case 1:  // Differ somewhere
+      if(la)
+        sb[rand() % la] ^= 1 << (rand() % 8);
+      break;
+    case 2:  // Prefix
+      lb = la ? rand() % la : 0;
+      sb[lb] = 0;
+      break;
+    case 3:  // Differ in case only
+      for(size_t i = 0; i < la; i++)
+        if(rand() & 1)
+          sb[i] ^= sb[i] >= 'A' && sb[i] <= 'z' ? 0x20 : 0;
+      break;
+    }
+
+    CHECK(strlen(sa) == ref_strlen(sa), "strlen len:%zd off:%zd", la, oa);
+    CHECK(sign(strcmp(sa, sb)) == sign(ref_strncmp(sa, sb, SIZE_MAX)),
+          "strcmp len:%zd off:%zd,%zd", la, oa, ob);
+    const size_t n = rand() % 140;
+    CHECK(sign(strncmp(sa, sb, n)) == sign(ref_strncmp(sa, sb, n)),
+          "strncmp len:%zd n:%zd off:%zd,%zd", la, n, oa, ob);
+    CHECK(sign(strcasecmp(sa, sb)) == sign(ref_strcasecmp(sa, sb)),
+          "strcasecmp len:%zd off:%zd,%zd", la, oa, ob);
+    const int c = rand() & 3 ? sa[rand() % (la + 1)] : rand();
+    CHECK(strchr(sa, c) == ref_strchr(sa, c),
+          "strchr len:%zd off:%zd c:%d", la, oa, c);
+  }
+}
+
+
+static void
+test_mem(int rounds)
+{
+  uint8_t a[640], b[640], ref[640];
+
+  for(int r = 0; r < rounds; r++) {
+    for(size_t i = 0; i < sizeof(a); i++)
+      a[i] = rand();
+    for(size_t i = 0; i < sizeof(a); i++)
+      b[i] = ref[i] = a[i];
+
+    const size_t n = rand() % 256;
+    const size_t so = rand() % 64;
+    const size_t d = rand() % 64;
+
+    switch(rand() % 4) {
+    case 0:
+      memcpy(b + 300 + d, a + so, n);
+      ref_memmove(ref + 300 + d, a + so, n);
+      break;
+    case 1:
+      memmove(b + d, b + so, n);
+      ref_memmove(ref + d, ref + so, n);
+      break;
+    case 2: {
+      const int v = rand();
+      memset(b + d, v, n);
+      for(size_t i = 0; i < n; i++)
+        ref[d + i] = v;
+      break;
+    }
+    case 3: {
+      if(n && rand() & 1)
+        b[so + rand() % n] ^= 1 << (rand() % 8);
+      const int x = memcmp(a + so, b + so, n);
+      int y = 0;
+      for(size_t i = 0; i < n && !y; i++)
+        y = a[so + i] - b[so + i];
+      CHECK(sign(x) == sign(y), "memcmp n:%zd off:%zd", n, so);
+      continue;
+    }
+    }
+    for(size_t i = 0; i < sizeof(b); i++)
+      CHECK(b[i] == ref[i], "mem* n:%zd src:%zd dst:%zd at %zd", n, so, d, i);
+  }
+}
+
+
+// Strings ending at the very end of a readable page
+static void
+test_page_end(void)
+{
+  const size_t pagesize = sysconf(_SC_PAGESIZE);
+  uint8_t *pages = mmap(NULL, pagesize * 2, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(pages == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  mprotect(pages + pagesize, pagesize, PROT_NONE);
+  char *end = (char *)pages + pagesize;
+  char other[64];
+
+  for(size_t len = 0; len < 40; len++) {
+    char *s = end - len - 1;
+    fill_string(s, len);
+    for(size_t i = 0; i <= len; i++)
+      other[i] = s[i];
+
+    CHECK(strlen(s) == len, "strlen at page end len:%zd", len);
+    CHECK(strcmp(s, s) == 0, "strcmp at page end len:%zd", len);
+    CHECK(strcmp(s, other) == 0, "strcmp at page end len:%zd", len);
+    CHECK(strncmp(s, s, len + 100) == 0, "strncmp at page end len:%zd", len);
+    CHECK(strcasecmp(s, s) == 0, "strcasecmp at page end len:%zd", len);
+    CHECK(strchr(s, '#') == NULL, "strchr at page end len:%zd", len);
+    CHECK(memcmp(s, other, len + 1) == 0, "memcmp at page end len:%zd", len);
+  }
+  munmap(pages, pagesize * 2);
+}
+
+
+int
+main(int argc, char **argv)
+{
+  const int rounds = argc > 1 ? atoi(argv[1]) : 200000;
+  srand(1);
+
+  printf("string: %d rounds, %zd byte words\n", rounds, WSIZE);
+  test_strings(rounds);
+  test_mem(rounds);
+  test_page_end();
+
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return !!failures;
+}
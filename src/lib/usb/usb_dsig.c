@@ -51,18 +51,8 @@ buffer_alloc(usb_dsig_t *ud)
 {
   // IRQ_LEVEL_NET must be blocked
 
-  void *buf = pbuf_data_get(0);
-  if(buf == NULL) {
-    ud->rx_pbuf = NULL;
-    return;
-  }
-
-  pbuf_t *pb = pbuf_get(0);
-  if(pb == NULL) {
-    pbuf_data_put(buf);
-  } else {
-    pb->pb_data = buf;
-
+  pbuf_t *pb = pbuf_make_account_irq_blocked(&ud->cni.cni_rx_account, 0);
+  if(pb != NULL) {
     usb_ep_t *ue = &ud->iface->ui_endpoints[0]; // OUT
     if(ue->ue_vtable != NULL)
       ue->ue_vtable->cnak(ue->ue_dev, ue);
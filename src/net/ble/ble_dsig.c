@@ -75,7 +75,7 @@ ble_dsig_output(struct netif *ni, pbuf_t *pb, uint32_t group, uint32_t flags)
   ble_dsig_client_t *bdc;
   LIST_FOREACH(bdc, &bd->bd_clients, bdc_link) {
     if(LIST_NEXT(bdc, bdc_link) != NULL) {
-      pbuf_t *copy = pbuf_copy(pb, 0);
+      pbuf_t *copy = pbuf_clone(pb, 0);
       if(copy != NULL)
         client_enqueue(bdc, copy);
     } else {
@@ -104,7 +104,7 @@ ble_dsig_push(void *opaque, struct pbuf *pb)
   LIST_FOREACH(bdc, &g_ble_dsig.bd_clients, bdc_link) {
     if(bdc == self)
       continue;
-    pbuf_t *copy = pbuf_copy(pb, 0);
+    pbuf_t *copy = pbuf_clone(pb, 0);
     if(copy != NULL)
       client_enqueue(bdc, copy);
   }
@@ -725,7 +725,10 @@ static void
 att_send_error(l2cap_t *l2c, pbuf_t *pb,
                uint8_t request_opcode, uint16_t handle, uint8_t error)
 {
-  pbuf_reset(pb, pb->pb_offset, sizeof(l2cap_att_error_t));
+  if(pbuf_reset(pb, pb->pb_offset, sizeof(l2cap_att_error_t))) {
+    pbuf_free(pb);
+    return;
+  }
 
   l2cap_att_error_t *rsp = pbuf_data(pb, 0);
   rsp->request_opcode = request_opcode;
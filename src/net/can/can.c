@@ -1,6 +1,7 @@
 #include "can.h"
 
 #include <assert.h>
+#include <stdio.h>
 
 #include <mios/bytestream.h>
 #include <mios/dsig.h>
@@ -44,6 +45,23 @@ can_netif_attach(can_netif_t *cni, const char *name,
   cni->cni_ni.ni_input = can_input;
   cni->cni_ni.ni_mtu = 8; // Should be set by caller
 
+  pbuf_account_init(&cni->cni_rx_account, name,
+                    CAN_RX_PBUF_MIN, CAN_RX_PBUF_MAX);
+
   netif_init(&cni->cni_ni, name, dc);
   netif_attach(&cni->cni_ni);
 }
+
+
+void
+can_print(can_netif_t *cni, struct stream *st)
+{
+  const pbuf_account_t *pa = &cni->cni_rx_account;
+  stprintf(st, "RX buffers: Min:%d  Max:", pa->pa_min);
+  if(pa->pa_max)
+    stprintf(st, "%d", pa->pa_max);
+  else
+    stprintf(st, "Unlimited");
+  stprintf(st, "  Inuse:%d  Peak:%d  Denied:%u\n",
+           pa->pa_inuse, pa->pa_peak, pa->pa_denied);
+}
@@ -2,6 +2,16 @@
 
 #include "net/netif.h"
 
+// RX data buffers guaranteed to / at most held by each CAN interface.
+// Define CAN_RX_PBUF_MAX to 0 to remove the upper limit
+#ifndef CAN_RX_PBUF_MIN
+#define CAN_RX_PBUF_MIN 2
+#endif
+
+#ifndef CAN_RX_PBUF_MAX
+#define CAN_RX_PBUF_MAX (4 * CAN_RX_PBUF_MIN)
+#endif
+
 typedef struct can_netif {
   netif_t cni_ni;
 
@@ -12,6 +22,8 @@ typedef struct can_netif {
 
   uint16_t cni_low_latency_output_timestamp;
 
+  pbuf_account_t cni_rx_account;
+
 } can_netif_t;
 
 struct dsig_filter;
@@ -19,3 +31,7 @@ struct dsig_filter;
 void can_netif_attach(can_netif_t *mni, const char *name,
                       const device_class_t *dc,
                       const struct dsig_filter *output_filter);
+
+struct stream;
+
+void can_print(can_netif_t *cni, struct stream *st);
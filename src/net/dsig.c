@@ -102,7 +102,7 @@ dsig_output(uint32_t id, struct pbuf *pb, struct netif *exclude)
     }
 
     if(to != NULL) {
-      pbuf_t *copy = pbuf_copy(pb, 0);
+      pbuf_t *copy = pbuf_clone(pb, 0);
       if(copy != NULL) {
         copy = to->ni_dsig_output(to, copy, id, to_flags);
         if(copy != NULL)
@@ -207,7 +207,7 @@ nexthop_destroy(nexthop_t *nh)
     pbuf_free(nh->nh_pending);
   LIST_REMOVE(nh, nh_global_link);
   LIST_REMOVE(nh, nh_netif_link);
-  free(nh);
+  kmem_cache_free(&nexthop_cache, nh);
 }
 
 
@@ -238,8 +238,12 @@ static void
 ether_periodic(void *opaque, uint64_t expire)
 {
   ether_netif_t *eni = opaque;
-  net_timer_arm(&eni->eni_periodic, expire + 1000000);
   ether_nexthop_periodic(eni);
+
+  // Nothing to age, stay quiet until ether_ipv4_output() needs us again
+  if(LIST_EMPTY(&eni->eni_ni.ni_nexthops))
+    return;
+  net_timer_arm(&eni->eni_periodic, expire + 1000000);
 }
 
 static error_t
@@ -280,6 +284,9 @@ ether_ipv4_output(netif_t *ni, struct nexthop *nh, pbuf_t *pb)
 
   nh->nh_in_use = 5;
 
+  if(!eni->eni_periodic.t_expire)
+    net_timer_arm(&eni->eni_periodic, clock_get() + 1000000);
+
   if(nh->nh_state <= NEXTHOP_RESOLVE) {
 
     if(nh->nh_state == 0) {
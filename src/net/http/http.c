@@ -27,6 +27,7 @@
 #include <mios/timer.h>
 #include <mios/atomic.h>
 #include <mios/type_macros.h>
+#include <mios/kmem.h>
 
 STAILQ_HEAD(http_connection_squeue, http_connection);
 STAILQ_HEAD(http_server_task_squeue, http_server_task);
@@ -71,6 +72,7 @@ struct http_connection {
 
   uint8_t hc_hold : 1;
   uint8_t hc_notify : 1;
+  uint8_t hc_request : 1; // hc_payload is a http_request_t
   uint8_t hc_ws_rx_opcode;
   uint8_t hc_ws_tx_opcode;
   uint8_t hc_output_mask_bit; // Set to 0x80 if we should do masking
@@ -85,6 +87,9 @@ struct http_connection {
   const char *hc_close_reason;
 };
 
+static kmem_cache_t http_connection_cache =
+  KMEM_CACHE_INITIALIZER("httpconn", sizeof(http_connection_t), 0);
+
 
 #define MAX_HTTP_SERVER_CONNECTIONS 16
 
@@ -134,7 +139,7 @@ http_connection_release(http_connection_t *hc)
   if(atomic_dec(&hc->hc_refcount))
     return;
 
-  free(hc);
+  kmem_cache_free(&http_connection_cache, hc);
 }
 
 
@@ -194,9 +199,67 @@ http_response_close(stream_t *s)
 }
 
 
+// Payload is sent as a chunk of its own. The chunk header and trailer
+// are added to the chain so the socket gets it all in one go without
+// copying the payload
+static ssize_t
+http_response_write_pbuf(stream_t *s, struct pbuf *pb)
+{
+  http_connection_t *hc = (http_connection_t *)s;
+  const size_t len = pb->pb_pktlen;
+
+  if(len == 0) {
+    pbuf_free(pb);
+    return 0;
+  }
+
+  if(hc->hc_output_buffer_used) {
+    http_response_chunk_send(hc, hc->hc_output_buffer,
+                             hc->hc_output_buffer_used);
+    hc->hc_output_buffer_used = 0;
+  }
+
+  char hdr[20];
+  const int hlen = snprintf(hdr, sizeof(hdr), "%zx\r\n", len);
+
+  pb = pbuf_prepend(pb, hlen, 1, 0);
+  if(pb == NULL)
+    return ERR_NO_BUFFER;
+  memcpy(pbuf_data(pb, 0), hdr, hlen);
+
+  pbuf_t *tail = pb;
+  while(tail->pb_next)
+    tail = tail->pb_next;
+
+  if(tail->pb_offset + tail->pb_buflen + 2 > pbuf_data_size(tail->pb_data)) {
+    pbuf_t *n = pbuf_make(0, 1);
+    if(n == NULL) {
+      pbuf_free(pb);
+      return ERR_NO_BUFFER;
+    }
+    n->pb_flags = PBUF_EOP;
+    tail->pb_flags &= ~PBUF_EOP;
+    tail->pb_next = n;
+  }
+
+  void *trailer = pbuf_append(pb, 2);
+  if(trailer == NULL) {
+    pbuf_free(pb);
+    return ERR_NO_BUFFER;
+  }
+  memcpy(trailer, "\r\n", 2);
+
+  const ssize_t r = stream_write_pbuf(hc->hc_socket, pb);
+  if(r < 0)
+    return r;
+  return len;
+}
+
+
 static const stream_vtable_t http_response_vtable = {
   .write = http_response_write,
   .close = http_response_close,
+  .write_pbuf = http_response_write_pbuf,
 };
 
 
@@ -447,10 +510,17 @@ http_timer_arm(http_connection_t *hc, http_server_t *hs, int seconds)
 }
 
 
+// Request headers and body are allocated from an arena. The first chunk
+// is inline with the http_request_t, larger requests chain heap chunks
+// up to HTTP_REQUEST_MAX_HEAP bytes
+#define HTTP_REQUEST_ALLOC_SIZE 1024
+#define HTTP_REQUEST_CHUNK_SIZE 1024
+#define HTTP_REQUEST_MAX_HEAP   8192
+
 static int
 http_server_message_begin(http_parser *p)
 {
-  const size_t alloc_size = 4096;
+  const size_t alloc_size = HTTP_REQUEST_ALLOC_SIZE;
 
   http_request_t *hr = xalloc(alloc_size, 0, MEM_MAY_FAIL);
   if(hr == NULL) {
@@ -458,15 +528,25 @@ http_server_message_begin(http_parser *p)
   }
 
   memset(hr, 0, sizeof(http_request_t));
-  hr->hr_bumpalloc.capacity = alloc_size - sizeof(http_request_t);
+  arena_init(&hr->hr_arena, hr + 1, alloc_size - sizeof(http_request_t),
+             HTTP_REQUEST_CHUNK_SIZE, HTTP_REQUEST_MAX_HEAP);
 
   http_connection_t *hc = p->data;
   hr->hr_hc = hc;
   hc->hc_payload = hr;
+  hc->hc_request = 1;
   return 0;
 }
 
 
+static void
+http_request_free(http_request_t *hr)
+{
+  arena_release(&hr->hr_arena);
+  free(hr);
+}
+
+
 static int
 http_server_url(http_parser *p, const char *at, size_t length)
 {
@@ -475,8 +555,7 @@ http_server_url(http_parser *p, const char *at, size_t length)
   if(hr == NULL || hr->hr_header_err)
     return 0;
 
-  if(!balloc_append_data(&hr->hr_bumpalloc, at, length,
-                         (void **)&hr->hr_url, NULL)) {
+  if(!arena_strappend(&hr->hr_arena, &hr->hr_url, at, length)) {
     hr->hr_header_err = HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE;
   }
   return 0;
@@ -484,10 +563,9 @@ http_server_url(http_parser *p, const char *at, size_t length)
 
 __attribute__((noinline))
 static int
-header_append(http_request_t *hr, const char *str, size_t len, void **p)
+header_append(http_request_t *hr, const char *str, size_t len, char **p)
 {
-  void *x = balloc_append_data(&hr->hr_bumpalloc, str, len, p, NULL);
-  if(x == NULL)
+  if(arena_strappend(&hr->hr_arena, p, str, len) == NULL)
     hr->hr_header_err = HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE;
   return 0;
 }
@@ -497,42 +575,42 @@ static int
 header_host(void *opaque, const char *str, size_t len)
 {
   http_request_t *hr = opaque;
-  return header_append(hr, str, len, (void **)&hr->hr_host);
+  return header_append(hr, str, len, &hr->hr_host);
 }
 
 static int
 header_sec_websocket_key(void *opaque, const char *str, size_t len)
 {
   http_request_t *hr = opaque;
-  return header_append(hr, str, len, (void **)&hr->hr_wskey);
+  return header_append(hr, str, len, &hr->hr_wskey);
 }
 
 static int
 header_content_type(void *opaque, const char *str, size_t len)
 {
   http_request_t *hr = opaque;
-  return header_append(hr, str, len, (void **)&hr->hr_content_type);
+  return header_append(hr, str, len, &hr->hr_content_type);
 }
 
 static int
 header_connection(void *opaque, const char *str, size_t len)
 {
   http_request_t *hr = opaque;
-  return header_append(hr, str, len, (void **)&hr->hr_connection);
+  return header_append(hr, str, len, &hr->hr_connection);
 }
 
 static int
 header_upgrade(void *opaque, const char *str, size_t len)
 {
   http_request_t *hr = opaque;
-  return header_append(hr, str, len, (void **)&hr->hr_upgrade);
+  return header_append(hr, str, len, &hr->hr_upgrade);
 }
 
 static int
 header_sec_websocket_protocol(void *opaque, const char *str, size_t len)
 {
   http_request_t *hr = opaque;
-  return header_append(hr, str, len, (void **)&hr->hr_wsproto);
+  return header_append(hr, str, len, &hr->hr_wsproto);
 }
 
 static const http_header_callback_t server_headers[] = {
@@ -600,10 +678,15 @@ http_server_body(http_parser *p, const char *at, size_t length)
   if(hr == NULL || hr->hr_header_err)
     return 0;
 
-  if(!balloc_append_data(&hr->hr_bumpalloc, at, length,
-                         &hr->hr_body, &hr->hr_body_size)) {
+  uint8_t *body = arena_realloc(&hr->hr_arena, hr->hr_body,
+                                hr->hr_body_size, hr->hr_body_size + length);
+  if(body == NULL) {
     hr->hr_header_err = HTTP_STATUS_PAYLOAD_TOO_LARGE;
+    return 0;
   }
+  memcpy(body + hr->hr_body_size, at, length);
+  hr->hr_body = body;
+  hr->hr_body_size += length;
 
   return 0;
 }
@@ -707,7 +790,8 @@ http_server_message_complete(http_parser *p)
 
   http_process_request(hr, hc);
   hc->hc_payload = NULL;
-  free(hr);
+  hc->hc_request = 0;
+  http_request_free(hr);
   http_timer_arm(hc, &g_http_server, 5);
   return 0;
 }
@@ -745,7 +829,12 @@ http_connection_shutdown(http_connection_t *hc, http_server_t *hs,
   free(hc->hc_ctrl);
   hc->hc_ctrl = NULL;
 
-  free(hc->hc_payload);
+  if(hc->hc_request) {
+    http_request_free(hc->hc_payload);
+    hc->hc_request = 0;
+  } else {
+    free(hc->hc_payload);
+  }
   hc->hc_payload = NULL;
 }
 
@@ -776,11 +865,11 @@ static http_connection_t *
 http_connection_create(enum http_parser_type type,
                        const http_parser_settings *parser_settings)
 {
-  http_connection_t *hc = xalloc(sizeof(http_connection_t), 0, MEM_MAY_FAIL);
+  http_connection_t *hc = kmem_cache_alloc(&http_connection_cache,
+                                           MEM_MAY_FAIL | MEM_CLEAR);
   if(hc == NULL)
     return NULL;
 
-  memset(hc, 0, sizeof(http_connection_t));
   hc->hc_parser_settings = parser_settings;
   atomic_set(&hc->hc_refcount, 1);
 
@@ -866,7 +955,7 @@ http_thread(void *arg)
   mutex_lock(&hs->hs_mutex);
 
   while(1) {
-    timer_t *t = LIST_FIRST(&hs->hs_timers);
+    const uint64_t next = timer_list_next(&hs->hs_timers);
 
     if(hs->hs_update_pollset) {
       hs->hs_update_pollset = 0;
@@ -874,7 +963,7 @@ http_thread(void *arg)
     }
 
     int idx = poll(hs->hs_pollset, MAX_HTTP_SERVER_CONNECTIONS + 1,
-                   &hs->hs_mutex, t != NULL ? t->t_expire : INT64_MAX);
+                   &hs->hs_mutex, next ? next : INT64_MAX);
 
     mutex_unlock(&hs->hs_mutex);
     if(idx >= 0 && idx < MAX_HTTP_SERVER_CONNECTIONS) {
@@ -937,7 +1026,7 @@ http_accept(stream_t *s)
 
   error_t err = http_connection_link(hc);
   if(err)
-    free(hc);
+    kmem_cache_free(&http_connection_cache, hc);
 
   return err;
 }
@@ -1083,8 +1172,8 @@ http_request_accept_websocket(http_request_t *hr,
   SHA1Update(&shactx, (const void *)hr->hr_wskey, strlen(hr->hr_wskey));
   SHA1Update(&shactx, (const void *)WSGUID, strlen(WSGUID));
 
-  uint8_t *digest = balloc_alloc(&hr->hr_bumpalloc, 20);
-  char *sig = balloc_alloc(&hr->hr_bumpalloc, 64);
+  uint8_t *digest = arena_alloc(&hr->hr_arena, 20);
+  char *sig = arena_alloc(&hr->hr_arena, 64);
   if(digest == NULL || sig == NULL) {
     return HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE;
   }
@@ -1160,7 +1249,7 @@ http_websocket_create(int (*cb)(void *opaque,
 
   stream_t *sk = tcp_create_socket(name, 2048, 2048);
   if(sk == NULL) {
-    free(hc);
+    kmem_cache_free(&http_connection_cache, hc);
     return NULL;
   }
 
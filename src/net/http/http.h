@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <mios/mios.h>
+#include <mios/arena.h>
 #include <mios/bumpalloc.h>
 #include <sys/queue.h>
 
@@ -37,7 +38,7 @@ typedef struct http_request {
 
   http_connection_t *hr_hc;
 
-  balloc_t hr_bumpalloc;
+  arena_t hr_arena;  // Everything above is allocated from here
 
 } http_request_t;
 
@@ -119,7 +119,7 @@ ipv4_nexthop_resolve(uint32_t addr)
   if(ni == NULL)
     return NULL;
 
-  nh = xalloc(sizeof(nexthop_t), 0, MEM_MAY_FAIL);
+  nh = kmem_cache_alloc(&nexthop_cache, MEM_MAY_FAIL);
   if(nh == NULL)
     return NULL;
 
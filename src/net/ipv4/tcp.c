@@ -1,4 +1,5 @@
 #include "tcp.h"
+#include "tcp_cc.h"
 
 #include <sys/param.h>
 #include <assert.h>
@@ -21,6 +22,8 @@
 #include <mios/eventlog.h>
 #include <mios/cli.h>
 #include <mios/align.h>
+#include <mios/kmem.h>
+#include <mios/bytestream.h>
 
 #define TCP_EVENT_CONNECT  0x1
 #define TCP_EVENT_CLOSE    0x2
@@ -36,11 +39,30 @@
  *  Computing TCP's Retransmission Timer
  *          https://datatracker.ietf.org/doc/html/rfc6298
  *
+ *  TCP Selective Acknowledgment Options
+ *          https://datatracker.ietf.org/doc/html/rfc2018
+ *
+ *  A Conservative Loss Recovery Algorithm Based on SACK for TCP
+ *          https://datatracker.ietf.org/doc/html/rfc6675
+ *
+ *  TCP Congestion Control
+ *          https://datatracker.ietf.org/doc/html/rfc5681
+ *
+ *  The NewReno Modification to TCP's Fast Recovery Algorithm
+ *          https://datatracker.ietf.org/doc/html/rfc6582
+ *
  */
 
 
 #define TCP_KEEPALIVE_INTERVAL 10000 // ms
 #define TCP_TIMEOUT_INTERVAL   21000 // ms
+
+#define TCP_RTO_INITIAL 250    // ms
+#define TCP_RTO_MIN     200    // ms
+#define TCP_RTO_MAX     60000  // ms
+
+// A ts_recent older than this is no longer used for PAWS (RFC 7323 5.5)
+#define TCP_PAWS_IDLE (24ULL * 86400 * 1000000) // µs
 #define TCP_TIMEOUT_HANDSHAKE   5000 // ms
 
 #define TCP_STATE_CLOSED       0
@@ -55,18 +77,43 @@
 #define TCP_STATE_CLOSE_WAIT   9
 #define TCP_STATE_LAST_ACK     10
 
+#define TCP_CA_OPEN     0  // Normal operation
+#define TCP_CA_RECOVERY 1  // Fast recovery after duplicate ACKs / SACK
+#define TCP_CA_LOSS     2  // Recovery after retransmission timeout
+
+// Number of SACK blocks we keep track of for data the peer has
+// SACKed. Four blocks is also the most that fit in the option space
+// of a segment
+#define TCP_SACK_BLOCKS 4
+
+// Number of disjoint out-of-order ranges we hold in the RX FIFO per
+// connection. Out-of-order segments that would need more are dropped.
+// Only the first TCP_SACK_BLOCKS ranges are reported to the peer
+#ifndef TCP_OOO_RANGES
+#define TCP_OOO_RANGES 8
+#endif
+
+typedef struct tcp_seq_range {
+  uint32_t start;
+  uint32_t end;   // Exclusive
+} tcp_seq_range_t;
+
 LIST_HEAD(tcb_list, tcb);
 
 static struct tcb_list tcbs;
 static mutex_t tcbs_mutex = MUTEX_INITIALIZER("tcp");
 
+static const tcp_cc_ops_t *tcp_cc_default = &tcp_cc_newreno;
+
 typedef struct tcb {
 
   stream_t tcb_stream;
 
   net_task_t tcb_task;
 
-  LIST_ENTRY(tcb) tcb_link;
+  LIST_ENTRY(tcb) tcb_link;       // All connections (tcbs)
+  LIST_ENTRY(tcb) tcb_hash_link;  // Demux bucket
+  uint32_t tcb_hash;
 
   uint8_t tcb_state;
   uint8_t tcb_app_closed;
@@ -88,6 +135,29 @@ typedef struct tcb {
   uint8_t tcb_wnd_scale_ok;
   uint8_t tcb_snd_wnd_shift;
 
+  // RFC 2018 SACK. sack_ok is set if the peer sent SACK-permitted in
+  // its SYN. snd_sacked is the scoreboard of data above snd.una the
+  // peer has told us it holds, sorted by sequence. rcv_ooo is data we
+  // have stored in the RX FIFO beyond rcv.nxt (also sorted), reported
+  // back to the peer as SACK blocks. The out-of-order data is held
+  // even if SACK is not in use
+  uint8_t tcb_sack_ok;
+  uint8_t tcb_snd_sacked_count;
+  uint8_t tcb_rcv_ooo_count;
+  tcp_seq_range_t tcb_snd_sacked[TCP_SACK_BLOCKS];
+  tcp_seq_range_t tcb_rcv_ooo[TCP_OOO_RANGES];
+  uint32_t tcb_snd_high_rxt;   // Holes below this are already retransmitted
+  uint32_t tcb_rcv_ooo_recent; // Start of most recent out-of-order segment
+  uint32_t tcb_rcv_ooo_fin_seq; // Sequence of a FIN beyond a hole
+  uint8_t tcb_rcv_ooo_fin;
+
+  // Congestion control
+  const tcp_cc_ops_t *tcb_cc_ops;
+  tcp_cc_t tcb_cc;
+  uint32_t tcb_recover;        // snd.nxt when loss recovery started
+  uint8_t tcb_ca_state;        // TCP_CA_*
+  uint8_t tcb_dupacks;
+
   struct {
     uint32_t wrptr; // Unsent (Enqueued by stream but not yet processed by TCP)
     uint32_t nxt;   // Next to send
@@ -118,13 +188,37 @@ typedef struct tcb {
   uint32_t tcb_txfifo_size; // Must be power of 2
   uint32_t tcb_rxfifo_size; // Must be power of 2
 
+  // Zero-copy TX, see tcp_stream_write_pbuf(). Payload buffers for
+  // [txq_seq, txq_seq + txq_bytes) are held here until acknowledged.
+  // When not empty, the queue always extends to snd.wrptr (plain
+  // writes are copied into pbufs rather than the FIFO). The queued
+  // bytes still count towards the FIFO fill level
+  struct pbuf_queue tcb_txq;
+  uint32_t tcb_txq_seq;
+  uint32_t tcb_txq_bytes;
+  uint8_t tcb_txq_tail_copy;
+
   timer_t tcb_rtx_timer;
   timer_t tcb_delayed_ack_timer;
   timer_t tcb_time_wait_timer;
 
-  int tcb_rto;  // in ms
-  int tcb_srtt;
-  int tcb_rttvar;
+  int tcb_rto;     // in ms
+  int tcb_srtt;    // in µs, 0 until we have the first sample
+  int tcb_rttvar;  // in µs
+
+  // RFC 7323 timestamps. ts_ok is set if both SYNs carried TSopt.
+  // ts_recent is the peer's TSval we echo back and check PAWS against.
+  // last_ack_sent is the rcv.nxt we last told the peer about
+  uint8_t tcb_ts_ok;
+  uint32_t tcb_ts_recent;
+  uint64_t tcb_ts_recent_time;
+  uint32_t tcb_last_ack_sent;
+
+  // Without timestamps one segment at a time is timed. rtt_start is 0
+  // when nothing is being timed. Timing is abandoned if the segment is
+  // retransmitted (Karn's algorithm)
+  uint32_t tcb_rtt_seq;
+  uint64_t tcb_rtt_start;
 
   uint64_t tcb_tx_bytes;
   uint64_t tcb_rx_bytes;
@@ -134,8 +228,16 @@ typedef struct tcb {
   uint32_t tcb_timo;
 
   const char *tcb_name;
+  kmem_cache_t *tcb_cache;  // One per distinct fifo configuration
 
   uint32_t tcb_rtx_drop;
+  uint32_t tcb_sack_rtx_segs;
+  uint32_t tcb_fast_rtx;
+  uint32_t tcb_rto_count;
+  uint32_t tcb_paws_drops;
+  uint32_t tcb_ooo_held;     // Out-of-order segments stored
+  uint32_t tcb_ooo_dropped;  // ... and dropped for lack of ranges
+  uint64_t tcb_ooo_merged;   // Bytes pulled in when gaps were filled
 
   task_waitable_t tcb_rx_waitq;
   task_waitable_t tcb_tx_waitq;
@@ -163,7 +265,9 @@ __attribute__((unused))
 static uint32_t
 tcb_txfifo_avail(const tcb_t *tcb)
 {
-  return tcb->tcb_txfifo_size - tcb_txfifo_used(tcb);
+  // Zero-copy writes may take us beyond the FIFO size
+  const uint32_t used = tcb_txfifo_used(tcb);
+  return used < tcb->tcb_txfifo_size ? tcb->tcb_txfifo_size - used : 0;
 }
 
 static inline uint8_t *
@@ -220,9 +324,71 @@ ltow_memcpy(uint8_t *fifo, const uint8_t *src,
 }
 
 
+static inline int
+seq_lt(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) < 0;
+}
+
+static inline int
+seq_leq(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) <= 0;
+}
+
+
+/*
+ * Add [start, end) to a sorted set of at most 'max' sequence ranges,
+ * merging it with any ranges it overlaps or touches. Returns -1 (and
+ * leaves the set untouched) if a new range is needed but the set is
+ * full
+ */
+static int
+tcp_range_add(tcp_seq_range_t *r, uint8_t *countp, int max,
+              uint32_t start, uint32_t end)
+{
+  const int n = *countp;
+  int i = 0;
+  while(i < n && seq_lt(r[i].end, start))
+    i++;
+
+  int j = i;
+  while(j < n && seq_leq(r[j].start, end)) {
+    if(seq_lt(r[j].start, start))
+      start = r[j].start;
+    if(seq_lt(end, r[j].end))
+      end = r[j].end;
+    j++;
+  }
+
+  if(i == j) {
+    if(n == max)
+      return -1;
+    memmove(r + i + 1, r + i, (n - i) * sizeof(tcp_seq_range_t));
+    *countp = n + 1;
+  } else {
+    memmove(r + i + 1, r + j, (n - j) * sizeof(tcp_seq_range_t));
+    *countp = n - (j - i - 1);
+  }
+  r[i].start = start;
+  r[i].end = end;
+  return 0;
+}
+
+
+static void
+tcp_range_pop(tcp_seq_range_t *r, uint8_t *countp)
+{
+  (*countp)--;
+  memmove(r, r + 1, *countp * sizeof(tcp_seq_range_t));
+}
+
+
 
 #define TCP_PBUF_HEADROOM (16 + sizeof(ipv4_header_t) + sizeof(tcp_hdr_t))
 
+#define TCP_OPTIONS_MAX 40
+
 static void tcp_close(tcb_t *tcb, const char *reason);
 
 static const char *tcp_state_to_str(int state);
@@ -315,59 +481,240 @@ tcp_output_tcb(tcb_t *tcb, pbuf_t *pb, const char *why)
   th->src_port = tcb->tcb_local_port;
   th->dst_port = tcb->tcb_remote_port;
   th->ack = htonl(tcb->tcb_rcv.nxt);
+  tcb->tcb_last_ack_sent = tcb->tcb_rcv.nxt;
 
   uint32_t rcv_wnd = tcb_rxfifo_avail(tcb);
   th->wnd = htons(MIN(rcv_wnd, 65535));
 
+  return tcp_output(pb, tcb->tcb_local_addr, tcb->tcb_remote_addr);
+}
+
+
+// Our TSval clock ticks in milliseconds
+static uint32_t
+tcp_ts_now(void)
+{
+  return clock_get() / 1000;
+}
+
+
+static void
+tcp_add_ts_option(tcb_t *tcb, pbuf_t *pb)
+{
+  uint8_t *ts = pbuf_append(pb, 12);
+  ts[0] = 1;   // NOP
+  ts[1] = 1;   // NOP
+  ts[2] = 8;   // kind = Timestamps
+  ts[3] = 10;  // length
+  wr32_be(ts + 4, tcp_ts_now());
+  wr32_be(ts + 8, tcb->tcb_ts_recent);
+}
+
+
+/*
+ * Append options to a segment that so far only holds the TCP header
+ * (with th->flg already set) and set the data offset accordingly.
+ * Must be done before any payload is added
+ */
+static void
+tcp_add_options(tcb_t *tcb, pbuf_t *pb)
+{
+  tcp_hdr_t *th = pbuf_data(pb, 0);
+
   if(th->flg & TCP_F_SYN) {
     uint8_t *opts = pbuf_append(pb, 4);
     opts[0] = 2;
     opts[1] = 4;
     opts[2] = tcb->tcb_rcv.mss >> 8;
     opts[3] = tcb->tcb_rcv.mss;
-    int opt_words = 1;
-
-    // Include RFC 7323 WSopt. For SYN-ACK we only include it if the
-    // peer's SYN also had one (tcb_wnd_scale_ok was set by
-    // tcp_parse_options). For a pure SYN (active open) we always
-    // include it — peer will mirror it if supported. Pad with a NOP to
-    // keep the options 4-byte aligned.
-    int send_wsopt;
-    if(th->flg & TCP_F_ACK)
-      send_wsopt = tcb->tcb_wnd_scale_ok;
-    else
-      send_wsopt = 1;
 
-    if(send_wsopt) {
+    // Include RFC 7323 WSopt and RFC 2018 SACK-permitted. For SYN-ACK
+    // we only include them if the peer's SYN also had them. For a pure
+    // SYN (active open) we always include them — peer will mirror them
+    // if supported. Pad with NOPs to keep the options 4-byte aligned.
+    const int syn_ack = !!(th->flg & TCP_F_ACK);
+
+    if(!syn_ack || tcb->tcb_wnd_scale_ok) {
       uint8_t *ws = pbuf_append(pb, 4);
       ws[0] = 1;   // NOP (4-byte alignment)
       ws[1] = 3;   // kind = Window Scale
       ws[2] = 3;   // length
       ws[3] = 0;   // our shift — 0, since our RX FIFO is small enough
                    // that the 16-bit wnd field covers it without scaling
-      opt_words++;
     }
 
-    th->off = ((sizeof(tcp_hdr_t) >> 2) + opt_words) << 4;
-  } else {
-    th->off = (sizeof(tcp_hdr_t) >> 2) << 4;
+    if(!syn_ack || tcb->tcb_sack_ok) {
+      uint8_t *sp = pbuf_append(pb, 4);
+      sp[0] = 1;   // NOP
+      sp[1] = 1;   // NOP
+      sp[2] = 4;   // kind = SACK-permitted
+      sp[3] = 2;   // length
+    }
+
+    // RFC 7323 Timestamps. TSecr is zero in a pure SYN
+    if(!syn_ack || tcb->tcb_ts_ok)
+      tcp_add_ts_option(tcb, pb);
+
+    th->off = (pb->pb_pktlen >> 2) << 4;
+    return;
   }
 
-  return tcp_output(pb, tcb->tcb_local_addr, tcb->tcb_remote_addr);
+  // Once negotiated, timestamps go in every segment (RFC 7323 3.2)
+  if(tcb->tcb_ts_ok)
+    tcp_add_ts_option(tcb, pb);
+
+  if(tcb->tcb_sack_ok && tcb->tcb_rcv_ooo_count) {
+    // Report the out-of-order data we hold. The block containing the
+    // most recently received segment must come first (RFC 2018 4).
+    // With timestamps there's only room for three blocks
+    const int count = tcb->tcb_rcv_ooo_count;
+    const int n = MIN(count, tcb->tcb_ts_ok ? 3 : 4);
+    uint8_t *opts = pbuf_append(pb, 4 + n * 8);
+    opts[0] = 1;
+    opts[1] = 1;
+    opts[2] = 5;
+    opts[3] = 2 + n * 8;
+
+    int first = 0;
+    for(int i = 0; i < count; i++) {
+      const tcp_seq_range_t *r = &tcb->tcb_rcv_ooo[i];
+      if(seq_leq(r->start, tcb->tcb_rcv_ooo_recent) &&
+         seq_lt(tcb->tcb_rcv_ooo_recent, r->end)) {
+        first = i;
+        break;
+      }
+    }
+
+    uint8_t *o = opts + 4;
+    wr32_be(o, tcb->tcb_rcv_ooo[first].start);
+    wr32_be(o + 4, tcb->tcb_rcv_ooo[first].end);
+    o += 8;
+    for(int i = 0; i < count && o < opts + 4 + n * 8; i++) {
+      if(i == first)
+        continue;
+      wr32_be(o, tcb->tcb_rcv_ooo[i].start);
+      wr32_be(o + 4, tcb->tcb_rcv_ooo[i].end);
+      o += 8;
+    }
+  }
+
+  th->off = (pb->pb_pktlen >> 2) << 4;
 }
 
 
-static error_t
-tcp_emit(tcb_t *tcb, pbuf_t *pb, uint32_t seq, int gen_ack, const char *why)
+// Max payload per segment, before subtracting options
+static uint32_t
+tcp_snd_mss(const tcb_t *tcb)
 {
+  return MIN(1460, tcb->tcb_max_segment_size);
+}
+
+
+/*
+ * Estimate of bytes actually in the network (RFC 6675 'pipe'). SACKed
+ * data has left the network and so has data in holes we consider lost
+ * but haven't retransmitted yet. After a timeout everything that
+ * hasn't been retransmitted is presumed lost.
+ */
+static uint32_t
+tcp_pipe(const tcb_t *tcb)
+{
+  const uint32_t una = tcb->tcb_snd.una;
+  const uint32_t high_rxt = seq_lt(una, tcb->tcb_snd_high_rxt) ?
+    tcb->tcb_snd_high_rxt : una;
+
+  if(tcb->tcb_ca_state == TCP_CA_LOSS) {
+    return (high_rxt - una) + (tcb->tcb_snd.nxt - tcb->tcb_recover);
+  }
+
+  const tcp_seq_range_t *r = tcb->tcb_snd_sacked;
+  const int n = tcb->tcb_snd_sacked_count;
+  uint32_t sacked_above = 0;
+  for(int i = 0; i < n; i++)
+    sacked_above += r[i].end - r[i].start;
+
+  uint32_t pipe = tcb->tcb_snd.nxt - una - sacked_above;
+
+  uint32_t seq = una;
+  for(int i = 0; i < n && sacked_above > 2 * tcb->tcb_cc.mss; i++) {
+    const uint32_t from = seq_lt(seq, high_rxt) ? high_rxt : seq;
+    if(seq_lt(from, r[i].start))
+      pipe -= r[i].start - from;
+    sacked_above -= r[i].end - r[i].start;
+    seq = r[i].end;
+  }
+  return pipe;
+}
+
+
+/*
+ * How much new data we may send, limited by both the peer's receive
+ * window and the congestion window
+ */
+static uint32_t
+tcp_snd_room(const tcb_t *tcb)
+{
+  const uint32_t in_flight = tcb->tcb_snd.nxt - tcb->tcb_snd.una;
+  const uint32_t wnd_room = tcb->tcb_snd.wnd > in_flight ?
+    tcb->tcb_snd.wnd - in_flight : 0;
+
+  const uint32_t pipe = tcp_pipe(tcb);
+  const uint32_t cwnd_room = tcb->tcb_cc.cwnd > pipe ?
+    tcb->tcb_cc.cwnd - pipe : 0;
+
+  return MIN(wnd_room, cwnd_room);
+}
+
+
+static int
+tcp_txq_covers(const tcb_t *tcb, uint32_t seq)
+{
+  return tcb->tcb_txq_bytes && seq_leq(tcb->tcb_txq_seq, seq) &&
+    seq_lt(seq, tcb->tcb_txq_seq + tcb->tcb_txq_bytes);
+}
+
+
+/*
+ * Send a segment starting at 'seq' with data from the TX FIFO (or the
+ * zero-copy queue) up to (but not including) 'end'. A segment never
+ * mixes data from the two.
+ *
+ * Returns number of payload bytes sent or a negative error
+ */
+static int
+tcp_emit_range(tcb_t *tcb, pbuf_t *pb, uint32_t seq, uint32_t end,
+               int gen_ack, const char *why)
+{
+  uint32_t bytes_in_fifo = end - seq;
+
+  // Honor the receiver's advertised send window and our congestion
+  // window. Only applies when we're sending fresh data (seq ==
+  // snd.nxt); retransmits (seq < snd.nxt) re-send data that was
+  // already inside the window when it was first transmitted and are
+  // paced by the loss recovery code.
+  if(seq == tcb->tcb_snd.nxt) {
+    bytes_in_fifo = MIN(bytes_in_fifo, tcp_snd_room(tcb));
+  }
+
+  // Payload from the zero-copy queue is chained after the header
+  const int zero_copy = tcp_txq_covers(tcb, seq);
+
   if(pb == NULL) {
-    pb = pbuf_make(TCP_PBUF_HEADROOM, 0);
+    // Size hint covers a full segment, or just options for SYN/ACK/FIN
+    const size_t payload =
+      bytes_in_fifo > 1 && !tcb->tcb_pending_syn && !zero_copy ?
+      MIN(bytes_in_fifo, tcp_snd_mss(tcb)) + TCP_OPTIONS_MAX :
+      TCP_OPTIONS_MAX;
+    pb = pbuf_make_sized(TCP_PBUF_HEADROOM, payload, 0);
     if(pb == NULL) {
       return ERR_NO_BUFFER;
     }
   } else {
     // Recycle packet
-    pbuf_reset(pb, TCP_PBUF_HEADROOM, 0);
+    if(pbuf_reset(pb, TCP_PBUF_HEADROOM, 0)) {
+      pbuf_free(pb);
+      return ERR_NO_BUFFER;
+    }
   }
 
   pb = pbuf_prepend(pb, sizeof(tcp_hdr_t), 0, 0);
@@ -379,23 +726,11 @@ tcp_emit(tcb_t *tcb, pbuf_t *pb, uint32_t seq, int gen_ack, const char *why)
 
   tcp_hdr_t *th = pbuf_data(pb, 0);
 
-  uint32_t bytes_in_fifo = tcb->tcb_snd.wrptr - seq;
-
-  // Honor the receiver's advertised send window. Only applies when
-  // we're sending fresh data (seq == snd.nxt); retransmits (seq ==
-  // snd.una) re-send data that was already inside the window when it
-  // was first transmitted and don't need re-checking.
-  if(seq == tcb->tcb_snd.nxt) {
-    uint32_t in_flight = tcb->tcb_snd.nxt - tcb->tcb_snd.una;
-    uint32_t wnd_room = tcb->tcb_snd.wnd > in_flight
-                          ? tcb->tcb_snd.wnd - in_flight : 0;
-    bytes_in_fifo = MIN(bytes_in_fifo, wnd_room);
-  }
-
   if(tcb->tcb_pending_syn) {
     // If we have a pending SYN it's the only thing we may send
     th->flg = tcb->tcb_pending_syn;
     th->seq = htonl(tcb->tcb_iss);
+    tcp_add_options(tcb, pb);
     return tcp_output_tcb(tcb, pb, "pending-syn");
 
   } else if(!bytes_in_fifo) {
@@ -403,13 +738,14 @@ tcp_emit(tcb_t *tcb, pbuf_t *pb, uint32_t seq, int gen_ack, const char *why)
     if(gen_ack) {
       th->flg = TCP_F_ACK;
       th->seq = htonl(seq);
+      tcp_add_options(tcb, pb);
       return tcp_output_tcb(tcb, pb, "empty_ack");
     } else {
       pbuf_free(pb);
     }
     return 0;
 
-  } else if(tcb->tcb_pending_fin) {
+  } else if(tcb->tcb_pending_fin && end == tcb->tcb_snd.wrptr) {
 
     if(bytes_in_fifo == 1) {
       // We only have the last FIN left
@@ -419,6 +755,7 @@ tcp_emit(tcb_t *tcb, pbuf_t *pb, uint32_t seq, int gen_ack, const char *why)
       if(tcb->tcb_snd.nxt != tcb->tcb_snd.wrptr)
         tcb->tcb_snd.nxt = tcb->tcb_snd.wrptr;
 
+      tcp_add_options(tcb, pb);
       return tcp_output_tcb(tcb, pb, "fin");
     } else {
       bytes_in_fifo--;
@@ -426,18 +763,49 @@ tcp_emit(tcb_t *tcb, pbuf_t *pb, uint32_t seq, int gen_ack, const char *why)
 
   }
 
+  if(zero_copy) {
+    bytes_in_fifo = MIN(bytes_in_fifo,
+                        tcb->tcb_txq_seq + tcb->tcb_txq_bytes - seq);
+  } else if(tcb->tcb_txq_bytes && seq_lt(seq, tcb->tcb_txq_seq)) {
+    bytes_in_fifo = MIN(bytes_in_fifo, tcb->tcb_txq_seq - seq);
+  }
+
   uint32_t seq0 = seq;
 
   pbuf_t *p = pb;
 
   th->flg = TCP_F_PSH | TCP_F_ACK;
   th->seq = htonl(seq);
+  tcp_add_options(tcb, pb);
   int total = 0;
 
-  size_t max_pkt_size = 1460 + sizeof(tcp_hdr_t);
+  // Options eat into the segment size
+  size_t max_pkt_size = tcp_snd_mss(tcb) + sizeof(tcp_hdr_t);
+
+  if(zero_copy) {
+    const size_t len = MIN(bytes_in_fifo, max_pkt_size - pb->pb_pktlen);
+    pbuf_t *data = pbuf_clone_range(STAILQ_FIRST(&tcb->tcb_txq),
+                                    seq - tcb->tcb_txq_seq, len, 0);
+    if(data == NULL) {
+      pbuf_free(pb);
+      return ERR_NO_BUFFER;
+    }
+    total = data->pb_pktlen;
+    pb->pb_pktlen += total;
+    data->pb_flags &= ~PBUF_SOP;
+    data->pb_pktlen = 0;
+    while(p->pb_next)
+      p = p->pb_next;
+    p->pb_flags &= ~PBUF_EOP;
+    p->pb_next = data;
+    seq += total;
+    bytes_in_fifo = 0;
+  }
+
+  size_t data_size = pbuf_data_size(p->pb_data);
 
   while(bytes_in_fifo && pb->pb_pktlen < max_pkt_size) {
-    if(p->pb_offset + p->pb_buflen == PBUF_DATA_SIZE) {
+    if(p->pb_offset + p->pb_buflen == data_size) {
       pbuf_t *n = pbuf_make(0, 0);
 
       if(n == NULL)
@@ -447,8 +815,9 @@ tcp_emit(tcb_t *tcb, pbuf_t *pb, uint32_t seq, int gen_ack, const char *why)
       n->pb_flags = PBUF_EOP;
       p->pb_next = n;
       p = n;
+      data_size = pbuf_data_size(p->pb_data);
     }
-    size_t avail_in_pbuf = PBUF_DATA_SIZE - p->pb_offset - p->pb_buflen;
+    size_t avail_in_pbuf = data_size - p->pb_offset - p->pb_buflen;
     size_t to_copy = MIN(bytes_in_fifo, avail_in_pbuf);
     to_copy = MIN(max_pkt_size - pb->pb_pktlen, to_copy);
 
@@ -470,10 +839,79 @@ tcp_emit(tcb_t *tcb, pbuf_t *pb, uint32_t seq, int gen_ack, const char *why)
   if(tcb->tcb_snd.nxt == seq0) {
     tcb->tcb_snd.nxt += total;
     tcb->tcb_tx_bytes += total;
+    if(!tcb->tcb_ts_ok && !tcb->tcb_rtt_start) {
+      tcb->tcb_rtt_seq = tcb->tcb_snd.nxt;
+      tcb->tcb_rtt_start = clock_get();
+    }
   } else {
     tcb->tcb_rtx_bytes += total;
+    if(seq_lt(seq0, tcb->tcb_rtt_seq))
+      tcb->tcb_rtt_start = 0;
   }
-  return 0;
+  return total;
+}
+
+
+static error_t
+tcp_emit(tcb_t *tcb, pbuf_t *pb, uint32_t seq, int gen_ack, const char *why)
+{
+  const int r = tcp_emit_range(tcb, pb, seq, tcb->tcb_snd.wrptr, gen_ack, why);
+  return r < 0 ? r : 0;
+}
+
+
+/*
+ * Retransmit at most 'max_segs' segments of unacknowledged data below
+ * 'limit', skipping what the peer has SACKed, starting at snd.una (or
+ * where we left off). If 'lost_only' is set, only holes below a SACK
+ * block with more than two segments worth of data SACKed above them
+ * are resent (the IsLost() rule of RFC 6675 with DupThresh = 3)
+ */
+static int
+tcp_retransmit_holes(tcb_t *tcb, uint32_t limit, int max_segs, int lost_only)
+{
+  const uint32_t mss = tcp_snd_mss(tcb);
+  const int n = tcb->tcb_snd_sacked_count;
+  const tcp_seq_range_t *r = tcb->tcb_snd_sacked;
+  uint32_t seq = tcb->tcb_snd.una;
+  int sent = 0;
+
+  if(seq_lt(seq, tcb->tcb_snd_high_rxt))
+    seq = tcb->tcb_snd_high_rxt;
+
+  uint32_t sacked_above = 0;
+  for(int i = 0; i < n; i++)
+    sacked_above += r[i].end - r[i].start;
+
+  for(int i = 0; i <= n && sent < max_segs; i++) {
+
+    const uint32_t hole_end = i < n ? r[i].start : limit;
+
+    if(seq_lt(seq, hole_end)) {
+
+      if(lost_only && sacked_above <= 2 * mss)
+        break;
+
+      while(seq_lt(seq, hole_end) && sent < max_segs) {
+        const uint32_t end = seq_lt(seq + mss, hole_end) ?
+          seq + mss : hole_end;
+        const int len = tcp_emit_range(tcb, NULL, seq, end, 0, "ReTX");
+        if(len <= 0)
+          return sent;
+        seq += len;
+        tcb->tcb_snd_high_rxt = seq;
+        if(n)
+          tcb->tcb_sack_rtx_segs++;
+        sent++;
+      }
+    }
+    if(i < n) {
+      if(seq_lt(seq, r[i].end))
+        seq = r[i].end;
+      sacked_above -= r[i].end - r[i].start;
+    }
+  }
+  return sent;
 }
 
 
@@ -487,6 +925,8 @@ tcp_send_syn(tcb_t *tcb, uint8_t flags, pbuf_t *pb)
 
   tcb->tcb_pending_syn = flags;
   tcb->tcb_snd.nxt++;
+  tcb->tcb_rtt_seq = tcb->tcb_snd.nxt;
+  tcb->tcb_rtt_start = clock_get();
   tcp_emit(tcb, pb, tcb->tcb_snd.nxt, 0, "SYN");
 }
 
@@ -519,6 +959,175 @@ arm_rtx(tcb_t *tcb, uint64_t now)
 }
 
 
+static void
+tcp_cc_init(tcb_t *tcb)
+{
+  tcp_cc_t *cc = &tcb->tcb_cc;
+  const uint32_t mss = tcp_snd_mss(tcb);
+
+  cc->mss = mss;
+  // Initial window (RFC 5681 3.1)
+  cc->cwnd = mss > 2190 ? 2 * mss : mss > 1095 ? 3 * mss : 4 * mss;
+  cc->ssthresh = UINT32_MAX;
+
+  if(tcb->tcb_cc_ops->init != NULL)
+    tcb->tcb_cc_ops->init(cc);
+}
+
+
+static void
+tcp_fast_retransmit(tcb_t *tcb, uint64_t now)
+{
+  tcp_cc_t *cc = &tcb->tcb_cc;
+
+  tcb->tcb_cc_ops->loss(cc, tcb->tcb_snd.nxt - tcb->tcb_snd.una, now);
+  tcb->tcb_ca_state = TCP_CA_RECOVERY;
+  tcb->tcb_recover = tcb->tcb_snd.nxt;
+  tcb->tcb_snd_high_rxt = tcb->tcb_snd.una;
+  tcb->tcb_fast_rtx++;
+
+  if(tcb->tcb_snd_sacked_count) {
+    // SACKed data is not counted in the pipe so there is no need to
+    // inflate the window (RFC 6675)
+    cc->cwnd = cc->ssthresh;
+  } else {
+    // RFC 6582 3.2 step 2
+    cc->cwnd = cc->ssthresh + 3 * cc->mss;
+  }
+  tcp_retransmit_holes(tcb, tcb->tcb_snd.nxt, 1, 0);
+}
+
+
+/*
+ * Fill holes while in recovery, as far as the congestion window allows
+ */
+static void
+tcp_recovery_retransmit(tcb_t *tcb)
+{
+  const tcp_cc_t *cc = &tcb->tcb_cc;
+  const uint32_t pipe = tcp_pipe(tcb);
+  if(pipe >= cc->cwnd)
+    return;
+  const int segs = MAX((cc->cwnd - pipe) / cc->mss, 1);
+
+  if(tcb->tcb_ca_state == TCP_CA_LOSS) {
+    // Everything up to the recovery point is presumed lost
+    tcp_retransmit_holes(tcb, tcb->tcb_recover, segs, 0);
+  } else if(tcb->tcb_snd_sacked_count) {
+    const int n = tcb->tcb_snd_sacked_count;
+    tcp_retransmit_holes(tcb, tcb->tcb_snd_sacked[n - 1].end, segs, 1);
+  }
+}
+
+
+/*
+ * Congestion control part of ACK processing. 'acked' is number of
+ * newly acknowledged bytes, 'dupack' is set for duplicate ACKs
+ */
+static void
+tcp_cc_input(tcb_t *tcb, uint32_t acked, int dupack, uint64_t now)
+{
+  tcp_cc_t *cc = &tcb->tcb_cc;
+
+  if(acked)
+    tcb->tcb_dupacks = 0;
+  else if(dupack && tcb->tcb_dupacks < 255)
+    tcb->tcb_dupacks++;
+
+  switch(tcb->tcb_ca_state) {
+  case TCP_CA_OPEN:
+    if(acked) {
+      if(cc->cwnd < cc->ssthresh)
+        cc->cwnd += MIN(acked, 2 * cc->mss); // Slow start (RFC 3465 L=2)
+      else
+        tcb->tcb_cc_ops->cong_avoid(cc, acked, now, tcb->tcb_srtt / 1000);
+    }
+
+    // Don't react to duplicates of segments sent before the last
+    // recovery started (RFC 6582 4.1)
+    if(tcb->tcb_snd.una == tcb->tcb_snd.nxt ||
+       seq_lt(tcb->tcb_snd.una, tcb->tcb_recover))
+      break;
+
+    if(tcb->tcb_dupacks >= 3) {
+      tcp_fast_retransmit(tcb, now);
+    } else if(tcb->tcb_snd_sacked_count) {
+      // Enough data SACKed above snd.una to consider it lost
+      uint32_t sacked = 0;
+      for(int i = 0; i < tcb->tcb_snd_sacked_count; i++)
+        sacked += tcb->tcb_snd_sacked[i].end - tcb->tcb_snd_sacked[i].start;
+      if(sacked > 2 * cc->mss)
+        tcp_fast_retransmit(tcb, now);
+    }
+    break;
+
+  case TCP_CA_RECOVERY:
+  case TCP_CA_LOSS:
+    if(seq_leq(tcb->tcb_recover, tcb->tcb_snd.una)) {
+      // Full acknowledgement, recovery done (RFC 6582 3.2 step 3)
+      if(tcb->tcb_ca_state == TCP_CA_RECOVERY) {
+        const uint32_t flight = tcb->tcb_snd.nxt - tcb->tcb_snd.una;
+        cc->cwnd = MIN(cc->ssthresh, MAX(flight, cc->mss) + cc->mss);
+      }
+      tcb->tcb_ca_state = TCP_CA_OPEN;
+      tcb->tcb_dupacks = 0;
+      break;
+    }
+
+    if(tcb->tcb_ca_state == TCP_CA_LOSS) {
+      // Slow start from the loss window
+      if(acked)
+        cc->cwnd += MIN(acked, 2 * cc->mss);
+    } else if(!tcb->tcb_snd_sacked_count) {
+      if(acked) {
+        // Partial ACK: The segment at snd.una is lost as well. Deflate
+        // the window by what was acknowledged (RFC 6582 3.2 step 4)
+        cc->cwnd -= MIN(acked, cc->cwnd - cc->mss);
+        if(acked >= cc->mss)
+          cc->cwnd += cc->mss;
+        tcp_retransmit_holes(tcb, tcb->tcb_snd.nxt, 1, 0);
+      } else if(dupack) {
+        cc->cwnd += cc->mss;
+      }
+      break;
+    }
+    tcp_recovery_retransmit(tcb);
+    break;
+  }
+
+  if(tcb->tcb_snd.wrptr != tcb->tcb_snd.nxt)
+    net_task_raise(&tcb->tcb_task, TCP_EVENT_EMIT);
+}
+
+
+/*
+ * Retransmission timeout, collapse the window to one segment and
+ * resend from snd.una
+ */
+static void
+tcp_cc_timeout(tcb_t *tcb, uint64_t now)
+{
+  tcp_cc_t *cc = &tcb->tcb_cc;
+
+  // ssthresh is left alone if we time out again (RFC 5681 3.1)
+  if(tcb->tcb_ca_state != TCP_CA_LOSS)
+    tcb->tcb_cc_ops->loss(cc, tcb->tcb_snd.nxt - tcb->tcb_snd.una, now);
+
+  cc->cwnd = cc->mss;
+  tcb->tcb_ca_state = TCP_CA_LOSS;
+  tcb->tcb_recover = tcb->tcb_snd.nxt;
+  tcb->tcb_dupacks = 0;
+  tcb->tcb_rto_count++;
+
+  // The receiver is allowed to discard data it has SACKed, so after a
+  // timeout the scoreboard can't be trusted (RFC 2018 8). SACK blocks
+  // in the ACKs that follow will rebuild it
+  tcb->tcb_snd_sacked_count = 0;
+  tcb->tcb_snd_high_rxt = tcb->tcb_snd.una;
+  tcp_retransmit_holes(tcb, tcb->tcb_snd.wrptr, 1, 0);
+}
+
+
 static void
 tcp_rtx_cb(void *opaque, uint64_t now)
 {
@@ -536,13 +1145,14 @@ tcp_rtx_cb(void *opaque, uint64_t now)
     pb = NULL;
     if(tcb->tcb_state == TCP_STATE_ESTABLISHED) {
 
-      pb = pbuf_make(TCP_PBUF_HEADROOM, 0);
+      pb = pbuf_make_sized(TCP_PBUF_HEADROOM, TCP_OPTIONS_MAX, 0);
       if(pb != NULL) {
         pb = pbuf_prepend(pb, sizeof(tcp_hdr_t), 0, 0);
         if(pb != NULL) {
           tcp_hdr_t *th = pbuf_data(pb, 0);
           th->flg = TCP_F_ACK | TCP_F_PSH;
           th->seq = htonl(tcb->tcb_snd.una - 1);
+          tcp_add_options(tcb, pb);
         }
       }
     }
@@ -551,13 +1161,66 @@ tcp_rtx_cb(void *opaque, uint64_t now)
       tcp_output_tcb(tcb, pb, "ka");
 
   } else {
-    tcp_emit(tcb, NULL, tcb->tcb_snd.una, 0, "RTX");
+    // Back off and don't trust timing of what we resend (RFC 6298 5.5)
+    tcb->tcb_rto = MIN(tcb->tcb_rto * 2, TCP_RTO_MAX);
+    tcb->tcb_rtt_start = 0;
+
+    if(tcb->tcb_pending_syn || tcb->tcb_snd.una == tcb->tcb_snd.nxt) {
+      tcp_emit(tcb, NULL, tcb->tcb_snd.una, 0, "RTX");
+    } else {
+      tcp_cc_timeout(tcb, now);
+    }
   }
 
   arm_rtx(tcb, now);
 }
 
 
+/*
+ * Release zero-copy payload below snd.una
+ */
+static void
+tcp_txq_ack(tcb_t *tcb)
+{
+  if(!tcb->tcb_txq_bytes || !seq_lt(tcb->tcb_txq_seq, tcb->tcb_snd.una))
+    return;
+
+  uint32_t acked = MIN(tcb->tcb_snd.una - tcb->tcb_txq_seq,
+                       tcb->tcb_txq_bytes);
+
+  int q = irq_forbid(IRQ_LEVEL_SWITCH);
+  tcb->tcb_txq_seq += acked;
+  tcb->tcb_txq_bytes -= acked;
+
+  pbuf_t *pb;
+  while((pb = STAILQ_FIRST(&tcb->tcb_txq)) != NULL &&
+        (acked || !tcb->tcb_txq_bytes)) {
+    if(pb->pb_buflen > acked) {
+      pb->pb_offset += acked;
+      pb->pb_buflen -= acked;
+      break;
+    }
+    acked -= pb->pb_buflen;
+    STAILQ_REMOVE_HEAD(&tcb->tcb_txq, pb_link);
+    pb->pb_next = NULL;
+    pbuf_free(pb);
+  }
+  irq_permit(q);
+}
+
+
+static void
+tcp_txq_flush(tcb_t *tcb)
+{
+  int q = irq_forbid(IRQ_LEVEL_SWITCH);
+  pbuf_t *pb = STAILQ_FIRST(&tcb->tcb_txq);
+  STAILQ_INIT(&tcb->tcb_txq);
+  tcb->tcb_txq_bytes = 0;
+  irq_permit(q);
+  pbuf_free(pb);
+}
+
+
 static void
 tcp_ack(tcb_t *tcb, uint32_t count)
 {
@@ -566,6 +1229,16 @@ tcp_ack(tcb_t *tcb, uint32_t count)
 
   tcb->tcb_snd.una += count;
   tcb->tcb_pending_syn = 0;
+  tcp_txq_ack(tcb);
+
+  // Forget SACK blocks that are now cumulatively acknowledged
+  tcp_seq_range_t *r = tcb->tcb_snd_sacked;
+  while(tcb->tcb_snd_sacked_count && seq_leq(r[0].end, tcb->tcb_snd.una))
+    tcp_range_pop(r, &tcb->tcb_snd_sacked_count);
+  if(tcb->tcb_snd_sacked_count && seq_lt(r[0].start, tcb->tcb_snd.una))
+    r[0].start = tcb->tcb_snd.una;
+  if(seq_lt(tcb->tcb_snd_high_rxt, tcb->tcb_snd.una))
+    tcb->tcb_snd_high_rxt = tcb->tcb_snd.una;
   task_wakeup(&tcb->tcb_tx_waitq, 1);
   arm_rtx(tcb, tcb->tcb_last_rx);
 
@@ -586,16 +1259,105 @@ tcp_destroy(tcb_t *tcb)
   if(!tcb->tcb_app_closed)
     return;
 
-  free(tcb);
+  tcp_txq_flush(tcb);
+  kmem_cache_free(tcb->tcb_cache, tcb);
+}
+
+
+/*
+ * Connection demux
+ *
+ * Connections are hashed on (remote addr, remote port, local port)
+ * into a power-of-two sized bucket table. When there are more
+ * connections than buckets the table is doubled. Rehashing everything
+ * at once would stall packet processing, so instead the old table is
+ * kept around and each lookup or insert moves a few of its buckets
+ * over until it's empty. Lookups check both tables while this is
+ * going on. The table never shrinks.
+ *
+ * The hash is only accessed from the net thread so no locking is
+ * needed. tcbs_mutex protects the 'tcbs' list which is also walked by
+ * the CLI.
+ */
+
+#define TCB_HASH_INITIAL_BUCKETS 16
+#define TCB_HASH_MIGRATE_BUCKETS 2   // Per lookup/insert while resizing
+
+typedef struct tcb_hash {
+  struct tcb_list *th_buckets;
+  uint32_t th_mask;  // Number of buckets - 1
+} tcb_hash_t;
+
+static struct tcb_list tcb_hash_initial[TCB_HASH_INITIAL_BUCKETS];
+
+static tcb_hash_t tcb_hash_cur = {
+  tcb_hash_initial, TCB_HASH_INITIAL_BUCKETS - 1
+};
+static tcb_hash_t tcb_hash_old;      // Being drained into tcb_hash_cur
+static uint32_t tcb_hash_migrate_pos; // Next bucket in tcb_hash_old
+static uint32_t tcb_hash_count;
+
+static uint32_t
+tcb_hash_tuple(uint32_t remote_addr, uint16_t remote_port,
+               uint16_t local_port)
+{
+  // Mix the address before adding the ports, both are in network byte
+  // order so the low bits of each land in the same place otherwise
+  uint32_t h = remote_addr * 0x9e3779b1;
+  h ^= h >> 16;
+  h += (uint32_t)remote_port << 16 | local_port;
+  h *= 0x85ebca6b;
+  return h ^ (h >> 13);
+}
+
+
+static void
+tcb_hash_migrate(void)
+{
+  for(int i = 0; i < TCB_HASH_MIGRATE_BUCKETS; i++) {
+    struct tcb_list *b = &tcb_hash_old.th_buckets[tcb_hash_migrate_pos];
+    tcb_t *tcb;
+    while((tcb = LIST_FIRST(b)) != NULL) {
+      LIST_REMOVE(tcb, tcb_hash_link);
+      LIST_INSERT_HEAD(&tcb_hash_cur.th_buckets[tcb->tcb_hash &
+                                                tcb_hash_cur.th_mask],
+                       tcb, tcb_hash_link);
+    }
+
+    if(tcb_hash_migrate_pos++ == tcb_hash_old.th_mask) {
+      if(tcb_hash_old.th_buckets != tcb_hash_initial)
+        free(tcb_hash_old.th_buckets);
+      tcb_hash_old.th_buckets = NULL;
+      return;
+    }
+  }
+}
+
+
+static void
+tcb_hash_grow(void)
+{
+  const size_t buckets = (tcb_hash_cur.th_mask + 1) * 2;
+  struct tcb_list *b = xalloc(sizeof(struct tcb_list) * buckets, 0,
+                              MEM_MAY_FAIL | MEM_CLEAR);
+  if(b == NULL)
+    return; // Keep going with longer chains, we'll try again later
+
+  tcb_hash_old = tcb_hash_cur;
+  tcb_hash_migrate_pos = 0;
+  tcb_hash_cur.th_buckets = b;
+  tcb_hash_cur.th_mask = buckets - 1;
 }
 
 
 static tcb_t *
-tcb_find(uint32_t remote_addr, uint16_t remote_port, uint16_t local_port)
+tcb_hash_find(const tcb_hash_t *th, uint32_t hash, uint32_t remote_addr,
+              uint16_t remote_port, uint16_t local_port)
 {
   tcb_t *tcb;
-  LIST_FOREACH(tcb, &tcbs, tcb_link) {
-    if(tcb->tcb_remote_addr == remote_addr &&
+  LIST_FOREACH(tcb, &th->th_buckets[hash & th->th_mask], tcb_hash_link) {
+    if(tcb->tcb_hash == hash &&
+       tcb->tcb_remote_addr == remote_addr &&
        tcb->tcb_remote_port == remote_port &&
        tcb->tcb_local_port == local_port) {
       return tcb;
@@ -604,6 +1366,132 @@ tcb_find(uint32_t remote_addr, uint16_t remote_port, uint16_t local_port)
   return NULL;
 }
 
+
+static tcb_t *
+tcb_find(uint32_t remote_addr, uint16_t remote_port, uint16_t local_port)
+{
+  const uint32_t hash = tcb_hash_tuple(remote_addr, remote_port, local_port);
+
+  if(tcb_hash_old.th_buckets != NULL) {
+    tcb_hash_migrate();
+    if(tcb_hash_old.th_buckets != NULL) {
+      tcb_t *tcb = tcb_hash_find(&tcb_hash_old, hash, remote_addr,
+                                 remote_port, local_port);
+      if(tcb != NULL)
+        return tcb;
+    }
+  }
+  return tcb_hash_find(&tcb_hash_cur, hash, remote_addr,
+                       remote_port, local_port);
+}
+
+
+static void
+tcb_insert(tcb_t *tcb)
+{
+  if(tcb_hash_old.th_buckets != NULL)
+    tcb_hash_migrate();
+  else if(tcb_hash_count > tcb_hash_cur.th_mask)
+    tcb_hash_grow();
+
+  tcb->tcb_hash = tcb_hash_tuple(tcb->tcb_remote_addr,
+                                 tcb->tcb_remote_port,
+                                 tcb->tcb_local_port);
+  LIST_INSERT_HEAD(&tcb_hash_cur.th_buckets[tcb->tcb_hash &
+                                            tcb_hash_cur.th_mask],
+                   tcb, tcb_hash_link);
+  tcb_hash_count++;
+
+  mutex_lock(&tcbs_mutex);
+  LIST_INSERT_HEAD(&tcbs, tcb, tcb_link);
+  mutex_unlock(&tcbs_mutex);
+}
+
+
+static void
+tcb_remove(tcb_t *tcb)
+{
+  LIST_REMOVE(tcb, tcb_hash_link);
+  tcb_hash_count--;
+
+  mutex_lock(&tcbs_mutex);
+  LIST_REMOVE(tcb, tcb_link);
+  mutex_unlock(&tcbs_mutex);
+}
+
+
+/*
+ * Listening services, sorted by port (network byte order) so a SYN
+ * can be matched with a binary search instead of walking all
+ * services. Services are defined at link time so the table is built
+ * once, on the first incoming SYN
+ */
+
+typedef struct tcp_listener {
+  uint16_t tl_port;
+  const service_t *tl_svc;
+} tcp_listener_t;
+
+static tcp_listener_t *tcp_listeners;
+static int tcp_num_listeners = -1;
+
+static void
+tcp_listeners_init(void)
+{
+  extern unsigned long _servicedef_array_begin;
+  extern unsigned long _servicedef_array_end;
+
+  const service_t *begin = (void *)&_servicedef_array_begin;
+  const service_t *end = (void *)&_servicedef_array_end;
+
+  tcp_num_listeners = 0;
+  tcp_listeners = xalloc(sizeof(tcp_listener_t) * (end - begin), 0,
+                         MEM_MAY_FAIL);
+  if(tcp_listeners == NULL)
+    return;
+
+  for(const service_t *s = begin; s != end; s++) {
+    if(s->ip_port == 0)
+      continue;
+    const uint16_t port = htons(s->ip_port);
+
+    // Insertion sort, first service defined for a port wins (same as
+    // service_find_by_ip_port())
+    int i = tcp_num_listeners;
+    while(i > 0 && tcp_listeners[i - 1].tl_port > port)
+      i--;
+    if(i > 0 && tcp_listeners[i - 1].tl_port == port)
+      continue;
+    memmove(tcp_listeners + i + 1, tcp_listeners + i,
+            sizeof(tcp_listener_t) * (tcp_num_listeners - i));
+    tcp_listeners[i].tl_port = port;
+    tcp_listeners[i].tl_svc = s;
+    tcp_num_listeners++;
+  }
+}
+
+
+static const service_t *
+tcp_listener_find(uint16_t local_port)
+{
+  if(tcp_num_listeners == -1)
+    tcp_listeners_init();
+
+  int lo = 0, hi = tcp_num_listeners;
+  while(lo < hi) {
+    const int mid = (lo + hi) / 2;
+    const uint16_t port = tcp_listeners[mid].tl_port;
+    if(port == local_port)
+      return tcp_listeners[mid].tl_svc;
+    if(port < local_port)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+
 static void
 tcp_do_connect(tcb_t *tcb)
 {
@@ -624,9 +1512,7 @@ tcp_do_connect(tcb_t *tcb)
 
   tcp_send_syn(tcb, TCP_F_SYN, NULL);
 
-  mutex_lock(&tcbs_mutex);
-  LIST_INSERT_HEAD(&tcbs, tcb, tcb_link);
-  mutex_unlock(&tcbs_mutex);
+  tcb_insert(tcb);
 }
 
 
@@ -660,15 +1546,13 @@ tcp_task_cb(net_task_t *nt, uint32_t signals)
 
       while(tcb->tcb_snd.wrptr != tcb->tcb_snd.nxt) {
         uint32_t unsent = tcb->tcb_snd.wrptr - tcb->tcb_snd.nxt;
-        uint32_t in_flight = tcb->tcb_snd.nxt - tcb->tcb_snd.una;
-        uint32_t wnd_room = tcb->tcb_snd.wnd > in_flight
-                              ? tcb->tcb_snd.wnd - in_flight : 0;
-
-        // Send window exhausted — stop. When the peer ACKs, tcp_ack
-        // re-raises TCP_EVENT_EMIT and we'll pick up here. (No zero-
-        // window probe yet; if the peer truly advertises win=0 and
-        // the subsequent window-update ACK is lost, we'd deadlock.)
-        if(wnd_room == 0)
+
+        // Send or congestion window exhausted — stop. When the peer
+        // ACKs, tcp_ack re-raises TCP_EVENT_EMIT and we'll pick up
+        // here. (No zero-window probe yet; if the peer truly advertises
+        // win=0 and the subsequent window-update ACK is lost, we'd
+        // deadlock.)
+        if(tcp_snd_room(tcb) == 0)
           break;
 
         // Nagle: hold sub-MSS tails while there is still unACKed data
@@ -714,13 +1598,16 @@ static pbuf_t *
 tcp_reply(struct netif *ni, struct pbuf *pb, uint32_t remote_addr,
           uint32_t seq, uint32_t ack, uint8_t flag, uint32_t rcv_wnd)
 {
-  tcp_hdr_t *th = pbuf_data(pb, 0);
+  const tcp_hdr_t *in = pbuf_cdata(pb, 0);
 
-  const uint16_t src_port = th->src_port;
-  const uint16_t dst_port = th->dst_port;
+  const uint16_t src_port = in->src_port;
+  const uint16_t dst_port = in->dst_port;
 
-  pbuf_reset(pb, pb->pb_offset, sizeof(tcp_hdr_t));
+  // May move the header to a private buffer
+  if(pbuf_reset(pb, pb->pb_offset, sizeof(tcp_hdr_t)))
+    return pb;
 
+  tcp_hdr_t *th = pbuf_data(pb, 0);
   th->src_port = dst_port;
   th->dst_port = src_port;
   th->seq = htonl(seq);
@@ -733,6 +1620,22 @@ tcp_reply(struct netif *ni, struct pbuf *pb, uint32_t remote_addr,
   return NULL;
 }
 
+/*
+ * ACK from a connection in response to an unacceptable segment. Once
+ * timestamps are negotiated the ACK has to carry them too
+ */
+static struct pbuf *
+tcp_reply_tcb(tcb_t *tcb, struct netif *ni, struct pbuf *pb)
+{
+  if(tcb->tcb_ts_ok) {
+    tcp_emit_range(tcb, pb, tcb->tcb_snd.nxt, tcb->tcb_snd.nxt, 1, "ack");
+    return NULL;
+  }
+  return tcp_reply(ni, pb, tcb->tcb_remote_addr, tcb->tcb_snd.nxt,
+                   tcb->tcb_rcv.nxt, TCP_F_ACK, tcb_rxfifo_avail(tcb));
+}
+
+
 struct pbuf *
 tcp_reject(struct netif *ni, struct pbuf *pb, uint32_t remote_addr,
            uint16_t port, uint32_t ack, const char *reason)
@@ -763,11 +1666,10 @@ tcp_close(tcb_t *tcb, const char *reason)
 {
   tcp_disarm_all_timers(tcb);
 
-  mutex_lock(&tcbs_mutex);
-  LIST_REMOVE(tcb, tcb_link);
-  mutex_unlock(&tcbs_mutex);
+  tcb_remove(tcb);
 
   tcp_set_state(tcb, TCP_STATE_CLOSED, reason);
+  tcp_txq_flush(tcb);
 
   task_wakeup(&tcb->tcb_rx_waitq, 1);
   task_wakeup(&tcb->tcb_tx_waitq, 1);
@@ -801,8 +1703,21 @@ tcp_delayed_ack_cb(void *opaque, uint64_t now)
 }
 
 
+typedef struct tcp_opts {
+  uint16_t mss;         // 0 if not present
+  uint8_t wscale;
+  uint8_t wscale_ok;
+  uint8_t sack_ok;
+  uint8_t sack_count;
+  uint8_t ts_ok;
+  uint32_t ts_val;
+  uint32_t ts_ecr;
+  tcp_seq_range_t sack[TCP_SACK_BLOCKS];
+} tcp_opts_t;
+
+
 static void
-tcp_parse_options(tcb_t *tcb, const uint8_t *buf, size_t len)
+tcp_parse_options(tcp_opts_t *to, const uint8_t *buf, size_t len)
 {
   while(len > 0) {
 
@@ -818,12 +1733,13 @@ tcp_parse_options(tcb_t *tcb, const uint8_t *buf, size_t len)
     int opt = buf[0];
     int optlen = buf[1];
 
-    if(optlen > len)
+    if(optlen < 2 || optlen > len)
       return;
 
     switch(opt) {
     case 2:
-      tcb->tcb_max_segment_size = buf[3] | (buf[2] << 8);
+      if(optlen == 4)
+        to->mss = buf[3] | (buf[2] << 8);
       break;
     case 3:
       // RFC 7323 Window Scale option. Length must be 3.
@@ -832,8 +1748,30 @@ tcp_parse_options(tcb_t *tcb, const uint8_t *buf, size_t len)
         // RFC caps shift at 14 to keep the maximum window under 2^30.
         if(shift > 14)
           shift = 14;
-        tcb->tcb_snd_wnd_shift = shift;
-        tcb->tcb_wnd_scale_ok = 1;
+        to->wscale = shift;
+        to->wscale_ok = 1;
+      }
+      break;
+    case 4:
+      // RFC 2018 SACK-permitted
+      if(optlen == 2)
+        to->sack_ok = 1;
+      break;
+    case 5:
+      // RFC 2018 SACK blocks
+      for(int i = 2; i + 8 <= optlen &&
+            to->sack_count < TCP_SACK_BLOCKS; i += 8) {
+        tcp_seq_range_t *r = &to->sack[to->sack_count++];
+        r->start = rd32_be(buf + i);
+        r->end = rd32_be(buf + i + 4);
+      }
+      break;
+    case 8:
+      // RFC 7323 Timestamps
+      if(optlen == 10) {
+        to->ts_val = rd32_be(buf + 2);
+        to->ts_ecr = rd32_be(buf + 6);
+        to->ts_ok = 1;
       }
       break;
     }
@@ -843,6 +1781,178 @@ tcp_parse_options(tcb_t *tcb, const uint8_t *buf, size_t len)
 }
 
 
+// Options only valid in a SYN
+static void
+tcp_syn_options(tcb_t *tcb, const tcp_opts_t *to)
+{
+  if(to->mss)
+    tcb->tcb_max_segment_size = to->mss;
+  if(to->wscale_ok) {
+    tcb->tcb_snd_wnd_shift = to->wscale;
+    tcb->tcb_wnd_scale_ok = 1;
+  }
+  tcb->tcb_sack_ok = to->sack_ok;
+  tcb->tcb_ts_ok = to->ts_ok;
+  if(to->ts_ok) {
+    tcb->tcb_ts_recent = to->ts_val;
+    tcb->tcb_ts_recent_time = clock_get();
+  }
+  tcp_cc_init(tcb);
+}
+
+
+/*
+ * RFC 7323 5.3 R1: Protection Against Wrapped Sequences. Returns true
+ * if the segment carries a timestamp older than ts_recent and thus
+ * must be dropped. RST segments are exempt
+ */
+static int
+tcp_paws_reject(const tcb_t *tcb, const tcp_opts_t *to, uint8_t flag,
+                uint64_t now)
+{
+  if(!tcb->tcb_ts_ok || !to->ts_ok || (flag & TCP_F_RST))
+    return 0;
+
+  if(!seq_lt(to->ts_val, tcb->tcb_ts_recent))
+    return 0;
+
+  // ts_recent is too old to compare against after a long idle period
+  return now - tcb->tcb_ts_recent_time < TCP_PAWS_IDLE;
+}
+
+
+/*
+ * Update smoothed RTT and RTO from an ACK of new data, before snd.una
+ * is advanced (RFC 6298). With timestamps every such ACK gives a sample, in which
+ * case the gains are scaled down by the number of samples we expect
+ * per RTT so the estimator's memory stays about the same (RFC 7323
+ * appendix G). Without timestamps only the one timed segment does
+ */
+static void
+tcp_rtt_update(tcb_t *tcb, const tcp_opts_t *to, uint32_t ack,
+               uint64_t now)
+{
+  int rtt;        // µs
+  int granularity;
+  uint32_t samples_per_rtt = 1;
+
+  if(!seq_lt(tcb->tcb_snd.una, ack))
+    return;
+
+  if(tcb->tcb_ts_ok && to->ts_ok && to->ts_ecr) {
+    rtt = (int32_t)(tcp_ts_now() - to->ts_ecr);
+    if(rtt < 0 || rtt > TCP_RTO_MAX)
+      return;
+    rtt *= 1000;
+    granularity = 1000;
+    const uint32_t flight = tcb->tcb_snd.nxt - tcb->tcb_snd.una;
+    samples_per_rtt = MAX(1, flight / (2 * tcb->tcb_cc.mss));
+  } else if(tcb->tcb_rtt_start && seq_leq(tcb->tcb_rtt_seq, ack)) {
+    rtt = now - tcb->tcb_rtt_start;
+    granularity = 1;
+    tcb->tcb_rtt_start = 0;
+  } else {
+    return;
+  }
+
+  if(tcb->tcb_srtt == 0) {
+    tcb->tcb_srtt = MAX(rtt, 1);
+    tcb->tcb_rttvar = rtt / 2;
+  } else {
+    const int err = rtt - tcb->tcb_srtt;
+    const int n = samples_per_rtt;
+    tcb->tcb_rttvar += ((err < 0 ? -err : err) - tcb->tcb_rttvar) / (4 * n);
+    tcb->tcb_srtt = MAX(tcb->tcb_srtt + err / (8 * n), 1);
+  }
+
+  const int rto = tcb->tcb_srtt + MAX(granularity, 4 * tcb->tcb_rttvar);
+  tcb->tcb_rto = MIN(MAX(rto / 1000, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+
+/*
+ * Merge SACK blocks from an incoming ACK into the scoreboard
+ */
+static void
+tcp_sack_input(tcb_t *tcb, const tcp_opts_t *to)
+{
+  for(int i = 0; i < to->sack_count; i++) {
+    uint32_t start = to->sack[i].start;
+    const uint32_t end = to->sack[i].end;
+
+    // Ignore blocks that are bogus or cover nothing outstanding
+    if(!seq_lt(start, end) ||
+       seq_leq(end, tcb->tcb_snd.una) ||
+       seq_lt(tcb->tcb_snd.nxt, end))
+      continue;
+
+    if(seq_lt(start, tcb->tcb_snd.una))
+      start = tcb->tcb_snd.una;
+
+    tcp_range_add(tcb->tcb_snd_sacked, &tcb->tcb_snd_sacked_count,
+                  TCP_SACK_BLOCKS, start, end);
+  }
+}
+
+
+/*
+ * Store an out-of-order segment in the RX FIFO beyond rcv.nxt. The
+ * acceptance check has already made sure it's inside our window. The
+ * range is remembered so rcv.nxt can skip over it once the gap before
+ * it is filled, and so it can be reported to the peer in SACK blocks.
+ *
+ * If we run out of ranges (TCP_OOO_RANGES) the segment is dropped, the
+ * peer will have to retransmit it.
+ */
+static void
+tcp_rcv_ooo(tcb_t *tcb, pbuf_t *pb, uint32_t seq)
+{
+  if(tcp_range_add(tcb->tcb_rcv_ooo, &tcb->tcb_rcv_ooo_count,
+                   TCP_OOO_RANGES, seq, seq + pb->pb_pktlen)) {
+    tcb->tcb_ooo_dropped++;
+    return;
+  }
+
+  tcb->tcb_rcv_ooo_recent = seq;
+  tcb->tcb_ooo_held++;
+
+  for(const pbuf_t *p = pb; p != NULL; p = p->pb_next) {
+    ltow_memcpy(tcb_rxfifo(tcb), p->pb_data + p->pb_offset,
+                p->pb_buflen, seq, tcb->tcb_rxfifo_size);
+    seq += p->pb_buflen;
+  }
+}
+
+
+/*
+ * rcv.nxt has advanced, pull in out-of-order data that is now
+ * contiguous. Returns non-zero if any out-of-order data was held.
+ * '*fin' is set if rcv.nxt reached a FIN that arrived out of order
+ */
+static int
+tcp_rcv_ooo_merge(tcb_t *tcb, int *fin)
+{
+  const int held = tcb->tcb_rcv_ooo_count;
+
+  tcp_seq_range_t *r = tcb->tcb_rcv_ooo;
+  while(tcb->tcb_rcv_ooo_count && seq_leq(r[0].start, tcb->tcb_rcv.nxt)) {
+    if(seq_lt(tcb->tcb_rcv.nxt, r[0].end)) {
+      const uint32_t merged = r[0].end - tcb->tcb_rcv.nxt;
+      tcb->tcb_rx_bytes += merged;
+      tcb->tcb_ooo_merged += merged;
+      tcb->tcb_rcv.nxt = r[0].end;
+    }
+    tcp_range_pop(r, &tcb->tcb_rcv_ooo_count);
+  }
+
+  if(tcb->tcb_rcv_ooo_fin && tcb->tcb_rcv_ooo_fin_seq == tcb->tcb_rcv.nxt) {
+    tcb->tcb_rcv_ooo_fin = 0;
+    *fin = 1;
+  }
+  return held;
+}
+
+
 static ssize_t
 tcb_rxfifo_user_bytes(tcb_t *tcb)
 {
@@ -892,7 +2002,8 @@ tcp_stream_read(stream_t *s, void *buf, size_t size, size_t require)
     ssize_t used = tcb_rxfifo_user_bytes(tcb);
     if(used < 0) {
       irq_permit(q);
-      return used;
+      // Hand out what we got, the error is seen on the next read
+      return total ?: used;
     }
 
     if(used == 0) {
@@ -918,6 +2029,63 @@ tcp_stream_read(stream_t *s, void *buf, size_t size, size_t require)
 }
 
 
+/*
+ * Append the pbuf chain 'pb' to the zero-copy queue. 'copy' is set if
+ * it's our own buffer which we may keep filling from tcp_txq_copy()
+ */
+static void
+tcp_txq_append(tcb_t *tcb, pbuf_t *pb, size_t len, int copy)
+{
+  if(!tcb->tcb_txq_bytes)
+    tcb->tcb_txq_seq = tcb->tcb_snd.wrptr;
+
+  pbuf_t *last = pb;
+  while(last->pb_next)
+    last = last->pb_next;
+
+  // Queue entries are linked through pb_next, so append the whole chain
+  *tcb->tcb_txq.stqh_last = pb;
+  tcb->tcb_txq.stqh_last = &last->pb_next;
+
+  tcb->tcb_txq_bytes += len;
+  tcb->tcb_txq_tail_copy = copy;
+}
+
+
+/*
+ * Copy data written with write() to the zero-copy queue. Returns
+ * number of bytes copied, 0 if out of buffers
+ */
+static size_t
+tcp_txq_copy(tcb_t *tcb, const void *buf, size_t len)
+{
+  pbuf_t *tail = STAILQ_LAST(&tcb->tcb_txq, pbuf, pb_link);
+
+  if(tcb->tcb_txq_tail_copy) {
+    const size_t room = pbuf_data_size(tail->pb_data) -
+      tail->pb_offset - tail->pb_buflen;
+    // It may be shared with a segment still on its way out
+    if(room && !pbuf_unshare(tail)) {
+      len = MIN(len, room);
+      memcpy(tail->pb_data + tail->pb_offset + tail->pb_buflen, buf, len);
+      tail->pb_buflen += len;
+      tcb->tcb_txq_bytes += len;
+      return len;
+    }
+  }
+
+  pbuf_t *pb = pbuf_make_sized(0, len, 0);
+  if(pb == NULL)
+    return 0;
+  len = MIN(len, pbuf_data_size(pb->pb_data));
+  memcpy(pb->pb_data, buf, len);
+  pb->pb_buflen = len;
+  pb->pb_pktlen = len;
+  tcp_txq_append(tcb, pb, len, 1);
+  return len;
+}
+
+
 static ssize_t
 tcp_stream_writev(struct stream *s, struct iovec *iov, size_t iovcnt,
                   int flags)
@@ -947,8 +2115,15 @@ tcp_stream_writev(struct stream *s, struct iovec *iov, size_t iovcnt,
     size_t size = iov[i].iov_len;
     void *buf = iov[i].iov_base;
     while(size) {
-      size_t avail = tcb_txfifo_avail(tcb);
-      if(avail == 0) {
+      size_t to_copy = MIN(size, tcb_txfifo_avail(tcb));
+
+      // Once there is zero-copy data queued everything else must go
+      // after it, so copy into pbufs instead of the FIFO until the
+      // queue is drained
+      if(to_copy && tcb->tcb_txq_bytes)
+        to_copy = tcp_txq_copy(tcb, buf, to_copy);
+
+      if(to_copy == 0) {
         if(flags & STREAM_WRITE_NO_WAIT || tcb->tcb_state == TCP_STATE_CLOSED) {
           irq_permit(q);
           mutex_unlock(&tcb->tcb_write_mutex);
@@ -958,10 +2133,12 @@ tcp_stream_writev(struct stream *s, struct iovec *iov, size_t iovcnt,
         task_sleep(&tcb->tcb_tx_waitq);
         continue;
       }
-      size_t to_copy = MIN(size, avail);
-      ltow_memcpy(tcb_txfifo(tcb), buf,
-                  to_copy, tcb->tcb_snd.wrptr,
-                  tcb->tcb_txfifo_size);
+
+      if(!tcb->tcb_txq_bytes) {
+        ltow_memcpy(tcb_txfifo(tcb), buf,
+                    to_copy, tcb->tcb_snd.wrptr,
+                    tcb->tcb_txfifo_size);
+      }
 
       tcb->tcb_snd.wrptr += to_copy;
       buf += to_copy;
@@ -1004,6 +2181,62 @@ tcp_stream_write(stream_t *s, const void *buf, size_t size, int flags)
 }
 
 
+/*
+ * Queue the payload of 'pb' for transmission without copying it into
+ * the TX FIFO. Segments are sent as a header pbuf followed by clones
+ * of the payload buffers (see pbuf_clone_range()) and the buffers are
+ * released once acknowledged.
+ *
+ * Zero-copy data counts towards the TX FIFO fill level. A chain larger
+ * than the FIFO is accepted once everything before it has been
+ * acknowledged.
+ */
+static ssize_t
+tcp_stream_write_pbuf(stream_t *s, pbuf_t *pb)
+{
+  tcb_t *tcb = (tcb_t *)s;
+  const size_t len = pb->pb_pktlen;
+
+  if(len == 0) {
+    pbuf_free(pb);
+    return 0;
+  }
+
+  mutex_lock(&tcb->tcb_write_mutex);
+
+  int q = irq_forbid(IRQ_LEVEL_SWITCH);
+
+  while(1) {
+    if(tcb->tcb_state == TCP_STATE_CLOSED) {
+      irq_permit(q);
+      mutex_unlock(&tcb->tcb_write_mutex);
+      pbuf_free(pb);
+      return ERR_NOT_CONNECTED;
+    }
+
+    if(tcb_txfifo_avail(tcb) >= len || tcb_txfifo_used(tcb) == 0)
+      break;
+
+    net_task_raise(&tcb->tcb_task, TCP_EVENT_EMIT);
+    task_sleep(&tcb->tcb_tx_waitq);
+  }
+
+  tcp_txq_append(tcb, pb, len, 0);
+  tcb->tcb_snd.wrptr += len;
+
+  uint32_t unsent = tcb->tcb_snd.wrptr - tcb->tcb_snd.nxt;
+  int pipeline_idle = (tcb->tcb_snd.una == tcb->tcb_snd.nxt);
+  irq_permit(q);
+  mutex_unlock(&tcb->tcb_write_mutex);
+
+  // Same Nagle rule as tcp_stream_writev()
+  if(unsent >= tcb->tcb_max_segment_size || pipeline_idle)
+    net_task_raise(&tcb->tcb_task, TCP_EVENT_EMIT);
+
+  return len;
+}
+
+
 static void
 tcp_stream_close(stream_t *s)
 {
@@ -1088,7 +2321,8 @@ static const stream_vtable_t tcp_stream_vtable = {
   .close = tcp_stream_close,
   .poll = tcp_stream_poll,
   .peek = tcp_stream_peek,
-  .drop = tcp_stream_drop
+  .drop = tcp_stream_drop,
+  .write_pbuf = tcp_stream_write_pbuf,
 };
 
 
@@ -1096,15 +2330,21 @@ static const stream_vtable_t tcp_stream_vtable = {
 static tcb_t *
 tcb_create(const char *name, size_t txfifo_size, size_t rxfifo_size)
 {
-  tcb_t *tcb = xalloc(sizeof(tcb_t) + txfifo_size + rxfifo_size, 0,
-                      MEM_MAY_FAIL);
+  kmem_cache_t *kc = kmem_cache_get("tcb", sizeof(tcb_t) +
+                                    txfifo_size + rxfifo_size, 0);
+  if(kc == NULL)
+    return NULL;
+
+  tcb_t *tcb = kmem_cache_alloc(kc, MEM_MAY_FAIL);
   if(tcb == NULL)
     return NULL;
 
   memset(tcb, 0, sizeof(tcb_t));
+  tcb->tcb_cache = kc;
 
   tcb->tcb_txfifo_size = txfifo_size;
   tcb->tcb_rxfifo_size = rxfifo_size;
+  STAILQ_INIT(&tcb->tcb_txq);
 
   tcb->tcb_stream.vtable = &tcp_stream_vtable;
 
@@ -1112,7 +2352,7 @@ tcb_create(const char *name, size_t txfifo_size, size_t rxfifo_size)
 
   tcb->tcb_task.nt_cb = tcp_task_cb;
 
-  tcb->tcb_rto = 250;
+  tcb->tcb_rto = TCP_RTO_INITIAL;
 
   tcb->tcb_time_wait_timer.t_cb = tcp_time_wait_cb;
   tcb->tcb_time_wait_timer.t_opaque = tcb;
@@ -1132,9 +2372,14 @@ tcb_create(const char *name, size_t txfifo_size, size_t rxfifo_size)
   tcb->tcb_snd.nxt = tcb->tcb_iss;
   tcb->tcb_snd.una = tcb->tcb_iss;
   tcb->tcb_snd.wrptr = tcb->tcb_iss + 1;
+  tcb->tcb_snd_high_rxt = tcb->tcb_iss;
 
   tcb->tcb_max_segment_size = 536;
 
+  tcb->tcb_cc_ops = tcp_cc_default;
+  tcb->tcb_recover = tcb->tcb_iss;
+  tcp_cc_init(tcb);
+
   tcb->tcb_timo = TCP_TIMEOUT_HANDSHAKE * 1000;
 
   task_waitable_init(&tcb->tcb_rx_waitq, "tcp");
@@ -1188,6 +2433,12 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
   const uint16_t wnd = ntohs(th->wnd);
   const uint8_t flag = th->flg;
 
+  tcp_opts_t opts = {};
+  if(hdr_len > sizeof(tcp_hdr_t) && !pbuf_pullup(pb, hdr_len)) {
+    tcp_parse_options(&opts, pbuf_data(pb, sizeof(tcp_hdr_t)),
+                      hdr_len - sizeof(tcp_hdr_t));
+  }
+
   if(tcb == NULL) {
 
     if(flag != TCP_F_SYN) {
@@ -1208,7 +2459,7 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
 
     uint16_t local_port_ho = ntohs(local_port);
 
-    const service_t *svc = service_find_by_ip_port(local_port_ho);
+    const service_t *svc = tcp_listener_find(local_port);
 
     if(svc == NULL || svc->open_stream == NULL) {
       return tcp_reject(ni, pb, remote_addr, local_port_ho, seq + 1,
@@ -1234,15 +2485,11 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
     tcb->tcb_rcv.nxt = seq + 1;
     tcb->tcb_rcv.rdptr = seq + 1;
 
-    if(!pbuf_pullup(pb, hdr_len)) {
-      tcp_parse_options(tcb,
-                        pbuf_data(pb, sizeof(tcp_hdr_t)),
-                        hdr_len - sizeof(tcp_hdr_t));
-    }
+    tcp_syn_options(tcb, &opts);
 
     error_t err = svc->open_stream(&tcb->tcb_stream);
     if(err) {
-      free(tcb);
+      kmem_cache_free(tcb->tcb_cache, tcb);
       return tcp_reject(ni, pb, remote_addr, local_port_ho, seq + 1,
                         error_to_string(err));
     }
@@ -1250,9 +2497,7 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
     tcp_send_syn(tcb, TCP_F_SYN | TCP_F_ACK, pb);
 
     tcp_set_state(tcb, TCP_STATE_SYN_RECEIVED, "syn-recvd");
-    mutex_lock(&tcbs_mutex);
-    LIST_INSERT_HEAD(&tcbs, tcb, tcb_link);
-    mutex_unlock(&tcbs_mutex);
+    tcb_insert(tcb);
     return NULL;
   }
 
@@ -1295,7 +2540,10 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
       tcb->tcb_rcv.nxt = seq + 1;
       tcb->tcb_rcv.rdptr = seq + 1;
 
+      tcp_syn_options(tcb, &opts);
+
       if(flag & TCP_F_ACK) {
+        tcp_rtt_update(tcb, &opts, ack, tcb->tcb_last_rx);
         tcp_ack(tcb, una_ack);
       }
 
@@ -1343,18 +2591,19 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
 
     } else {
 
-#if 0
-      acceptance = (uint32_t)nxt_seq < tcb->tcb_rcv.nxt + tcb->tcb_rcv.wnd;
-
-      int seq_delta_end = nxt_seq + seg_len - 1;
-      acceptance |=
-        (uint32_t)seq_delta_end < tcb->tcb_rcv.nxt + tcb->tcb_rcv.wnd;
-#endif
-
-      acceptance = nxt_seq == 0;
+      // Next in sequence, or out-of-order but entirely within our
+      // window (stored ahead in the RX FIFO, see tcp_rcv_ooo())
+      acceptance = nxt_seq == 0 ||
+        (nxt_seq > 0 && !(flag & TCP_F_SYN) &&
+         nxt_seq + seg_len <= rcv_wnd);
     }
   }
 
+  if(acceptance && tcp_paws_reject(tcb, &opts, flag, clock_get())) {
+    tcb->tcb_paws_drops++;
+    acceptance = 0;
+  }
+
   if(!acceptance) {
     if(flag & TCP_F_RST)
       return pb;
@@ -1365,11 +2614,20 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
       return pb;
 
     tcb->fast_reject_limiter++;
-    return tcp_reply(ni, pb, remote_addr, tcb->tcb_snd.nxt,
-                     tcb->tcb_rcv.nxt, TCP_F_ACK, rcv_wnd);
+    return tcp_reply_tcb(tcb, ni, pb);
   }
   tcb->fast_reject_limiter = 0;
 
+  // RFC 7323 4.3: Remember the timestamp to echo. Only from segments
+  // covering the left edge of what we've acknowledged so the peer gets
+  // the RTT including any delayed ACK wait
+  if(tcb->tcb_ts_ok && opts.ts_ok &&
+     seq_leq(tcb->tcb_ts_recent, opts.ts_val) &&
+     seq_leq(seq, tcb->tcb_last_ack_sent)) {
+    tcb->tcb_ts_recent = opts.ts_val;
+    tcb->tcb_ts_recent_time = clock_get();
+  }
+
   //
   // Step 2: RST
   //
@@ -1426,6 +2684,13 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
   case TCP_STATE_CLOSING:
     if(una_ack >= 0 && ack_nxt >= 0) {
 
+      // RFC 5681 2: Acknowledges nothing new, carries no data and
+      // doesn't change the window while we have data outstanding
+      const int dupack = una_ack == 0 && seg_len == 0 &&
+        scaled_wnd == tcb->tcb_snd.wnd &&
+        tcb->tcb_snd.una != tcb->tcb_snd.nxt;
+
+      tcp_rtt_update(tcb, &opts, ack, tcb->tcb_last_rx);
       tcp_ack(tcb, una_ack); // Handles una_ack=0 by doing nothing
 
       int wl1_seq = seq - tcb->tcb_snd.wl1;
@@ -1437,12 +2702,16 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
         tcb->tcb_snd.wl2 = ack;
       }
 
+      if(tcb->tcb_sack_ok && opts.sack_count)
+        tcp_sack_input(tcb, &opts);
+
+      tcp_cc_input(tcb, una_ack, dupack, tcb->tcb_last_rx);
+
     } else if(una_ack < 0) {
       // Old
     } else if(ack_nxt < 0) {
       // Too new
-      return tcp_reply(ni, pb, remote_addr, tcb->tcb_snd.nxt,
-                       tcb->tcb_rcv.nxt, TCP_F_ACK, rcv_wnd);
+      return tcp_reply_tcb(tcb, ni, pb);
     }
 
     switch(tcb->tcb_state) {
@@ -1481,14 +2750,33 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
 
   pb = pbuf_drop(pb, hdr_len, 0);
 
+  // A FIN is only processed once everything before it has arrived
+  const uint32_t fin_seq = seq + pb->pb_pktlen;
+  int ooo_fin = 0;
+
   switch(tcb->tcb_state) {
   case TCP_STATE_ESTABLISHED:
   case TCP_STATE_FIN_WAIT1:
   case TCP_STATE_FIN_WAIT2:
 
+    if(flag & TCP_F_FIN && seq_lt(tcb->tcb_rcv.nxt, seq)) {
+      // Beyond a hole, tcp_rcv_ooo_merge() picks it up once filled
+      tcb->tcb_rcv_ooo_fin = 1;
+      tcb->tcb_rcv_ooo_fin_seq = fin_seq;
+    }
+
     if(!pb->pb_pktlen)
       break;
 
+    if(seq != tcb->tcb_rcv.nxt) {
+      tcp_rcv_ooo(tcb, pb, seq);
+      // Duplicate ACK right away to tell the sender about the hole
+      // (RFC 5681 4.2)
+      tcp_emit(tcb, pb, tcb->tcb_snd.nxt, 1, "ooo-ack");
+      pb = NULL;
+      break;
+    }
+
     uint32_t avail = tcb_rxfifo_avail(tcb);
 
     if(avail >= pb->pb_pktlen) {
@@ -1502,10 +2790,14 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
       }
       tcb->tcb_rx_bytes += pb->pb_pktlen;
 
+      const int gap_filled = tcp_rcv_ooo_merge(tcb, &ooo_fin);
+
       task_wakeup(&tcb->tcb_rx_waitq, 1);
 
       /*
         Ack immediately if we have nothing to send and
+          We filled (part of) a gap in the sequence space
+         OR
           We are waiting to send a delayed ack (which will be cancelled)
          OR
           Our RX buffer is fully depleted
@@ -1514,7 +2806,8 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
       tcb->rcv_window_closed = rx_avail < tcb->tcb_rcv.mss;
 
       if(tcb->tcb_snd.wrptr == tcb->tcb_snd.nxt &&
-         (!timer_disarm(&tcb->tcb_delayed_ack_timer) ||
+         (gap_filled ||
+          !timer_disarm(&tcb->tcb_delayed_ack_timer) ||
           tcb->rcv_window_closed)) {
         tcp_emit(tcb, pb, tcb->tcb_snd.nxt, 1, "Instant ack");
         pb = NULL;
@@ -1529,7 +2822,7 @@ tcp_input_ipv4(struct netif *ni, struct pbuf *pb, int tcp_offset)
     break;
   }
 
-  if(flag & TCP_F_FIN) {
+  if((flag & TCP_F_FIN && fin_seq == tcb->tcb_rcv.nxt) || ooo_fin) {
 
     switch(tcb->tcb_state) {
     case TCP_STATE_CLOSED:
@@ -1624,11 +2917,21 @@ tcp_state_to_str(int state)
 }
 
 
+static const char *tcp_ca_statenames =
+  "Open\0"
+  "Recovery\0"
+  "Loss\0";
+
+
 static error_t
 cmd_tcp(cli_t *cli, int argc, char **argv)
 {
   tcb_t *tcb;
 
+  cli_printf(cli, "Demux: %d connections, %d buckets%s\n",
+             tcb_hash_count, tcb_hash_cur.th_mask + 1,
+             tcb_hash_old.th_buckets ? " (resizing)" : "");
+
   mutex_lock(&tcbs_mutex);
 
   LIST_FOREACH(tcb, &tcbs, tcb_link) {
@@ -1646,9 +2949,34 @@ cmd_tcp(cli_t *cli, int argc, char **argv)
                tcb->tcb_rtx_drop);
     cli_printf(cli, "\tRTO: %d ms  Unacked bytes:%d", tcb->tcb_rto,
                tcb->tcb_snd.nxt  - tcb->tcb_snd.una);
-    cli_printf(cli, "\tRX-FIFO:%d  TX-FIFO:%d\n",
+    cli_printf(cli, "\tRX-FIFO:%d  TX-FIFO:%d (zero-copy:%d)\n",
                tcb_rxfifo_used(tcb),
-               tcb_txfifo_used(tcb));
+               tcb_txfifo_used(tcb),
+               tcb->tcb_txq_bytes);
+    cli_printf(cli, "\tSRTT: %d.%03d ms  RTTVAR: %d.%03d ms  Timestamps:%s",
+               tcb->tcb_srtt / 1000, tcb->tcb_srtt % 1000,
+               tcb->tcb_rttvar / 1000, tcb->tcb_rttvar % 1000,
+               tcb->tcb_ts_ok ? "yes" : "no");
+    if(tcb->tcb_ts_ok)
+      cli_printf(cli, "  PAWS drops:%d", tcb->tcb_paws_drops);
+    cli_printf(cli, "\n");
+    if(tcb->tcb_sack_ok) {
+      cli_printf(cli, "\tSACK: Scoreboard:%d  SACK-ReTX segments:%d\n",
+                 tcb->tcb_snd_sacked_count,
+                 tcb->tcb_sack_rtx_segs);
+    }
+    cli_printf(cli, "\tOOO: Ranges:%d  Held:%u  Dropped:%u  Merged:%"PRIu64" bytes\n",
+               tcb->tcb_rcv_ooo_count,
+               tcb->tcb_ooo_held,
+               tcb->tcb_ooo_dropped,
+               tcb->tcb_ooo_merged);
+    cli_printf(cli, "\tCC: %s %s  cwnd:%u ssthresh:%u  Fast ReTX:%d  Timeouts:%d\n",
+               tcb->tcb_cc_ops->name,
+               strtbl(tcp_ca_statenames, tcb->tcb_ca_state),
+               tcb->tcb_cc.cwnd,
+               tcb->tcb_cc.ssthresh,
+               tcb->tcb_fast_rtx,
+               tcb->tcb_rto_count);
   }
   mutex_unlock(&tcbs_mutex);
   return 0;
@@ -1657,6 +2985,30 @@ cmd_tcp(cli_t *cli, int argc, char **argv)
 CLI_CMD_DEF_EXT("show_tcp", cmd_tcp, NULL, "Show active TCP connections");
 
 
+static error_t
+cmd_tcp_cc(cli_t *cli, int argc, char **argv)
+{
+  extern unsigned long _tcpcc_array_begin;
+  extern unsigned long _tcpcc_array_end;
+
+  const tcp_cc_ops_t **ops = (void *)&_tcpcc_array_begin;
+  for(; ops != (void *)&_tcpcc_array_end; ops++) {
+    if(argc < 2) {
+      cli_printf(cli, "%c %s\n", *ops == tcp_cc_default ? '*' : ' ',
+                 (*ops)->name);
+    } else if(!strcmp(argv[1], (*ops)->name)) {
+      // Only affects new connections
+      tcp_cc_default = *ops;
+      return 0;
+    }
+  }
+  return argc < 2 ? 0 : ERR_NOT_FOUND;
+}
+
+CLI_CMD_DEF_EXT("tcp_cc", cmd_tcp_cc, "[<algorithm>]",
+                "Show or set TCP congestion control for new connections");
+
+
 
 static error_t
 cmd_killtcp(cli_t *cli, int argc, char **argv)
@@ -1675,3 +3027,184 @@ cmd_killtcp(cli_t *cli, int argc, char **argv)
 
 CLI_CMD_DEF("tcp_kill", cmd_killtcp);
 
+
+
+/*
+ * Demux benchmark. Creates 'connections' established tcbs (with tiny
+ * FIFOs) to addresses in the 198.18.0.0/15 benchmark range and feeds
+ * pure ACKs for random connections through tcp_input_ipv4(). This
+ * runs on the net thread as it would for real traffic, so it's best
+ * done on an otherwise idle system
+ */
+
+#define TCP_BENCH_SEGMENTS 20000
+
+typedef struct tcp_bench {
+  net_task_t tb_task;
+  mutex_t tb_mutex;
+  cond_t tb_cond;
+  int tb_done;
+
+  int tb_connections;
+  error_t tb_err;
+  int tb_ns;
+  int tb_buckets;
+  int tb_longest_chain;
+
+  netif_t tb_netif;
+} tcp_bench_t;
+
+
+static pbuf_t *
+tcp_bench_segment(tcb_t *tcb)
+{
+  pbuf_t *pb = pbuf_make(0, 0);
+  if(pb == NULL)
+    return NULL;
+  ipv4_header_t *ip = pbuf_append(pb, sizeof(ipv4_header_t));
+  memset(ip, 0, sizeof(ipv4_header_t));
+  ip->ver_ihl = 0x45;
+  ip->proto = IPPROTO_TCP;
+  ip->src_addr = tcb->tcb_remote_addr;
+  ip->dst_addr = tcb->tcb_local_addr;
+
+  tcp_hdr_t *th = pbuf_append(pb, sizeof(tcp_hdr_t));
+  th->src_port = tcb->tcb_remote_port;
+  th->dst_port = tcb->tcb_local_port;
+  th->seq = htonl(tcb->tcb_rcv.nxt);
+  th->ack = htonl(tcb->tcb_snd.nxt);
+  th->off = (sizeof(tcp_hdr_t) >> 2) << 4;
+  th->flg = TCP_F_ACK;
+  th->wnd = htons(8192);
+  th->cksum = 0;
+  th->up = 0;
+  return pb;
+}
+
+
+static void
+tcp_bench_run(tcp_bench_t *tb)
+{
+  const int n = tb->tb_connections;
+  tcb_t **conns = xalloc(sizeof(tcb_t *) * n, 0, MEM_MAY_FAIL | MEM_CLEAR);
+  if(conns == NULL) {
+    tb->tb_err = ERR_NO_MEMORY;
+    return;
+  }
+
+  const uint32_t local_addr = htonl(0xc6120001); // 198.18.0.1
+  tb->tb_netif.ni_ipv4_local_addr = local_addr;
+
+  int created = 0;
+  for(; created < n; created++) {
+    tcb_t *tcb = tcb_create("bench", 256, 256);
+    if(tcb == NULL) {
+      tb->tb_err = ERR_NO_MEMORY;
+      goto cleanup;
+    }
+    tcb->tcb_app_closed = 1;
+    tcb->tcb_local_addr = local_addr;
+    tcb->tcb_remote_addr = htonl(0xc6130000 + created); // 198.19.x.x
+    tcb->tcb_remote_port = htons(1024 + created);
+    tcb->tcb_local_port = htons(80);
+    tcb->tcb_snd.una = tcb->tcb_snd.nxt = tcb->tcb_snd.wrptr;
+    tcb->tcb_rcv.nxt = tcb->tcb_rcv.rdptr = rand();
+    tcb->tcb_timo = TCP_TIMEOUT_INTERVAL * 1000;
+    tcp_set_state(tcb, TCP_STATE_ESTABLISHED, "bench");
+    tcb_insert(tcb);
+    conns[created] = tcb;
+  }
+
+  // Let any resize complete before measuring
+  while(tcb_hash_old.th_buckets != NULL)
+    tcb_hash_migrate();
+
+  tb->tb_buckets = tcb_hash_cur.th_mask + 1;
+  for(int i = 0; i < tb->tb_buckets; i++) {
+    int len = 0;
+    tcb_t *tcb;
+    LIST_FOREACH(tcb, &tcb_hash_cur.th_buckets[i], tcb_hash_link)
+      len++;
+    tb->tb_longest_chain = MAX(tb->tb_longest_chain, len);
+  }
+
+  uint32_t seed = 1;
+  const int64_t t0 = clock_get();
+  for(int i = 0; i < TCP_BENCH_SEGMENTS; i++) {
+    seed = seed * 1664525 + 1013904223;
+    pbuf_t *pb = tcp_bench_segment(conns[(seed >> 8) % n]);
+    if(pb == NULL) {
+      tb->tb_err = ERR_NO_BUFFER;
+      goto cleanup;
+    }
+    pb = tcp_input_ipv4(&tb->tb_netif, pb, sizeof(ipv4_header_t));
+    if(pb != NULL)
+      pbuf_free(pb);
+  }
+  tb->tb_ns = (clock_get() - t0) * 1000 / TCP_BENCH_SEGMENTS;
+
+ cleanup:
+  for(int i = 0; i < created; i++)
+    tcp_close(conns[i], "bench");
+  free(conns);
+}
+
+
+static void
+tcp_bench_cb(net_task_t *nt, uint32_t signals)
+{
+  tcp_bench_t *tb = (void *)nt - offsetof(tcp_bench_t, tb_task);
+
+  tcp_bench_run(tb);
+
+  mutex_lock(&tb->tb_mutex);
+  tb->tb_done = 1;
+  cond_signal(&tb->tb_cond);
+  mutex_unlock(&tb->tb_mutex);
+}
+
+
+static error_t
+cmd_tcp_bench(cli_t *cli, int argc, char **argv)
+{
+  static const int defaults[] = {1, 64, 512};
+  const int runs = argc > 1 ? 1 : 3;
+
+  tcp_bench_t *tb = xalloc(sizeof(tcp_bench_t), 0, MEM_MAY_FAIL);
+  if(tb == NULL)
+    return ERR_NO_MEMORY;
+
+  error_t err = 0;
+  for(int r = 0; r < runs; r++) {
+    memset(tb, 0, sizeof(tcp_bench_t));
+    tb->tb_connections = argc > 1 ? atoi(argv[1]) : defaults[r];
+    if(tb->tb_connections < 1) {
+      err = ERR_INVALID_ARGS;
+      break;
+    }
+    tb->tb_task.nt_cb = tcp_bench_cb;
+    mutex_init(&tb->tb_mutex, "tcpbench");
+    cond_init(&tb->tb_cond, "tcpbench");
+
+    net_task_raise(&tb->tb_task, 1);
+
+    mutex_lock(&tb->tb_mutex);
+    while(!tb->tb_done)
+      cond_wait(&tb->tb_cond, &tb->tb_mutex);
+    mutex_unlock(&tb->tb_mutex);
+
+    if(tb->tb_err) {
+      err = tb->tb_err;
+      break;
+    }
+    cli_printf(cli, "%4d connections: %6d ns/segment  "
+               "%d buckets, longest chain %d\n",
+               tb->tb_connections, tb->tb_ns, tb->tb_buckets,
+               tb->tb_longest_chain);
+  }
+  free(tb);
+  return err;
+}
+
+CLI_CMD_DEF_EXT("tcp_bench", cmd_tcp_bench, "[<connections>]",
+                "Benchmark TCP connection demux");
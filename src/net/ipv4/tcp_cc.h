@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <mios/mios.h>
+
+/*
+ * TCP congestion control
+ *
+ * Common parts (slow start, fast retransmit / fast recovery, reaction
+ * to retransmission timeouts) live in tcp.c. An algorithm only decides
+ * how the congestion window grows during congestion avoidance and what
+ * ssthresh becomes after a loss. Algorithms register with TCP_CC_DEF()
+ * and each tcb picks one when it's created.
+ *
+ * All window sizes are in bytes.
+ */
+
+typedef struct tcp_cc {
+  uint32_t cwnd;
+  uint32_t ssthresh;
+  uint32_t mss;
+
+  union {
+    struct {
+      uint32_t bytes_acked;  // Appropriate Byte Counting (RFC 3465)
+    } reno;
+
+    struct {
+      uint32_t w_max;        // cwnd just before the last reduction
+      uint32_t w_est;        // Reno-friendly estimate
+      uint32_t k;            // ms until cwnd is back at w_max
+      uint64_t epoch;        // Start of current congestion avoidance stage
+    } cubic;
+  };
+
+} tcp_cc_t;
+
+
+typedef struct tcp_cc_ops {
+  const char *name;
+
+  // Optional. cwnd, ssthresh and mss are already set up
+  void (*init)(tcp_cc_t *cc);
+
+  // 'acked' bytes of new data acknowledged while cwnd >= ssthresh.
+  // 'now' is in µs, 'srtt' is smoothed RTT in ms (0 if unknown)
+  void (*cong_avoid)(tcp_cc_t *cc, uint32_t acked, uint64_t now,
+                     uint32_t srtt);
+
+  // Loss detected (by duplicate ACKs, SACK or timeout), set ssthresh.
+  // 'flight' is bytes outstanding in the network
+  void (*loss)(tcp_cc_t *cc, uint32_t flight, uint64_t now);
+
+} tcp_cc_ops_t;
+
+// Default for new connections, can be changed with 'tcp_cc'
+extern const tcp_cc_ops_t tcp_cc_newreno;
+
+#define TCP_CC_DEF(ops)                                                 \
+  static const tcp_cc_ops_t *MIOS_JOIN(tcpcc, __LINE__) __attribute__ ((used, section("tcpcc"))) = &ops;
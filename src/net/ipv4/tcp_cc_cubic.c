@@ -0,0 +1,112 @@
+#include "tcp_cc.h"
+
+#include <sys/param.h>
+
+/*
+ * CUBIC congestion avoidance
+ *
+ *  CUBIC for Fast and Long-Distance Networks
+ *          https://datatracker.ietf.org/doc/html/rfc9438
+ *
+ * Integer only. Time is in ms, windows in bytes. With C = 0.4
+ * segments/s^3 the cubic term for 't' ms is mss * 2 * t^3 / 5e9 bytes
+ */
+
+#define CUBIC_T_MAX 100000 // ms, keeps mss * t^3 inside 64 bits
+
+static uint32_t
+icbrt64(uint64_t x)
+{
+  uint64_t y = 0;
+  for(int s = 63; s >= 0; s -= 3) {
+    y <<= 1;
+    const uint64_t b = 3 * y * (y + 1) + 1;
+    if((x >> s) >= b) {
+      x -= b << s;
+      y++;
+    }
+  }
+  return y;
+}
+
+
+static uint32_t
+cubic_delta(uint32_t mss, uint32_t t)
+{
+  t = MIN(t, CUBIC_T_MAX);
+  return (uint64_t)mss * 2 * t * t * t / 5000000000ULL;
+}
+
+
+static void
+cubic_init(tcp_cc_t *cc)
+{
+  cc->cubic.w_max = 0;
+  cc->cubic.epoch = 0;
+}
+
+
+static void
+cubic_cong_avoid(tcp_cc_t *cc, uint32_t acked, uint64_t now, uint32_t srtt)
+{
+  if(cc->cubic.epoch == 0) {
+    cc->cubic.epoch = now;
+    cc->cubic.w_est = cc->cwnd;
+    if(cc->cwnd < cc->cubic.w_max) {
+      // K = cbrt((W_max - cwnd) / C)
+      cc->cubic.k = icbrt64((uint64_t)(cc->cubic.w_max - cc->cwnd) *
+                            5000000000ULL / (2 * cc->mss));
+    } else {
+      cc->cubic.k = 0;
+      cc->cubic.w_max = cc->cwnd;
+    }
+  }
+
+  // Where the cubic curve will be one RTT from now
+  const uint32_t t = (now - cc->cubic.epoch) / 1000 + srtt;
+  uint32_t target;
+  if(t < cc->cubic.k) {
+    target = cc->cubic.w_max - cubic_delta(cc->mss, cc->cubic.k - t);
+  } else {
+    target = cc->cubic.w_max + cubic_delta(cc->mss, t - cc->cubic.k);
+  }
+  target = MIN(target, cc->cwnd + cc->cwnd / 2);
+
+  // Reno-friendly region, alpha = 3 * (1 - beta) / (1 + beta) ~ 9/17
+  cc->cubic.w_est += (uint64_t)acked * cc->mss * 9 / (17 * cc->cwnd);
+  target = MAX(target, cc->cubic.w_est);
+
+  uint32_t inc;
+  if(target > cc->cwnd) {
+    inc = (uint64_t)(target - cc->cwnd) * acked / cc->cwnd;
+  } else {
+    // Plateau, grow very slowly
+    inc = (uint64_t)acked * cc->mss / (100 * cc->cwnd);
+  }
+  cc->cwnd += MAX(inc, 1);
+}
+
+
+static void
+cubic_loss(tcp_cc_t *cc, uint32_t flight, uint64_t now)
+{
+  // Fast convergence: Release bandwidth if we didn't get back to the
+  // previous maximum
+  if(cc->cwnd < cc->cubic.w_max)
+    cc->cubic.w_max = cc->cwnd * 17 / 20;
+  else
+    cc->cubic.w_max = cc->cwnd;
+
+  cc->cubic.epoch = 0;
+  cc->ssthresh = MAX(cc->cwnd * 7 / 10, 2 * cc->mss); // beta = 0.7
+}
+
+
+static const tcp_cc_ops_t tcp_cc_cubic = {
+  .name = "cubic",
+  .init = cubic_init,
+  .cong_avoid = cubic_cong_avoid,
+  .loss = cubic_loss,
+};
+
+TCP_CC_DEF(tcp_cc_cubic);
@@ -0,0 +1,43 @@
+#include "tcp_cc.h"
+
+#include <sys/param.h>
+
+/*
+ * NewReno congestion avoidance
+ *
+ *  TCP Congestion Control
+ *          https://datatracker.ietf.org/doc/html/rfc5681
+ *
+ *  TCP Congestion Control with Appropriate Byte Counting (ABC)
+ *          https://datatracker.ietf.org/doc/html/rfc3465
+ *
+ * Recovery itself (RFC 6582) is handled by tcp.c
+ */
+
+static void
+newreno_cong_avoid(tcp_cc_t *cc, uint32_t acked, uint64_t now, uint32_t srtt)
+{
+  // One MSS per window's worth of acknowledged data
+  cc->reno.bytes_acked += acked;
+  if(cc->reno.bytes_acked >= cc->cwnd) {
+    cc->reno.bytes_acked -= cc->cwnd;
+    cc->cwnd += cc->mss;
+  }
+}
+
+
+static void
+newreno_loss(tcp_cc_t *cc, uint32_t flight, uint64_t now)
+{
+  cc->ssthresh = MAX(flight / 2, 2 * cc->mss);
+  cc->reno.bytes_acked = 0;
+}
+
+
+const tcp_cc_ops_t tcp_cc_newreno = {
+  .name = "newreno",
+  .cong_avoid = newreno_cong_avoid,
+  .loss = newreno_loss,
+};
+
+TCP_CC_DEF(tcp_cc_newreno);
@@ -38,15 +38,18 @@ mbus_crc32(struct pbuf *pb, uint32_t crc)
   return ~crc;
 }
 
-void
+error_t
 mbus_append_crc(struct pbuf *pb)
 {
   uint32_t crc = mbus_crc32(pb, 0);
   uint8_t *trailer = pbuf_append(pb, sizeof(uint32_t));
+  if(trailer == NULL)
+    return ERR_NO_BUFFER;
   trailer[0] = crc;
   trailer[1] = crc >> 8;
   trailer[2] = crc >> 16;
   trailer[3] = crc >> 24;
+  return 0;
 }
 
 
@@ -56,7 +59,8 @@ mbus_output_unicast(pbuf_t *pb)
   const uint8_t *hdr = pbuf_cdata(pb, 0);
   const int dst_addr = hdr[0];
 
-  mbus_append_crc(pb);
+  if(mbus_append_crc(pb))
+    return pb;
 
   mbus_netif_t *mni, *n;
   const uint32_t mask = 1 << dst_addr;
@@ -76,7 +80,7 @@ mbus_output_unicast(pbuf_t *pb)
       return mni->mni_output(mni, pb);
     }
 
-    pbuf_t *copy = pbuf_copy(pb, 0);
+    pbuf_t *copy = pbuf_clone(pb, 0);
     if(copy != NULL) {
 
       mni->mni_tx_bytes += pb->pb_pktlen;
@@ -106,7 +110,8 @@ mbus_output_flow(pbuf_t *pb, const mbus_flow_t *mf)
 static pbuf_t *
 mbus_ping(pbuf_t *pb, uint8_t remote_addr, uint16_t flow)
 {
-  pbuf_reset(pb, 0, 0);
+  if(pbuf_reset(pb, 0, 0))
+    return pb;
   uint8_t *pkt = pbuf_append(pb, 3);
   pkt[0] = remote_addr;
   pkt[1] = ((flow >> 3) & 0x60) | mbus_local_addr;
@@ -237,7 +242,7 @@ mbus_bcast(pbuf_t *pb, mbus_netif_t *src)
     if(mni == src)
       continue;
 
-    pbuf_t *copy = pbuf_copy(pb, 0);
+    pbuf_t *copy = pbuf_clone(pb, 0);
     if(copy == NULL)
       continue;
     mni->mni_tx_bytes += copy->pb_pktlen;
@@ -262,9 +267,8 @@ mbus_input(struct netif *ni, struct pbuf *pb)
     return pb;
   }
 
-  if(pbuf_pullup(pb, pb->pb_pktlen)) {
-    panic("pullup failed");
-  }
+  if(pbuf_pullup(pb, pb->pb_pktlen))
+    return pb; // Out of buffers (copy-on-write of a shared buffer)
 
   if(mbus_crc32(pb, 0)) {
     mni->mni_rx_crc_errors++;
@@ -364,7 +368,8 @@ mbus_dsig_output(struct netif *ni, pbuf_t *pb, uint32_t group, uint32_t flags)
   hdr[0] = 0x20 | (group >> 8);
   hdr[1] = group;
 
-  mbus_append_crc(pb);
+  if(mbus_append_crc(pb))
+    return pb;
 
   mbus_netif_t *mni = (mbus_netif_t *)ni;
   return mni->mni_output(mni, pb);
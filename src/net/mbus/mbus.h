@@ -44,4 +44,5 @@ void mbus_send(pbuf_t *pb);
 
 uint32_t mbus_crc32(struct pbuf *pb, uint32_t crc);
 
-void mbus_append_crc(struct pbuf *pb);
+__attribute__((warn_unused_result))
+error_t mbus_append_crc(struct pbuf *pb);
@@ -56,7 +56,8 @@ mbus_seqpkt_inter_flow_xmit(pbuf_t *pb, mbus_seqpkt_con_t *msc)
   hdr[1] = src_addr | ((flow >> 3) & 0x60);
   hdr[2] = flow;
 
-  mbus_append_crc(pb);
+  if(mbus_append_crc(pb))
+    return pb;
 
   STAILQ_INSERT_TAIL(&ms->ms_mni.mni_ni.ni_rx_queue, pb, pb_link);
   netif_wakeup(&ms->ms_mni.mni_ni);
@@ -95,7 +96,8 @@ mbus_seqpkt_inter_recv(pbuf_t *pb, mbus_seqpkt_con_t *msc)
   hdr[2] = flow;
   hdr[3] = (pb->pb_flags & 3) | (creds << 2);
 
-  mbus_append_crc(pb);
+  if(mbus_append_crc(pb))
+    return pb;
 
   STAILQ_INSERT_TAIL(&ms->ms_tx_queue, pb, pb_link);
   socket_wakeup(ms->ms_sock, SOCKET_EVENT_PULL);
@@ -130,7 +132,10 @@ give_credits(mbus_seqpkt_con_t *msc, int num_credits)
   hdr[2] = flow;
   hdr[3] = num_credits << 2;
 
-  mbus_append_crc(pb);
+  if(mbus_append_crc(pb)) {
+    pbuf_free(pb);
+    return 1;
+  }
 
   STAILQ_INSERT_TAIL(&ms->ms_tx_queue, pb, pb_link);
   socket_wakeup(ms->ms_sock, SOCKET_EVENT_PULL);
@@ -175,10 +180,12 @@ mbus_seqpkt_inter_svc_shut(mbus_seqpkt_con_t *msc, const char *reason)
   hdr[2] = flow;
   hdr[3] = SP_EOS;
 
-  mbus_append_crc(pb);
-
-  STAILQ_INSERT_TAIL(&ms->ms_tx_queue, pb, pb_link);
-  socket_wakeup(ms->ms_sock, SOCKET_EVENT_PULL);
+  if(mbus_append_crc(pb)) {
+    pbuf_free(pb);
+  } else {
+    STAILQ_INSERT_TAIL(&ms->ms_tx_queue, pb, pb_link);
+    socket_wakeup(ms->ms_sock, SOCKET_EVENT_PULL);
+  }
 
   msc->msc_sock.app_opaque = NULL;
 }
@@ -195,10 +202,10 @@ flow_find(mbus_svc_t *ms, uint32_t tag, int create)
   if(!create)
     return NULL;
 
-  mbus_seqpkt_con_t *msc = xalloc(sizeof(mbus_seqpkt_con_t), 0, MEM_MAY_FAIL);
+  mbus_seqpkt_con_t *msc = kmem_cache_alloc(&mbus_seqpkt_con_cache,
+                                            MEM_MAY_FAIL | MEM_CLEAR);
   if(msc == NULL)
     return NULL;
-  memset(msc, 0, sizeof(mbus_seqpkt_con_t));
   msc->msc_name = "gdproxy";
   msc->msc_remote_xmit_credits = 1;
 
@@ -240,7 +247,9 @@ ms_inspect_from_svc(mbus_svc_t *ms, pbuf_t *pb)
   }
 
   if(pbuf_pullup(pb, 4)) {
-    panic("%s: Pullup failed", __FUNCTION__);
+    // Copy-on-write of a shared buffer failed, drop it
+    pbuf_free(pb);
+    return NULL;
   }
   uint8_t *pkt = pbuf_data(pb, 0);
   const uint8_t dst_addr = pkt[0] & 0x3f;
@@ -265,7 +274,10 @@ ms_inspect_from_svc(mbus_svc_t *ms, pbuf_t *pb)
 
   if(create) {
     pkt[3] = 1; // Transform into regular SEQPKT flow
-    mbus_append_crc(pb);
+    if(mbus_append_crc(pb)) {
+      pbuf_free(pb);
+      return NULL;
+    }
     give_credits(msc, 15);
     return pb;
   }
@@ -321,7 +333,8 @@ ms_output(struct mbus_netif *mni, pbuf_t *pb)
   mbus_svc_t *ms = (mbus_svc_t *)mni;
 
   if(pbuf_pullup(pb, 4)) {
-    panic("pullup failed");
+    mni->mni_tx_fail++;
+    return pb;
   }
   const uint8_t *pkt = pbuf_cdata(pb, 0);
   const uint8_t dst_addr = pkt[0] & 0x3f;
@@ -14,7 +14,8 @@
 static pbuf_t *
 mbus_rpc_err(struct pbuf *pb, const mbus_flow_t *mf, error_t code)
 {
-  pbuf_reset(pb, 4, 0);
+  if(pbuf_reset(pb, 4, 0))
+    return pb;
   pb = pbuf_prepend(pb, 1, 0, 0);
   if(pb == NULL)
     return pb;
@@ -45,7 +46,7 @@ mbus_rpc_dispatch(struct pbuf *pb, uint8_t src_addr, uint16_t flow)
   if(reply == NULL)
     return mbus_rpc_err(pb, &mf, ERR_NO_BUFFER);
 
-  rpc_result_t rr;
+  rpc_result_t rr = {};
   rpc_args_t ra = {};
 
   error_t err = rpc_trampoline(&rr, &ra, rm);
@@ -28,6 +28,9 @@ static void mbus_seqpkt_maybe_destroy(mbus_seqpkt_con_t *msc);
 
 static pbuf_t *mbus_seqpkt_input(mbus_flow_t *mf, pbuf_t *pb);
 
+kmem_cache_t mbus_seqpkt_con_cache =
+  KMEM_CACHE_INITIALIZER("seqpkt", sizeof(mbus_seqpkt_con_t), 0);
+
 
 static uint32_t
 mbus_seqpkt_local_flow_get_header(void *opaque)
@@ -212,12 +215,12 @@ mbus_seqpkt_accept(pbuf_t *pb, uint8_t remote_addr, uint16_t flow)
     return pb;
   }
 
-  mbus_seqpkt_con_t *msc = xalloc(sizeof(mbus_seqpkt_con_t), 0, MEM_MAY_FAIL);
+  mbus_seqpkt_con_t *msc = kmem_cache_alloc(&mbus_seqpkt_con_cache,
+                                            MEM_MAY_FAIL | MEM_CLEAR);
   if(msc == NULL) {
     mbus_seqpkt_accept_err(name, "No memory", remote_addr);
     return pb;
   }
-  memset(msc, 0, sizeof(mbus_seqpkt_con_t));
 
   msc->msc_sock.max_fragment_size = MBUS_FRAGMENT_SIZE;
   msc->msc_sock.net = &mbus_seqpkt_fn;
@@ -225,7 +228,7 @@ mbus_seqpkt_accept(pbuf_t *pb, uint8_t remote_addr, uint16_t flow)
 
   error_t err = s->open_pushpull(&msc->msc_sock);
   if(err) {
-    free(msc);
+    kmem_cache_free(&mbus_seqpkt_con_cache, msc);
     mbus_seqpkt_accept_err(name, error_to_string(err), remote_addr);
     return pb;
   }
@@ -269,8 +272,10 @@ pbuf_for_xmit(mbus_seqpkt_con_t *msc, pbuf_t *pb)
       net_timer_arm(&msc->msc_rtx_timer, clock_get() + SP_TIME_RTX);
       return NULL;
     }
-  } else {
-    pbuf_reset(pb, 3, 0);
+  } else if(pbuf_reset(pb, 3, 0)) {
+    pbuf_free(pb);
+    net_timer_arm(&msc->msc_rtx_timer, clock_get() + SP_TIME_RTX);
+    return NULL;
   }
   return pb;
 }
@@ -441,7 +446,7 @@ mbus_seqpkt_maybe_destroy(mbus_seqpkt_con_t *msc)
   timer_disarm(&msc->msc_ka_timer);
   mbus_flow_remove(&msc->msc_flow);
   evlog(LOG_DEBUG, "seqpkt/%s: Destroyed", msc->msc_name);
-  free(msc);
+  kmem_cache_free(&mbus_seqpkt_con_cache, msc);
 }
 
 
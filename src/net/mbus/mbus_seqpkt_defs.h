@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <mios/kmem.h>
+
 #include "mbus_flow.h"
 
 #define MBUS_FRAGMENT_SIZE 56
@@ -93,6 +95,8 @@ typedef struct mbus_seqpkt_con {
 
 } mbus_seqpkt_con_t;
 
+extern kmem_cache_t mbus_seqpkt_con_cache;
+
 
 void mbus_seqpkt_txq_enq(mbus_seqpkt_con_t *msc, struct pbuf *pb);
 
@@ -48,11 +48,15 @@ SRCS-${ENABLE_NET_IPV4} += \
 	${SRC}/net/ipv4/igmp.c \
 	${SRC}/net/ipv4/udp.c \
 	${SRC}/net/ipv4/tcp.c \
+	${SRC}/net/ipv4/tcp_cc_newreno.c \
 	${SRC}/net/ipv4/dhcpv4.c \
 	${SRC}/net/ipv4/ntp.c \
 	${SRC}/net/ipv4/cmd_ipv4.c \
 	${SRC}/net/ipv4/mdns.c \
 
+SRCS-${ENABLE_NET_IPV4}-${ENABLE_NET_TCP_CUBIC} += \
+	${SRC}/net/ipv4/tcp_cc_cubic.c \
+
 SRCS-${ENABLE_NET_ETHER} += \
 	${SRC}/net/ether.c \
 	${SRC}/net/ethphy.c \
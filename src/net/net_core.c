@@ -18,6 +18,9 @@
 
 struct netif_list netifs;
 
+kmem_cache_t nexthop_cache = KMEM_CACHE_INITIALIZER("nexthop",
+                                                    sizeof(nexthop_t), 0);
+
 static mutex_t netif_mutex = MUTEX_INITIALIZER("netifs");
 
 static task_waitable_t net_waitq = WAITABLE_INITIALIZER("net");
@@ -56,7 +59,7 @@ netif_detach_task(netif_t *ni)
   for(nh = LIST_FIRST(&ni->ni_nexthops); nh != NULL; nh = n) {
     n = LIST_NEXT(nh, nh_netif_link);
     LIST_REMOVE(nh, nh_global_link);
-    free(nh);
+    kmem_cache_free(&nexthop_cache, nh);
   }
   LIST_INIT(&ni->ni_nexthops);
 
@@ -129,10 +132,10 @@ net_thread(void *arg)
       continue;
     }
 
-    const timer_t *t = LIST_FIRST(&net_timers);
-    if(t == NULL) {
+    const uint64_t next = timer_list_next(&net_timers);
+    if(next == 0) {
       task_sleep(&net_waitq);
-    } else if(task_sleep_deadline(&net_waitq, t->t_expire)) {
+    } else if(task_sleep_deadline(&net_waitq, next)) {
       uint64_t now = clock_get_irq_blocked();
       irq_permit(q);
       timer_dispatch(&net_timers, now);
@@ -168,8 +171,7 @@ net_buffers_available(void)
 void
 net_timer_arm(timer_t *t, uint64_t deadline)
 {
-  timer_arm_on_queue(t, deadline, &net_timers);
-  if(t == LIST_FIRST(&net_timers))
+  if(timer_arm_on_queue(t, deadline, &net_timers))
     task_wakeup(&net_waitq, 0);
 }
 
@@ -262,6 +264,13 @@ net_init(void)
   // we allocate some now
   pbuf_data_add(NULL, NULL);
 
+#if PBUF_SMALL_COUNT > 0
+  pbuf_data_add_class(PBUF_SMALL_SIZE, PBUF_SMALL_COUNT);
+#endif
+#if PBUF_LARGE_COUNT > 0
+  pbuf_data_add_class(PBUF_LARGE_SIZE, PBUF_LARGE_COUNT);
+#endif
+
 #ifdef ENABLE_NET_FPU_USAGE
   // This should really not be used.
   // The reason it's here is so various RPC handlers will work
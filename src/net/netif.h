@@ -3,6 +3,7 @@
 #include <mios/device.h>
 #include <mios/task.h>
 #include <mios/atomic.h>
+#include <mios/kmem.h>
 
 #include "pbuf.h"
 #include "net_task.h"
@@ -96,6 +97,8 @@ typedef struct nexthop {
 
 } nexthop_t;
 
+extern kmem_cache_t nexthop_cache;
+
 
 
 void netif_init(netif_t *ni, const char *name, const device_class_t *dc);
@@ -2,11 +2,14 @@
 #include <malloc.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <mios/task.h>
 #include <mios/mios.h>
 #include <sys/queue.h>
 #include <sys/param.h>
 #include <mios/pushpull.h>
+#include <mios/objpool.h>
+#include <mios/stream.h>
 
 #include "irq.h"
 #include "pbuf.h"
@@ -23,9 +26,61 @@ typedef struct pbuf_pool {
   task_waitable_t pp_wait;
   int pp_avail;
   int pp_total;
+  int pp_low;          // Lowest pp_avail seen
+  int pp_reserved;     // Held back for accounts below their minimum
+  uint32_t pp_allocs;
+  uint32_t pp_fails;   // Failed non-blocking allocations
+  uint64_t pp_pressure_since;  // When pp_avail dropped below PBUF_POOL_SPARE
+  uint64_t pp_pressure_time;   // Total time below PBUF_POOL_SPARE (µs)
 } pbuf_pool_t;
 
-static struct pbuf_pool pbuf_datas = { . pp_wait = WAITABLE_INITIALIZER("pbufdata")};
+// Always have some spare capacity for waiters
+#define PBUF_POOL_SPARE 2
+
+/*
+ * Data buffers come in up to three size classes. The default class
+ * (PBUF_DATA_SIZE) may consist of multiple arenas and is what
+ * pbuf_data_get() returns. The small and large classes each have a
+ * single arena so the class of a buffer can be derived from its address
+ */
+
+typedef struct pbuf_class {
+  pbuf_pool_t pc_pool;
+  void *pc_start;
+  void *pc_end;
+  size_t pc_size;
+} pbuf_class_t;
+
+#define PBUF_CLASS_SMALL   0
+#define PBUF_CLASS_DEFAULT 1
+#define PBUF_CLASS_LARGE   2
+#define PBUF_NUM_CLASSES   3
+
+#if PBUF_SMALL_COUNT > 0 && PBUF_SMALL_SIZE >= PBUF_DATA_SIZE
+#error PBUF_SMALL_SIZE must be smaller than PBUF_DATA_SIZE
+#endif
+
+#if PBUF_LARGE_COUNT > 0 && PBUF_LARGE_SIZE <= PBUF_DATA_SIZE
+#error PBUF_LARGE_SIZE must be larger than PBUF_DATA_SIZE
+#endif
+
+static pbuf_class_t pbuf_classes[PBUF_NUM_CLASSES] = {
+  [PBUF_CLASS_SMALL] = {
+    .pc_pool.pp_wait = WAITABLE_INITIALIZER("pbufsmall"),
+    .pc_size = PBUF_SMALL_SIZE,
+  },
+  [PBUF_CLASS_DEFAULT] = {
+    .pc_pool.pp_wait = WAITABLE_INITIALIZER("pbufdata"),
+    .pc_size = PBUF_DATA_SIZE,
+  },
+  [PBUF_CLASS_LARGE] = {
+    .pc_pool.pp_wait = WAITABLE_INITIALIZER("pbuflarge"),
+    .pc_size = PBUF_LARGE_SIZE,
+  },
+};
+
+#define pbuf_datas pbuf_classes[PBUF_CLASS_DEFAULT].pc_pool
+
 static struct pbuf_pool pbufs  = { . pp_wait = WAITABLE_INITIALIZER("pbuf")};
 
 int
@@ -40,6 +95,26 @@ pbuf_buffer_total(void)
   return pbuf_datas.pp_total;
 }
 
+
+static pbuf_class_t *
+pbuf_class_of(const void *ptr)
+{
+  pbuf_class_t *pc = &pbuf_classes[PBUF_CLASS_SMALL];
+  if(ptr >= pc->pc_start && ptr < pc->pc_end)
+    return pc;
+  pc = &pbuf_classes[PBUF_CLASS_LARGE];
+  if(ptr >= pc->pc_start && ptr < pc->pc_end)
+    return pc;
+  return &pbuf_classes[PBUF_CLASS_DEFAULT];
+}
+
+
+size_t
+pbuf_data_size(const void *ptr)
+{
+  return pbuf_class_of(ptr)->pc_size;
+}
+
 void __attribute__((weak))
 net_buffers_available(void)
 {
@@ -54,48 +129,87 @@ pbuf_pool_put(pbuf_pool_t *pp, void *item)
   assert(((unsigned long)item & 0x3) == 0);
   SLIST_INSERT_HEAD(&pp->pp_items, pi, pi_link);
 
-  if(pp->pp_avail == 0) {
+  if(pp->pp_avail <= pp->pp_reserved) {
     task_wakeup(&pp->pp_wait, 0);
     net_buffers_available();
   }
   pp->pp_avail++;
+
+  if(pp->pp_avail == PBUF_POOL_SPARE && pp->pp_pressure_since) {
+    pp->pp_pressure_time += clock_get() - pp->pp_pressure_since;
+    pp->pp_pressure_since = 0;
+  }
 }
 
-#include <stdlib.h>
 
-__attribute__((malloc, warn_unused_result))
-static void *
-pbuf_pool_get(pbuf_pool_t *pp, int wait PBUF_ORIGIN_ARG_DECL)
+#ifdef PBUF_ORIGIN_TRACE
+
+#define PBUF_FAIL_ORIGINS 8
+
+static struct {
+  const char *origin;
+  uint32_t count;
+} pbuf_fail_origins[PBUF_FAIL_ORIGINS];
+
+static void
+pbuf_fail_origin(const char *origin)
 {
-  if(!wait) {
-#if 0
-    if((rand() & 15) == 1) {
-      printf("Buffer drop (%s)\n", origin);
-      return NULL;
-    }
+  // Last slot collects everything that does not fit
+  int i;
+  for(i = 0; i < PBUF_FAIL_ORIGINS - 1; i++) {
+    if(pbuf_fail_origins[i].origin == NULL)
+      pbuf_fail_origins[i].origin = origin;
+    if(pbuf_fail_origins[i].origin == origin)
+      break;
+  }
+  pbuf_fail_origins[i].count++;
+}
 #endif
-    // Always have some spare capacity for waiters
-    if(pp->pp_avail < 2) {
-      return NULL;
-    }
 
-    pbuf_item_t *pi = SLIST_FIRST(&pp->pp_items);
-    SLIST_REMOVE_HEAD(&pp->pp_items, pi_link);
-    pp->pp_avail--;
-    return pi;
-  }
 
-  while(pp->pp_avail == 0) {
-    task_sleep(&pp->pp_wait);
-  }
+static void
+pbuf_pool_fail(pbuf_pool_t *pp PBUF_ORIGIN_ARG_DECL)
+{
+  pp->pp_fails++;
+#ifdef PBUF_ORIGIN_TRACE
+  pbuf_fail_origin(origin);
+#endif
+}
+
 
+static void *
+pbuf_pool_take(pbuf_pool_t *pp)
+{
   pbuf_item_t *pi = SLIST_FIRST(&pp->pp_items);
   SLIST_REMOVE_HEAD(&pp->pp_items, pi_link);
   pp->pp_avail--;
+  pp->pp_allocs++;
+  if(pp->pp_avail < pp->pp_low)
+    pp->pp_low = pp->pp_avail;
+  if(pp->pp_avail == PBUF_POOL_SPARE - 1)
+    pp->pp_pressure_since = clock_get() ?: 1;
   return pi;
 }
 
 
+__attribute__((malloc, warn_unused_result))
+static void *
+pbuf_pool_get(pbuf_pool_t *pp, int wait PBUF_ORIGIN_ARG_DECL)
+{
+  if(!wait) {
+    if(pp->pp_avail < PBUF_POOL_SPARE + pp->pp_reserved) {
+      pbuf_pool_fail(pp PBUF_ORIGIN_ARG_CALL);
+      return NULL;
+    }
+  } else {
+    while(pp->pp_avail <= pp->pp_reserved) {
+      task_sleep(&pp->pp_wait);
+    }
+  }
+  return pbuf_pool_take(pp);
+}
+
+
 static size_t
 pbuf_pool_add(pbuf_pool_t *pp, void *start, void *end, size_t item_size)
 {
@@ -107,59 +221,476 @@ pbuf_pool_add(pbuf_pool_t *pp, void *start, void *end, size_t item_size)
     count++;
   }
   pp->pp_total += count;
+  pp->pp_low += count;
   return count;
 }
 
+/*
+ * Per-consumer accounting
+ *
+ * An account limits how many default class data buffers a consumer
+ * (typically the RX path of a netif) may hold and guarantees it a
+ * minimum. The guaranteed buffers are held back from everybody else
+ * via pp_reserved as long as the account is below its minimum.
+ *
+ * The charge is kept with the data buffer, one byte per buffer in a
+ * table next to the arena it belongs to, and is dropped when the
+ * buffer goes back to the pool. That way it does not matter who
+ * releases it: the last clone, or a driver that detached pb_data and
+ * returns it with pbuf_data_put() once transmitted.
+ */
+
+#ifndef PBUF_ACCOUNTS_MAX
+#define PBUF_ACCOUNTS_MAX 8
+#endif
+
+// Slot 0 means not accounted
+static pbuf_account_t *pbuf_accounts[PBUF_ACCOUNTS_MAX + 1];
+static int pbuf_num_accounts;
+
+
+void
+pbuf_account_init(pbuf_account_t *pa, const char *name,
+                  unsigned int min, unsigned int max)
+{
+  memset(pa, 0, sizeof(pbuf_account_t));
+  pa->pa_name = name;
+  pa->pa_min = min;
+  pa->pa_max = max;
+
+  int q = irq_forbid(IRQ_LEVEL_NET);
+  if(pbuf_num_accounts == PBUF_ACCOUNTS_MAX) {
+    irq_permit(q);
+    printf("pbuf: No account slot for %s\n", name);
+    return;
+  }
+  pa->pa_id = ++pbuf_num_accounts;
+  pbuf_accounts[pa->pa_id] = pa;
+  pbuf_datas.pp_reserved += min;
+  irq_permit(q);
+}
+
+
+#ifndef PBUF_DATA_ARENAS
+#define PBUF_DATA_ARENAS 4
+#endif
+
+typedef struct pbuf_data_arena {
+  void *pda_start;
+  void *pda_end;
+  uint8_t *pda_account;  // pa_id charged per buffer, 0 = not charged
+} pbuf_data_arena_t;
+
+static pbuf_data_arena_t pbuf_data_arenas[PBUF_DATA_ARENAS];
+
+
+static void
+pbuf_data_arena_add(void *start, void *end, size_t count, void *caller)
+{
+  for(int i = 0; i < PBUF_DATA_ARENAS; i++) {
+    pbuf_data_arena_t *pda = &pbuf_data_arenas[i];
+    if(pda->pda_start != NULL)
+      continue;
+    pda->pda_account = xalloc_caller(count, 0, MEM_CLEAR, caller);
+    pda->pda_start = start;
+    pda->pda_end = end;
+    return;
+  }
+  panic("pbuf: Too many data arenas");
+}
+
+
+static uint8_t *
+pbuf_account_slot(const void *buf)
+{
+  for(int i = 0; i < PBUF_DATA_ARENAS; i++) {
+    const pbuf_data_arena_t *pda = &pbuf_data_arenas[i];
+    if(buf >= pda->pda_start && buf < pda->pda_end)
+      return pda->pda_account + (buf - pda->pda_start) / PBUF_DATA_SIZE;
+  }
+  return NULL;
+}
+
+
+// Drop the charge (if any) of a default class data buffer
+static void
+pbuf_account_uncharge(void *buf)
+{
+  uint8_t *slot = pbuf_account_slot(buf);
+  if(slot == NULL || *slot == 0)
+    return;
+
+  pbuf_account_t *pa = pbuf_accounts[*slot];
+  *slot = 0;
+  pa->pa_inuse--;
+  if(pa->pa_inuse < pa->pa_min)
+    pbuf_datas.pp_reserved++;
+
+  // Consumers that were refused (typically because they hit pa_max)
+  // retry from net_buffers_available(). The pool itself only signals
+  // when it runs low, so tell them here that there is room again
+  if(pa->pa_starved) {
+    pa->pa_starved = 0;
+    task_wakeup(&pbuf_datas.pp_wait, 0);
+    net_buffers_available();
+  }
+}
+
+
 #ifndef PBUF_DEFAULT_COUNT
 #define PBUF_DEFAULT_COUNT 8
 #endif
 
 
-void
-pbuf_data_add(void *start, void *end)
+static void
+pbuf_alloc0(size_t count, void *caller)
+{
+  void *start = xalloc_caller(count * sizeof(pbuf_t), 0, 0, caller);
+  void *end = start + count * sizeof(pbuf_t);
+  pbuf_pool_add(&pbufs, start, end, sizeof(pbuf_t));
+}
+
+
+static void
+pbuf_data_add0(void *start, void *end, void *caller)
 {
   if(end == NULL) {
     if(pbuf_datas.pp_avail)
       return;
     const size_t size = PBUF_DATA_SIZE * PBUF_DEFAULT_COUNT;
-    start = xalloc(size, CACHE_LINE_SIZE, MEM_TYPE_DMA);
+    start = xalloc_caller(size, CACHE_LINE_SIZE, MEM_TYPE_DMA, caller);
     end = start + size;
   }
   size_t count = pbuf_pool_add(&pbuf_datas, start, end, PBUF_DATA_SIZE);
+  pbuf_data_arena_add(start, end, count, caller);
   printf("pbuf: size:%d arena:%zd count:%zd\n",
          PBUF_DATA_SIZE, end - start, count);
-  pbuf_alloc(count);
+  pbuf_alloc0(count, caller);
+}
+
+
+void
+pbuf_data_add(void *start, void *end)
+{
+  pbuf_data_add0(start, end, MALLOC_CALLER);
 }
 
+
+void
+pbuf_data_add_class(size_t size, size_t count)
+{
+  void *const caller = MALLOC_CALLER;
+
+  if(size == PBUF_DATA_SIZE) {
+    const size_t bytes = size * count;
+    void *start = xalloc_caller(bytes, CACHE_LINE_SIZE, MEM_TYPE_DMA, caller);
+    pbuf_data_add0(start, start + bytes, caller);
+    return;
+  }
+
+  pbuf_class_t *pc;
+  if(size == PBUF_SMALL_SIZE && size < PBUF_DATA_SIZE) {
+    pc = &pbuf_classes[PBUF_CLASS_SMALL];
+  } else if(size == PBUF_LARGE_SIZE && size > PBUF_DATA_SIZE) {
+    pc = &pbuf_classes[PBUF_CLASS_LARGE];
+  } else {
+    panic("pbuf: Invalid size class %zd", size);
+  }
+
+  if(pc->pc_start != NULL)
+    panic("pbuf: Size class %zd already populated", size);
+
+  const size_t bytes = size * count;
+  void *start = xalloc_caller(bytes, CACHE_LINE_SIZE, MEM_TYPE_DMA, caller);
+  pc->pc_start = start;
+  pc->pc_end = start + bytes;
+  int q = irq_forbid(IRQ_LEVEL_NET);
+  pbuf_pool_add(&pc->pc_pool, start, start + bytes, size);
+  irq_permit(q);
+  printf("pbuf: size:%zd count:%zd\n", size, count);
+  pbuf_alloc0(count, caller);
+}
+
+
 void *
 pbuf_data_get0(int wait PBUF_ORIGIN_ARG_DECL)
 {
   return pbuf_pool_get(&pbuf_datas, wait PBUF_ORIGIN_ARG_CALL);
 }
 
+
+void *
+pbuf_data_get_sized0(size_t size, int wait PBUF_ORIGIN_ARG_DECL)
+{
+  pbuf_class_t *pc = NULL;
+  if(size <= PBUF_SMALL_SIZE)
+    pc = &pbuf_classes[PBUF_CLASS_SMALL];
+  else if(size > PBUF_DATA_SIZE)
+    pc = &pbuf_classes[PBUF_CLASS_LARGE];
+
+  if(pc != NULL && pc->pc_pool.pp_total) {
+    void *r = pbuf_pool_get(&pc->pc_pool, 0 PBUF_ORIGIN_ARG_CALL);
+    if(r != NULL)
+      return r;
+  }
+  return pbuf_pool_get(&pbuf_datas, wait PBUF_ORIGIN_ARG_CALL);
+}
+
+
+/*
+ * IRQ-safe allocation
+ *
+ * The pools above must be accessed with IRQ_LEVEL_NET forbidden.
+ * pbuf_irq_reserve() moves pbufs and default class data buffers to
+ * lock-free stashes (objpool_t) which pbuf_make_irq() can take from at
+ * any interrupt level without masking anything. The stashes are topped
+ * up with buffers as they are released, as long as that does not
+ * starve the regular pools.
+ */
+
+static objpool_t pbuf_irq_pbufs;
+static objpool_t pbuf_irq_datas;
+static int pbuf_irq_target;
+
+
+static int
+pbuf_irq_divert(pbuf_pool_t *pp, objpool_t *stash)
+{
+  return objpool_avail(stash) < pbuf_irq_target &&
+    pp->pp_avail >= PBUF_POOL_SPARE + pp->pp_reserved;
+}
+
+
+void
+pbuf_irq_reserve(size_t count)
+{
+  int q = irq_forbid(IRQ_LEVEL_NET);
+  pbuf_irq_target += count;
+  while(pbuf_irq_divert(&pbufs, &pbuf_irq_pbufs))
+    objpool_put(&pbuf_irq_pbufs, pbuf_pool_take(&pbufs));
+  while(pbuf_irq_divert(&pbuf_datas, &pbuf_irq_datas))
+    objpool_put(&pbuf_irq_datas, pbuf_pool_take(&pbuf_datas));
+  irq_permit(q);
+}
+
+
+pbuf_t *
+pbuf_make_irq(int offset)
+{
+  pbuf_t *pb = objpool_get(&pbuf_irq_pbufs);
+  if(pb == NULL)
+    return NULL;
+  void *data = objpool_get(&pbuf_irq_datas);
+  if(data == NULL) {
+    objpool_put(&pbuf_irq_pbufs, pb);
+    return NULL;
+  }
+  pb->pb_next = NULL;
+  pb->pb_data = data;
+  pb->pb_flags = PBUF_SOP | PBUF_EOP;
+  pb->pb_credits = 0;
+  pb->pb_pktlen = 0;
+  pb->pb_offset = offset;
+  pb->pb_buflen = 0;
+  return pb;
+}
+
+
+void
+pbuf_free_irq(pbuf_t *pb)
+{
+  pbuf_t *next;
+  for(; pb != NULL; pb = next) {
+    next = pb->pb_next;
+    objpool_put(&pbuf_irq_datas, pb->pb_data);
+    objpool_put(&pbuf_irq_pbufs, pb);
+  }
+}
+
+
+// Return a data buffer to its pool. Caller must hold the only reference
+static void
+pbuf_data_free(void *buf)
+{
+  pbuf_class_t *pc = pbuf_class_of(buf);
+  if(pc == &pbuf_classes[PBUF_CLASS_DEFAULT]) {
+    pbuf_account_uncharge(buf);
+    if(pbuf_irq_divert(&pbuf_datas, &pbuf_irq_datas)) {
+      objpool_put(&pbuf_irq_datas, buf);
+      return;
+    }
+  }
+  pbuf_pool_put(&pc->pc_pool, buf);
+}
+
+
+// Get a data buffer of the same class as 'src'. Falls back to the
+// default class if that is large enough
+static void *
+pbuf_data_get_like(const void *src, int wait PBUF_ORIGIN_ARG_DECL)
+{
+  pbuf_class_t *pc = pbuf_class_of(src);
+  if(pc == &pbuf_classes[PBUF_CLASS_DEFAULT])
+    return pbuf_pool_get(&pbuf_datas, wait PBUF_ORIGIN_ARG_CALL);
+
+  void *r = pbuf_pool_get(&pc->pc_pool, 0 PBUF_ORIGIN_ARG_CALL);
+  if(r == NULL && pc->pc_size < PBUF_DATA_SIZE)
+    r = pbuf_pool_get(&pbuf_datas, wait PBUF_ORIGIN_ARG_CALL);
+  return r;
+}
+
+
+/*
+ * Shared data buffers
+ *
+ * pbuf_clone() creates pbufs that refer to the same data buffers as
+ * the original. Only buffers with more than one reference are tracked
+ * (in a small table), all other buffers have a single owner.
+ *
+ * A shared buffer is never written to. pbuf_prepend(), pbuf_append(),
+ * pbuf_pullup(), pbuf_write() and pbuf_reset() give the pbuf a private
+ * copy first (copy-on-write). That can fail for lack of buffers, in
+ * which case they return an error like any other allocation failure.
+ * Code that writes to pbuf_data() of a received packet without going
+ * through any of those must call pbuf_unshare() itself.
+ *
+ * Drivers that detach pb_data and release it later with pbuf_data_put()
+ * (Ethernet TX rings) only drop their own reference, so a buffer still
+ * held by other clones (the TCP retransmit queue with zero-copy TX)
+ * stays alive.
+ */
+
+#ifndef PBUF_SHARED_MAX
+#define PBUF_SHARED_MAX 16
+#endif
+
+typedef struct pbuf_shared {
+  void *ps_data;
+  uint32_t ps_refs;
+} pbuf_shared_t;
+
+static pbuf_shared_t pbuf_shared[PBUF_SHARED_MAX];
+static int pbuf_shared_count;
+static uint32_t pbuf_clones;
+static uint32_t pbuf_cow_copies;
+
+
+static pbuf_shared_t *
+pbuf_shared_find(const void *data)
+{
+  if(!pbuf_shared_count)
+    return NULL;
+  for(int i = 0; i < PBUF_SHARED_MAX; i++) {
+    if(pbuf_shared[i].ps_data == data)
+      return &pbuf_shared[i];
+  }
+  return NULL;
+}
+
+
+static int
+pbuf_shared_ref(void *data)
+{
+  pbuf_shared_t *ps = pbuf_shared_find(data);
+  if(ps == NULL) {
+    if(pbuf_shared_count == PBUF_SHARED_MAX)
+      return -1;
+    ps = pbuf_shared;
+    while(ps->ps_data != NULL)
+      ps++;
+    ps->ps_data = data;
+    ps->ps_refs = 1;
+    pbuf_shared_count++;
+  }
+  ps->ps_refs++;
+  return 0;
+}
+
+
+static void
+pbuf_shared_unref(pbuf_shared_t *ps)
+{
+  if(--ps->ps_refs == 1) {
+    // Last reference is now the sole owner
+    ps->ps_data = NULL;
+    pbuf_shared_count--;
+  }
+}
+
+
 void
 pbuf_data_put(void *buf)
 {
-  pbuf_pool_put(&pbuf_datas, buf);
+  pbuf_shared_t *ps = pbuf_shared_find(buf);
+  if(ps != NULL) {
+    pbuf_shared_unref(ps);
+    return;
+  }
+  pbuf_data_free(buf);
+}
+
+
+static void
+pbuf_data_release(pbuf_t *pb)
+{
+  pbuf_shared_t *ps = pbuf_shared_find(pb->pb_data);
+  if(ps != NULL) {
+    pbuf_shared_unref(ps);
+  } else {
+    pbuf_data_free(pb->pb_data);
+  }
+}
+
+
+error_t
+pbuf_unshare(pbuf_t *pb)
+{
+  int q = irq_forbid(IRQ_LEVEL_NET);
+  if(pbuf_shared_find(pb->pb_data) == NULL) {
+    irq_permit(q);
+    return 0;
+  }
+
+#ifdef PBUF_ORIGIN_TRACE
+  void *data = pbuf_data_get_like(pb->pb_data, 0, __FUNCTION__);
+#else
+  void *data = pbuf_data_get_like(pb->pb_data, 0);
+#endif
+  irq_permit(q);
+  if(data == NULL)
+    return ERR_NO_BUFFER;
+
+  // Our reference keeps the source alive while copying
+  memcpy(data + pb->pb_offset, pb->pb_data + pb->pb_offset, pb->pb_buflen);
+
+  q = irq_forbid(IRQ_LEVEL_NET);
+  pbuf_data_release(pb);
+  pb->pb_data = data;
+  pbuf_cow_copies++;
+  irq_permit(q);
+  return 0;
 }
 
 void
 pbuf_alloc(size_t count)
 {
-  void *start = xalloc(count * sizeof(pbuf_t), 0, 0);
-  void *end = start + count * sizeof(pbuf_t);
-  pbuf_pool_add(&pbufs, start, end, sizeof(pbuf_t));
+  pbuf_alloc0(count, MALLOC_CALLER);
 }
 
 pbuf_t *
 pbuf_get0(int wait PBUF_ORIGIN_ARG_DECL)
 {
-  return pbuf_pool_get(&pbufs, wait PBUF_ORIGIN_ARG_CALL);
+  pbuf_t *pb = pbuf_pool_get(&pbufs, wait PBUF_ORIGIN_ARG_CALL);
+  return pb;
 }
 
 void
 pbuf_put(pbuf_t *pb)
 {
+  if(pbuf_irq_divert(&pbufs, &pbuf_irq_pbufs)) {
+    objpool_put(&pbuf_irq_pbufs, pb);
+    return;
+  }
   pbuf_pool_put(&pbufs, pb);
 }
 
@@ -170,7 +701,7 @@ pbuf_free_irq_blocked(pbuf_t *pb)
   pbuf_t *next;
   for(; pb ; pb = next) {
     next = pb->pb_next;
-    pbuf_data_put(pb->pb_data);
+    pbuf_data_release(pb);
     pbuf_put(pb);
   }
 }
@@ -225,7 +756,7 @@ pbuf_read(pbuf_t *pb, void *ptr, size_t len)
       if(n != NULL)
         n->pb_pktlen = pb->pb_pktlen;
       int q = irq_forbid(IRQ_LEVEL_NET);
-      pbuf_data_put(pb->pb_data);
+      pbuf_data_release(pb);
       pbuf_put(pb);
       irq_permit(q);
       pb = n;
@@ -249,6 +780,11 @@ pbuf_write(pbuf_t *head, const void *data, size_t len, const pushpull_t *pp,
     pb = pb->pb_next;
   }
 
+  if(pbuf_unshare(pb)) {
+    pbuf_free(head);
+    return NULL;
+  }
+
   while(len) {
 
     if(pb->pb_buflen >= pp->max_fragment_size) {
@@ -325,7 +861,7 @@ pbuf_drop(pbuf_t *pb, size_t bytes, int free_when_empty)
       }
 
       int q = irq_forbid(IRQ_LEVEL_NET);
-      pbuf_data_put(pb->pb_data);
+      pbuf_data_release(pb);
       pbuf_put(pb);
       irq_permit(q);
 
@@ -359,7 +895,7 @@ pbuf_trim(pbuf_t *pb, size_t bytes)
       prev->pb_flags |= tail->pb_flags & PBUF_EOP;
       prev->pb_next = NULL;
 
-      pbuf_data_put(tail->pb_data);
+      pbuf_data_release(tail);
       pbuf_put(tail);
     }
   }
@@ -371,6 +907,10 @@ pbuf_t *
 pbuf_prepend(pbuf_t *pb, size_t bytes, int wait, size_t extra_offset)
 {
   if(bytes + extra_offset <= pb->pb_offset) {
+    if(pbuf_unshare(pb)) {
+      pbuf_free(pb);
+      return NULL;
+    }
     pb->pb_offset -= bytes;
     pb->pb_buflen += bytes;
     pb->pb_pktlen += bytes;
@@ -395,14 +935,18 @@ pbuf_prepend(pbuf_t *pb, size_t bytes, int wait, size_t extra_offset)
 void *
 pbuf_append(pbuf_t *pb, size_t bytes)
 {
-  pb->pb_pktlen += bytes;
+  pbuf_t *head = pb;
 
   // Jump to end of chain
   while(pb->pb_next) {
     pb = pb->pb_next;
   }
 
-  assert(pb->pb_offset + pb->pb_buflen + bytes <= PBUF_DATA_SIZE);
+  if(pbuf_unshare(pb))
+    return NULL;
+
+  head->pb_pktlen += bytes;
+  assert(pb->pb_offset + pb->pb_buflen + bytes <= pbuf_data_size(pb->pb_data));
   void *r = pb->pb_data + pb->pb_offset + pb->pb_buflen;
   pb->pb_buflen += bytes;
   return r;
@@ -422,8 +966,12 @@ pbuf_pullup(pbuf_t *pb, size_t bytes)
   if(pb->pb_buflen >= bytes)
     return 0;
 
-  if(bytes + pb->pb_offset > PBUF_DATA_SIZE) {
-    assert(bytes <= PBUF_DATA_SIZE);
+  if(pbuf_unshare(pb))
+    return bytes - pb->pb_buflen;
+
+  const size_t data_size = pbuf_data_size(pb->pb_data);
+  if(bytes + pb->pb_offset > data_size) {
+    assert(bytes <= data_size);
     memcpy(pb->pb_data, pb->pb_data + pb->pb_offset, pb->pb_buflen);
     pb->pb_offset = 0;
   }
@@ -449,7 +997,7 @@ pbuf_pullup(pbuf_t *pb, size_t bytes)
       pb->pb_flags |= next->pb_flags & PBUF_EOP;
       pb->pb_credits += next->pb_credits;
       int q = irq_forbid(IRQ_LEVEL_NET);
-      pbuf_data_put(next->pb_data);
+      pbuf_data_release(next);
       pbuf_put(next);
       irq_permit(q);
     }
@@ -520,11 +1068,14 @@ pbuf_memcmp_at(pbuf_t *pb, const void *data, size_t offset, size_t len)
 }
 
 
-void
+error_t
 pbuf_reset(pbuf_t *pb, size_t header_size, size_t len)
 {
   assert(pb->pb_buflen >= len);
 
+  if(pbuf_unshare(pb))
+    return ERR_NO_BUFFER;
+
   if(pb->pb_next) {
     pbuf_free(pb->pb_next);
     pb->pb_next = NULL;
@@ -534,15 +1085,26 @@ pbuf_reset(pbuf_t *pb, size_t header_size, size_t len)
   pb->pb_offset = header_size;
   pb->pb_buflen = len;
   pb->pb_pktlen = len;
+  return 0;
 }
 
 pbuf_t *
 pbuf_make_irq_blocked0(int offset, int wait PBUF_ORIGIN_ARG_DECL)
+{
+  return pbuf_make_sized_irq_blocked0(offset, PBUF_DATA_SIZE - offset,
+                                      wait PBUF_ORIGIN_ARG_CALL);
+}
+
+
+pbuf_t *
+pbuf_make_sized_irq_blocked0(int offset, size_t size,
+                             int wait PBUF_ORIGIN_ARG_DECL)
 {
   pbuf_t *pb = pbuf_get0(wait PBUF_ORIGIN_ARG_CALL);
   if(pb != NULL) {
     pb->pb_next = NULL;
-    pb->pb_data = pbuf_data_get0(wait PBUF_ORIGIN_ARG_CALL);
+    pb->pb_data = pbuf_data_get_sized0(offset + size,
+                                       wait PBUF_ORIGIN_ARG_CALL);
     if(pb->pb_data == NULL) {
       pbuf_put(pb);
     } else {
@@ -558,6 +1120,70 @@ pbuf_make_irq_blocked0(int offset, int wait PBUF_ORIGIN_ARG_DECL)
 }
 
 
+pbuf_t *
+pbuf_make_account_irq_blocked0(pbuf_account_t *pa, int offset
+                               PBUF_ORIGIN_ARG_DECL)
+{
+  if(pa->pa_id == 0)
+    return pbuf_make_irq_blocked0(offset, 0 PBUF_ORIGIN_ARG_CALL);
+
+  pbuf_pool_t *pp = &pbuf_datas;
+  const int guaranteed = pa->pa_inuse < pa->pa_min;
+
+  if(pa->pa_max && pa->pa_inuse >= pa->pa_max) {
+    pa->pa_denied++;
+    pa->pa_starved = 1;
+    return NULL;
+  }
+
+  if(guaranteed ? pp->pp_avail == 0 :
+     pp->pp_avail < PBUF_POOL_SPARE + pp->pp_reserved) {
+    pa->pa_denied++;
+    pa->pa_starved = 1;
+    pbuf_pool_fail(pp PBUF_ORIGIN_ARG_CALL);
+    return NULL;
+  }
+
+  pbuf_t *pb = pbuf_get0(0 PBUF_ORIGIN_ARG_CALL);
+  if(pb == NULL) {
+    pa->pa_denied++;
+    pa->pa_starved = 1;
+    return NULL;
+  }
+
+  pb->pb_data = pbuf_pool_take(pp);
+  if(guaranteed)
+    pp->pp_reserved--;
+
+  uint8_t *slot = pbuf_account_slot(pb->pb_data);
+  assert(slot != NULL && *slot == 0);
+  *slot = pa->pa_id;
+
+  pa->pa_inuse++;
+  if(pa->pa_inuse > pa->pa_peak)
+    pa->pa_peak = pa->pa_inuse;
+
+  pb->pb_next = NULL;
+  pb->pb_flags = PBUF_SOP | PBUF_EOP;
+  pb->pb_credits = 0;
+  pb->pb_pktlen = 0;
+  pb->pb_offset = offset;
+  pb->pb_buflen = 0;
+  return pb;
+}
+
+
+pbuf_t *
+pbuf_make_account0(pbuf_account_t *pa, int offset PBUF_ORIGIN_ARG_DECL)
+{
+  int q = irq_forbid(IRQ_LEVEL_NET);
+  pbuf_t *pb = pbuf_make_account_irq_blocked0(pa, offset
+                                              PBUF_ORIGIN_ARG_CALL);
+  irq_permit(q);
+  return pb;
+}
+
+
 pbuf_t *
 pbuf_make0(int offset, int wait PBUF_ORIGIN_ARG_DECL)
 {
@@ -568,6 +1194,18 @@ pbuf_make0(int offset, int wait PBUF_ORIGIN_ARG_DECL)
 }
 
 
+pbuf_t *
+pbuf_make_sized0(int offset, size_t size, int wait PBUF_ORIGIN_ARG_DECL)
+{
+  int q = irq_forbid(IRQ_LEVEL_NET);
+  pbuf_t *pb = pbuf_make_sized_irq_blocked0(offset, size,
+                                            wait PBUF_ORIGIN_ARG_CALL);
+  irq_permit(q);
+  return pb;
+}
+
+
+
 pbuf_t *
 pbuf_copy0(const pbuf_t *src, int wait PBUF_ORIGIN_ARG_DECL)
 {
@@ -575,7 +1213,7 @@ pbuf_copy0(const pbuf_t *src, int wait PBUF_ORIGIN_ARG_DECL)
   pbuf_t *dst = pbuf_get0(wait PBUF_ORIGIN_ARG_CALL);
   if(dst != NULL) {
     dst->pb_next = NULL;
-    dst->pb_data = pbuf_data_get0(wait PBUF_ORIGIN_ARG_CALL);
+    dst->pb_data = pbuf_data_get_like(src->pb_data, wait PBUF_ORIGIN_ARG_CALL);
     if(dst->pb_data == NULL) {
       pbuf_put(dst);
     } else {
@@ -611,7 +1249,11 @@ pbuf_copy_pkt(const pbuf_t *src, int wait)
     }
 
     dst->pb_next = NULL;
-    dst->pb_data = pbuf_data_get(wait);
+#ifdef PBUF_ORIGIN_TRACE
+    dst->pb_data = pbuf_data_get_like(src->pb_data, wait, __FUNCTION__);
+#else
+    dst->pb_data = pbuf_data_get_like(src->pb_data, wait);
+#endif
     if(dst->pb_data == NULL) {
       pbuf_put(dst);
       pbuf_free_irq_blocked(r);
@@ -637,12 +1279,182 @@ pbuf_copy_pkt(const pbuf_t *src, int wait)
 }
 
 
+/*
+ * Make 'dst' refer to 'len' bytes at 'offset' in the data buffer of
+ * 'src' without copying. Falls back to a copy if we're out of share
+ * slots. Called with IRQ_LEVEL_NET blocked
+ */
+static error_t
+pbuf_share_data(pbuf_t *dst, const pbuf_t *src, size_t offset, size_t len,
+                int wait PBUF_ORIGIN_ARG_DECL)
+{
+  dst->pb_offset = src->pb_offset + offset;
+  dst->pb_buflen = len;
+
+  if(!pbuf_shared_ref(src->pb_data)) {
+    dst->pb_data = src->pb_data;
+    pbuf_clones++;
+    return 0;
+  }
+
+  // Out of share slots, fall back to a copy
+  dst->pb_data = pbuf_data_get_like(src->pb_data, wait PBUF_ORIGIN_ARG_CALL);
+  if(dst->pb_data == NULL)
+    return ERR_NO_BUFFER;
+
+  memcpy(dst->pb_data + dst->pb_offset, src->pb_data + dst->pb_offset, len);
+  return 0;
+}
+
+
+pbuf_t *
+pbuf_clone0(const pbuf_t *src, int wait PBUF_ORIGIN_ARG_DECL)
+{
+  pbuf_t *r = NULL;
+  pbuf_t **dp = &r;
+
+  int q = irq_forbid(IRQ_LEVEL_NET);
+
+  while(src) {
+    pbuf_t *dst = pbuf_get0(wait PBUF_ORIGIN_ARG_CALL);
+    if(dst == NULL) {
+      pbuf_free_irq_blocked(r);
+      r = NULL;
+      break;
+    }
+
+    dst->pb_next = NULL;
+    dst->pb_flags = src->pb_flags;
+    dst->pb_credits = 0;
+    dst->pb_pktlen = src->pb_pktlen;
+
+    if(pbuf_share_data(dst, src, 0, src->pb_buflen,
+                       wait PBUF_ORIGIN_ARG_CALL)) {
+      pbuf_put(dst);
+      pbuf_free_irq_blocked(r);
+      r = NULL;
+      break;
+    }
+
+    *dp = dst;
+    dp = &dst->pb_next;
+    src = src->pb_next;
+    if(src == NULL || src->pb_flags & PBUF_SOP)
+      break;
+  }
+  irq_permit(q);
+  return r;
+}
+
+
+pbuf_t *
+pbuf_clone_range0(const pbuf_t *src, size_t offset, size_t len,
+                  int wait PBUF_ORIGIN_ARG_DECL)
+{
+  pbuf_t *r = NULL;
+  pbuf_t *tail = NULL;
+  size_t total = 0;
+
+  while(src != NULL && offset >= src->pb_buflen) {
+    offset -= src->pb_buflen;
+    src = src->pb_next;
+  }
+
+  int q = irq_forbid(IRQ_LEVEL_NET);
+
+  for(; src != NULL && total < len; src = src->pb_next, offset = 0) {
+    const size_t chunk = MIN(len - total, src->pb_buflen - offset);
+    if(chunk == 0)
+      continue;
+
+    pbuf_t *dst = pbuf_get0(wait PBUF_ORIGIN_ARG_CALL);
+    if(dst == NULL)
+      goto fail;
+
+    dst->pb_next = NULL;
+    dst->pb_flags = 0;
+    dst->pb_credits = 0;
+    dst->pb_pktlen = 0;
+
+    if(pbuf_share_data(dst, src, offset, chunk, wait PBUF_ORIGIN_ARG_CALL)) {
+      pbuf_put(dst);
+      goto fail;
+    }
+
+    if(tail == NULL)
+      r = dst;
+    else
+      tail->pb_next = dst;
+    tail = dst;
+    total += chunk;
+  }
+
+  if(r != NULL) {
+    r->pb_flags |= PBUF_SOP;
+    r->pb_pktlen = total;
+    tail->pb_flags |= PBUF_EOP;
+  }
+  irq_permit(q);
+  return r;
+
+ fail:
+  pbuf_free_irq_blocked(r);
+  irq_permit(q);
+  return NULL;
+}
+
+
 void
 pbuf_status(stream_t *st)
 {
-  stprintf(st, "pbuf size:%d\n", (int)PBUF_DATA_SIZE);
-  stprintf(st, "pbuf: %d avail\n", pbufs.pp_avail);
-  stprintf(st, "pbuf_data: %d avail\n", pbuf_datas.pp_avail);
+  static const char classnames[PBUF_NUM_CLASSES][8] = {
+    "small", "default", "large"
+  };
+  const uint64_t now = clock_get();
+  stprintf(st, "pbuf: %d avail, %u fails\n", pbufs.pp_avail, pbufs.pp_fails);
+  stprintf(st, "pbuf_data: Class    Size Total Avail   Low  Rsvd     Allocs   Fails  Starved\n");
+  for(int i = 0; i < PBUF_NUM_CLASSES; i++) {
+    const pbuf_class_t *pc = &pbuf_classes[i];
+    const pbuf_pool_t *pp = &pc->pc_pool;
+    if(!pp->pp_total)
+      continue;
+    uint64_t starved = pp->pp_pressure_time;
+    if(pp->pp_pressure_since)
+      starved += now - pp->pp_pressure_since;
+    stprintf(st, "           %-7s %5zd %5d %5d %5d %5d %10u %7u %6dms\n",
+             classnames[i], pc->pc_size, pp->pp_total, pp->pp_avail,
+             pp->pp_low, pp->pp_reserved, pp->pp_allocs, pp->pp_fails,
+             (int)(starved / 1000));
+  }
+  stprintf(st, "pbuf_data: %d shared, %u clones, %u copy-on-write\n",
+           pbuf_shared_count, pbuf_clones, pbuf_cow_copies);
+  if(pbuf_irq_target) {
+    stprintf(st, "pbuf_irq: %d reserved, %d pbufs, %d data, %d empty\n",
+             pbuf_irq_target, objpool_avail(&pbuf_irq_pbufs),
+             objpool_avail(&pbuf_irq_datas),
+             atomic_get(&pbuf_irq_pbufs.op_fails) +
+             atomic_get(&pbuf_irq_datas.op_fails));
+  }
+
+  if(pbuf_num_accounts) {
+    stprintf(st, "pbuf_account: Name             Min   Max Inuse  Peak   Denied\n");
+    for(int i = 1; i <= pbuf_num_accounts; i++) {
+      const pbuf_account_t *pa = pbuf_accounts[i];
+      stprintf(st, "              %-15s %4d %5d %5d %5d %8u\n",
+               pa->pa_name, pa->pa_min, pa->pa_max, pa->pa_inuse,
+               pa->pa_peak, pa->pa_denied);
+    }
+  }
+
+#ifdef PBUF_ORIGIN_TRACE
+  for(int i = 0; i < PBUF_FAIL_ORIGINS; i++) {
+    if(pbuf_fail_origins[i].count == 0)
+      continue;
+    stprintf(st, "pbuf_fail: %8u %s%s\n", pbuf_fail_origins[i].count,
+             pbuf_fail_origins[i].origin,
+             i == PBUF_FAIL_ORIGINS - 1 ? " (and others)" : "");
+  }
+#endif
 }
 
 
@@ -700,3 +1512,26 @@ pbuf_dump(const char *prefix, const pbuf_t *pb, int full)
 {
   pbuf_dump_stream(prefix, pb, full, stdio);
 }
+
+
+ssize_t
+stream_write_pbuf(struct stream *s, pbuf_t *pb)
+{
+  if(s->vtable->write_pbuf != NULL)
+    return s->vtable->write_pbuf(s, pb);
+
+  ssize_t total = 0;
+  for(const pbuf_t *p = pb; p != NULL; p = p->pb_next) {
+    if(p->pb_buflen == 0)
+      continue;
+    const ssize_t r = stream_write(s, p->pb_data + p->pb_offset,
+                                   p->pb_buflen, 0);
+    if(r < 0) {
+      total = r;
+      break;
+    }
+    total += r;
+  }
+  pbuf_free(pb);
+  return total;
+}
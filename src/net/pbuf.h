@@ -5,11 +5,30 @@
 #include <sys/queue.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <mios/error.h>
 
 #ifndef PBUF_DATA_SIZE
 #define PBUF_DATA_SIZE 512
 #endif
 
+// Optional additional size classes for data buffers. Disabled unless
+// the corresponding count is non-zero or pbuf_data_add_class() is called
+#ifndef PBUF_SMALL_SIZE
+#define PBUF_SMALL_SIZE 128
+#endif
+
+#ifndef PBUF_SMALL_COUNT
+#define PBUF_SMALL_COUNT 0
+#endif
+
+#ifndef PBUF_LARGE_SIZE
+#define PBUF_LARGE_SIZE 1536
+#endif
+
+#ifndef PBUF_LARGE_COUNT
+#define PBUF_LARGE_COUNT 0
+#endif
+
 #ifdef PBUF_ORIGIN_TRACE
 #define PBUF_ORIGIN_ARG_DECL , const char *origin
 #define PBUF_ORIGIN_ARG_CALL , origin
@@ -62,7 +81,10 @@ typedef struct pbuf_timestamp {
 
 
 
-void pbuf_reset(pbuf_t *pb, size_t header_size, size_t len);
+// Fails (and leaves 'pb' untouched) if the data buffer is shared and
+// there is no buffer for a private copy
+__attribute__((warn_unused_result))
+error_t pbuf_reset(pbuf_t *pb, size_t header_size, size_t len);
 
 static inline void *pbuf_data(pbuf_t *pb, size_t offset) {
   return pb->pb_data + pb->pb_offset + offset;
@@ -91,12 +113,38 @@ void pbuf_free(pbuf_t *pb);
 __attribute__((warn_unused_result))
 pbuf_t *pbuf_make0(int offset, int wait PBUF_ORIGIN_ARG_DECL);
 
+// Like pbuf_make() but with a hint that 'size' bytes will be added after
+// 'offset', see pbuf_data_get_sized0()
+__attribute__((warn_unused_result))
+pbuf_t *pbuf_make_sized0(int offset, size_t size,
+                         int wait PBUF_ORIGIN_ARG_DECL);
+
 __attribute__((warn_unused_result))
 pbuf_t *pbuf_copy0(const pbuf_t *src, int wait PBUF_ORIGIN_ARG_DECL);
 
 __attribute__((warn_unused_result))
 pbuf_t *pbuf_copy_pkt(const pbuf_t *src, int wait);
 
+// Like pbuf_copy_pkt() but the new pbufs share the data buffers with
+// 'src' rather than copying. Shared buffers are copied when written to
+__attribute__((warn_unused_result))
+pbuf_t *pbuf_clone0(const pbuf_t *src, int wait PBUF_ORIGIN_ARG_DECL);
+
+// Clone 'len' bytes starting at 'offset' into 'src' as a new packet,
+// sharing data buffers like pbuf_clone(). Buffers are followed via
+// pb_next regardless of packet boundaries, so 'src' can be the head
+// of a pbuf_queue holding a byte stream
+__attribute__((warn_unused_result))
+pbuf_t *pbuf_clone_range0(const pbuf_t *src, size_t offset, size_t len,
+                          int wait PBUF_ORIGIN_ARG_DECL);
+
+// Make sure the data buffer of 'pb' (but not the rest of the chain) is
+// not shared with any other pbuf so it can be written to
+__attribute__((warn_unused_result))
+error_t pbuf_unshare(pbuf_t *pb);
+
+// Returns NULL if the last buffer is shared and there is no buffer for
+// a private copy. Can't happen for buffers from pbuf_make()
 __attribute__((warn_unused_result))
 void *pbuf_append(pbuf_t *pb, size_t bytes);
 
@@ -141,9 +189,27 @@ void pbuf_dump_stream(const char *prefix, const pbuf_t *pb, int full,
 
 void pbuf_data_add(void *start, void *end);
 
+// Add 'count' data buffers of 'size' bytes. 'size' must be PBUF_DATA_SIZE,
+// PBUF_SMALL_SIZE or PBUF_LARGE_SIZE. The small and large classes can
+// only be populated once
+void pbuf_data_add_class(size_t size, size_t count);
+
 __attribute__((warn_unused_result, malloc))
 void *pbuf_data_get0(int wait PBUF_ORIGIN_ARG_DECL);
 
+// Get a data buffer with room for (preferably) at least 'size' bytes.
+// Picks the smallest size class that fits and falls back to a
+// PBUF_DATA_SIZE buffer if that class is exhausted or if no class is
+// large enough. Use pbuf_data_size() to find the actual size
+__attribute__((warn_unused_result, malloc))
+void *pbuf_data_get_sized0(size_t size, int wait PBUF_ORIGIN_ARG_DECL);
+
+// Size of a data buffer
+size_t pbuf_data_size(const void *ptr);
+
+// Drop a reference to a data buffer, typically one a driver detached
+// from its pbuf (pb_data) for DMA. The buffer goes back to the pool
+// once no clone refers to it. Must be called with IRQ_LEVEL_NET blocked
 void pbuf_data_put(void *ptr);
 
 void pbuf_alloc(size_t count);
@@ -158,19 +224,82 @@ void pbuf_free_irq_blocked(pbuf_t *pb);
 __attribute__((warn_unused_result))
 pbuf_t *pbuf_make_irq_blocked0(int offset, int wait PBUF_ORIGIN_ARG_DECL);
 
+__attribute__((warn_unused_result))
+pbuf_t *pbuf_make_sized_irq_blocked0(int offset, size_t size,
+                                     int wait PBUF_ORIGIN_ARG_DECL);
+
 void pbuf_free_queue_irq_blocked(struct pbuf_queue *pq);
 
+// Set aside 'count' pbufs with default class data buffers for
+// pbuf_make_irq(). Call from thread context, typically when attaching
+// a driver
+void pbuf_irq_reserve(size_t count);
+
+// Like pbuf_make(offset, 0) but lock-free, can be called from
+// interrupt handlers at any level. NULL if the reserve is exhausted
+__attribute__((warn_unused_result))
+pbuf_t *pbuf_make_irq(int offset);
+
+// Return pbufs from pbuf_make_irq() that were never handed off, from
+// any level. Handed off pbufs are freed as usual
+void pbuf_free_irq(pbuf_t *pb);
+
+
+// =========================================================
+// Per-consumer accounting of data buffers
+// =========================================================
+
+typedef struct pbuf_account {
+  const char *pa_name;
+  uint16_t pa_min;     // Guaranteed buffers
+  uint16_t pa_max;     // 0 = No limit
+  uint16_t pa_inuse;
+  uint16_t pa_peak;
+  uint32_t pa_denied;  // Allocations refused
+  uint8_t pa_id;       // 0 if not registered
+  uint8_t pa_starved;  // Refused since last uncharge
+} pbuf_account_t;
+
+// Register an account. 'min' buffers are reserved for it, so the sum of
+// all minimums must leave room in the pool for everybody else
+void pbuf_account_init(pbuf_account_t *pa, const char *name,
+                       unsigned int min, unsigned int max);
+
+// Like pbuf_make(..., 0) but charged to 'pa'. Never waits. The charge
+// stays with the data buffer until it is returned to the pool
+__attribute__((warn_unused_result))
+pbuf_t *pbuf_make_account_irq_blocked0(pbuf_account_t *pa, int offset
+                                       PBUF_ORIGIN_ARG_DECL);
+
+__attribute__((warn_unused_result))
+pbuf_t *pbuf_make_account0(pbuf_account_t *pa, int offset
+                           PBUF_ORIGIN_ARG_DECL);
+
 
 #ifdef PBUF_ORIGIN_TRACE
 #define pbuf_data_get(wait) pbuf_data_get0(wait, __FUNCTION__)
+#define pbuf_data_get_sized(size, wait) pbuf_data_get_sized0(size, wait, __FUNCTION__)
 #define pbuf_get(wait) pbuf_get0(wait, __FUNCTION__)
 #define pbuf_copy(src, wait) pbuf_copy0(src, wait, __FUNCTION__)
+#define pbuf_clone(src, wait) pbuf_clone0(src, wait, __FUNCTION__)
+#define pbuf_clone_range(src, offset, len, wait) pbuf_clone_range0(src, offset, len, wait, __FUNCTION__)
 #define pbuf_make(offset, wait) pbuf_make0(offset, wait, __FUNCTION__)
+#define pbuf_make_sized(offset, size, wait) pbuf_make_sized0(offset, size, wait, __FUNCTION__)
 #define pbuf_make_irq_blocked(offset, wait) pbuf_make_irq_blocked0(offset, wait, __FUNCTION__)
+#define pbuf_make_sized_irq_blocked(offset, size, wait) pbuf_make_sized_irq_blocked0(offset, size, wait, __FUNCTION__)
+#define pbuf_make_account(pa, offset) pbuf_make_account0(pa, offset, __FUNCTION__)
+#define pbuf_make_account_irq_blocked(pa, offset) pbuf_make_account_irq_blocked0(pa, offset, __FUNCTION__)
 #else
 #define pbuf_data_get(wait) pbuf_data_get0(wait)
+#define pbuf_data_get_sized(size, wait) pbuf_data_get_sized0(size, wait)
 #define pbuf_get(wait) pbuf_get0(wait)
 #define pbuf_copy(src, wait) pbuf_copy0(src, wait)
+#define pbuf_clone(src, wait) pbuf_clone0(src, wait)
+#define pbuf_clone_range(src, offset, len, wait) pbuf_clone_range0(src, offset, len, wait)
 #define pbuf_make(offset, wait) pbuf_make0(offset, wait)
+#define pbuf_make_sized(offset, size, wait) pbuf_make_sized0(offset, size, wait)
 #define pbuf_make_irq_blocked(offset, wait) pbuf_make_irq_blocked0(offset, wait)
+#define pbuf_make_sized_irq_blocked(offset, size, wait) pbuf_make_sized_irq_blocked0(offset, size, wait)
+#define pbuf_make_account(pa, offset) pbuf_make_account0(pa, offset)
+#define pbuf_make_account_irq_blocked(pa, offset) pbuf_make_account_irq_blocked0(pa, offset)
 #endif
@@ -0,0 +1,233 @@
+// ====================================================================
+// Host side tests for pbuf.c
+//
+// Run tests:    make pbuf_test
+//
+// Covers data buffer ownership: clones sharing a buffer, drivers that
+// detach pb_data and release it with pbuf_data_put(), copy-on-write
+// and per-consumer accounts
+// ====================================================================
+
+// Built against the mios headers (-Iinclude) as pbuf.c needs them, so
+// only what those declare (and the host libc provides) is used here
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#define CACHE_LINE_SIZE 64
+#define curcpu() NULL
+
+#include "pbuf.c"
+
+// Stand-ins for the kernel
+
+static int wakeups;
+
+uint64_t
+clock_get(void)
+{
+  return 1;
+}
+
+void
+task_wakeup(task_waitable_t *waitable, int all)
+{
+  wakeups++;
+}
+
+void
+task_sleep(task_waitable_t *waitable)
+{
+  panic("task_sleep() would block");
+}
+
+void *
+xalloc_caller(size_t size, size_t alignment, unsigned int type, void *caller)
+{
+  // Only used for the pbuf headers here, malloc() alignment will do
+  return calloc(1, size);
+}
+
+void *
+objpool_get(objpool_t *op)
+{
+  return NULL;
+}
+
+void
+objpool_put(objpool_t *op, void *item)
+{
+  panic("Unexpected objpool_put()");
+}
+
+void
+panic(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf("\n");
+  __builtin_trap();
+}
+
+void
+__assert_func(const char *expr, const char *file, int line)
+{
+  panic("%s:%d: Assertion %s failed", file, line, expr);
+}
+
+int
+stprintf(stream_t *st, const char *fmt, ...)
+{
+  return 0;
+}
+
+
+static int failures;
+
+#define CHECK(x) do {                                           \
+    if(!(x)) {                                                  \
+      printf("%s:%d: %s failed\n", __FILE__, __LINE__, #x);    \
+      failures++;                                               \
+    }                                                           \
+  } while(0)
+
+
+static pbuf_t *
+make_packet(const char *payload)
+{
+  pbuf_t *pb = pbuf_make(16, 0);
+  CHECK(pb != NULL);
+  const size_t len = strlen(payload);
+  void *p = pbuf_append(pb, len);
+  CHECK(p != NULL);
+  memcpy(p, payload, len);
+  return pb;
+}
+
+
+// A clone goes out through a driver that keeps pb_data for DMA and
+// frees the pbuf header right away. The original (think tcb_txq) must
+// keep its buffer until it is freed as well, regardless of order
+static void
+test_driver_detach(int original_first)
+{
+  const int avail = pbuf_datas.pp_avail;
+
+  pbuf_t *pb = make_packet("retransmit me");
+  pbuf_t *clone = pbuf_clone(pb, 0);
+  CHECK(clone != NULL);
+  CHECK(clone->pb_data == pb->pb_data);
+  CHECK(pbuf_shared_count == 1);
+  CHECK(pbuf_datas.pp_avail == avail - 1);
+
+  void *dma = clone->pb_data;
+  pbuf_put(clone);
+
+  if(original_first) {
+    pbuf_free(pb);
+    CHECK(pbuf_datas.pp_avail == avail - 1);
+    CHECK(pbuf_shared_count == 0);
+    pbuf_data_put(dma);
+  } else {
+    pbuf_data_put(dma);
+    CHECK(pbuf_shared_count == 0);
+    CHECK(pbuf_datas.pp_avail == avail - 1);
+    CHECK(!memcmp(pbuf_cdata(pb, 0), "retransmit me", 13));
+    pbuf_free(pb);
+  }
+  CHECK(pbuf_datas.pp_avail == avail);
+}
+
+
+// Writing to a clone gives it a private copy and leaves the original
+// untouched
+static void
+test_copy_on_write(void)
+{
+  const int avail = pbuf_datas.pp_avail;
+
+  pbuf_t *pb = make_packet("hello");
+  pbuf_t *clone = pbuf_clone(pb, 0);
+  CHECK(clone != NULL);
+
+  char *p = pbuf_append(clone, 6);
+  CHECK(p != NULL);
+  memcpy(p, " world", 6);
+  CHECK(clone->pb_data != pb->pb_data);
+  CHECK(pbuf_shared_count == 0);
+  CHECK(pb->pb_pktlen == 5);
+  CHECK(!memcmp(pbuf_cdata(clone, 0), "hello world", 11));
+
+  pbuf_free(clone);
+  pbuf_free(pb);
+  CHECK(pbuf_datas.pp_avail == avail);
+}
+
+
+// A received frame charged to an account is forwarded to a driver that
+// detaches pb_data (CAN -> UDP -> Ethernet TX). The charge must be
+// dropped once the driver releases the buffer or the account stalls
+static void
+test_account_driver_detach(void)
+{
+  static pbuf_account_t pa;
+  pbuf_account_init(&pa, "test", 1, 2);
+  const int avail = pbuf_datas.pp_avail;
+
+  pbuf_t *a = pbuf_make_account(&pa, 0);
+  pbuf_t *b = pbuf_make_account(&pa, 0);
+  CHECK(a != NULL);
+  CHECK(b != NULL);
+  CHECK(pa.pa_inuse == 2);
+  CHECK(pbuf_make_account(&pa, 0) == NULL);
+
+  // Plain driver detach. The refused consumer is told to retry
+  void *dma = a->pb_data;
+  pbuf_put(a);
+  CHECK(pa.pa_inuse == 2);
+  const int w = wakeups;
+  pbuf_data_put(dma);
+  CHECK(pa.pa_inuse == 1);
+  CHECK(wakeups == w + 1);
+  CHECK(pa.pa_starved == 0);
+
+  // Detach of a clone, charge goes when the last reference does
+  pbuf_t *clone = pbuf_clone(b, 0);
+  CHECK(clone != NULL);
+  dma = clone->pb_data;
+  pbuf_put(clone);
+  pbuf_data_put(dma);
+  CHECK(pa.pa_inuse == 1);
+  pbuf_free(b);
+  CHECK(pa.pa_inuse == 0);
+
+  a = pbuf_make_account(&pa, 0);
+  CHECK(a != NULL);
+  CHECK(pa.pa_inuse == 1);
+  pbuf_free(a);
+  CHECK(pa.pa_inuse == 0);
+  CHECK(pbuf_datas.pp_avail == avail);
+}
+
+
+int
+main(void)
+{
+  static uint8_t arena[8 * PBUF_DATA_SIZE] __attribute__((aligned(64)));
+  pbuf_data_add(arena, arena + sizeof(arena));
+
+  test_driver_detach(0);
+  test_driver_detach(1);
+  test_copy_on_write();
+  test_account_driver_detach();
+
+  if(failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <mios/rpc.h>
 
+#include <mios/arena.h>
 #include <mios/service.h>
 #include <mios/task.h>
 #include <mios/bytestream.h>
@@ -13,6 +14,11 @@
 
 #include "net/pbuf.h"
 
+// Per request scratch memory. The first chunk is part of svc_rpc_t,
+// requests spanning multiple pbufs and large results chain heap chunks
+#define RPC_SCRATCH_SIZE       256
+#define RPC_SCRATCH_CHUNK_SIZE 512
+#define RPC_SCRATCH_MAX_HEAP   4096
 
 typedef struct svc_rpc {
   pushpull_t *pp;
@@ -21,6 +27,8 @@ typedef struct svc_rpc {
   mutex_t mutex;
   cond_t cond;
   int stop;
+  arena_t arena;
+  uint8_t scratch[RPC_SCRATCH_SIZE];
 } svc_rpc_t;
 
 
@@ -58,10 +66,23 @@ rpc_pull(void *opaque)
 }
 
 
+// Reuse the request buffer for the reply
+static pbuf_t *
+rpc_reply_buf(pbuf_t *pb)
+{
+  if(pbuf_reset(pb, 0, 0)) {
+    // Shared and no buffer for a private copy, wait for a new one
+    pbuf_free(pb);
+    pb = pbuf_make(0, 1);
+  }
+  return pb;
+}
+
+
 static pbuf_t *
 rpc_err(pbuf_t *pb, error_t err)
 {
-  pbuf_reset(pb, 0, 0);
+  pb = rpc_reply_buf(pb);
   uint8_t *p = pbuf_append(pb, 5);
   p[0] = 'e';
   wr32_le(p + 1, err);
@@ -70,29 +91,33 @@ rpc_err(pbuf_t *pb, error_t err)
 
 
 static pbuf_t *
-rpc_dispatch(pbuf_t *pb)
+rpc_dispatch(pbuf_t *pb, arena_t *a)
 {
-  if(pbuf_pullup(pb, pb->pb_pktlen)) {
-    /* Request larger than what fits in a single pbuf
-       TODO: We could try to allocate memory and read into it
-    */
-    return rpc_err(pb, ERR_MTU_EXCEEDED);
+  uint8_t *req;
+  size_t len = pb->pb_pktlen;
+
+  if(pb->pb_buflen >= len) {
+    req = pbuf_data(pb, 0);
+  } else {
+    // Request spans multiple pbufs, decode from a contiguous copy
+    req = arena_alloc(a, len);
+    if(req == NULL)
+      return rpc_err(pb, ERR_MTU_EXCEEDED);
+    pbuf_read_at(pb, req, 0, len);
   }
 
-  uint8_t *req = pbuf_data(pb, 0);
-  size_t len = pb->pb_pktlen;
-  const uint8_t namelen = req[0];
-  if(1 + namelen > len) {
+  if(len < 1 || 1 + req[0] > len) {
     return rpc_err(pb, ERR_MALFORMED);
   }
+  const uint8_t namelen = req[0];
 
-  rpc_result_t rr;
+  rpc_result_t rr = { .arena = a };
   error_t err = rpc_dispatch_cbor(&rr, (const char *)req + 1, namelen,
                                   req + 1 + namelen, len - 1 - namelen);
   if(err)
     return rpc_err(pb, err);
 
-  pbuf_reset(pb, 0, 0);
+  pb = rpc_reply_buf(pb);
 
   uint8_t *p = pbuf_append(pb, 1);
   p[0] = rr.type | 0x20; // make lowercase
@@ -147,7 +172,8 @@ rpc_thread(void *arg)
     }
     sr->req = NULL;
     mutex_unlock(&sr->mutex);
-    pb = rpc_dispatch(pb);
+    pb = rpc_dispatch(pb, &sr->arena);
+    arena_release(&sr->arena);
     mutex_lock(&sr->mutex);
     sr->resp = pb;
     sr->pp->net->event(sr->pp->net_opaque, PUSHPULL_EVENT_PULL);
@@ -199,6 +225,8 @@ rpc_open(pushpull_t *pp)
 
   mutex_init(&sr->mutex, "rpc");
   cond_init(&sr->cond, "rpc");
+  arena_init(&sr->arena, sr->scratch, sizeof(sr->scratch),
+             RPC_SCRATCH_CHUNK_SIZE, RPC_SCRATCH_MAX_HEAP);
 
   sr->pp = pp;
   if(!thread_create(rpc_thread, sr, 0, "rpc", TASK_DETACHED, 3)) {
@@ -12,6 +12,7 @@
 #include <mios/service.h>
 #include <mios/stream.h>
 #include <mios/cli.h>
+#include <mios/kmem.h>
 
 #include <sys/param.h>
 
@@ -89,6 +90,9 @@ struct vllp_channel {
   uint8_t net_closed;
 };
 
+static kmem_cache_t vllp_channel_cache =
+  KMEM_CACHE_INITIALIZER("vllpchan", sizeof(vllp_channel_t), 0);
+
 
 #define VLLP_VERSION 2
 
@@ -157,15 +161,15 @@ vllp_channel_destroy(vllp_t *v, vllp_channel_t *vc)
   pbuf_free_queue_irq_blocked(&vc->rxq);
   irq_permit(q);
   evlog(LOG_DEBUG, "VLLP: channel %d closed", vc->id);
-  free(vc);
+  kmem_cache_free(&vllp_channel_cache, vc);
 }
 
 
 static vllp_channel_t *
 vllp_channel_make(vllp_t *v, int id)
 {
-  vllp_channel_t *vc = xalloc(sizeof(vllp_channel_t), 0,
-                               MEM_MAY_FAIL | MEM_CLEAR);
+  vllp_channel_t *vc = kmem_cache_alloc(&vllp_channel_cache,
+                                        MEM_MAY_FAIL | MEM_CLEAR);
   if(vc == NULL)
     return NULL;
 
@@ -221,8 +225,9 @@ vllp_tx_ack(vllp_t *v, pbuf_t *pb)
     pb = pbuf_make(4, 0); /* offset: 4 bytes for ID prefix in dsig.c */
     if(pb == NULL)
       return NULL;
-  } else {
-    pbuf_reset(pb, 4, 0);
+  } else if(pbuf_reset(pb, 4, 0)) {
+    pbuf_free(pb);
+    return NULL;
   }
 
   uint8_t *pkt = pbuf_append(pb, 7);
@@ -337,7 +342,10 @@ static inline void
 send_cmc_message(vllp_t *v, vllp_channel_t *cmc, pbuf_t *pb,
                  int opcode, int target_channel, error_t err)
 {
-  pbuf_reset(pb, 1, 0);
+  if(pbuf_reset(pb, 1, 0)) {
+    pbuf_free(pb);
+    return;
+  }
   uint8_t *u8 = pbuf_append(pb, 3);
   u8[0] = (opcode << 4) | target_channel;
   u8[1] = err;
@@ -395,7 +403,7 @@ handle_cmc_open(vllp_t *v, vllp_channel_t *cmc,
     LIST_REMOVE(vc, link);
     evlog(LOG_DEBUG, "VLLP: failed to open service %s on channel %d -- %s",
           s->name, vc->id, error_to_string(err));
-    free(vc);
+    kmem_cache_free(&vllp_channel_cache, vc);
     return err;
   }
 
@@ -577,8 +585,9 @@ vllp_tx(vllp_t *v, pbuf_t *pb)
 
   if(pb == NULL) {
     pb = pbuf_make(4, 0); /* offset: 4 bytes for ID prefix in dsig.c */
-  } else {
-    pbuf_reset(pb, 4, 0);
+  } else if(pbuf_reset(pb, 4, 0)) {
+    pbuf_free(pb);
+    pb = NULL;
   }
 
   if(pb != NULL) {
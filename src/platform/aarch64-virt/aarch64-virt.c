@@ -11,7 +11,17 @@ extern uintptr_t semihosting_call(uint32_t reason, uintptr_t arg);
 long
 gicr_base(void)
 {
-  return GIC_GICR_BASE;
+  uint64_t v;
+  __asm__ volatile ("mrs %0, mpidr_el1" : "=r"(v));
+  int linear_core_id = ((v >> 8) & 0xff) * 16 + (v & 0xff);
+  return GIC_GICR_BASE + linear_core_id * 0x20000;
+}
+
+uint64_t
+cpu_mpidr(unsigned int index)
+{
+  // QEMU virt puts 16 cores per cluster with GICv3
+  return ((index / 16) << 8) | (index % 16);
 }
 
 
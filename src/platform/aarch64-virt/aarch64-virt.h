@@ -4,3 +4,5 @@
 
 #define CACHE_LINE_SIZE 64
 
+#define CPU_MAX 8
+
@@ -16,14 +16,16 @@ SRCS += \
 
 ENABLE_TASK_ACCOUNTING := no
 
+QEMU_SMP ?= 4
+
 GDB_PORT ?= 1234
 GDB_HOST ?= 127.0.0.1
 
 qemu: ${O}/${ARTIFACT}.elf
-	qemu-system-aarch64 -M virt,gic-version=3,virtualization=on -semihosting -cpu cortex-a57 -nographic -kernel $< -s -S
+	qemu-system-aarch64 -M virt,gic-version=3,virtualization=on -semihosting -cpu cortex-a57 -smp ${QEMU_SMP} -nographic -kernel $< -s -S
 
 run: ${O}/${ARTIFACT}.elf
-	qemu-system-aarch64 -m 8192 -M virt,gic-version=3 -semihosting -cpu cortex-a57 -nographic -kernel $<
+	qemu-system-aarch64 -m 8192 -M virt,gic-version=3 -semihosting -cpu cortex-a57 -smp ${QEMU_SMP} -nographic -kernel $<
 
 gdb: ${O}/${ARTIFACT}.elf
 	${GDB} -ex "target extended-remote ${GDB_HOST}:${GDB_PORT}" -ex "layout asm" -ex "layout regs" -x ${T}/gdb/macros $<
@@ -20,9 +20,9 @@
 static struct timer_list systim_rtc1_timers;
 
 static void
-systim_rtc1_rearm(timer_t *t, int64_t now)
+systim_rtc1_rearm(uint64_t expire, int64_t now)
 {
-  const int64_t delta = t->t_expire - now;
+  const int64_t delta = expire - now;
   uint32_t delta32;
 
   if(delta < 2) {
@@ -51,41 +51,18 @@ irq_17(void)
 
     const int64_t now = clock_get_irq_blocked();
 
-    while(1) {
-      timer_t *t = LIST_FIRST(&systim_rtc1_timers);
-      if(t == NULL)
-        break;
-
-      if(t->t_expire > now) {
-        systim_rtc1_rearm(t, now);
-        break;
-      }
-
-      uint64_t expire = t->t_expire;
-      LIST_REMOVE(t, t_link);
-      t->t_expire = 0;
-      t->t_cb(t->t_opaque, expire);
-    }
+    const uint64_t next = timer_dispatch(&systim_rtc1_timers, now);
+    if(next)
+      systim_rtc1_rearm(next, clock_get_irq_blocked());
   }
 }
 
 
-static int
-systim_cmp(const timer_t *a, const timer_t *b)
-{
-  return a->t_expire > b->t_expire;
-}
-
-
 void
 timer_arm_abs(timer_t *t, uint64_t deadline)
 {
-  timer_disarm(t);
-
-  t->t_expire = deadline;
-  LIST_INSERT_SORTED(&systim_rtc1_timers, t, t_link, systim_cmp);
-  if(t == LIST_FIRST(&systim_rtc1_timers))
-    systim_rtc1_rearm(t, clock_get_irq_blocked());
+  if(timer_arm_on_queue(t, deadline, &systim_rtc1_timers))
+    systim_rtc1_rearm(deadline, clock_get_irq_blocked());
 }
 
 
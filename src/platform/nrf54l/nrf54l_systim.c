@@ -112,18 +112,18 @@ exc_systick(void)
 }
 
 
-// Program the one-shot to fire at the head of the timer list. Caller must
-// hold IRQ_LEVEL_CLOCK.
+// Program the one-shot to fire at the earliest deadline of the timer
+// queue. Caller must hold IRQ_LEVEL_CLOCK.
 static void
 systim_rearm(int64_t now)
 {
   reg_wr(TIMER_BASE + TIMER_TASKS_STOP, 1);
 
-  const timer_t *t = LIST_FIRST(&systim_timers);
-  if(t == NULL)
+  const uint64_t expire = timer_list_next(&systim_timers);
+  if(expire == 0)
     return;
 
-  int64_t delta = t->t_expire - now;
+  int64_t delta = expire - now;
   uint32_t d;
   if(delta < 2)
     d = 2;
@@ -149,28 +149,8 @@ irq_203(void)
 
   const int64_t now = clock_get_irq_blocked();
 
-  while(1) {
-    timer_t *t = LIST_FIRST(&systim_timers);
-    if(t == NULL)
-      break;
-
-    if(t->t_expire > now) {
-      systim_rearm(now);
-      break;
-    }
-
-    uint64_t expire = t->t_expire;
-    LIST_REMOVE(t, t_link);
-    t->t_expire = 0;
-    t->t_cb(t->t_opaque, expire);
-  }
-}
-
-
-static int
-systim_cmp(const timer_t *a, const timer_t *b)
-{
-  return a->t_expire > b->t_expire;
+  timer_dispatch(&systim_timers, now);
+  systim_rearm(clock_get_irq_blocked());
 }
 
 
@@ -178,11 +158,7 @@ systim_cmp(const timer_t *a, const timer_t *b)
 void
 timer_arm_abs(timer_t *t, uint64_t deadline)
 {
-  timer_disarm(t);
-
-  t->t_expire = deadline;
-  LIST_INSERT_SORTED(&systim_timers, t, t_link, systim_cmp);
-  if(t == LIST_FIRST(&systim_timers))
+  if(timer_arm_on_queue(t, deadline, &systim_timers))
     systim_rearm(clock_get_irq_blocked());
 }
 
@@ -211,34 +187,45 @@ nrf54l_systim_init(void)
 // (t_expire != 0) but never fire.
 #include <mios/cli.h>
 
+typedef struct {
+  struct {
+    const char *name;
+    uint64_t expire;
+  } snap[16];
+  int n;
+} timers_snapshot_t;
+
+
+static void
+timers_snapshot(const timer_t *t, void *opaque)
+{
+  timers_snapshot_t *ts = opaque;
+  if(ts->n == 16)
+    return;
+  ts->snap[ts->n].name = t->t_name;
+  ts->snap[ts->n].expire = t->t_expire;
+  ts->n++;
+}
+
+
 static error_t
 cmd_timers(cli_t *cli, int argc, char **argv)
 {
-  static struct {
-    const char *name;
-    uint64_t expire;
-  } snap[16]; // static: stack frames are capped at 192 bytes
-  int n = 0;
+  static timers_snapshot_t ts; // static: stack frames are capped at 192 bytes
+  ts.n = 0;
 
   int q = irq_forbid(IRQ_LEVEL_CLOCK);
   const int64_t now = clock_get_irq_blocked();
-  const timer_t *t;
-  LIST_FOREACH(t, &systim_timers, t_link) {
-    if(n == 16)
-      break;
-    snap[n].name = t->t_name;
-    snap[n].expire = t->t_expire;
-    n++;
-  }
+  timer_list_walk(&systim_timers, timers_snapshot, &ts);
   irq_permit(q);
 
   cli_printf(cli, "now: %lld\n", now);
-  for(int i = 0; i < n; i++)
+  for(int i = 0; i < ts.n; i++)
     cli_printf(cli, "%2d: %-12s expire:%lld (%s%lld us)\n",
-               i, snap[i].name ?: "?", snap[i].expire,
-               snap[i].expire >= (uint64_t)now ? "+" : "-",
-               snap[i].expire >= (uint64_t)now ?
-               snap[i].expire - now : now - snap[i].expire);
+               i, ts.snap[i].name ?: "?", ts.snap[i].expire,
+               ts.snap[i].expire >= (uint64_t)now ? "+" : "-",
+               ts.snap[i].expire >= (uint64_t)now ?
+               ts.snap[i].expire - now : now - ts.snap[i].expire);
   return 0;
 }
 
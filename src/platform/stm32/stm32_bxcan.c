@@ -183,7 +183,7 @@ stm32_bxcan_rx(bxcan_t *bx, int mailbox)
     uint32_t ri = reg_rd(bx->reg_base + CAN_RI(mailbox));
     uint32_t rdt = reg_rd(bx->reg_base + CAN_RDT(mailbox));
 
-    pbuf_t *pb = pbuf_make_irq_blocked(0, 0);
+    pbuf_t *pb = pbuf_make_account_irq_blocked(&bx->cni.cni_rx_account, 0);
     if(pb != NULL) {
       const uint32_t id = ri >> (ri & 4 ? 3 : 21);
       uint32_t len = rdt & 0xf;
@@ -244,6 +244,7 @@ stm32_bxcan_print_info(struct device *dev, struct stream *st)
   stprintf(st, "Bus Off: %s\n", esr & 0x4 ? "Yes" : "No");
   stprintf(st, "Error Passive: %s\n", esr & 0x2 ? "Yes" : "No");
   stprintf(st, "Error Warning: %s\n", esr & 0x1 ? "Yes" : "No");
+  can_print(&bx->cni, st);
 }
 
 static const device_class_t stm32_bxcan_device_class = {
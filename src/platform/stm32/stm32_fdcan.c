@@ -118,7 +118,7 @@ stm32_fdcan_irq0(void *arg)
       uint32_t w1 = reg_rd(fc->ram_base + FDCAN_RXFIFO0(get_index, 1));
       uint32_t len = dlc_to_len[(w1 >> 16) & 0xf];
 
-      pbuf_t *pb = pbuf_make(0, 0);
+      pbuf_t *pb = pbuf_make_account(&fc->cni.cni_rx_account, 0);
       if(pb != NULL) {
         uint32_t w0 = reg_rd(fc->ram_base + FDCAN_RXFIFO0(get_index, 0));
 #ifdef ENABLE_NET_TIMESTAMPING
@@ -169,6 +169,7 @@ stm32_fdcan_print_info(struct device *dev, struct stream *st)
            fc->rx_fifo0, fc->rx_fifo1, fc->nobufs);
   stprintf(st, "Transmitted packets:%u  Drops:%u\n",
            fc->tx, fc->tx_drop);
+  can_print(&fc->cni, st);
 
   stprintf(st, "Receive error counter:%d  Transmit error counter:%d\n",
            rec, tec);
@@ -31,7 +31,7 @@ static volatile unsigned int * const SYST_VAL = (unsigned int *)0xe000e018;
 
 typedef struct {
   uint64_t when;
-  timer_t *t;
+  const timer_t *t;
   uint32_t syst_val;
   uint16_t arr;
   uint8_t op;
@@ -41,7 +41,7 @@ static int traceptr;
 static systim_trace_t tracebuf[SYSTIM_TRACE];
 
 static void
-systim_trace_add(uint64_t when, timer_t *t,
+systim_trace_add(uint64_t when, const timer_t *t,
                   uint16_t arr, uint8_t op)
 {
   int idx = traceptr & (SYSTIM_TRACE - 1);
@@ -54,6 +54,19 @@ systim_trace_add(uint64_t when, timer_t *t,
 }
 
 
+static void
+systim_dump_timer(const timer_t *t, void *opaque)
+{
+  stream_t *s = opaque;
+  int64_t now = clock_get_irq_blocked();
+  stprintf(s, "%p %p %p %15d %15d %s\n",
+           t, t->t_cb, t->t_opaque,
+           (int)t->t_expire,
+           (int)(t->t_expire - now),
+           t->t_name);
+}
+
+
 static void
 systim_dump_trace(stream_t *s)
 {
@@ -84,14 +97,16 @@ systim_dump_trace(stream_t *s)
              ht->t);
   }
 
-  const timer_t *t;
-  LIST_FOREACH(t, &st->timers, t_link) {
-    stprintf(s, "%p %p %p %15d %15d %s\n",
-               t, t->t_cb, t->t_opaque,
-               (int)t->t_expire,
-               (int)(t->t_expire - now),
-               t->t_name);
-  }
+  timer_list_walk(&st->timers, systim_dump_timer, s);
+}
+
+
+static void
+systim_find_first(const timer_t *t, void *opaque)
+{
+  const timer_t **first = opaque;
+  if(*first == NULL || t->t_expire < (*first)->t_expire)
+    *first = t;
 }
 
 
@@ -103,9 +118,9 @@ systim_dump_trace(stream_t *s)
 #endif
 
 static void
-systim_rearm(timer_t *t, int64_t now, systim_t *st)
+systim_rearm(uint64_t expire, int64_t now, systim_t *st)
 {
-  const int64_t delta = t->t_expire - now;
+  const int64_t delta = expire - now;
   const uint32_t regbase = st->regbase;
   reg_wr(regbase + TIMx_CR1, 0x0);
   uint32_t arr;
@@ -118,7 +133,7 @@ systim_rearm(timer_t *t, int64_t now, systim_t *st)
   }
 
 #ifdef SYSTIM_TRACE
-  systim_trace_add(now, t, arr, SYSTIM_TRACE_ARM);
+  systim_trace_add(now, NULL, arr, SYSTIM_TRACE_ARM);
 #endif
   reg_wr(regbase + TIMx_CNT, 0xffff);
   reg_wr(regbase + TIMx_ARR, arr);
@@ -138,39 +153,24 @@ systim_irq(void *arg)
   systim_trace_add(now, NULL, 0, SYSTIM_TRACE_IRQ);
 #endif
 
-  while(1) {
-    timer_t *t = LIST_FIRST(&st->timers);
-    if(t == NULL)
-      break;
-
-    if(t->t_expire > now) {
-      systim_rearm(t, now, st);
-      break;
-    }
-
 #ifdef SYSTIM_TRACE
-    systim_trace_add(now, t, 0, SYSTIM_TRACE_FIRE);
+  const timer_t *first = NULL;
+  timer_list_walk(&st->timers, systim_find_first, &first);
+  if(first != NULL && first->t_expire <= now) {
+    systim_trace_add(now, first, 0, SYSTIM_TRACE_FIRE);
 
-    int64_t miss = now - t->t_expire;
+    int64_t miss = now - first->t_expire;
     if(miss > 500) {
       systim_dump_trace(stdio);
       panic("Timer %p \"%s\"  missed with %d",
-            t, t->t_name, (int)miss);
+            first, first->t_name, (int)miss);
     }
-#endif
-
-    uint64_t expire = t->t_expire;
-    LIST_REMOVE(t, t_link);
-    t->t_expire = 0;
-    t->t_cb(t->t_opaque, expire);
   }
-}
-
+#endif
 
-static int
-systim_cmp(const timer_t *a, const timer_t *b)
-{
-  return a->t_expire > b->t_expire;
+  const uint64_t next = timer_dispatch(&st->timers, now);
+  if(next)
+    systim_rearm(next, clock_get_irq_blocked(), st);
 }
 
 
@@ -179,12 +179,8 @@ timer_arm_abs(timer_t *t, uint64_t deadline)
 {
   systim_t *st = &g_systim;
 
-  timer_disarm(t);
-
-  t->t_expire = deadline;
-  LIST_INSERT_SORTED(&st->timers, t, t_link, systim_cmp);
-  if(t == LIST_FIRST(&st->timers))
-    systim_rearm(t, clock_get_irq_blocked(), st);
+  if(timer_arm_on_queue(t, deadline, &st->timers))
+    systim_rearm(deadline, clock_get_irq_blocked(), st);
 }
 
 
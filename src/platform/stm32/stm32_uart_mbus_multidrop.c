@@ -360,17 +360,21 @@ rx_complete(stm32_dma_instance_t instance, uint32_t status, void *arg)
 
       if(!rx_payload_read_sr(um))
         um->rx_payload_ok++;
+      // Only the handoff needs IRQ_LEVEL_NET, unless the reserve is empty
+      pbuf_t *nxt = pbuf_make_irq(0);
       int q = irq_forbid(IRQ_LEVEL_NET);
-      pbuf_t *nxt = pbuf_make_irq_blocked(0, 0);
+      if(nxt == NULL)
+        nxt = pbuf_make_irq_blocked(0, 0);
       if(nxt) {
         STAILQ_INSERT_TAIL(&um->um_mni.mni_ni.ni_rx_queue, um->rx, pb_link);
         netif_wakeup(&um->um_mni.mni_ni);
-
+      }
+      irq_permit(q);
+      if(nxt) {
         um->rx = nxt;
         stm32_dma_set_mem0(um->rx_dma, um->rx->pb_data + 1);
         memset(um->rx->pb_data, 0xaa, 64);
       }
-      irq_permit(q);
     }
 
   } else if(status & DMA_STATUS_ERRORS) {
@@ -594,6 +598,7 @@ stm32_mbus_uart_create(uint32_t uart_reg_base,
   um->timer.t_cb = timer_fire;
   um->timer.t_opaque = um;
 
+  pbuf_irq_reserve(2);
   mbus_netif_attach(&um->um_mni, name, &mbus_uart_device_class);
 
   irq_enable_fn_arg(uart_irq, IRQ_LEVEL_CLOCK, stm32_mbus_uart_irq, um);
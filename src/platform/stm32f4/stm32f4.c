@@ -116,7 +116,7 @@ cpu_idle(void)
   wdog_init();
   while(1) {
     for(int i = 0; i < 100; i++) {
-      asm volatile ("wfi;nop;nop;nop");
+      cpu_idle_wait();
     }
     *DBGMCU_CR |= 1;
     reg_wr(IWDG_KR, 0xAAAA);
@@ -1,4 +1,5 @@
 #include "irq.h"
+#include "cpu.h"
 
 #include <mios/device.h>
 
@@ -54,15 +55,17 @@ cpu_idle(void)
     if(!wakelock) {
 
       asm volatile ("cpsid i");
+      const uint64_t enter = cpu_idle_enter();
       *SCR = 0x4;
       device_power_state(DEVICE_POWER_STATE_SUSPEND);
       asm("wfi");
       *SCR = 0x0;
       stm32g0_init_pll();
       device_power_state(DEVICE_POWER_STATE_RESUME);
+      cpu_idle_leave(enter);
       asm volatile ("cpsie i");
     } else {
-      asm("wfi");
+      cpu_idle_wait();
     }
     reg_wr(IWDG_KR, 0xAAAA);
   }
@@ -1,4 +1,5 @@
 #include "irq.h"
+#include "cpu.h"
 
 #include <mios/device.h>
 #include <mios/suspend.h>
@@ -56,6 +57,7 @@ cpu_idle(void)
     if(!wakelock) {
 
       asm volatile ("cpsid i");
+      const uint64_t enter = cpu_idle_enter();
       *SCR = 0x4;
       device_power_state(DEVICE_POWER_STATE_SUSPEND);
       stm32g4_deinit_pll();
@@ -63,9 +65,10 @@ cpu_idle(void)
       *SCR = 0x0;
       stm32g4_reinit_pll();
       device_power_state(DEVICE_POWER_STATE_RESUME);
+      cpu_idle_leave(enter);
       asm volatile ("cpsie i");
     } else {
-      asm volatile("wfi");
+      cpu_idle_wait();
     }
     reg_wr(IWDG_KR, 0xAAAA);
   }
@@ -1,4 +1,5 @@
 #include "irq.h"
+#include "cpu.h"
 
 #include "stm32h7_wdog.h"
 #include "stm32h7_reg.h"
@@ -7,7 +8,7 @@ void __attribute__((noreturn))
 cpu_idle(void)
 {
   while(1) {
-    asm volatile("wfi");
+    cpu_idle_wait();
     reg_wr(IWDG_KR, 0xAAAA);
     (void)reg_rd(LPTIM5_CNT);  // RSTARE=1 → read resets counter
   }
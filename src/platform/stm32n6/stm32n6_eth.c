@@ -665,7 +665,7 @@ stm32n6_eth_output(struct ether_netif *eni, pbuf_t *pb,
     se->se_tx_pbuf_data[wrptr & ETH_TX_RING_MASK] = pb->pb_data;
 
     // Clean cache so DMA sees the TX data
-    dcache_op(pb->pb_data, PBUF_DATA_SIZE, DCACHE_CLEAN);
+    dcache_op(pb->pb_data + pb->pb_offset, pb->pb_buflen, DCACHE_CLEAN);
 
     tx->p0 = pb->pb_data + pb->pb_offset;
     tx->w1 = 0;
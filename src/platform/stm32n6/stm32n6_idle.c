@@ -1,3 +1,5 @@
+#include "cpu.h"
+
 #include "stm32n6_reg.h"
 #include "stm32n6_wdog.h"
 
@@ -5,7 +7,7 @@ void __attribute__((noreturn))
 cpu_idle(void)
 {
   while(1) {
-    asm volatile("wfi");
+    cpu_idle_wait();
     reg_wr(IWDG_KR, 0xAAAA);
   }
 }
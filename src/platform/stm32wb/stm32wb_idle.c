@@ -1,4 +1,5 @@
 #include "irq.h"
+#include "cpu.h"
 
 #include <mios/device.h>
 
@@ -35,6 +36,7 @@ cpu_idle(void)
   while(1) {
     if(!wakelock) {
       asm volatile ("cpsid i;isb");
+      const uint64_t enter = cpu_idle_enter();
       *SCR = 0x4;
       *DBGMCU_CR &= ~6;
       device_power_state(DEVICE_POWER_STATE_SUSPEND);
@@ -42,9 +44,10 @@ cpu_idle(void)
       *SCR = 0x0;
       stm32wb_use_hse();
       device_power_state(DEVICE_POWER_STATE_RESUME);
+      cpu_idle_leave(enter);
       asm volatile ("cpsie i;isb");
     } else {
-      asm("wfi");
+      cpu_idle_wait();
     }
   }
 }
@@ -37,6 +37,13 @@ gicr_base(void)
   return gicr0 + linear_core_id * 0x20000;
 }
 
+uint64_t
+cpu_mpidr(unsigned int index)
+{
+  // Four cores per cluster, Aff0 is always zero
+  return ((index / 4) << 16) | ((index % 4) << 8);
+}
+
 void
 reboot(void)
 {
@@ -2,6 +2,8 @@
 
 #define CACHE_LINE_SIZE 64
 
+#define CPU_MAX 12
+
 #define PBUF_DATA_SIZE 1536
 
 #define EVENTLOG_SIZE 4096
@@ -2,8 +2,13 @@
 
 #include <mios/ghook.h>
 #include <mios/cli.h>
+#include <mios/timer.h>
 
 #include <stdio.h>
+#include <unistd.h>
+
+#include "irq.h"
+#include "cpu.h"
 
 #define NUM_TIMERS 16
 
@@ -34,12 +39,37 @@ wdt_init(void)
 }
 
 
+/*
+ * The system clock is tickless so make sure the idle loop gets to run
+ * (and pet the watchdog) well within the watchdog period
+ */
+static void
+wdt_wakeup_cb(void *opaque, uint64_t expire)
+{
+  timer_arm_abs(opaque, expire + 250000);
+}
+
+static timer_t wdt_wakeup_timer = {
+  .t_cb = wdt_wakeup_cb,
+  .t_opaque = &wdt_wakeup_timer,
+  .t_name = "wdt",
+};
+
+static void __attribute__((constructor(141)))
+wdt_wakeup_init(void)
+{
+  int q = irq_forbid(IRQ_LEVEL_CLOCK);
+  timer_arm_abs(&wdt_wakeup_timer, clock_get_irq_blocked() + 250000);
+  irq_permit(q);
+}
+
+
 __attribute__((noreturn))
 void
 cpu_idle(void)
 {
   while(1) {
-    asm volatile("wfi");
+    cpu_idle_wait();
      // Restart watchdog
      reg_wr(WDT_BASE(0) + WDT_COMMAND, 1);
   }
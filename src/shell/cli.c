@@ -223,14 +223,15 @@ history_add(const char *line)
   hist_count++;
 }
 
-static char *
+// Returned line is only valid until the next history_add()
+static const char *
 history_get(int offset)
 {
   int avail = hist_count < HIST_MAX ? hist_count : HIST_MAX;
   if(offset < 0 || offset >= avail)
     return NULL;
   int idx = (hist_wpos - 1 - offset + HIST_MAX) % HIST_MAX;
-  return strdup(hist_lines[idx]);
+  return hist_lines[idx];
 }
 
 static size_t
@@ -720,13 +721,12 @@ cli_loop(cli_t *c, char promptchar,
 
     case CLI_ED_HIST_UP: {
       int next = hist_offset + 1;
-      char *str = history_get(next);
+      const char *str = history_get(next);
       if(str) {
         if(hist_offset == -1)
           saved_line = strdup(ed.buf);
         hist_offset = next;
         cli_ed_set(&ed, str);
-        free(str);
       }
       redraw_line(c, &ed, promptchar);
       break;
@@ -735,9 +735,8 @@ cli_loop(cli_t *c, char promptchar,
     case CLI_ED_HIST_DOWN: {
       if(hist_offset > 0) {
         hist_offset--;
-        char *str = history_get(hist_offset);
+        const char *str = history_get(hist_offset);
         cli_ed_set(&ed, str);
-        free(str);
       } else if(hist_offset == 0) {
         hist_offset = -1;
         cli_ed_set(&ed, saved_line);
@@ -835,22 +834,20 @@ feed_input(cli_t *c, cli_ed_t *ed, const char *input)
       break;
     case CLI_ED_HIST_UP: {
       int next = feed_hist_offset + 1;
-      char *str = history_get(next);
+      const char *str = history_get(next);
       if(str) {
         if(feed_hist_offset == -1)
           feed_saved_line = strdup(ed->buf);
         feed_hist_offset = next;
         cli_ed_set(ed, str);
-        free(str);
       }
       break;
     }
     case CLI_ED_HIST_DOWN: {
       if(feed_hist_offset > 0) {
         feed_hist_offset--;
-        char *str = history_get(feed_hist_offset);
+        const char *str = history_get(feed_hist_offset);
         cli_ed_set(ed, str);
-        free(str);
       } else if(feed_hist_offset == 0) {
         feed_hist_offset = -1;
         cli_ed_set(ed, feed_saved_line);
@@ -1574,12 +1571,10 @@ test_history_overflow(void)
     history_add(buf);
   }
   // Most recent is cmd9, oldest accessible is cmd2
-  char *str = history_get(0);
+  const char *str = history_get(0);
   CHECK(str && !strcmp(str, "cmd9"));
-  free(str);
   str = history_get(7);
   CHECK(str && !strcmp(str, "cmd2"));
-  free(str);
   str = history_get(8);
   CHECK(str == NULL);
 }
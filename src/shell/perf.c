@@ -1,10 +1,17 @@
 #include <unistd.h>
 #include <mios/cli.h>
+#include <mios/coro.h>
+#include <mios/timer.h>
+#include <mios/type_macros.h>
 #include <malloc.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 #include "lib/crypto/sha1.h"
 
+#include "cpu.h"
+
 #ifdef ENABLE_MATH
 #include <math.h>
 #endif
@@ -142,3 +149,459 @@ cmd_memperf(cli_t *cli, int argc, char **argv)
 
 CLI_CMD_DEF("memperf", cmd_memperf);
 
+
+
+static void
+timerbench_cb(void *opaque, uint64_t expire)
+{
+  int *fired = opaque;
+  (*fired)++;
+}
+
+
+static error_t
+cmd_timerbench(cli_t *cli, int argc, char **argv)
+{
+  const int count = argc > 1 ? atoi(argv[1]) : 10000;
+  const uint32_t spread = 10000000; // Deadlines within 10s
+  int fired = 0;
+
+  if(count < 1)
+    return ERR_INVALID_ARGS;
+
+  struct timer_list *tl = xalloc(sizeof(struct timer_list), 0, MEM_MAY_FAIL);
+  timer_t *timers = xalloc(sizeof(timer_t) * count, 0, MEM_MAY_FAIL);
+  if(tl == NULL || timers == NULL) {
+    free(tl);
+    free(timers);
+    return ERR_NO_MEMORY;
+  }
+
+  // The queue is private to us so no need to block IRQ_LEVEL_CLOCK
+  memset(tl, 0, sizeof(struct timer_list));
+  memset(timers, 0, sizeof(timer_t) * count);
+
+  uint32_t seed = 1;
+  const uint64_t base = clock_get();
+  // Start the wheel at 'now', otherwise every timer lands on the
+  // overflow list and we'd be measuring that instead
+  tl->tl_tick = base >> TIMER_WHEEL_SHIFT;
+
+  for(int i = 0; i < count; i++) {
+    timers[i].t_cb = timerbench_cb;
+    timers[i].t_opaque = &fired;
+    timers[i].t_name = "bench";
+  }
+
+  int64_t t0 = clock_get();
+  for(int i = 0; i < count; i++) {
+    seed = seed * 1664525 + 1013904223;
+    timer_arm_on_queue(&timers[i], base + 1 + seed % spread, tl);
+  }
+  int64_t t1 = clock_get();
+  for(int i = 0; i < count; i++) {
+    seed = seed * 1664525 + 1013904223;
+    timer_arm_on_queue(&timers[i], base + 1 + seed % spread, tl);
+  }
+  int64_t t2 = clock_get();
+  for(int i = 0; i < count; i++) {
+    timer_disarm(&timers[i]);
+  }
+  int64_t t3 = clock_get();
+
+  for(int i = 0; i < count; i++) {
+    seed = seed * 1664525 + 1013904223;
+    timer_arm_on_queue(&timers[i], base + 1 + seed % spread, tl);
+  }
+  int64_t t4 = clock_get();
+  int dispatches = 0;
+  for(uint64_t now = base; now <= base + spread; now += 1000) {
+    timer_dispatch(tl, now);
+    dispatches++;
+  }
+  int64_t t5 = clock_get();
+
+  cli_printf(cli, "%d timers\n", count);
+  cli_printf(cli, "  Arm:      %8d ns/timer\n",
+             (int)((t1 - t0) * 1000 / count));
+  cli_printf(cli, "  Rearm:    %8d ns/timer\n",
+             (int)((t2 - t1) * 1000 / count));
+  cli_printf(cli, "  Disarm:   %8d ns/timer\n",
+             (int)((t3 - t2) * 1000 / count));
+  cli_printf(cli, "  Dispatch: %8d ns/timer (%d timers fired in %d calls)\n",
+             (int)((t5 - t4) * 1000 / count), fired, dispatches);
+
+  free(timers);
+  free(tl);
+  return 0;
+}
+
+CLI_CMD_DEF("timerbench", cmd_timerbench);
+
+
+#ifdef HAVE_CYCLE_COUNTER
+#define perf_ticks() cpu_cycle_counter()
+#define perf_ticks_per_us() cpu_cycles_per_us()
+#define PERF_TICKS_SHIFT CPU_CYCLES_PER_US_SHIFT
+#else
+#define perf_ticks() ((uint32_t)clock_get())
+#define perf_ticks_per_us() 1
+#define PERF_TICKS_SHIFT 0
+#endif
+
+// Average time in ns of 'count' operations that took 'ticks' in total
+static int
+perf_ticks_to_ns(uint64_t ticks, int count)
+{
+  if(count == 0)
+    return 0;
+  return ((ticks * 1000) << PERF_TICKS_SHIFT) /
+    ((uint64_t)perf_ticks_per_us() * count);
+}
+
+
+#define MALLOCBENCH_SLOTS 32
+
+/*
+ * Allocator churn in the style of the old malloc_tests2(). First the
+ * heap is fragmented by leaving 'pinned' small blocks scattered around,
+ * then random sized (and sometimes aligned) blocks are allocated and
+ * freed. Build with ENABLE_HEAP_TLSF=yes|no to compare allocators
+ */
+static error_t
+cmd_mallocbench(cli_t *cli, int argc, char **argv)
+{
+  const int pinned = argc > 1 ? atoi(argv[1]) : 200;
+  const int rounds = 20000;
+
+  if(pinned < 0)
+    return ERR_INVALID_ARGS;
+
+  void **pins = xalloc(sizeof(void *) * (pinned + MALLOCBENCH_SLOTS), 0,
+                       MEM_MAY_FAIL | MEM_CLEAR);
+  if(pins == NULL)
+    return ERR_NO_MEMORY;
+  void **slots = pins + pinned;
+
+  for(int i = 0; i < pinned; i++) {
+    void *tmp = xalloc(24, 0, MEM_MAY_FAIL);
+    pins[i] = xalloc(24, 0, MEM_MAY_FAIL);
+    free(tmp);
+  }
+
+  uint32_t seed = 1;
+  int mallocs = 0, frees = 0, failed = 0;
+#ifdef HAVE_CYCLE_COUNTER
+  uint64_t malloc_time = 0, free_time = 0;
+  uint32_t malloc_max = 0, free_max = 0;
+#endif
+  const uint32_t start = perf_ticks();
+
+  for(int i = 0; i < rounds; i++) {
+    seed = seed * 1664525 + 1013904223;
+    void **s = &slots[(seed >> 8) % MALLOCBENCH_SLOTS];
+#ifdef HAVE_CYCLE_COUNTER
+    const uint32_t t0 = perf_ticks();
+#endif
+    if(*s) {
+      free(*s);
+      *s = NULL;
+#ifdef HAVE_CYCLE_COUNTER
+      const uint32_t d = perf_ticks() - t0;
+      free_time += d;
+      if(d > free_max)
+        free_max = d;
+#endif
+      frees++;
+    } else {
+      const size_t size = 1 + (seed >> 16) % 512;
+      const size_t align = seed & 3 ? 0 : 1 << ((seed >> 4) % 7);
+      *s = xalloc(size, align, MEM_MAY_FAIL);
+#ifdef HAVE_CYCLE_COUNTER
+      const uint32_t d = perf_ticks() - t0;
+      malloc_time += d;
+      if(d > malloc_max)
+        malloc_max = d;
+#endif
+      mallocs++;
+      if(*s == NULL)
+        failed++;
+    }
+  }
+
+  const uint32_t total = perf_ticks() - start;
+
+  for(int i = 0; i < pinned + MALLOCBENCH_SLOTS; i++)
+    free(pins[i]);
+  free(pins);
+
+  cli_printf(cli, "%d pinned blocks, %d failed allocations\n",
+             pinned, failed);
+#ifdef HAVE_CYCLE_COUNTER
+  cli_printf(cli, "  malloc: %8d ns avg  %8d ns max\n",
+             perf_ticks_to_ns(malloc_time, mallocs),
+             perf_ticks_to_ns(malloc_max, 1));
+  cli_printf(cli, "  free:   %8d ns avg  %8d ns max\n",
+             perf_ticks_to_ns(free_time, frees),
+             perf_ticks_to_ns(free_max, 1));
+#endif
+  // Without a cycle counter a single call is well below the resolution
+  // of the clock, so this is the only figure then
+  cli_printf(cli, "  total:  %8d ns avg  (%d mallocs, %d frees)\n",
+             perf_ticks_to_ns(total, rounds), mallocs, frees);
+  return 0;
+}
+
+CLI_CMD_DEF("mallocbench", cmd_mallocbench);
+
+
+#define MEMBENCH_BYTES (256 * 1024)  // Moved per measurement
+#define MEMBENCH_MAX   4096
+
+typedef struct membench_op {
+  const char *name;
+  int src_misalign;
+  int overlap;   // dst is src + overlap within the same buffer
+  int op;        // 0 = memcpy, 1 = memmove, 2 = memset, 3 = memcmp
+} membench_op_t;
+
+// Call through pointers so the compiler can not inline or elide anything
+static void *(*volatile membench_memcpy)(void *, const void *, size_t) = memcpy;
+static void *(*volatile membench_memmove)(void *, const void *, size_t) = memmove;
+static void *(*volatile membench_memset)(void *, int, size_t) = memset;
+static int (*volatile membench_memcmp)(const void *, const void *, size_t) = memcmp;
+
+#ifdef HAVE_CYCLE_COUNTER
+#define MEMBENCH_UNIT "bytes/cycle"
+#else
+// No cycle counter, per size figures are in bytes/µs (MB/s) instead
+#define MEMBENCH_UNIT "MB/s"
+#endif
+
+/*
+ * Throughput of the mem* functions for a few sizes and alignments.
+ * Bytes per cycle uses cpu_cycle_counter() which on some CPUs (AArch64)
+ * is a fixed frequency timer rather than the core clock
+ */
+static error_t
+cmd_membench(cli_t *cli, int argc, char **argv)
+{
+  static const membench_op_t ops[] = {
+    { "memcpy",        0,  0, 0 },
+    { "memcpy unalgn", 1,  0, 0 },
+    { "memmove fwd",   0, -4, 1 },
+    { "memmove bwd",   0,  4, 1 },
+    { "memset",        0,  0, 2 },
+    { "memcmp",        0,  0, 3 },
+  };
+  static const uint16_t sizes[] = { 8, 64, 256, 1536, MEMBENCH_MAX };
+
+  uint8_t *a = xalloc(MEMBENCH_MAX + 16, 16, MEM_MAY_FAIL);
+  uint8_t *b = xalloc(MEMBENCH_MAX + 16, 16, MEM_MAY_FAIL);
+  if(a == NULL || b == NULL) {
+    free(a);
+    free(b);
+    return ERR_NO_MEMORY;
+  }
+  memset(a, 0x55, MEMBENCH_MAX + 16);
+  memset(b, 0x55, MEMBENCH_MAX + 16);
+
+  cli_printf(cli, "%-14s", MEMBENCH_UNIT);
+  for(size_t j = 0; j < ARRAYSIZE(sizes); j++)
+    cli_printf(cli, " %7d", sizes[j]);
+  cli_printf(cli, "     MB/s@%d\n", MEMBENCH_MAX);
+
+  volatile int sink = 0;
+
+  for(size_t i = 0; i < ARRAYSIZE(ops); i++) {
+    const membench_op_t *mo = &ops[i];
+    cli_printf(cli, "%-14s", mo->name);
+    int mbps = 0;
+
+    // So memcmp() has to look at all bytes
+    memcpy(b, a, MEMBENCH_MAX + 16);
+
+    for(size_t j = 0; j < ARRAYSIZE(sizes); j++) {
+      const size_t size = sizes[j];
+      const int rounds = MEMBENCH_BYTES / size;
+      uint8_t *src = a + 8 + mo->src_misalign;
+      uint8_t *dst = mo->overlap ? src + mo->overlap : b + 8;
+
+      const uint32_t c0 = perf_ticks();
+      for(int r = 0; r < rounds; r++) {
+        switch(mo->op) {
+        case 0:
+          membench_memcpy(dst, src, size);
+          break;
+        case 1:
+          membench_memmove(dst, src, size);
+          break;
+        case 2:
+          membench_memset(dst, r, size);
+          break;
+        case 3:
+          sink += membench_memcmp(dst, src, size);
+          break;
+        }
+      }
+      const uint32_t cycles = perf_ticks() - c0;
+
+      const uint64_t bytes = (uint64_t)size * rounds;
+      if(cycles) {
+        const int bpc = bytes * 100 / cycles;
+        cli_printf(cli, " %4d.%02d", bpc / 100, bpc % 100);
+        mbps = ((bytes * perf_ticks_per_us()) >> PERF_TICKS_SHIFT) /
+          cycles;
+      } else {
+        cli_printf(cli, " %7s", "-");
+      }
+    }
+    cli_printf(cli, "     %d\n", mbps);
+  }
+  (void)sink;
+  free(a);
+  free(b);
+  return 0;
+}
+
+CLI_CMD_DEF("membench", cmd_membench);
+
+
+static size_t (*volatile strbench_strlen)(const char *) = strlen;
+static int (*volatile strbench_strcmp)(const char *, const char *) = strcmp;
+static int (*volatile strbench_strcasecmp)(const char *, const char *) = strcasecmp;
+static char *(*volatile strbench_strchr)(const char *, int) = strchr;
+
+/*
+ * Time of the str* functions for a few string lengths. Compared strings
+ * are equal (worst case), strchr() looks for a character not present
+ */
+static error_t
+cmd_strbench(cli_t *cli, int argc, char **argv)
+{
+  static const uint8_t lengths[] = { 4, 16, 64, 200 };
+  const int rounds = 10000;
+
+  char *a = xalloc(256, sizeof(void *), MEM_MAY_FAIL);
+  char *b = xalloc(256, sizeof(void *), MEM_MAY_FAIL);
+  if(a == NULL || b == NULL) {
+    free(a);
+    free(b);
+    return ERR_NO_MEMORY;
+  }
+
+  cli_printf(cli, "ns/call     ");
+  for(size_t j = 0; j < ARRAYSIZE(lengths); j++)
+    cli_printf(cli, " %6d", lengths[j]);
+  cli_printf(cli, "\n");
+
+  volatile int sink = 0;
+
+  for(int op = 0; op < 4; op++) {
+    static const char names[4][12] = {
+      "strlen", "strcmp", "strcasecmp", "strchr"
+    };
+    cli_printf(cli, "%-12s", names[op]);
+
+    for(size_t j = 0; j < ARRAYSIZE(lengths); j++) {
+      const size_t len = lengths[j];
+      for(size_t i = 0; i < len; i++)
+        a[i] = b[i] = 'a' + i % 26;
+      a[len] = b[len] = 0;
+
+      const int64_t t0 = clock_get();
+      for(int r = 0; r < rounds; r++) {
+        switch(op) {
+        case 0:
+          sink += strbench_strlen(a);
+          break;
+        case 1:
+          sink += strbench_strcmp(a, b);
+          break;
+        case 2:
+          sink += strbench_strcasecmp(a, b);
+          break;
+        case 3:
+          sink += strbench_strchr(a, '#') != NULL;
+          break;
+        }
+      }
+      const int64_t usec = clock_get() - t0;
+      cli_printf(cli, " %6d", (int)(usec * 1000 / rounds));
+    }
+    cli_printf(cli, "\n");
+  }
+  (void)sink;
+  free(a);
+  free(b);
+  return 0;
+}
+
+CLI_CMD_DEF("strbench", cmd_strbench);
+
+
+typedef struct {
+  coro_t co;
+  int resumed;   // Order in which the wait completed, 0 = still waiting
+  int timedout;
+} corotest_t;
+
+static task_waitable_t corotest_waitable;
+static int corotest_seq;
+
+static void
+corotest_fn(coro_t *co)
+{
+  corotest_t *ct = (corotest_t *)co;
+
+  CORO_BEGIN(co);
+  CORO_WAIT_DEADLINE(co, &corotest_waitable, clock_get() + 50000);
+  ct->timedout = coro_timedout(co);
+  ct->resumed = ++corotest_seq;
+  CORO_END(co);
+}
+
+/*
+ * Three coroutines wait on the same waitable. Two single wakeups from
+ * this thread must resume them in priority order, the last one must be
+ * resumed by its deadline
+ */
+static error_t
+cmd_corotest(cli_t *cli, int argc, char **argv)
+{
+  // Static as the scheduler may still reference them briefly after
+  // the coroutines are done
+  static corotest_t ct[3];
+  static const uint8_t prios[3] = { 2, 5, 3 };
+  static const uint8_t expect[3] = { 3, 1, 2 };
+
+  task_waitable_init(&corotest_waitable, "corotest");
+  corotest_seq = 0;
+
+  for(int i = 0; i < 3; i++) {
+    coro_init(&ct[i].co, corotest_fn, prios[i], "corotest");
+    ct[i].resumed = 0;
+    ct[i].timedout = 0;
+    coro_start(&ct[i].co);
+  }
+
+  usleep(1000);
+  task_wakeup(&corotest_waitable, 0);
+  usleep(1000);
+  task_wakeup(&corotest_waitable, 0);
+  usleep(100000);
+
+  error_t err = 0;
+  for(int i = 0; i < 3; i++) {
+    const int ok = ct[i].resumed == expect[i] && ct[i].timedout == (i == 0);
+    cli_printf(cli, "prio %d: resumed #%d%s  %s\n",
+               prios[i], ct[i].resumed,
+               ct[i].timedout ? " (timeout)" : "", ok ? "OK" : "FAIL");
+    if(!ok)
+      err = ERR_MISMATCH;
+    coro_stop(&ct[i].co);
+  }
+  return err;
+}
+
+CLI_CMD_DEF("corotest", cmd_corotest);
@@ -0,0 +1,183 @@
+#include <mios/arena.h>
+
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+
+#define ARENA_ALIGN 8
+
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+
+void
+arena_init(arena_t *a, void *buf, size_t bufsize,
+           size_t chunk_size, size_t limit)
+{
+  memset(a, 0, sizeof(arena_t));
+  a->a_chunk_size = chunk_size;
+  a->a_limit = limit;
+
+  if(buf == NULL)
+    return;
+
+  const uintptr_t start = ARENA_ROUND((uintptr_t)buf);
+  const uintptr_t end = (uintptr_t)buf + bufsize;
+  if(start + sizeof(arena_chunk_t) + ARENA_ALIGN > end)
+    return;
+
+  arena_chunk_t *ac = (arena_chunk_t *)start;
+  ac->ac_prev = NULL;
+  ac->ac_size = (end - (uintptr_t)ac->ac_data) & ~(ARENA_ALIGN - 1);
+  ac->ac_used = 0;
+  a->a_first = ac;
+  a->a_chunk = ac;
+}
+
+
+static arena_chunk_t *
+arena_chunk_add(arena_t *a, size_t size, size_t hint)
+{
+  if(size < a->a_chunk_size)
+    size = a->a_chunk_size;
+
+  // Take 'hint' bytes if the limit allows, 'size' is what's required
+  hint = ARENA_ROUND(hint);
+  if(hint > size &&
+     (!a->a_limit || a->a_heap + sizeof(arena_chunk_t) + hint <= a->a_limit))
+    size = hint;
+
+  const size_t total = sizeof(arena_chunk_t) + size;
+
+  if(a->a_limit && a->a_heap + total > a->a_limit)
+    return NULL;
+
+  arena_chunk_t *ac = xalloc(total, ARENA_ALIGN, MEM_MAY_FAIL);
+  if(ac == NULL)
+    return NULL;
+
+  ac->ac_prev = a->a_chunk;
+  ac->ac_size = size;
+  ac->ac_used = 0;
+  a->a_chunk = ac;
+  a->a_heap += total;
+  return ac;
+}
+
+
+static void *
+arena_alloc_hint(arena_t *a, size_t size, size_t hint)
+{
+  size = ARENA_ROUND(size);
+
+  arena_chunk_t *ac = a->a_chunk;
+  if(ac == NULL || ac->ac_size - ac->ac_used < size) {
+    // Whatever is left in the current chunk is wasted
+    ac = arena_chunk_add(a, size, hint);
+    if(ac == NULL)
+      return NULL;
+  }
+
+  void *r = ac->ac_data + ac->ac_used;
+  ac->ac_used += size;
+  a->a_last = r;
+  return r;
+}
+
+
+void *
+arena_alloc(arena_t *a, size_t size)
+{
+  return arena_alloc_hint(a, size, 0);
+}
+
+
+void *
+arena_realloc(arena_t *a, void *ptr, size_t oldsize, size_t newsize)
+{
+  if(ptr == NULL)
+    return arena_alloc(a, newsize);
+
+  if(newsize <= oldsize)
+    return ptr;
+
+  arena_chunk_t *ac = a->a_chunk;
+  arena_chunk_t *replace = NULL;
+  if(ptr == a->a_last) {
+    const size_t offset = (uint8_t *)ptr - ac->ac_data;
+    const size_t need = ARENA_ROUND(newsize);
+    if(offset + need <= ac->ac_size) {
+      ac->ac_used = offset + need;
+      return ptr;
+    }
+
+    if(offset == 0 && ac != a->a_first) {
+      // Alone in a heap chunk, unlink it and free it once moved
+      replace = ac;
+      a->a_chunk = ac->ac_prev;
+      a->a_heap -= sizeof(arena_chunk_t) + ac->ac_size;
+    }
+  }
+
+  // Something that grows once tends to grow again, so if a new chunk
+  // is needed ask for room to double in place
+  void *r = arena_alloc_hint(a, newsize, newsize * 2);
+  if(r != NULL) {
+    memcpy(r, ptr, oldsize);
+    free(replace);
+  } else if(replace != NULL) {
+    a->a_chunk = replace;
+    a->a_heap += sizeof(arena_chunk_t) + replace->ac_size;
+    a->a_last = ptr;
+  }
+  return r;
+}
+
+
+char *
+arena_strappend(arena_t *a, char **strp, const char *src, size_t len)
+{
+  const size_t oldlen = *strp ? strlen(*strp) : 0;
+  char *s = arena_realloc(a, *strp, *strp ? oldlen + 1 : 0, oldlen + len + 1);
+  if(s == NULL)
+    return NULL;
+  memcpy(s + oldlen, src, len);
+  s[oldlen + len] = 0;
+  *strp = s;
+  return s;
+}
+
+
+arena_mark_t
+arena_mark(arena_t *a)
+{
+  // The most recent allocation now predates the mark. Growing it in
+  // place would extend it past am_used, and moving it out of a chunk
+  // of its own would free am_chunk
+  a->a_last = NULL;
+  return (arena_mark_t) {
+    .am_chunk = a->a_chunk,
+    .am_used = a->a_chunk ? a->a_chunk->ac_used : 0,
+  };
+}
+
+
+void
+arena_rewind(arena_t *a, arena_mark_t m)
+{
+  while(a->a_chunk != m.am_chunk && a->a_chunk != a->a_first) {
+    arena_chunk_t *ac = a->a_chunk;
+    a->a_chunk = ac->ac_prev;
+    a->a_heap -= sizeof(arena_chunk_t) + ac->ac_size;
+    free(ac);
+  }
+  if(a->a_chunk != NULL)
+    a->a_chunk->ac_used = m.am_chunk == a->a_chunk ? m.am_used : 0;
+  a->a_last = NULL;
+}
+
+
+void
+arena_release(arena_t *a)
+{
+  arena_rewind(a, (arena_mark_t){ .am_chunk = a->a_first });
+}
@@ -0,0 +1,202 @@
+// ====================================================================
+// Host side tests for arena.c
+//
+// Run tests:    make arena_test
+//
+// Covers growing allocations within and across chunks, the heap limit,
+// mark/rewind and release. Heap chunks are counted so leaks and chunks
+// freed while still in use are caught.
+// ====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEM_MAY_FAIL 0
+
+static int live_chunks;
+
+static void *
+test_alloc(size_t size)
+{
+  void *p = malloc(size);
+  if(p != NULL)
+    live_chunks++;
+  return p;
+}
+
+static void
+test_free(void *p)
+{
+  if(p != NULL)
+    live_chunks--;
+  free(p);
+}
+
+#define xalloc(size, align, flags) test_alloc(size)
+#define free(p) test_free(p)
+
+#include "arena.c"
+
+
+static int failures;
+
+#define CHECK(x) do {                                           \
+    if(!(x)) {                                                  \
+      printf("%s:%d: %s failed\n", __FILE__, __LINE__, #x);    \
+      failures++;                                               \
+    }                                                           \
+  } while(0)
+
+
+static int
+filled(const uint8_t *p, size_t len, uint8_t v)
+{
+  for(size_t i = 0; i < len; i++) {
+    if(p[i] != v)
+      return 0;
+  }
+  return 1;
+}
+
+
+// Grows in place while the chunk has room, then moves with its content
+static void
+test_realloc_growth(void)
+{
+  uint8_t buf[128];
+  arena_t a;
+  arena_init(&a, buf, sizeof(buf), 64, 0);
+
+  uint8_t *p = arena_alloc(&a, 16);
+  CHECK(p != NULL);
+  memset(p, 0xaa, 16);
+
+  uint8_t *q = arena_realloc(&a, p, 16, 48);
+  CHECK(q == p);
+  memset(q, 0xaa, 48);
+
+  // Does not fit in the supplied chunk anymore
+  q = arena_realloc(&a, q, 48, 256);
+  CHECK(q != NULL);
+  CHECK(q != p);
+  CHECK(filled(q, 48, 0xaa));
+  CHECK(live_chunks == 1);
+  memset(q, 0xbb, 256);
+
+  // Alone in its heap chunk, moving it again drops the old chunk
+  uint8_t *r = arena_realloc(&a, q, 256, 4096);
+  CHECK(r != NULL);
+  CHECK(filled(r, 256, 0xbb));
+  CHECK(live_chunks == 1);
+
+  // strappend on top of the same machinery
+  char *s = NULL;
+  for(int i = 0; i < 100; i++)
+    CHECK(arena_strappend(&a, &s, "0123456789", 10) != NULL);
+  CHECK(strlen(s) == 1000);
+  CHECK(!memcmp(s + 990, "0123456789", 10));
+
+  arena_release(&a);
+  CHECK(live_chunks == 0);
+  CHECK(a.a_heap == 0);
+}
+
+
+static void
+test_limit(void)
+{
+  arena_t a;
+  arena_init(&a, NULL, 0, 64, 256);
+
+  void *p = arena_alloc(&a, 64);
+  CHECK(p != NULL);
+  CHECK(arena_alloc(&a, 512) == NULL);
+  CHECK(a.a_heap <= 256);
+
+  memset(p, 0x11, 64);
+  void *q = arena_realloc(&a, p, 64, 512);
+  CHECK(q == NULL);
+  CHECK(filled(p, 64, 0x11));
+
+  // Still usable after failing
+  CHECK(arena_alloc(&a, 32) != NULL);
+  CHECK(a.a_heap <= 256);
+
+  arena_release(&a);
+  CHECK(live_chunks == 0);
+  CHECK(a.a_heap == 0);
+}
+
+
+static void
+test_mark_rewind(void)
+{
+  arena_t a;
+  arena_init(&a, NULL, 0, 64, 0);
+
+  uint8_t *p = arena_alloc(&a, 64);
+  CHECK(p != NULL);
+  memset(p, 0x22, 64);
+
+  // 'p' fills a heap chunk of its own. Growing it after the mark must
+  // not free that chunk as the mark refers to it
+  arena_mark_t m = arena_mark(&a);
+  uint8_t *q = arena_realloc(&a, p, 64, 128);
+  CHECK(q != NULL);
+  CHECK(q != p);
+  CHECK(live_chunks == 2);
+
+  arena_rewind(&a, m);
+  CHECK(live_chunks == 1);
+  CHECK(a.a_chunk == m.am_chunk);
+  CHECK(filled(p, 64, 0x22));
+
+  arena_release(&a);
+  CHECK(live_chunks == 0);
+
+  // With room left in the chunk, growing in place past the mark would
+  // be undone by the rewind
+  uint8_t buf[256];
+  arena_init(&a, buf, sizeof(buf), 64, 0);
+  p = arena_alloc(&a, 16);
+  memset(p, 0x33, 16);
+  m = arena_mark(&a);
+  q = arena_realloc(&a, p, 16, 32);
+  CHECK(q != p);
+  arena_rewind(&a, m);
+
+  uint8_t *r = arena_alloc(&a, 32);
+  CHECK(r == p + 16);
+  memset(r, 0x44, 32);
+  CHECK(filled(p, 16, 0x33));
+
+  // Rewinding across heap chunks
+  m = arena_mark(&a);
+  for(int i = 0; i < 10; i++)
+    CHECK(arena_alloc(&a, 200) != NULL);
+  CHECK(live_chunks == 10);
+  arena_rewind(&a, m);
+  CHECK(live_chunks == 0);
+  CHECK(a.a_heap == 0);
+  CHECK(arena_alloc(&a, 16) == r + 32);
+
+  arena_release(&a);
+  CHECK(live_chunks == 0);
+}
+
+
+int
+main(void)
+{
+  test_realloc_growth();
+  test_limit();
+  test_mark_rewind();
+
+  if(failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
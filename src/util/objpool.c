@@ -0,0 +1,133 @@
+#include <mios/objpool.h>
+
+#include <stdint.h>
+#include <malloc.h>
+
+#include "irq.h"
+
+#if defined(__aarch64__)
+
+static void *
+objpool_pop(void **head)
+{
+  void *item, *next;
+  uint32_t fail;
+
+  asm volatile("1:   ldaxr   %0, [%3]\n\t"
+               "     cbz     %0, 2f\n\t"
+               "     ldr     %1, [%0]\n\t"
+               "     stxr    %w2, %1, [%3]\n\t"
+               "     cbnz    %w2, 1b\n\t"
+               "2:\n\t"
+               : "=&r"(item), "=&r"(next), "=&r"(fail)
+               : "r"(head)
+               : "memory");
+  return item;
+}
+
+#elif defined(__ARM_FEATURE_LDREX) && (__ARM_FEATURE_LDREX & 4)
+
+static void *
+objpool_pop(void **head)
+{
+  void *item, *next;
+  uint32_t fail;
+
+  // No other stores between LDREX and STREX, they may clear the monitor
+  asm volatile("1:   ldrex   %0, [%3]\n\t"
+               "     cmp     %0, #0\n\t"
+               "     beq     2f\n\t"
+               "     ldr     %1, [%0]\n\t"
+               "     strex   %2, %1, [%3]\n\t"
+               "     cmp     %2, #0\n\t"
+               "     bne     1b\n\t"
+               "2:\n\t"
+               : "=&r"(item), "=&r"(next), "=&r"(fail)
+               : "r"(head)
+               : "cc", "memory");
+#if __ARM_ARCH_PROFILE != 'M'
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+#endif
+  return item;
+}
+
+#else
+
+#define OBJPOOL_IRQ_MASK
+
+static void *
+objpool_pop(void **head)
+{
+  int q = irq_forbid(IRQ_LEVEL_ALL);
+  void *item = *head;
+  if(item != NULL)
+    *head = *(void **)item;
+  irq_permit(q);
+  return item;
+}
+
+#endif
+
+
+static void
+objpool_push(void **head, void *item)
+{
+#ifdef OBJPOOL_IRQ_MASK
+  int q = irq_forbid(IRQ_LEVEL_ALL);
+  *(void **)item = *head;
+  *head = item;
+  irq_permit(q);
+#else
+  // Pushing is not affected by ABA, a plain CAS is enough
+  void *old = __atomic_load_n(head, __ATOMIC_RELAXED);
+  do {
+    *(void **)item = old;
+  } while(!__atomic_compare_exchange_n(head, &old, item, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#endif
+}
+
+
+void *
+objpool_get(objpool_t *op)
+{
+  void *item = objpool_pop(&op->op_head);
+  if(item != NULL)
+    atomic_add(&op->op_avail, -1);
+  else
+    atomic_inc(&op->op_fails);
+  return item;
+}
+
+
+void
+objpool_put(objpool_t *op, void *item)
+{
+  objpool_push(&op->op_head, item);
+  atomic_inc(&op->op_avail);
+}
+
+
+size_t
+objpool_add(objpool_t *op, void *start, void *end, size_t item_size)
+{
+  size_t count = 0;
+  while(start + item_size <= end) {
+    objpool_put(op, start);
+    start += item_size;
+    count++;
+  }
+  return count;
+}
+
+
+error_t
+objpool_alloc(objpool_t *op, size_t item_size, size_t count)
+{
+  item_size = (item_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  void *start = xalloc(item_size * count, 0, MEM_MAY_FAIL);
+  if(start == NULL)
+    return ERR_NO_MEMORY;
+  objpool_add(op, start, start + item_size * count, item_size);
+  return 0;
+}
@@ -1,7 +1,9 @@
 GLOBALDEPS += ${SRC}/util/util.mk
 
 SRCS += ${SRC}/util/alert.c \
+	${SRC}/util/arena.c \
 	${SRC}/util/bumpalloc.c \
+	${SRC}/util/objpool.c \
 	${SRC}/util/base64.c \
 	${SRC}/util/cmdline.c \
 	${SRC}/util/crc32.c \
@@ -0,0 +1,46 @@
+#!/usr/bin/env bash
+#
+# Resolve the call sites in the output of the 'malloc profile' command
+#
+# The device prints raw return addresses. This maps them back to
+# function and source line using the ELF the firmware was built from.
+# The build-id printed by the device is compared against the ELF's so a
+# mismatching image is not silently used.
+#
+# Usage: support/malloc_profile.sh build.<platform>/mios.full.elf [capture.txt]
+#
+# Reads the captured command output from stdin if no file is given.
+# Set CROSS_COMPILE (default arm-none-eabi-) for the binutils prefix.
+#
+set -euo pipefail
+
+ELF="${1:?Usage: $0 <elf> [capture]}"
+INPUT="${2:-/dev/stdin}"
+CROSS_COMPILE="${CROSS_COMPILE-arm-none-eabi-}"
+
+ELF_ID=$("${CROSS_COMPILE}readelf" -n "$ELF" | awk '/Build ID:/ { print $3 }')
+
+while IFS= read -r line; do
+  case "$line" in
+    "# build-id "*)
+      DEV_ID="${line#\# build-id }"
+      DEV_ID="${DEV_ID//[[:space:]]/}"
+      if [ "$DEV_ID" != "$ELF_ID" ]; then
+        echo "Build-id mismatch: device $DEV_ID, $ELF has $ELF_ID" >&2
+        exit 1
+      fi
+      echo "$line"
+      ;;
+    "#"*|"")
+      echo "$line"
+      ;;
+    *)
+      read -r blocks bytes caller <<< "$line"
+      # Return addresses point after the call (and have the thumb bit
+      # set on Cortex-M), step back into the call instruction
+      addr=$(printf "0x%x" $(( (caller & ~1) - 1 )))
+      site=$("${CROSS_COMPILE}addr2line" -e "$ELF" -f -C -p -s "$addr")
+      printf "  %6s %10s  %s\n" "$blocks" "$bytes" "$site"
+      ;;
+  esac
+done < "$INPUT"